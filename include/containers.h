@@ -9,6 +9,47 @@ struct st_list_t {
   uint8_t *items;
 };
 
+/**
+ * Pool of fixed-size items whose address never changes. Items are carved from
+ * chunks of chunk_items slots; a freed slot goes to a free list and is reused
+ * by the next slab_add(). Each item has a handle -- the index of its slot --
+ * and a position within live, the dense array of the items in use, which
+ * slab_get() iterates over. Removing an item moves the last live one to its
+ * position, so iteration order is not kept.
+ */
+
+struct st_slab_t {
+  int itemsize;
+  /** size of one slot: a header and the item, rounded to 16 bytes */
+  int slotsize;
+  int chunk_items;
+  int nbr_chunks;
+  uint8_t **chunks;
+  /** number of items in use */
+  int size;
+  /** number of slots of live, which is allocated by the first slab_add() */
+  int capacity;
+  void **live;
+  /** handle of the first free slot, or -1 */
+  int free_handle;
+  /** number of slots ever carved from the chunks */
+  int nbr_slots;
+};
+
+/**
+ * Open-addressing hash table from a 32-bit id to a non-negative int value
+ * (e.g., a position within a list_t). The table doubles whenever it becomes
+ * half full.
+ */
+
+struct st_id_map_t {
+  /** power of 2; keys and values are allocated by the first id_map_set() */
+  int capacity;
+  int size;
+  uint32_t *keys;
+  int *values;
+};
+
 typedef enum queue_ret {
   OK,
   MEMORY_FULL,
@@ -28,26 +69,73 @@ struct st_tcpls_record_fifo_t {
   int back_idx;
 };
 
+/** a slot can receive any record decrypted in place */
+#define TCPLS_REORDER_SLOT_SIZE (PTLS_MAX_ENCRYPTED_RECORD_SIZE + 5)
+
+/**
+ * Multipath reordering window. Records received ahead of the next expected
+ * mpseq are stored in the slot mpseq % nbr_slots until the missing ones arrive;
+ * the buffer of a slot is only allocated once the slot is first used.
+ *
+ * A record may also be decrypted into the spare slot before its mpseq is
+ * known, then committed: the spare is swapped with the slot of its mpseq and
+ * the record is never copied.
+ */
+
+struct st_tcpls_reorder_window_t {
+  /** power of 2, and the max distance from the base mpseq */
+  uint32_t nbr_slots;
+  /** number of records currently held */
+  uint32_t size;
+  /** buffer of TCPLS_REORDER_SLOT_SIZE bytes used by each slot, or NULL */
+  uint8_t **slots;
+  /** the buffer which is not used by any slot, or NULL */
+  uint8_t *spare;
+  /** where the record's bytes start within its slot, and their number */
+  uint32_t *offsets;
+  uint32_t *lengths;
+  /** one bit per slot, set when the slot holds a record */
+  uint64_t *used;
+};
+
 /* exposes a per-stream buffer abstraction to the application for the
  * multi-connection non-aggregation mode */
 
-enum buf_kind {AGGREGATION, STREAMBASED};
+enum buf_kind {AGGREGATION, STREAMBASED, REASSEMBLY};
 
 struct st_tcpls_stream_buffer {
   ptls_buffer_t *decryptbuf;
   streamid_t streamid;
 };
 
+/** a decrypted record a reordering window had no room for yet */
+struct st_tcpls_held_record {
+  uint32_t mpseq;
+  size_t len;
+  uint8_t *data;
+};
+
 struct st_tcpls_buffer {
   enum buf_kind bufkind;
   union {
     struct { ptls_buffer_t *decryptbuf; };
     struct {
-      list_t *stream_buffers;
+      /** struct st_tcpls_stream_buffer, each followed by its decryptbuf */
+      slab_t *stream_buffers;
+      /** slab handle of each stream buffer, indexed by streamid */
+      id_map_t *stream_buffers_index;
       list_t *wtr_streams;
-      /** we usually add streamid in order anyway. Try not to reorder if the
-       * added value is greated than the max_streamid */
-      streamid_t max_streamid;
+    };
+    struct {
+      /** holds every record until the application consumes it */
+      tcpls_reorder_window_t *window;
+      /** first mpseq whose record has not been entirely consumed */
+      uint32_t read_mpseq;
+      /** wraps the spare slot of window during decryption */
+      ptls_buffer_t *slotbuf;
+      /** struct st_tcpls_held_record the window could not take; no socket is
+       * read while some are left */
+      list_t *held;
     };
   };
 };
@@ -56,12 +144,30 @@ struct st_tcpls_buffer {
 tcpls_buffer_t *tcpls_stream_buffers_new(tcpls_t *tcpls, int nbr_expected_streams);
 /* create a tcpls_buffer_t* to use in aggregated mode */
 tcpls_buffer_t *tcpls_aggr_buffer_new(tcpls_t *tcpls);
+/* create a tcpls_buffer_t* to use in aggregated mode, read with
+ * tcpls_buffer_peek() and tcpls_buffer_consume(). Once nbr_slots records wait
+ * for the application, tcpls_receive() returns TCPLS_HOLD_DATA_TO_CONSUME and
+ * stops reading the sockets until some are consumed */
+tcpls_buffer_t *tcpls_reassembly_buffer_new(tcpls_t *tcpls, uint32_t nbr_slots);
+
+int tcpls_held_records_add(list_t *held, uint32_t mpseq, const uint8_t *data, size_t len);
+
+int tcpls_held_records_release(list_t *held, tcpls_reorder_window_t *window, uint32_t base_mpseq);
+
+void tcpls_held_records_free(list_t *held);
+
+int tcpls_reassembly_hold(tcpls_buffer_t *buf, uint32_t mpseq, const uint8_t *data, size_t len);
+
+int tcpls_reassembly_release(tcpls_buffer_t *buf);
+
+size_t tcpls_buffer_peek(tcpls_t *tcpls, ptls_iovec_t *vecs, size_t nbr_vecs);
+
+void tcpls_buffer_consume(tcpls_t *tcpls, size_t len);
 
 int tcpls_stream_buffer_add(tcpls_buffer_t *buffer, streamid_t streamid);
 
 int tcpls_stream_buffer_remove(tcpls_buffer_t *buffer, streamid_t streamid);
 
-/* should be O(log(n)) over a sorted array with sparse ids */
 ptls_buffer_t *tcpls_get_stream_buffer(tcpls_buffer_t *buffer, streamid_t streamid);
 
 void tcpls_buffer_free(tcpls_t *tcpls, tcpls_buffer_t *buf);
@@ -79,8 +185,31 @@ queue_ret_t tcpls_record_queue_del(tcpls_record_fifo_t *fifo, int n);
 
 void tcpls_record_fifo_free(tcpls_record_fifo_t *fifo);
 
+tcpls_reorder_window_t *tcpls_reorder_window_new(uint32_t nbr_slots);
+
+uint8_t *tcpls_reorder_window_spare(tcpls_reorder_window_t *window);
+
+queue_ret_t tcpls_reorder_window_push(tcpls_reorder_window_t *window, uint32_t
+    next_expected_mpseq, uint32_t mpseq, const uint8_t *data, size_t len);
+
+int tcpls_reorder_window_pop(tcpls_reorder_window_t *window, uint32_t mpseq,
+    ptls_buffer_t *buf);
+
+queue_ret_t tcpls_reorder_window_commit(tcpls_reorder_window_t *window, uint32_t
+    base_mpseq, uint32_t mpseq, const uint8_t *data, size_t len);
+
+int tcpls_reorder_window_peek(tcpls_reorder_window_t *window, uint32_t mpseq,
+    ptls_iovec_t *vec);
+
+size_t tcpls_reorder_window_consume(tcpls_reorder_window_t *window, uint32_t
+    mpseq, size_t len);
+
+void tcpls_reorder_window_free(tcpls_reorder_window_t *window);
+
 list_t *new_list(int itemsize, int capacity);
 
+void list_init(list_t *list, int itemsize, int capacity);
+
 int list_add(list_t *list, void *item);
 
 void *list_get(list_t *list, int itemid);
@@ -89,6 +218,42 @@ int list_remove(list_t *list, void *item);
 
 void list_clean(list_t *list);
 
+void list_dispose(list_t *list);
+
 void list_free(list_t *list);
 
+slab_t *new_slab(int itemsize, int chunk_items);
+
+void slab_init(slab_t *slab, int itemsize, int chunk_items);
+
+void *slab_add(slab_t *slab, void *item);
+
+void *slab_get(slab_t *slab, int pos);
+
+void *slab_at(slab_t *slab, int handle);
+
+int slab_handle(slab_t *slab, void *item);
+
+int slab_remove(slab_t *slab, void *item);
+
+void slab_dispose(slab_t *slab);
+
+void slab_free(slab_t *slab);
+
+id_map_t *new_id_map(int capacity);
+
+void id_map_init(id_map_t *map, int capacity);
+
+int id_map_set(id_map_t *map, uint32_t key, int value);
+
+int id_map_get(id_map_t *map, uint32_t key);
+
+int id_map_remove(id_map_t *map, uint32_t key);
+
+void id_map_clean(id_map_t *map);
+
+void id_map_dispose(id_map_t *map);
+
+void id_map_free(id_map_t *map);
+
 #endif
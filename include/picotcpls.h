@@ -4,7 +4,6 @@
 #include "picotypes.h"
 #include "picotls.h"
 #include "containers.h"
-#include "heap.h"
 #include <netinet/in.h>
 #define NBR_SUPPORTED_TCPLS_OPTIONS 5
 #define VARSIZE_OPTION_MAX_CHUNK_SIZE 4*16384 /* should be able to hold 4 records before needing to be extended */
@@ -12,11 +11,30 @@
 #define TCPLS_SIGNAL_SIZE 12
 #define STREAM_SENDER_NEW_STREAM_SIZE 4
 #define STREAM_CLOSE_SIZE 4
+/** stream id sent in clear after the record header when stream hints are used */
+#define TCPLS_STREAM_HINT_SIZE 4
+/** default number of records the multipath reordering window may hold */
+#define TCPLS_REORDER_WINDOW_SIZE 1024
+/** default memory cap of the data kept for failover, per session */
+#define TCPLS_DEFAULT_MAX_UNACKED_BYTES (64*1024*1024)
+/** size of the buffer each session recv()s into */
+#define TCPLS_RECVBUF_SIZE (32*PTLS_MAX_ENCRYPTED_RECORD_SIZE)
+/** delay between two connection attempts of tcpls_connect_start(), see RFC 8305 */
+#define TCPLS_CONNECT_ATTEMPT_DELAY_MS 250
+/** default period at which the path metrics of the connections are sampled */
+#define TCPLS_PATH_METRICS_INTERVAL_MS 100
+/** buckets of tcpls_stats_t.reorder_delay_us; the last one takes the longer
+ * delays */
+#define TCPLS_STATS_REORDER_DELAY_BUCKETS 24
+/** max number of ready sockets handled by one tcpls_receive() over epoll */
+#define TCPLS_EPOLL_MAX_EVENTS 64
 
 #define TCPLS_OK 0
 #define TCPLS_HOLD_DATA_TO_READ 1
 #define TCPLS_HOLD_OUT_OF_ORDER_DATA_TO_READ 2
 #define TCPLS_HOLD_DATA_TO_SEND 3
+#define TCPLS_HOLD_DATA_TO_CONSUME 4
+#define TCPLS_HOLD_UNACKED_DATA 5
 
 #define COOKIE_LEN 16
 #define CONNID_LEN 16
@@ -69,7 +87,11 @@ typedef enum tcpls_event_t {
   ADD_ADDR,
   /* tells the app that we added an address! */
   ADDED_ADDR,
-  REMOVE_ADDR
+  REMOVE_ADDR,
+  /* a failover recovery, or a standby connection being made, waits for this
+   * socket to become writable; call tcpls_failover_progress() once it is --
+   * or tcpls_connect_progress() for a connection attempt */
+  CONN_WANTS_WRITE
 } tcpls_event_t;
 
 typedef enum tcpls_tcp_state_t {
@@ -102,6 +124,104 @@ typedef struct st_tcpls_v6_addr_t {
   struct st_tcpls_v6_addr_t *next;
 } tcpls_v6_addr_t;
 
+/**
+ * Estimates of the path a connection goes through, sampled from TCP_INFO; all
+ * zero until the first sample
+ */
+
+typedef struct st_tcpls_path_metrics_t {
+  /** smoothed RTT and its mean deviation, in µs */
+  uint32_t srtt_us;
+  uint32_t rttvar_us;
+  /** lowest RTT seen, in µs */
+  uint32_t min_rtt_us;
+  /** RTT estimated from what we receive, in µs */
+  uint32_t rcv_rtt_us;
+  /** congestion window, in segments of snd_mss bytes */
+  uint32_t snd_cwnd;
+  uint32_t snd_mss;
+  /** segments in flight */
+  uint32_t unacked;
+  /** segments retransmitted since the connection started */
+  uint32_t total_retrans;
+  /** rate at which the path delivers what we send, in bytes per second */
+  uint64_t delivery_rate;
+  /** rate at which we received between the last two samples, in bytes per
+   * second */
+  uint64_t rcv_rate;
+  /** bytes received over the connection as of the last sample */
+  uint64_t bytes_received;
+  /** when the last sample was taken */
+  struct timeval sampled;
+} tcpls_path_metrics_t;
+
+/**
+ * Counters returned by tcpls_get_stats(), tcpls_get_conn_stats() and
+ * tcpls_get_stream_stats(). They count from the session start; new fields are
+ * only ever appended.
+ *
+ * Bytes sent and received are the ones of the application, carried by DATA
+ * records; retransmitted bytes are the encrypted ones replayed by a failover
+ */
+
+typedef struct st_tcpls_stream_stats_t {
+  streamid_t streamid;
+  /** connection the stream is attached to */
+  uint32_t transportid;
+  uint64_t bytes_sent;
+  uint64_t records_sent;
+  uint64_t bytes_received;
+  uint64_t records_received;
+  uint64_t retransmitted_bytes;
+  uint64_t acks_sent;
+  /** times tcpls_send() returned TCPLS_HOLD_DATA_TO_SEND or
+   * TCPLS_HOLD_UNACKED_DATA for the stream */
+  uint64_t holds;
+  /** bytes of the sending buffer not sent yet, and sent but not acked yet */
+  uint64_t sendbuf_unsent;
+  uint64_t sendbuf_unacked;
+} tcpls_stream_stats_t;
+
+typedef struct st_tcpls_conn_stats_t {
+  uint32_t transportid;
+  uint64_t bytes_sent;
+  uint64_t records_sent;
+  uint64_t bytes_received;
+  uint64_t records_received;
+  uint64_t control_bytes_received;
+  uint64_t retransmitted_bytes;
+  uint64_t acks_sent;
+  /** records which failed a trial decryption with a stream's context */
+  uint64_t aead_failures;
+} tcpls_conn_stats_t;
+
+typedef struct st_tcpls_stats_t {
+  uint64_t bytes_sent;
+  uint64_t records_sent;
+  uint64_t bytes_received;
+  uint64_t records_received;
+  uint64_t retransmitted_bytes;
+  uint64_t acks_sent;
+  uint64_t aead_failures;
+  uint64_t holds;
+  /** bytes of the sending buffers, see tcpls_stream_stats_t */
+  uint64_t sendbuf_unsent;
+  uint64_t sendbuf_unacked;
+  /** most records the reordering window held at once */
+  uint32_t reorder_high_water;
+  /**
+   * How long the delivery stayed blocked on missing records: bucket i counts
+   * the delays of [2^(i-1), 2^i) µs, bucket 0 those below 1µs
+   */
+  uint64_t reorder_delay_us[TCPLS_STATS_REORDER_DELAY_BUCKETS];
+} tcpls_stats_t;
+
+/**
+ * The session structures below keep the fields used for every record at their
+ * top, and the ones only used when setting up or tearing down connections and
+ * streams at their bottom.
+ */
+
 typedef struct st_connect_info_t {
   tcpls_tcp_state_t state; /* Connection state */
   int socket;
@@ -114,23 +234,47 @@ typedef struct st_connect_info_t {
   uint32_t nbr_bytes_received;
   /** nbr records received on this con since the last ack sent */
   uint32_t nbr_records_received;
+  /** highest mpseq received over this connection */
+  uint32_t last_mpseq_received;
+  /** Id given for this connection */
+  uint32_t this_transportid;
   /** total number of DATA bytes received over this con */
   uint64_t tot_data_bytes_received;
   /** total number of CONTROL bytess received over this con */
   uint64_t tot_control_bytes_received;
-  /** Id given for this connection */
-  uint32_t this_transportid;
-  /** Id of the peer fort this connection */
-  uint32_t peer_transportid;
+  /** bytes this connection may still deliver, see deficit_round_robin_con_scheduler */
+  uint64_t rcv_deficit;
+  /** average nbr of bytes delivered per round of the receive scheduler */
+  uint64_t rcv_throughput;
+  /** share of the records given by weighted_round_robin_send_scheduler; 0
+   * counts as 1 */
+  uint32_t send_weight;
+  /** current credit of the weighted round-robin */
+  int32_t send_credit;
+  /** last scheduling round this connection got credited */
+  uint32_t send_round;
+  /** live estimates of the path, see tcpls_get_path_metrics() */
+  tcpls_path_metrics_t metrics;
+  /** see tcpls_get_conn_stats() */
+  tcpls_conn_stats_t stats;
+  /** first stream of the list of streams attached to this connection, chained
+   * by tcpls_stream_t.next_con_stream; 0 if none */
+  streamid_t first_stream;
+  /** number of streams attached to this connection */
+  int nbr_streams;
   /** Is this connection primary? Primary means the default one */
   unsigned is_primary : 1;
+  /** connected with TCP_FASTOPEN_CONNECT: the SYN left with our first write */
+  unsigned fastopen : 1;
+
+  /** Id of the peer fort this connection */
+  uint32_t peer_transportid;
   /* con_to_failover received a FAILOVER message with a stream linked to this
    * con.
    * If we have data in our send_queue we need to send them over con and then destroy the
    * connection 
    */
   uint32_t transportid_to_failover;
-
   /** RTT of this connection, computed by the client and ?eventually given to the
    * server TODO*/
   struct timeval connect_time;
@@ -140,7 +284,6 @@ typedef struct st_connect_info_t {
   /** only one is used */
   tcpls_v4_addr_t *dest;
   tcpls_v6_addr_t *dest6;
-
 } connect_info_t;
 
 typedef struct st_tcpls_stream {
@@ -165,6 +308,12 @@ typedef struct st_tcpls_stream {
    * That may happen if this stream is created before the handshake took place.
    */
   unsigned aead_initialized : 1;
+  /** set while the stream is within tcpls->streams_ack_due */
+  unsigned ack_due : 1;
+  /** Attached connection -- must be the index of the connection within
+   * tcpls->connect_infos
+   **/
+  uint32_t transportid;
   /** Note: The following contexts use the same key; but a different counter and
    * IV
    */
@@ -172,6 +321,15 @@ typedef struct st_tcpls_stream {
   ptls_aead_context_t *aead_enc;
   /* Context for decryption */
   ptls_aead_context_t *aead_dec;
+  /* Per stream sending buffer */
+  ptls_buffer_t *sendbuf;
+  /** for sending buffer */
+  int send_start;
+  /**
+   * nbr of bytes at the front of sendbuf which have been acked; they are
+   * dropped lazily, see release_acked_bytes()
+   */
+  int send_acked;
   /* Used for retaining records that have not been acknowledged yet */
   tcpls_record_fifo_t *send_queue;
   /* The last sequence number whom which we decrypted and processed some data
@@ -181,18 +339,12 @@ typedef struct st_tcpls_stream {
   uint32_t nbr_records_since_last_ack;
   /* Number of bytes received on this stream since the last acknowledgement sent */
   uint32_t nbr_bytes_since_last_ack;
-
-  /* Per stream sending buffer */
-  ptls_buffer_t *sendbuf;
-  /** for sending buffer */
-  int send_start;
   /** end position of the stream control event message in the current sending
    * buffer*/
   int send_stream_attach_in_sendbuf_pos;
-  /** Attached connection -- must be the index of the connection within
-   * tcpls->connect_infos
-   **/
-  uint32_t transportid;
+  /** next stream attached to transportid; 0 ends the list */
+  streamid_t next_con_stream;
+
   /**
    * Origin attached con
    * In case of failover, we mark orcon as the origin con
@@ -210,6 +362,8 @@ typedef struct st_tcpls_stream {
   unsigned int failover_end_sent : 1;
   unsigned int failover_end_received : 1;
   uint32_t last_seq_poped;
+  /** see tcpls_get_stream_stats() */
+  tcpls_stream_stats_t stats;
 } tcpls_stream_t;
 
 
@@ -219,48 +373,25 @@ struct st_tcpls_t {
   ptls_buffer_t *sendbuf;
   /** If we did not manage to empty sendbuf in one send call */
   int send_start;
-  /* Receiving buffer */
+  /* tells ptls_send on which con we expect to send encrypted bytes*/
+  connect_info_t *sending_con;
+  /* tells ptls_send on which stream we send encrypted bytes */
+  tcpls_stream_t *sending_stream;
+  /**
+   * Receiving buffer; allocated by the first tcpls_receive() call, so that
+   * sessions which never read do not hold it
+   */
   uint8_t *recvbuf;
   int recvbuflen;
-  /**
-   * Fragmentation buffer for TCPLS -- used when no streams are attached yet
-   * */
-  ptls_buffer_t *buffrag;
-  /* Record buffer for multipath reordering */
-  ptls_buffer_t *rec_reordering;
-  /* store buf_position_data */
-  heap *gap_rec_reordering;
-  /* Current gap_size -- i.e., the amount of data we can safefely shift the
-   * reordering buffer*/
-  uint32_t gap_size;
-  /* max_gap size until shift_buffer */
-  uint32_t max_gap_size;
-  /* gap offset for dataposition */
-  uint64_t gap_offset;
-  /** A priority queue to handle reording records */
-  heap *priority_q;
+  /** remember on which connection we are pulling bytes */
+  int transportid_rcv;
+  /** remember on which stream we are decrypting -- useful to send back a
+   * DATA_ACK with the right stream*/
+  streamid_t streamid_rcv;
   /** sending mpseq number */
   uint32_t send_mpseq;
   /** next expected receive seq */
   uint32_t next_expected_mpseq;
-  /* Size of a varlen option set when we receive a CONTROL_VARLEN_BEGIN */
-  uint32_t varlen_opt_size;
-  /**
-   * Linked List of address to be used for happy eyeball
-   * and for failover
-   */
-  /** Destination addresses */
-  tcpls_v4_addr_t *v4_addr_llist;
-  tcpls_v6_addr_t *v6_addr_llist;
-  /** Our addresses */
-  tcpls_v4_addr_t *ours_v4_addr_llist;
-  tcpls_v6_addr_t *ours_v6_addr_llist;
-  /**
-   * pointer to the Application-created receiving buffer -- Only one may be
-   * created at a time
-   **/
-  tcpls_buffer_t *buffer;
-
   /**
    *  enable failover; used for rst/drop resistance in case of
    *  network outage .. If multiple connections are available
@@ -282,30 +413,98 @@ struct st_tcpls_t {
   unsigned int enable_multipath: 1;
   /** Are we recovering from a network failure? */
   unsigned int failover_recovering : 1;
-  /** nbr of FAILOVER_END that we remain to see */
-  int nbr_remaining_failover_end;
-  /* tells ptls_send on which con we expect to send encrypted bytes*/
-  connect_info_t *sending_con;
-  /* tells ptls_send on which stream we send encrypted bytes */
-  tcpls_stream_t *sending_stream;
-  /** carry a list of tcpls_option_t */
-  list_t *tcpls_options;
-  /** Should contain all streams */
-  list_t *streams;
   /** We have stream control event to check */
   unsigned check_stream_attach_sent : 1;
   /** We have stream marked for close; close them after sending the control
    * message  */
   unsigned streams_marked_for_close : 1;
-  /** Connection ID used for MPJOIN */
-  uint8_t connid[128];
-  /** Multihoming Cookie */
-  list_t *cookies;
-  /** Indicates the position of the current cookie value within the
-   * HMAC chain of cookies */
-  int cookie_counter;
-  /** Contains the state of connected src and dest addresses */
-  list_t *connect_infos;
+  /**
+   * Set to 1 if both peers agreed to carry a stream hint in front of each
+   * record protected by the application traffic keys
+   */
+  unsigned stream_hint_confirmed : 1;
+  /**
+   * pointer to the Application-created receiving buffer -- Only one may be
+   * created at a time
+   **/
+  tcpls_buffer_t *buffer;
+  /**
+   * Fragmentation buffer for TCPLS -- used when no streams are attached yet
+   * */
+  ptls_buffer_t *buffrag;
+  /** Should contain all streams; their address is stable */
+  slab_t *streams;
+  /** slab handle of each stream, indexed by streamid */
+  id_map_t *streams_index;
+  /** Contains the state of connected src and dest addresses; the slab handle
+   * of a connection is its transportid */
+  slab_t *connect_infos;
+  /** transportid of the last connection seen with each socket */
+  id_map_t *sockets_index;
+  /** streams that have received enough to send an ack, see send_ack_if_needed() */
+  list_t *streams_ack_due;
+  /** ids of the streams whose STREAM_ATTACH sits in a sending buffer */
+  list_t *streams_attach_pending;
+  /**
+   * Records received ahead of next_expected_mpseq in multipath mode; allocated
+   * upon the first out-of-order record
+   */
+  tcpls_reorder_window_t *reorder_window;
+  /**
+   * struct st_tcpls_held_record too far ahead for reorder_window; they move
+   * there as the missing records arrive
+   */
+  list_t *reorder_held;
+  /**
+   * Key material shared by the streams' AEAD contexts, derived once per
+   * traffic secret
+   */
+  struct st_tcpls_stream_key_t *stream_key_enc;
+  struct st_tcpls_stream_key_t *stream_key_dec;
+  /**
+   * When failover is enabled, cap on the bytes the streams keep waiting for
+   * an ack: tcpls_send() refuses input which would go past it, and returns
+   * TCPLS_HOLD_DATA_TO_SEND once it is reached
+   */
+  size_t max_unacked_bytes;
+  /**
+   * Scheduler callback for the receiver. Can be set by the application to
+   * instrument how multiple connections should pull bytes.
+   */
+  int (*schedule_receive)(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *decryptbuf, void *data);
+  /**
+   * Same as schedule_receive, but called with the list of sockets reported
+   * ready by epoll rather than with an fd_set. Sockets which do not belong to
+   * this session must be ignored.
+   */
+  int (*schedule_receive_ready)(tcpls_t *tcpls, const int *ready_socks, int nready,
+      tcpls_buffer_t *decryptbuf, void *data);
+  /**
+   * Scheduler callback for the sender, used in multipath mode. If set,
+   * tcpls_send() asks it for each record which stream -- thus which connection
+   * -- to send the record with, and one call may spread over all the paths.
+   * If NULL, records go to the stream given to tcpls_send().
+   */
+  tcpls_stream_t *(*schedule_send)(tcpls_t *tcpls, size_t reclen, void *data);
+  /** incremented by each call of weighted_round_robin_send_scheduler */
+  uint32_t send_round;
+  /**
+   * epoll instance our connected sockets are registered with; -1 when
+   * tcpls_receive() relies on select()
+   */
+  int epoll_fd;
+
+  /**
+   * max number of records reorder_window may hold; must be a power of 2. The
+   * ones further ahead wait in reorder_held
+   */
+  uint32_t reorder_window_size;
+  /* Size of a varlen option set when we receive a CONTROL_VARLEN_BEGIN */
+  uint32_t varlen_opt_size;
+  /** nbr of FAILOVER_END that we remain to see */
+  int nbr_remaining_failover_end;
+  /** recovery from a failed connection in progress; NULL otherwise */
+  struct st_tcpls_failover_t *failover;
   /** value of the next stream id :) */
   uint32_t next_stream_id;
   /** value of the next transport id */
@@ -318,25 +517,62 @@ struct st_tcpls_t {
   uint32_t nbr_tcp_streams;
   /** socket of the primary address - must be update at each primary change*/
   int socket_primary;
-  /** remember on which connection we are pulling bytes */
-  int transportid_rcv;
-  /** remember on which stream we are decrypting -- useful to send back a
-   * DATA_ACK with the right stream*/
-  streamid_t streamid_rcv;
   /** the very initial socket used for the handshake */
   int initial_socket;
-
-  /**
-   * Scheduler callback for the receiver. Can be set by the application to
-   * instrument how multiple connections should pull bytes.
-   */
-  int (*schedule_receive)(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *decryptbuf, void *data);
-
+  /** carry a list of tcpls_option_t */
+  list_t *tcpls_options;
   /**
    * Set to 1 if the other peer also announced it supports Encrypted TCP
    * options
    */
   unsigned tcpls_options_confirmed : 1;
+  /** Set to 1 if epoll_fd has been created by us and must be closed with us */
+  unsigned epoll_owned : 1;
+  /**
+   * Client-side: connect with TCP Fast Open, so that the ClientHello -- or the
+   * MPJOIN one and its cookie -- rides in the SYN once the server gave us a
+   * fastopen cookie. The server enables it with tcpls_listen_fastopen().
+   */
+  unsigned enable_fastopen : 1;
+  /** Indicates the position of the current cookie value within the
+   * HMAC chain of cookies */
+  int cookie_counter;
+  /** Multihoming Cookie */
+  list_t *cookies;
+  /** nbr of standby connections to keep, see tcpls_set_standby() */
+  int nbr_standby;
+  /** no standby connection is made before this time */
+  struct timeval standby_retry;
+  /** connection attempts in progress, see tcpls_connect_start() */
+  struct st_tcpls_connector_t *connector;
+  /** delay between two attempts of tcpls_connect_start() */
+  uint32_t connect_attempt_delay_ms;
+  /** period at which tcpls_housekeeping() samples the path metrics of the
+   * connections; 0 leaves it to tcpls_get_path_metrics() */
+  uint32_t path_metrics_interval_ms;
+  /** when the path metrics are sampled next */
+  struct timeval path_metrics_next;
+  /** see tcpls_get_stats() */
+  tcpls_stats_t stats;
+  /**
+   * Set while records wait for a missing one: since when, and the highest
+   * mpseq received ahead of it
+   */
+  unsigned reorder_gap_open : 1;
+  struct timeval reorder_gap_start;
+  uint32_t reorder_gap_end;
+  /**
+   * Linked List of address to be used for happy eyeball
+   * and for failover
+   */
+  /** Destination addresses */
+  tcpls_v4_addr_t *v4_addr_llist;
+  tcpls_v6_addr_t *v6_addr_llist;
+  /** Our addresses */
+  tcpls_v4_addr_t *ours_v4_addr_llist;
+  tcpls_v6_addr_t *ours_v6_addr_llist;
+  /** Connection ID used for MPJOIN */
+  uint8_t connid[128];
 };
 
 struct st_ptls_record_t;
@@ -350,6 +586,20 @@ void *tcpls_new();
 int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
     struct timeval *timeout);
 
+/**
+ * Start connecting without blocking, staggering the attempts and preferring
+ * IPv6 as RFC 8305 does; the first connection to connect becomes primary. If
+ * race is set, the other attempts are cancelled then.
+ */
+int tcpls_connect_start(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest, int race);
+
+/**
+ * Push the attempts of tcpls_connect_start() forward. Returns 0 once done, 1
+ * if a connection is up while others are in progress, PTLS_ERROR_IN_PROGRESS
+ * if none is up yet, or -1 if every attempt failed
+ */
+int tcpls_connect_progress(tcpls_t *tcpls, struct timeval *next_attempt);
+
 int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties);
 
 int tcpls_accept(tcpls_t *tcpls, int socket, uint8_t *cookie, uint32_t transportid);
@@ -370,16 +620,92 @@ int tcpls_stream_close(ptls_t *tls, streamid_t streamid, int sendnow);
  * tcpls_send can be called whether or not tcpls_stream_new has been called before
  * by the application; but it must send a stream_attach record first to attach a
  * stream.
+ *
+ * Returns TCPLS_HOLD_DATA_TO_SEND if some of the data could not be sent yet, or
+ * if failover is enabled and max_unacked_bytes are waiting for an ack; input
+ * is buffered in both cases, but the application should let tcpls_receive()
+ * process acks before sending more.
+ *
+ * With failover, returns TCPLS_HOLD_UNACKED_DATA without taking any of the
+ * input if it would bring the bytes waiting for an ack past
+ * max_unacked_bytes; the same input is to be sent again once tcpls_receive()
+ * processed acks. An input larger than the cap is taken when no byte waits for
+ * an ack.
  */
 
 int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbytes);
 
+/**
+ * Vectored tcpls_send: sends the concatenation of the iovcnt buffers without
+ * copying them together first. If align is set, no record spans two buffers,
+ * so that e.g. a response header and its body go in distinct records.
+ */
+
+int tcpls_sendv(ptls_t *tls, streamid_t streamid, const ptls_iovec_t *iov, size_t iovcnt, int align);
+
 /**
  * Eventually read bytes and pu them in input -- Make sure the socket is
  * in blocking mode
+ *
+ * With a tcpls_reassembly_buffer_new() buffer, returns
+ * TCPLS_HOLD_DATA_TO_CONSUME once its window is full: the sockets are not
+ * read anymore, so that TCP flow control slows the peer down, until the
+ * application frees slots with tcpls_buffer_consume().
  */
 int tcpls_receive(ptls_t *tls, tcpls_buffer_t *input, struct timeval *tv);
 
+/**
+ * Register the session's sockets with an epoll instance. If epollfd is -1, a
+ * new instance is created and owned by the session; otherwise epollfd may be
+ * shared between several sessions and the application feeds the sockets it
+ * gets from epoll_wait() to tcpls_receive_ready().
+ */
+int tcpls_enable_epoll(tcpls_t *tcpls, int epollfd);
+
+int tcpls_receive_ready(ptls_t *tls, tcpls_buffer_t *input, const int *ready_socks, int nready);
+
+/**
+ * Push a failover recovery forward without blocking. tcpls_receive() and
+ * tcpls_send() call it on their own; an application feeding
+ * tcpls_receive_ready() calls it when a socket it got a CONN_WANTS_WRITE for
+ * becomes writable.
+ *
+ * Returns TCPLS_OK if no recovery is left, TCPLS_HOLD_DATA_TO_SEND while it
+ * waits for a socket to become writable, TCPLS_HOLD_DATA_TO_READ while it
+ * waits for the peer, or -1 if no connection could be recovered
+ */
+int tcpls_failover_progress(tcpls_t *tcpls);
+
+/**
+ * Client-side: keep nbr_standby connections joined in advance and idle, for
+ * a failover to move the streams of a failed connection to at once. The
+ * standby connections are replenished in the background.
+ */
+int tcpls_set_standby(tcpls_t *tcpls, int nbr_standby);
+
+int tcpls_listen_fastopen(int socket, int qlen);
+
+/**
+ * Sample the TCP_INFO of the connection transportid, and copy its path
+ * metrics into metrics. Returns -1 if the connection is not established
+ */
+int tcpls_get_path_metrics(tcpls_t *tcpls, uint32_t transportid, tcpls_path_metrics_t *metrics);
+
+/**
+ * Copy the counters of the session, of the connection transportid or of the
+ * stream streamid. The connection and stream ones return -1 if there is no
+ * such connection or stream
+ */
+void tcpls_get_stats(tcpls_t *tcpls, tcpls_stats_t *stats);
+
+int tcpls_get_conn_stats(tcpls_t *tcpls, uint32_t transportid, tcpls_conn_stats_t *stats);
+
+int tcpls_get_stream_stats(tcpls_t *tcpls, streamid_t streamid, tcpls_stream_stats_t *stats);
+
+int tcpls_set_send_weight(tcpls_t *tcpls, uint32_t transportid, uint32_t weight);
+
+int tcpls_set_max_unacked_bytes(tcpls_t *tcpls, size_t max_unacked_bytes);
+
 int tcpls_set_user_timeout(tcpls_t *tcpls, int transportid, uint16_t value,
     uint16_t msec_or_sec, uint8_t setlocal, uint8_t settopeer);
 
@@ -399,6 +725,12 @@ int get_tcpls_header_size(tcpls_t *tcpls, uint8_t type, tcpls_enum_t message);
 
 connect_info_t *connection_get(tcpls_t *tcpls, uint32_t transportid);
 
+connect_info_t *connection_get_from_socket(tcpls_t *tcpls, int socket);
+
+uint64_t connection_rtt_us(connect_info_t *con);
+
+void tcpls_stats_record_sent(tcpls_t *tcpls, size_t len);
+
 int is_varlen(tcpls_enum_t message);
 
 int is_handshake_tcpls_message(tcpls_enum_t message);
@@ -411,6 +743,11 @@ int handle_tcpls_control(ptls_t *ctx, tcpls_enum_t type,
 int handle_tcpls_control_record(ptls_t *tls, struct st_ptls_record_t *rec);
 int handle_tcpls_data_record(ptls_t *tls, struct st_ptls_record_t *rec);
 
+int tcpls_stream_hint_demux(tcpls_t *tcpls, streamid_t streamid,
+    ptls_aead_context_t **aead, ptls_buffer_t **decryptbuf);
+
+ptls_buffer_t *tcpls_reassembly_decryptbuf(tcpls_t *tcpls);
+
 int tcpls_failover_signal(tcpls_t *tcpls, ptls_buffer_t *sendbuf);
 
 void ptls_tcpls_options_free(tcpls_t *tcpls);
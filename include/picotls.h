@@ -223,6 +223,14 @@ extern "C" {
 #define PTLS_MAX_PLAINTEXT_RECORD_SIZE 16384
 #define PTLS_MAX_ENCRYPTED_RECORD_SIZE (16384 + 256)
 
+/* value of ptls_buffer_t::is_allocated for buffers using the per-thread pool */
+#define PTLS_BUFFER_POOLED 2
+/* capacities kept by the per-thread buffer pool: 1KB to 1MB, powers of 2 */
+#define PTLS_BUFFER_POOL_MIN_CLASS 10
+#define PTLS_BUFFER_POOL_NBR_CLASSES 11
+/* max number of blocks kept per capacity */
+#define PTLS_BUFFER_POOL_MAX_BLOCKS 32
+
 #define PTLS_RECORD_VERSION_MAJOR 3
 #define PTLS_RECORD_VERSION_MINOR 3
 
@@ -263,6 +271,8 @@ extern "C" {
 #define PTLS_EXTENSION_TYPE_ENCRYPTED_COOKIE 105
 /** unencrypted mpjoin */
 #define PTLS_EXTENSION_TYPE_MPJOIN 106
+/** records protected by the application traffic keys carry a stream hint */
+#define PTLS_EXTENSION_TYPE_TCPLS_STREAM_HINT 107
 
 #define PTLS_PROTOCOL_VERSION_TLS13_FINAL 0x0304
 #define PTLS_PROTOCOL_VERSION_TLS13_DRAFT26 0x7f1a
@@ -342,6 +352,10 @@ extern "C" {
     uint8_t *base;
     size_t capacity;
     size_t off;
+    /**
+     * 1 if base has been malloc'd, PTLS_BUFFER_POOLED if base comes from (and
+     * goes back to) the buffer pool of the thread, see ptls_buffer_init_pooled()
+     */
     int is_allocated;
   };
 
@@ -833,6 +847,24 @@ typedef struct st_ptls_log_event_t {
 
     unsigned failover : 1;
 
+    /**
+     * If set, we offer (client) or accept (server) to prefix each TCPLS record
+     * with the id of the stream it belongs to. The receiver then picks the
+     * stream's AEAD context directly instead of trying each stream attached to
+     * the connection. Requires support_tcpls_options.
+     */
+
+    unsigned tcpls_stream_hint : 1;
+
+    /**
+     * If set, the buffers of the TCPLS sessions using this context take their
+     * memory from the per-thread buffer pool (see ptls_buffer_init_pooled())
+     * instead of malloc and free. The per-stream buffers of
+     * tcpls_stream_buffers_new() always do.
+     */
+
+    unsigned use_buffer_pool : 1;
+
     /**
      *
      */
@@ -1296,7 +1328,19 @@ typedef struct st_ptls_log_event_t {
    */
   static void ptls_buffer_init(ptls_buffer_t *buf, void *smallbuf, size_t smallbuf_size);
   /**
-   * disposes a buffer, freeing resources allocated by the buffer itself (if any)
+   * initializes an empty buffer whose memory comes from the buffer pool of the
+   * calling thread; ptls_buffer_reserve() and ptls_buffer_dispose() recycle it
+   * through that pool instead of malloc and free. Pooled blocks are plain
+   * malloc'd memory, so the buffer may be disposed by any thread.
+   */
+  void ptls_buffer_init_pooled(ptls_buffer_t *buf);
+  /**
+   * frees the memory cached by the buffer pool of the calling thread
+   */
+  void ptls_buffer_pool_trim(void);
+  /**
+   * disposes a buffer, freeing resources allocated by the buffer itself (if any). A pooled buffer remembers it, so that the
+   * record fragment buffers the library disposes and sets up again keep using the pool
    */
   static void ptls_buffer_dispose(ptls_buffer_t *buf);
   /**
@@ -1587,10 +1631,21 @@ int ptls_handshake(ptls_t *tls, ptls_buffer_t *sendbuf, const void *input, size_
  * decrypts the first record within given buffer
  */
 int ptls_receive(ptls_t *tls, ptls_buffer_t *plaintextbuf, ptls_buffer_t *streambuf, const void *input, size_t *len);
+/**
+ * decrypts every complete record within given buffer back to back. A trailing partial record is kept (in streambuf if given) until
+ * the next call completes it. Stops at the first error; upon return, len is the number of bytes consumed, the record that failed to
+ * decrypt excluded.
+ */
+int ptls_receive_batch(ptls_t *tls, ptls_buffer_t *plaintextbuf, ptls_buffer_t *streambuf, const void *input, size_t *len);
 /**
  * encrypts given buffer into multiple TLS records
  */
 int ptls_send(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, const void *input, size_t inlen);
+/**
+ * encrypts the concatenation of iovcnt buffers into multiple TLS records, without copying them together first. If align is set,
+ * each buffer starts a new record.
+ */
+int ptls_sendv(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, const ptls_iovec_t *iov, size_t iovcnt, int align);
 
 
 /**
@@ -1737,6 +1792,10 @@ int buffer_push_encrypted_records(ptls_t *tls, streamid_t streamid, ptls_buffer_
     tcpls_enum_t tcpls_message, const uint8_t *src, size_t len,
     ptls_aead_context_t *aead);
 
+int buffer_push_encrypted_records_vec(ptls_t *tls, streamid_t streamid, ptls_buffer_t *buf, uint8_t type,
+    tcpls_enum_t tcpls_message, const ptls_iovec_t *iov, size_t iovcnt, int align,
+    ptls_aead_context_t *aead);
+
 int update_send_key(ptls_t *tls, ptls_buffer_t *_sendbuf, int request_update);
 /**
  * Return the current read epoch.
@@ -1858,8 +1917,11 @@ inline void ptls_buffer_init(ptls_buffer_t *buf, void *smallbuf, size_t smallbuf
 
 inline void ptls_buffer_dispose(ptls_buffer_t *buf)
 {
+    int pooled = buf->is_allocated == PTLS_BUFFER_POOLED;
     ptls_buffer__release_memory(buf);
     *buf = (ptls_buffer_t){NULL};
+    if (pooled)
+        buf->is_allocated = PTLS_BUFFER_POOLED;
 }
 
 inline uint8_t *ptls_encode_quicint(uint8_t *p, uint64_t v)
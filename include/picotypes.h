@@ -13,7 +13,10 @@ typedef struct st_ptls_iovec_t ptls_iovec_t;
 typedef struct st_ptls_buffer_t ptls_buffer_t;
 typedef struct st_ptls_aead_context_t ptls_aead_context_t;
 typedef struct st_tcpls_record_fifo_t tcpls_record_fifo_t;
+typedef struct st_tcpls_reorder_window_t tcpls_reorder_window_t;
 typedef struct st_list_t list_t;
+typedef struct st_id_map_t id_map_t;
+typedef struct st_slab_t slab_t;
 typedef struct st_ptls_handshake_properties_t ptls_handshake_properties_t;
 typedef struct st_tcpls_buffer tcpls_buffer_t;
 #endif
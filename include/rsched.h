@@ -4,6 +4,31 @@
 #include "picotls.h"
 #include "picotcpls.h"
 
+/** max nbr of bytes read from one connection during one scheduler call */
+#define TCPLS_RSCHED_DRAIN_BUDGET (4*1024*1024)
+/** base nbr of bytes a connection is given per round */
+#define TCPLS_RSCHED_QUANTUM (64*1024)
+
 int round_robin_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *decryptbuf, void *data);
 
+int round_robin_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *decryptbuf, void *data);
+
+int drain_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *decryptbuf, void *data);
+
+int drain_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *decryptbuf, void *data);
+
+int deficit_round_robin_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t
+    *decryptbuf, void *data);
+
+int deficit_round_robin_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *decryptbuf, void *data);
+
+int next_expected_mpseq_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t
+    *decryptbuf, void *data);
+
+int next_expected_mpseq_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *decryptbuf, void *data);
+
 #endif
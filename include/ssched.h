@@ -0,0 +1,16 @@
+#ifndef ssched_h
+#define ssched_h
+#include "picotypes.h"
+#include "picotls.h"
+#include "picotcpls.h"
+
+/** pending bytes above which a connection is not considered to have room */
+#define TCPLS_SSCHED_MAX_BACKLOG (4*PTLS_MAX_ENCRYPTED_RECORD_SIZE)
+
+tcpls_stream_t *lowest_rtt_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data);
+
+tcpls_stream_t *weighted_round_robin_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data);
+
+tcpls_stream_t *buffer_occupancy_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data);
+
+#endif
@@ -1,5 +1,6 @@
 #include "containers.h"
 #include "picotls.h"
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -32,12 +33,36 @@ Exit:
 }
 
 /**
- * Push a record to the front of the queue
+ * Double the capacity of a full queue; records are laid out again from the
+ * start of the new memory
+ */
+static queue_ret_t record_queue_grow(tcpls_record_fifo_t *fifo) {
+  size_t recsize = 2*sizeof(uint32_t);
+  uint8_t *queue = malloc(fifo->max_record_num*2*recsize);
+  if (queue == NULL)
+    return MEMORY_FULL;
+  /** the queue is full: its records go from back_idx to the end, then wrap */
+  size_t tail = fifo->max_record_num*recsize - fifo->back_idx;
+  memcpy(queue, fifo->queue+fifo->back_idx, tail);
+  memcpy(queue+tail, fifo->queue, fifo->back_idx);
+  free(fifo->queue);
+  fifo->queue = queue;
+  fifo->back_idx = 0;
+  fifo->front_idx = fifo->size*recsize;
+  fifo->max_record_num *= 2;
+  return OK;
+}
+
+/**
+ * Push a record to the front of the queue; the queue grows when full, the
+ * memory it indexes being bounded by the session (see
+ * tcpls_set_max_unacked_bytes())
  *
  * return MEMORY_FULL, OK
  */
 queue_ret_t tcpls_record_queue_push(tcpls_record_fifo_t *fifo, uint32_t
-    stream_seq, uint32_t reclen) { if (fifo->size == fifo->max_record_num)
+    stream_seq, uint32_t reclen) {
+  if (fifo->size == fifo->max_record_num && record_queue_grow(fifo) != OK)
     return MEMORY_FULL;
   memcpy(&fifo->queue[fifo->front_idx], &stream_seq, sizeof(uint32_t));
   memcpy(&fifo->queue[fifo->front_idx+4], &reclen, sizeof(uint32_t));
@@ -92,6 +117,177 @@ void tcpls_record_fifo_free(tcpls_record_fifo_t *fifo) {
   free(fifo);
 }
 
+/* ========================REORDER WINDOW================================ */
+
+#define SLOT_IS_USED(window, slot) ((window)->used[(slot)/64] & ((uint64_t) 1 << ((slot)%64)))
+
+/**
+ * Window able to hold records up to nbr_slots (a power of 2) after the next
+ * expected mpseq. The buffer of a slot is allocated the first time the slot
+ * holds a record, then kept, so that the memory follows the actual reordering.
+ */
+
+tcpls_reorder_window_t *tcpls_reorder_window_new(uint32_t nbr_slots) {
+  assert(nbr_slots != 0 && (nbr_slots & (nbr_slots-1)) == 0);
+  tcpls_reorder_window_t *window = malloc(sizeof(*window));
+  if (window == NULL)
+    return NULL;
+  memset(window, 0, sizeof(*window));
+  window->nbr_slots = nbr_slots;
+  window->slots = calloc(nbr_slots, sizeof(uint8_t *));
+  window->offsets = malloc(nbr_slots*sizeof(uint32_t));
+  window->lengths = malloc(nbr_slots*sizeof(uint32_t));
+  window->used = calloc((nbr_slots+63)/64, sizeof(uint64_t));
+  if (!window->slots || !window->offsets || !window->lengths || !window->used) {
+    tcpls_reorder_window_free(window);
+    return NULL;
+  }
+  return window;
+}
+
+/**
+ * The buffer which is not used by any slot, allocated if needed
+ *
+ * returns NULL if we ran out of memory
+ */
+
+uint8_t *tcpls_reorder_window_spare(tcpls_reorder_window_t *window) {
+  if (!window->spare)
+    window->spare = malloc(TCPLS_REORDER_SLOT_SIZE);
+  return window->spare;
+}
+
+static void reorder_window_set(tcpls_reorder_window_t *window, uint32_t slot,
+    uint32_t offset, size_t len) {
+  window->offsets[slot] = offset;
+  window->lengths[slot] = len;
+  window->used[slot/64] |= (uint64_t) 1 << (slot%64);
+  window->size++;
+}
+
+static void reorder_window_release(tcpls_reorder_window_t *window, uint32_t slot) {
+  window->used[slot/64] &= ~((uint64_t) 1 << (slot%64));
+  window->size--;
+}
+
+/**
+ * Copy the record mpseq into its slot. Records we already hold are silently
+ * ignored.
+ *
+ * return OK, or MEMORY_FULL if mpseq is too far ahead of next_expected_mpseq
+ */
+
+queue_ret_t tcpls_reorder_window_push(tcpls_reorder_window_t *window, uint32_t
+    next_expected_mpseq, uint32_t mpseq, const uint8_t *data, size_t len) {
+  assert(len <= TCPLS_REORDER_SLOT_SIZE);
+  if (mpseq - next_expected_mpseq >= window->nbr_slots)
+    return MEMORY_FULL;
+  uint32_t slot = mpseq & (window->nbr_slots-1);
+  if (SLOT_IS_USED(window, slot))
+    return OK;
+  if (!window->slots[slot] && !(window->slots[slot] = malloc(TCPLS_REORDER_SLOT_SIZE)))
+    return MEMORY_FULL;
+  memcpy(window->slots[slot], data, len);
+  reorder_window_set(window, slot, 0, len);
+  return OK;
+}
+
+/**
+ * Append the record mpseq to buf and release its slot
+ *
+ * return 1 if the record was there, 0 if it is still missing, or a
+ * PTLS_ERROR_* upon error
+ */
+
+int tcpls_reorder_window_pop(tcpls_reorder_window_t *window, uint32_t mpseq,
+    ptls_buffer_t *buf) {
+  int ret;
+  uint32_t slot = mpseq & (window->nbr_slots-1);
+  if (!SLOT_IS_USED(window, slot))
+    return 0;
+  if ((ret = ptls_buffer_reserve(buf, window->lengths[slot])) != 0)
+    return ret;
+  memcpy(buf->base+buf->off, window->slots[slot]+window->offsets[slot], window->lengths[slot]);
+  buf->off += window->lengths[slot];
+  reorder_window_release(window, slot);
+  return 1;
+}
+
+/**
+ * The record mpseq has been decrypted within the spare slot, at data: the
+ * spare becomes the slot of mpseq, and the buffer this slot had (if any)
+ * becomes the spare. Records we already hold are silently ignored.
+ *
+ * return OK, or MEMORY_FULL if mpseq is too far ahead of base_mpseq
+ */
+
+queue_ret_t tcpls_reorder_window_commit(tcpls_reorder_window_t *window, uint32_t
+    base_mpseq, uint32_t mpseq, const uint8_t *data, size_t len) {
+  if (mpseq - base_mpseq >= window->nbr_slots)
+    return MEMORY_FULL;
+  uint32_t slot = mpseq & (window->nbr_slots-1);
+  if (SLOT_IS_USED(window, slot))
+    return OK;
+  if (!window->spare || data < window->spare || data+len > window->spare+TCPLS_REORDER_SLOT_SIZE)
+    return tcpls_reorder_window_push(window, base_mpseq, mpseq, data, len);
+  uint8_t *spare = window->spare;
+  window->spare = window->slots[slot];
+  window->slots[slot] = spare;
+  reorder_window_set(window, slot, data-spare, len);
+  return OK;
+}
+
+/**
+ * Give the bytes left of record mpseq
+ *
+ * return 1 if the record is there, 0 otherwise
+ */
+
+int tcpls_reorder_window_peek(tcpls_reorder_window_t *window, uint32_t mpseq,
+    ptls_iovec_t *vec) {
+  uint32_t slot = mpseq & (window->nbr_slots-1);
+  if (!SLOT_IS_USED(window, slot))
+    return 0;
+  *vec = ptls_iovec_init(window->slots[slot]+window->offsets[slot], window->lengths[slot]);
+  return 1;
+}
+
+/**
+ * Consume at most len bytes of the record mpseq, and release its slot if
+ * nothing is left
+ *
+ * returns the number of bytes consumed
+ */
+
+size_t tcpls_reorder_window_consume(tcpls_reorder_window_t *window, uint32_t
+    mpseq, size_t len) {
+  uint32_t slot = mpseq & (window->nbr_slots-1);
+  if (!SLOT_IS_USED(window, slot))
+    return 0;
+  if (len > window->lengths[slot])
+    len = window->lengths[slot];
+  window->offsets[slot] += len;
+  window->lengths[slot] -= len;
+  if (window->lengths[slot] == 0)
+    reorder_window_release(window, slot);
+  return len;
+}
+
+void tcpls_reorder_window_free(tcpls_reorder_window_t *window) {
+  if (!window)
+    return;
+  if (window->slots) {
+    for (uint32_t i = 0; i < window->nbr_slots; i++)
+      free(window->slots[i]);
+  }
+  free(window->spare);
+  free(window->slots);
+  free(window->offsets);
+  free(window->lengths);
+  free(window->used);
+  free(window);
+}
+
 /* =================================================LIST===========================*/
 /**
  * Create a new list_t containting room capacity items of size itemsize
@@ -103,17 +299,23 @@ list_t *new_list(int itemsize, int capacity) {
   list_t *list = malloc(sizeof(*list));
   if (!list)
     return NULL;
+  list_init(list, itemsize, capacity);
+  return list;
+}
+
+/**
+ * Initialize a list_t embedded in another structure. Room for capacity items
+ * is only allocated by the first list_add(), so that lists which stay empty
+ * cost nothing
+ */
+
+void list_init(list_t *list, int itemsize, int capacity) {
   if (!capacity)
     capacity+=1;
-  list->items = malloc(itemsize*capacity);
-  if (!list->items) {
-    free(list);
-    return NULL;
-  }
+  list->items = NULL;
   list->capacity = capacity;
   list->size = 0;
   list->itemsize = itemsize;
-  return list;
 }
 
 /**
@@ -123,10 +325,15 @@ list_t *new_list(int itemsize, int capacity) {
  */
 
 int list_add(list_t *list, void *item) {
-  if (list->size == list->capacity) {
-    list->items = realloc(list->items, list->capacity*2*list->itemsize);
-    if (!list->items)
+  if (!list->items) {
+    if ((list->items = malloc(list->capacity*list->itemsize)) == NULL)
+      return -1;
+  }
+  else if (list->size == list->capacity) {
+    uint8_t *items = realloc(list->items, list->capacity*2*list->itemsize);
+    if (!items)
       return -1;
+    list->items = items;
     list->capacity = list->capacity*2;
   }
   memcpy(&list->items[list->size*list->itemsize], item, list->itemsize);
@@ -158,10 +365,8 @@ int list_remove(list_t *list, void *item) {
         return 0;
       }
       else {
-        uint8_t *items_tmp[(list->size-i-1)*list->itemsize];
-        /** Note: could do a memmove instead */
-        memcpy(items_tmp, &list->items[(i+1)*list->itemsize], (list->size-i-1)*list->itemsize);
-        memcpy(&list->items[i*list->itemsize], items_tmp, (list->size-i-1)*list->itemsize);
+        memmove(&list->items[i*list->itemsize], &list->items[(i+1)*list->itemsize],
+            (list->size-i-1)*list->itemsize);
         list->size--;
         return 0;
       }
@@ -179,31 +384,373 @@ void list_clean(list_t *list) {
   list->size = 0;
 }
 
+/**
+ * Release the items of a list initialized by list_init()
+ */
+
+void list_dispose(list_t *list) {
+  if (!list)
+    return;
+  free(list->items);
+  list->items = NULL;
+  list->size = 0;
+}
+
 void list_free(list_t *list) {
   if (!list)
     return;
-  if (!list->items) {
-    free(list);
+  list_dispose(list);
+  free(list);
+}
+
+/* =================================================SLAB===========================*/
+
+struct st_slab_slot_hdr {
+  /** index of this slot */
+  int handle;
+  /** position within slab->live; -1 while the slot is free */
+  int pos;
+  /** next free slot while the slot is free */
+  int next_free;
+  int pad;
+};
+
+static inline struct st_slab_slot_hdr *slab_slot(slab_t *slab, int handle) {
+  return (struct st_slab_slot_hdr *) (slab->chunks[handle / slab->chunk_items] +
+      (handle % slab->chunk_items) * slab->slotsize);
+}
+
+static inline struct st_slab_slot_hdr *slab_item_hdr(void *item) {
+  return (struct st_slab_slot_hdr *) item - 1;
+}
+
+/**
+ * Create a new slab_t of items of size itemsize, allocated by chunks of
+ * chunk_items items
+ *
+ * return NULL if an error occured
+ */
+
+slab_t *new_slab(int itemsize, int chunk_items) {
+  slab_t *slab = malloc(sizeof(*slab));
+  if (!slab)
+    return NULL;
+  slab_init(slab, itemsize, chunk_items);
+  return slab;
+}
+
+/**
+ * Initialize a slab_t embedded in another structure; nothing is allocated
+ * before the first slab_add()
+ */
+
+void slab_init(slab_t *slab, int itemsize, int chunk_items) {
+  memset(slab, 0, sizeof(*slab));
+  if (chunk_items <= 0)
+    chunk_items = 1;
+  slab->itemsize = itemsize;
+  slab->slotsize = (sizeof(struct st_slab_slot_hdr) + itemsize + 15) & ~15;
+  slab->chunk_items = chunk_items;
+  slab->free_handle = -1;
+  slab->capacity = chunk_items;
+}
+
+/**
+ * Copy item within a free slot of the slab, or zero it if item is NULL.
+ *
+ * returns the address of the item within the slab, which stays valid until
+ * slab_remove(); NULL if an error occured
+ */
+
+void *slab_add(slab_t *slab, void *item) {
+  struct st_slab_slot_hdr *hdr;
+  if (!slab->live) {
+    if ((slab->live = malloc(slab->capacity*sizeof(*slab->live))) == NULL)
+      return NULL;
+  }
+  else if (slab->size == slab->capacity) {
+    void **live = realloc(slab->live, slab->capacity*2*sizeof(*slab->live));
+    if (!live)
+      return NULL;
+    slab->live = live;
+    slab->capacity *= 2;
+  }
+  if (slab->free_handle >= 0) {
+    hdr = slab_slot(slab, slab->free_handle);
+    slab->free_handle = hdr->next_free;
+  }
+  else {
+    if (slab->nbr_slots == slab->nbr_chunks * slab->chunk_items) {
+      uint8_t **chunks = realloc(slab->chunks, (slab->nbr_chunks+1)*sizeof(*chunks));
+      if (!chunks)
+        return NULL;
+      slab->chunks = chunks;
+      if ((chunks[slab->nbr_chunks] = malloc(slab->chunk_items*slab->slotsize)) == NULL)
+        return NULL;
+      slab->nbr_chunks++;
+    }
+    hdr = slab_slot(slab, slab->nbr_slots);
+    hdr->handle = slab->nbr_slots++;
+  }
+  hdr->pos = slab->size;
+  void *slot_item = hdr + 1;
+  if (item)
+    memcpy(slot_item, item, slab->itemsize);
+  else
+    memset(slot_item, 0, slab->itemsize);
+  slab->live[slab->size++] = slot_item;
+  return slot_item;
+}
+
+/**
+ * returns the item at position pos within the items in use; pos < size
+ */
+
+void *slab_get(slab_t *slab, int pos) {
+  if (pos < 0 || pos >= slab->size)
+    return NULL;
+  return slab->live[pos];
+}
+
+/**
+ * returns the item of the given handle, or NULL if that slot is not in use
+ */
+
+void *slab_at(slab_t *slab, int handle) {
+  if (handle < 0 || handle >= slab->nbr_slots)
+    return NULL;
+  struct st_slab_slot_hdr *hdr = slab_slot(slab, handle);
+  if (hdr->pos < 0)
+    return NULL;
+  return hdr + 1;
+}
+
+int slab_handle(slab_t *slab, void *item) {
+  return slab_item_hdr(item)->handle;
+}
+
+/**
+ * Give the slot of item back to the slab; the last live item takes its
+ * position.
+ *
+ * return -1 if item is not in use
+ */
+
+int slab_remove(slab_t *slab, void *item) {
+  struct st_slab_slot_hdr *hdr = slab_item_hdr(item);
+  if (hdr->pos < 0 || hdr->pos >= slab->size || slab->live[hdr->pos] != item)
+    return -1;
+  void *last = slab->live[--slab->size];
+  slab->live[hdr->pos] = last;
+  slab_item_hdr(last)->pos = hdr->pos;
+  hdr->pos = -1;
+  hdr->next_free = slab->free_handle;
+  slab->free_handle = hdr->handle;
+  return 0;
+}
+
+/**
+ * Release the items of a slab initialized by slab_init()
+ */
+
+void slab_dispose(slab_t *slab) {
+  if (!slab)
+    return;
+  for (int i = 0; i < slab->nbr_chunks; i++)
+    free(slab->chunks[i]);
+  free(slab->chunks);
+  free(slab->live);
+  slab_init(slab, slab->itemsize, slab->chunk_items);
+}
+
+void slab_free(slab_t *slab) {
+  if (!slab)
     return;
+  slab_dispose(slab);
+  free(slab);
+}
+
+/* =================================================ID MAP=========================*/
+
+/** an empty bucket holds a negative value */
+#define ID_MAP_EMPTY -1
+
+static inline int id_map_bucket(id_map_t *map, uint32_t key) {
+  /** Knuth's multiplicative hashing; ids are often consecutive */
+  return (int) ((key * 2654435761u) & (map->capacity-1));
+}
+
+static int id_map_alloc(id_map_t *map, int capacity) {
+  map->keys = malloc(capacity*sizeof(*map->keys));
+  map->values = malloc(capacity*sizeof(*map->values));
+  if (!map->keys || !map->values) {
+    free(map->keys);
+    free(map->values);
+    return -1;
   }
-  free(list->items);
-  free(list);
+  for (int i = 0; i < capacity; i++)
+    map->values[i] = ID_MAP_EMPTY;
+  map->capacity = capacity;
+  map->size = 0;
+  return 0;
 }
 
-/*********************Stream buffers ****************************/
+/**
+ * Create a new id_map_t with room for at least capacity ids
+ *
+ * return NULL if an error occured
+ */
+
+id_map_t *new_id_map(int capacity) {
+  id_map_t *map = malloc(sizeof(*map));
+  if (!map)
+    return NULL;
+  id_map_init(map, capacity);
+  return map;
+}
 
-static int stream_buffer_cmp(const void *elem1, const void *elem2) {
-  struct st_tcpls_stream_buffer *stream_buf1 = (struct st_tcpls_stream_buffer*) elem1;
-  struct st_tcpls_stream_buffer *stream_buf2 = (struct st_tcpls_stream_buffer*) elem1;
-  int val = stream_buf1->streamid - stream_buf2->streamid;
-  if (val < 0)
+/**
+ * Initialize an id_map_t embedded in another structure; the buckets are
+ * allocated by the first id_map_set()
+ */
+
+void id_map_init(id_map_t *map, int capacity) {
+  int pow2 = 8;
+  while (pow2 < 2*capacity)
+    pow2 *= 2;
+  map->capacity = pow2;
+  map->size = 0;
+  map->keys = NULL;
+  map->values = NULL;
+}
+
+/**
+ * Map key to value (value >= 0), replacing any previous value of key.
+ *
+ * return 0 on success, -1 if an error occured
+ */
+
+int id_map_set(id_map_t *map, uint32_t key, int value) {
+  assert(value >= 0);
+  if (!map->values) {
+    if (id_map_alloc(map, map->capacity))
+      return -1;
+  }
+  else if (2*(map->size+1) > map->capacity) {
+    id_map_t old = *map;
+    if (id_map_alloc(map, old.capacity*2)) {
+      *map = old;
+      return -1;
+    }
+    for (int i = 0; i < old.capacity; i++) {
+      if (old.values[i] != ID_MAP_EMPTY)
+        id_map_set(map, old.keys[i], old.values[i]);
+    }
+    free(old.keys);
+    free(old.values);
+  }
+  int i = id_map_bucket(map, key);
+  while (map->values[i] != ID_MAP_EMPTY && map->keys[i] != key)
+    i = (i+1) & (map->capacity-1);
+  if (map->values[i] == ID_MAP_EMPTY)
+    map->size++;
+  map->keys[i] = key;
+  map->values[i] = value;
+  return 0;
+}
+
+/**
+ * return the value of key, or -1 if key is not in the map
+ */
+
+int id_map_get(id_map_t *map, uint32_t key) {
+  if (!map->values)
     return -1;
-  else if (val == 0)
-    return 0;
-  else
-    return 1;
+  int i = id_map_bucket(map, key);
+  while (map->values[i] != ID_MAP_EMPTY) {
+    if (map->keys[i] == key)
+      return map->values[i];
+    i = (i+1) & (map->capacity-1);
+  }
+  return -1;
+}
+
+/**
+ * Remove key from the map. The following entries of the cluster are shifted
+ * back so that lookups never need tombstones.
+ *
+ * return -1 if key is not in the map
+ */
+
+int id_map_remove(id_map_t *map, uint32_t key) {
+  if (!map->values)
+    return -1;
+  int mask = map->capacity-1;
+  int i = id_map_bucket(map, key);
+  while (map->values[i] != ID_MAP_EMPTY && map->keys[i] != key)
+    i = (i+1) & mask;
+  if (map->values[i] == ID_MAP_EMPTY)
+    return -1;
+  int j = i;
+  for (;;) {
+    map->values[i] = ID_MAP_EMPTY;
+    int home;
+    do {
+      j = (j+1) & mask;
+      if (map->values[j] == ID_MAP_EMPTY) {
+        map->size--;
+        return 0;
+      }
+      home = id_map_bucket(map, map->keys[j]);
+      /** keep j in place if its home bucket lies cyclically within (i, j] */
+    } while (((j-home) & mask) < ((j-i) & mask));
+    map->keys[i] = map->keys[j];
+    map->values[i] = map->values[j];
+    i = j;
+  }
+}
+
+/**
+ * Virtually clean the map
+ */
+
+void id_map_clean(id_map_t *map) {
+  if (!map || !map->values)
+    return;
+  for (int i = 0; i < map->capacity; i++)
+    map->values[i] = ID_MAP_EMPTY;
+  map->size = 0;
 }
 
+/**
+ * Release the buckets of a map initialized by id_map_init()
+ */
+
+void id_map_dispose(id_map_t *map) {
+  if (!map)
+    return;
+  free(map->keys);
+  free(map->values);
+  map->keys = NULL;
+  map->values = NULL;
+  map->size = 0;
+}
+
+void id_map_free(id_map_t *map) {
+  if (!map)
+    return;
+  id_map_dispose(map);
+  free(map);
+}
+
+/*********************Stream buffers ****************************/
+
+/** a stream buffer and the ptls_buffer_t it points to, in one slab item */
+struct st_tcpls_stream_buffer_slot {
+  struct st_tcpls_stream_buffer super;
+  ptls_buffer_t decryptbuf;
+};
+
 /**
  * Create a new tcpls_buffer_t * with rooms for nbr_expected_streams buffers.
  *
@@ -218,17 +765,23 @@ tcpls_buffer_t *tcpls_stream_buffers_new(tcpls_t *tcpls, int nbr_expect_streams)
     return NULL;
   memset(buf, 0, sizeof(tcpls_buffer_t));
   buf->bufkind = STREAMBASED;
-  buf->stream_buffers = new_list(sizeof(struct st_tcpls_stream_buffer), nbr_expect_streams);
+  buf->stream_buffers = new_slab(sizeof(struct st_tcpls_stream_buffer_slot), nbr_expect_streams);
+  buf->stream_buffers_index = new_id_map(nbr_expect_streams);
   buf->wtr_streams = new_list(sizeof(streamid_t), nbr_expect_streams);
-  if (!buf->stream_buffers || !buf->wtr_streams)
+  if (!buf->stream_buffers || !buf->stream_buffers_index || !buf->wtr_streams) {
+    slab_free(buf->stream_buffers);
+    id_map_free(buf->stream_buffers_index);
+    list_free(buf->wtr_streams);
+    free(buf);
     return NULL;
+  }
   tcpls->buffer = buf;
   /** In case the application changes its aggregation-based buffer to a
    * stream-based buffering in the middle of the connection */
   if (tcpls->streams->size > 0) {
     tcpls_stream_t *stream;
     for (int i = 0; i < tcpls->streams->size; i++) {
-      stream = list_get(tcpls->streams, i);
+      stream = slab_get(tcpls->streams, i);
       if (stream->stream_usable)
         tcpls_stream_buffer_add(buf, stream->streamid);
     }
@@ -253,91 +806,188 @@ tcpls_buffer_t *tcpls_aggr_buffer_new(tcpls_t *tcpls) {
     free(buf);
     return NULL;
   }
-  ptls_buffer_init(buf->decryptbuf, "", 0);
+  if (tcpls->tls->ctx->use_buffer_pool)
+    ptls_buffer_init_pooled(buf->decryptbuf);
+  else
+    ptls_buffer_init(buf->decryptbuf, "", 0);
   tcpls->buffer = buf;
   return buf;
 }
 
+/**
+ * Creates a buffer for the aggregation mode in which each record is decrypted
+ * once, straight into a slot of a reassembly window of nbr_slots records (a
+ * power of 2). The application reads the in-order bytes with
+ * tcpls_buffer_peek() and releases them with tcpls_buffer_consume().
+ * /!\ returns NULL if a tcpls_buffer_t * has already been created /!\
+ */
+tcpls_buffer_t *tcpls_reassembly_buffer_new(tcpls_t *tcpls, uint32_t nbr_slots) {
+  if (tcpls->buffer)
+    return NULL;
+  tcpls_buffer_t *buf = malloc(sizeof(tcpls_buffer_t));
+  if (!buf)
+    return NULL;
+  memset(buf, 0, sizeof(tcpls_buffer_t));
+  buf->bufkind = REASSEMBLY;
+  buf->window = tcpls_reorder_window_new(nbr_slots);
+  buf->slotbuf = malloc(sizeof(ptls_buffer_t));
+  buf->held = new_list(sizeof(struct st_tcpls_held_record), 4);
+  if (!buf->window || !buf->slotbuf || !buf->held) {
+    tcpls_reorder_window_free(buf->window);
+    free(buf->slotbuf);
+    list_free(buf->held);
+    free(buf);
+    return NULL;
+  }
+  ptls_buffer_init(buf->slotbuf, "", 0);
+  buf->read_mpseq = tcpls->next_expected_mpseq;
+  tcpls->buffer = buf;
+  return buf;
+}
 
 /**
- * When a stream is created, we need to add a buffer that the application can
- * use. Maintain the list of buffer ordered
+ * Keep a copy of a decrypted record a reordering window has no room for, until
+ * tcpls_held_records_release() can move it there
+ *
+ * return OK, or MEMORY_FULL
+ */
+int tcpls_held_records_add(list_t *held, uint32_t mpseq, const uint8_t *data, size_t len) {
+  struct st_tcpls_held_record record;
+  record.mpseq = mpseq;
+  record.len = len;
+  if ((record.data = malloc(len)) == NULL)
+    return MEMORY_FULL;
+  memcpy(record.data, data, len);
+  if (list_add(held, &record) < 0) {
+    free(record.data);
+    return MEMORY_FULL;
+  }
+  return OK;
+}
+
+/**
+ * Move the held records window has room for now, base_mpseq being its first
+ * record; the ones before base_mpseq are duplicates and are dropped
+ *
+ * returns the number of records still held
+ */
+int tcpls_held_records_release(list_t *held, tcpls_reorder_window_t *window, uint32_t base_mpseq) {
+  int i = 0;
+  while (i < held->size) {
+    struct st_tcpls_held_record *record = list_get(held, i);
+    if ((int32_t) (record->mpseq - base_mpseq) >= 0 &&
+        tcpls_reorder_window_push(window, base_mpseq, record->mpseq,
+          record->data, record->len) != OK) {
+      i++;
+      continue;
+    }
+    free(record->data);
+    list_remove(held, record);
+  }
+  return held->size;
+}
+
+void tcpls_held_records_free(list_t *held) {
+  if (!held)
+    return;
+  for (int i = 0; i < held->size; i++)
+    free(((struct st_tcpls_held_record *) list_get(held, i))->data);
+  list_free(held);
+}
+
+int tcpls_reassembly_hold(tcpls_buffer_t *buf, uint32_t mpseq, const uint8_t *data, size_t len) {
+  return tcpls_held_records_add(buf->held, mpseq, data, len);
+}
+
+int tcpls_reassembly_release(tcpls_buffer_t *buf) {
+  return tcpls_held_records_release(buf->held, buf->window, buf->read_mpseq);
+}
+
+/**
+ * Fills vecs with at most nbr_vecs chunks of the in-order bytes received so
+ * far; they stay valid until consumed.
  *
+ * returns the number of chunks
+ */
+size_t tcpls_buffer_peek(tcpls_t *tcpls, ptls_iovec_t *vecs, size_t nbr_vecs) {
+  tcpls_buffer_t *buf = tcpls->buffer;
+  size_t n = 0;
+  assert(buf->bufkind == REASSEMBLY);
+  for (uint32_t mpseq = buf->read_mpseq; n < nbr_vecs && mpseq != tcpls->next_expected_mpseq; mpseq++) {
+    if (tcpls_reorder_window_peek(buf->window, mpseq, &vecs[n]))
+      n++;
+  }
+  return n;
+}
+
+/**
+ * Releases the first len in-order bytes, whose slots can then receive new
+ * records
+ */
+void tcpls_buffer_consume(tcpls_t *tcpls, size_t len) {
+  tcpls_buffer_t *buf = tcpls->buffer;
+  ptls_iovec_t vec;
+  assert(buf->bufkind == REASSEMBLY);
+  while (buf->read_mpseq != tcpls->next_expected_mpseq) {
+    if (tcpls_reorder_window_peek(buf->window, buf->read_mpseq, &vec)) {
+      len -= tcpls_reorder_window_consume(buf->window, buf->read_mpseq, len);
+      if (tcpls_reorder_window_peek(buf->window, buf->read_mpseq, &vec))
+        break;
+    }
+    buf->read_mpseq++;
+  }
+}
+
+
+/**
+ * When a stream is created, we need to add a buffer that the application can
+ * use. Its memory always comes from the per-thread buffer pool, so that
+ * streams opened and closed in turn keep using the same blocks
  */
 
 int tcpls_stream_buffer_add(tcpls_buffer_t *buffers, streamid_t streamid) {
   if (buffers->bufkind != STREAMBASED)
     return -1;
-  struct st_tcpls_stream_buffer stream_buffer;
-  memset(&stream_buffer, 0, sizeof(stream_buffer));
-  stream_buffer.decryptbuf = malloc(sizeof(ptls_buffer_t));
-  stream_buffer.streamid = streamid;
-  ptls_buffer_init(stream_buffer.decryptbuf, "", 0);
-  if (!stream_buffer.decryptbuf)
+  if (id_map_get(buffers->stream_buffers_index, streamid) >= 0)
+    return 0;
+  struct st_tcpls_stream_buffer_slot *slot = slab_add(buffers->stream_buffers, NULL);
+  if (!slot)
+    return -1;
+  if (id_map_set(buffers->stream_buffers_index, streamid, slab_handle(buffers->stream_buffers, slot))) {
+    slab_remove(buffers->stream_buffers, slot);
     return -1;
-  list_add(buffers->stream_buffers, &stream_buffer);
-  if (streamid > buffers->max_streamid)
-    buffers->max_streamid = streamid;
-  else {
-    qsort(buffers->stream_buffers->items, buffers->stream_buffers->size,
-        sizeof(struct st_tcpls_stream_buffer), stream_buffer_cmp);
   }
+  slot->super.streamid = streamid;
+  slot->super.decryptbuf = &slot->decryptbuf;
+  ptls_buffer_init_pooled(&slot->decryptbuf);
   return 0;
 }
 
+/**
+ * Removes the buffer of streamid; its memory goes back to the per-thread
+ * buffer pool
+ */
+
 int tcpls_stream_buffer_remove(tcpls_buffer_t *buffers, streamid_t streamid) {
   if (buffers->bufkind != STREAMBASED)
     return -1;
-  struct st_tcpls_stream_buffer *stream_buffer;
-  if (streamid > buffers->max_streamid)
+  struct st_tcpls_stream_buffer_slot *slot = slab_at(buffers->stream_buffers,
+      id_map_get(buffers->stream_buffers_index, streamid));
+  if (!slot)
     return -1;
-  /** Ensure that buffers->max_streamid is still relevant after removal */
-  else if (streamid == buffers->max_streamid && buffers->stream_buffers->size > 1) {
-    stream_buffer = list_get(buffers->stream_buffers, buffers->stream_buffers->size-2);
-    buffers->max_streamid = stream_buffer->streamid;
-  }
-  else if (streamid == buffers->max_streamid && buffers->stream_buffers->size == 1) {
-    buffers->max_streamid = 0;
-  }
-  for (int i = 0; i < buffers->stream_buffers->size; i++) {
-    stream_buffer = list_get(buffers->stream_buffers, i);
-    if (stream_buffer->streamid == streamid)
-      return list_remove(buffers->stream_buffers, stream_buffer);
-  }
-  return -1;
-}
-
-static struct st_tcpls_stream_buffer * pivot_search_stream_buffer(tcpls_buffer_t *buffers, int left, int right, streamid_t streamid) {
-  int center = (right+left)/2;
-  struct st_tcpls_stream_buffer *stream_buffer;
-  stream_buffer = list_get(buffers->stream_buffers, center);
-  if (stream_buffer->streamid == streamid)
-    return stream_buffer;
-  else if (left == right)
-    return NULL;
-  else if (stream_buffer->streamid < streamid)
-    return pivot_search_stream_buffer(buffers, center+1, right, streamid);
-  else
-    return pivot_search_stream_buffer(buffers, left, center, streamid);
+  ptls_buffer_dispose(&slot->decryptbuf);
+  id_map_remove(buffers->stream_buffers_index, streamid);
+  return slab_remove(buffers->stream_buffers, slot);
 }
 
-/**
- * Does a binary search of the streamid
- */
-
 ptls_buffer_t *tcpls_get_stream_buffer(tcpls_buffer_t *buffers, streamid_t streamid) {
-  if (streamid < 0 || streamid > buffers->max_streamid || buffers->stream_buffers->size == 0)
+  struct st_tcpls_stream_buffer_slot *slot = slab_at(buffers->stream_buffers,
+      id_map_get(buffers->stream_buffers_index, streamid));
+  if (!slot)
     return NULL;
-  struct st_tcpls_stream_buffer *stream_buffer = pivot_search_stream_buffer(buffers, 0, buffers->stream_buffers->size-1, streamid);
-  if (stream_buffer) {
-    return stream_buffer->decryptbuf;
-  }
-  else {
-    return NULL;
-  }
+  return &slot->decryptbuf;
 }
 
-
 /**
  * Free a tcpls_buffer_t *
  */
@@ -347,12 +997,19 @@ void tcpls_buffer_free(tcpls_t *tcpls, tcpls_buffer_t *buf) {
   if (buf->bufkind == AGGREGATION) {
     ptls_buffer_dispose(buf->decryptbuf);
   }
+  else if (buf->bufkind == REASSEMBLY) {
+    ptls_buffer_dispose(buf->slotbuf);
+    free(buf->slotbuf);
+    tcpls_reorder_window_free(buf->window);
+    tcpls_held_records_free(buf->held);
+  }
   else {
     for (int i = 0; i < buf->stream_buffers->size; i++) {
-      struct st_tcpls_stream_buffer *stream_buffer = (struct st_tcpls_stream_buffer *) list_get(buf->stream_buffers, i);
+      struct st_tcpls_stream_buffer *stream_buffer = slab_get(buf->stream_buffers, i);
       ptls_buffer_dispose(stream_buffer->decryptbuf);
     }
-    list_free(buf->stream_buffers);
+    slab_free(buf->stream_buffers);
+    id_map_free(buf->stream_buffers_index);
     list_free(buf->wtr_streams);
   }
   tcpls->buffer = NULL;
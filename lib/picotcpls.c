@@ -54,6 +54,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -66,6 +68,9 @@
 #include "picotls.h"
 #include "picotcpls.h"
 #include "rsched.h"
+#if PICOTLS_USE_DTRACE
+#include "picotls-probes.h"
+#endif
 /* Forward declarations */
 static int tcpls_init_context(ptls_t *ptls, const void *data, size_t datalen,
   tcpls_enum_t type, uint8_t setlocal, uint8_t settopeer);
@@ -78,7 +83,6 @@ static void stream_free(tcpls_stream_t *stream);
 static int cmp_times(struct timeval *t1, struct timeval *t2);
 static int stream_send_control_message(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, ptls_aead_context_t *enc,
   const void *inputinfo, tcpls_enum_t message, uint32_t message_len);
-static connect_info_t *get_con_info_from_socket(tcpls_t *tcpls, int socket);
 /*static connect_info_t *get_best_con(tcpls_t *tcpls);*/
 static int get_con_info_from_addrs(tcpls_t *tcpls, tcpls_v4_addr_t *src,
   tcpls_v4_addr_t *dest, tcpls_v6_addr_t *src6, tcpls_v6_addr_t *dest6,
@@ -88,30 +92,175 @@ static tcpls_v6_addr_t *get_addr6_from_sockaddr(tcpls_v6_addr_t *llist, struct s
 static connect_info_t *get_primary_con_info(tcpls_t *tcpls);
 static int count_streams_from_transportid(tcpls_t *tcpls, int transportid);
 static tcpls_stream_t *stream_get(tcpls_t *tcpls, streamid_t streamid);
+static tcpls_stream_t *stream_insert(tcpls_t *tcpls, tcpls_stream_t *stream);
+static void stream_remove(tcpls_t *tcpls, tcpls_stream_t *stream);
+static void stream_con_link(tcpls_t *tcpls, tcpls_stream_t *stream);
+static void stream_con_unlink(tcpls_t *tcpls, tcpls_stream_t *stream);
+static void stream_count_received(tcpls_t *tcpls, tcpls_stream_t *stream, uint32_t nbytes);
 static tcpls_stream_t *stream_helper_new(tcpls_t *tcpls, connect_info_t *con);
 static void check_stream_attach_have_been_sent(tcpls_t *tcpls, int consumed);
 static int new_stream_derive_aead_context(ptls_t *tls, tcpls_stream_t *stream, int is_client_origin);
-static int handle_connect(tcpls_t *tcpls, tcpls_v4_addr_t *src, tcpls_v4_addr_t
-  *dest, tcpls_v6_addr_t *src6, tcpls_v6_addr_t *dest6, unsigned short sa_family,
-  int *nfds, connect_info_t *coninfo);
+static connect_info_t *connection_prepare(tcpls_t *tcpls, tcpls_v4_addr_t *src,
+  tcpls_v4_addr_t *dest, tcpls_v6_addr_t *src6, tcpls_v6_addr_t *dest6,
+  unsigned short sa_family);
+static int connection_start(tcpls_t *tcpls, connect_info_t *con);
+static struct st_tcpls_connector_t *connector_new(tcpls_t *tcpls);
+static void connector_free(tcpls_t *tcpls);
+static int connector_add(tcpls_t *tcpls, connect_info_t *con);
+static void connector_interleave(tcpls_t *tcpls, int first);
+static void connection_make_primary(tcpls_t *tcpls, connect_info_t *con);
 static int multipath_merge_buffers(tcpls_t *tcpls, ptls_buffer_t *decryptbuf);
-static int cmp_uint32(void *mpseq1, void *mpseq2);
-static void free_heap_key_value(void *key, void *val);
+static void reassembly_advance(tcpls_t *tcpls);
+static int reassembly_release_held(tcpls_t *tcpls);
 static int check_con_has_connected(tcpls_t *tcpls, connect_info_t *con, int *res);
+static void connection_fastopen_rtt(connect_info_t *con, struct timeval *t_sent);
+static int connection_sample_metrics(connect_info_t *con, struct timeval *now);
+static void path_metrics_sample(tcpls_t *tcpls);
+static int path_is_better(connect_info_t *con, connect_info_t *best);
+static void stream_sendbuf_occupancy(tcpls_t *tcpls, tcpls_stream_t *stream, uint64_t *unsent, uint64_t *unacked);
+static void reorder_stats_held(tcpls_t *tcpls, uint32_t mpseq, uint32_t depth);
+static void reorder_stats_delivered(tcpls_t *tcpls);
 static void compute_client_rtt(connect_info_t *con, struct timeval *timeout,
   struct timeval *t_initial, struct timeval *t_previous);
 static void shift_buffer(ptls_buffer_t *buf, size_t delta);
+static void release_acked_bytes(tcpls_stream_t *stream);
+static int should_hold_data_to_send(tcpls_t *tcpls, tcpls_stream_t *stream);
+static size_t unacked_bytes(tcpls_t *tcpls);
 static int send_ack_if_needed(tcpls_t *tcpls, tcpls_stream_t *stream);
 static void free_bytes_in_sending_buffer(tcpls_t *tcpls, tcpls_stream_t *stream, uint32_t seqnum);
 static void connection_close(tcpls_t *tcpls, connect_info_t *con);
 static void connection_fail(tcpls_t *tcpls, connect_info_t *con);
-static int did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int bytes_sent);
+static void connection_epoll_add(tcpls_t *tcpls, connect_info_t *con);
+static void connection_epoll_del(tcpls_t *tcpls, connect_info_t *con);
+static int receive_finish(tcpls_t *tcpls);
+static int receive_epoll(tcpls_t *tcpls, tcpls_buffer_t *buf, struct timeval *tv);
+static void did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int bytes_sent);
 static void tcpls_housekeeping(tcpls_t *tcpls);
-static connect_info_t *try_reconnect(tcpls_t *tcpls, connect_info_t *con, int *remaining_con);
-static int send_unacked_data(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *tocon);
 static int do_send(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *con);
+static int send_scheduled(tcpls_t *tcpls, tcpls_stream_t *stream, const ptls_iovec_t *iov, size_t iovcnt, int align);
 static int initiate_recovering(tcpls_t *tcpls, connect_info_t *con);
+static struct st_tcpls_failover_t *failover_new(tcpls_t *tcpls);
+static void failover_free(tcpls_t *tcpls);
+static int failover_next_path(tcpls_t *tcpls);
+static int failover_connect(tcpls_t *tcpls, connect_info_t *recon);
+static int failover_join(tcpls_t *tcpls, connect_info_t *recon);
+static void failover_joined(tcpls_t *tcpls, connect_info_t *con);
+static int failover_path_failed(tcpls_t *tcpls, connect_info_t *recon);
+static int standby_count(tcpls_t *tcpls);
+static void standby_replenish(tcpls_t *tcpls);
+static void standby_abort(tcpls_t *tcpls);
+static int failover_replay_start(tcpls_t *tcpls, connect_info_t *recon);
+static int failover_replay(tcpls_t *tcpls);
+static int failover_wants_write(tcpls_t *tcpls);
+static int failover_progress(tcpls_t *tcpls);
+static int flush_nonblocking(tcpls_t *tcpls, connect_info_t *con, ptls_buffer_t *sendbuf, int *send_start);
+static void connection_want_write(tcpls_t *tcpls, connect_info_t *con);
+static void connection_epoll_watch(tcpls_t *tcpls, connect_info_t *con, int want_write);
+static struct timeval timediff(struct timeval *t_current, struct timeval *t_init);
 static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input, tcpls_buffer_t *decryptbuf,  size_t *input_off, size_t input_size);
+static int decrypt_with_stream_hint(tcpls_t *tcpls, connect_info_t *con, tcpls_buffer_t *buf, size_t input_size);
+
+/**
+ * Initialize an empty buffer of a session, taking its memory from the
+ * per-thread pool if the context asks for it
+ */
+
+static inline void session_buffer_init(ptls_context_t *ctx, ptls_buffer_t *buf) {
+  if (ctx->use_buffer_pool)
+    ptls_buffer_init_pooled(buf);
+  else
+    ptls_buffer_init(buf, "", 0);
+}
+
+/**
+ * A session and the containers it holds from its creation, carved out of one
+ * allocation by tcpls_new(). The pointers of tcpls_t refer to the fields
+ * below; the containers only allocate their items once they get some.
+ */
+
+struct st_tcpls_session_t {
+  tcpls_t tcpls;
+  ptls_buffer_t sendbuf;
+  ptls_buffer_t buffrag;
+  slab_t streams;
+  id_map_t streams_index;
+  list_t streams_ack_due;
+  list_t streams_attach_pending;
+  slab_t connect_infos;
+  id_map_t sockets_index;
+  list_t tcpls_options;
+  list_t cookies;
+};
+
+/** Steps of the recovery from a failed connection */
+
+typedef enum tcpls_failover_step_t {
+  /** connecting the connection to recover onto; client only */
+  FAILOVER_CONNECTING,
+  /** MPJOIN handshake over that connection; client only */
+  FAILOVER_JOINING,
+  /** FAILOVER messages, unacked data and FAILOVER_END are being sent */
+  FAILOVER_REPLAYING
+} tcpls_failover_step_t;
+
+/**
+ * A recovery in progress, allocated upon the failure. No step waits on a
+ * socket: each one writes what the socket takes and tcpls_failover_progress()
+ * resumes it later.
+ */
+
+struct st_tcpls_failover_t {
+  tcpls_failover_step_t step;
+  /** the connection which failed */
+  uint32_t failed_transportid;
+  /** the connection its streams move to */
+  uint32_t recon_transportid;
+  /** nbr of connections we may still try to recover onto */
+  int remaining_con;
+  /** when we started connecting recon */
+  struct timeval started;
+  /** give up on recon past this time, while connecting or joining */
+  struct timeval deadline;
+  /** MPJOIN client hello, and how much of it has been written */
+  ptls_buffer_t joinbuf;
+  int joinbuf_sent;
+  /** stream whose sendbuf carries our FAILOVER messages; 0 for tcpls->sendbuf */
+  streamid_t ctl_streamid;
+  /** socket whose writability we wait for, if any */
+  int wants_write;
+  /** no stream failed: recon is only joined to become a standby connection */
+  unsigned standby : 1;
+};
+
+/** A connection attempt of tcpls_connect() or tcpls_connect_start() */
+
+struct st_tcpls_connect_attempt_t {
+  uint32_t transportid;
+  /** when its connect() was issued */
+  struct timeval started;
+  unsigned launched : 1;
+  /** connected, failed, or cancelled */
+  unsigned settled : 1;
+};
+
+/**
+ * The attempts towards the addresses given to tcpls_connect() or
+ * tcpls_connect_start(), started in order
+ */
+
+struct st_tcpls_connector_t {
+  /** st_tcpls_connect_attempt_t */
+  list_t attempts;
+  /** position of the next attempt to start */
+  int next;
+  int nbr_connected;
+  /** the next attempt starts at this time at the latest */
+  struct timeval next_start;
+  /** one attempt at a time, and the first connected one becomes primary */
+  unsigned staggered : 1;
+  /** cancel the other attempts once one connected */
+  unsigned race : 1;
+};
 
 /**
 * Create a new TCPLS object
@@ -119,11 +268,13 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input, tcpl
 void *tcpls_new(void *ctx, int is_server) {
   ptls_t *tls;
   ptls_context_t *ptls_ctx = (ptls_context_t *) ctx;
-  tcpls_t *tcpls  = malloc(sizeof(*tcpls));
-  if (tcpls == NULL)
+  struct st_tcpls_session_t *session = malloc(sizeof(*session));
+  if (session == NULL)
     return NULL;
-  memset(tcpls, 0, sizeof(*tcpls));
-  tcpls->cookies = new_list(COOKIE_LEN, 18);
+  memset(session, 0, sizeof(*session));
+  tcpls_t *tcpls = &session->tcpls;
+  tcpls->cookies = &session->cookies;
+  list_init(tcpls->cookies, COOKIE_LEN, 18);
   if (is_server) {
     tls = ptls_server_new(ptls_ctx);
     tcpls->next_stream_id = 2147483649;  // 2**31 +1
@@ -140,30 +291,51 @@ void *tcpls_new(void *ctx, int is_server) {
     tcpls->next_stream_id = 1;
   }
   // init tcpls stuffs
-  tcpls->sendbuf = malloc(sizeof(*tcpls->sendbuf));
-  tcpls->recvbuflen = 32*PTLS_MAX_ENCRYPTED_RECORD_SIZE;
-  tcpls->recvbuf = malloc(tcpls->recvbuflen);
-  tcpls->rec_reordering = malloc(sizeof(*tcpls->rec_reordering));
-  tcpls->gap_rec_reordering = malloc(sizeof(*tcpls->gap_rec_reordering));
-  heap_create(tcpls->gap_rec_reordering, 0, cmp_uint32);
-  tcpls->max_gap_size = PTLS_MAX_PLAINTEXT_RECORD_SIZE * 256;
-  tcpls->buffrag = malloc(sizeof(*tcpls->buffrag));
-  ptls_buffer_init(tcpls->buffrag, "", 0);
-  if (ptls_buffer_reserve(tcpls->buffrag, 5) != 0)
-    return NULL;
+  tcpls->sendbuf = &session->sendbuf;
+  session_buffer_init(ptls_ctx, tcpls->sendbuf);
+  /** recvbuf is allocated by the first receive, see session_recvbuf_reserve() */
+  tcpls->recvbuflen = TCPLS_RECVBUF_SIZE;
+  tcpls->reorder_window_size = TCPLS_REORDER_WINDOW_SIZE;
+  tcpls->max_unacked_bytes = TCPLS_DEFAULT_MAX_UNACKED_BYTES;
+  /** left zeroed, as ptls_receive() leaves it after each record */
+  tcpls->buffrag = &session->buffrag;
   tcpls->tls = tls;
-  ptls_buffer_init(tcpls->sendbuf, "", 0);
-  ptls_buffer_init(tcpls->rec_reordering, "", 0);
-  tcpls->priority_q = malloc(sizeof(*tcpls->priority_q));
-  heap_create(tcpls->priority_q, 0, cmp_uint32);
-  tcpls->tcpls_options = new_list(sizeof(tcpls_options_t), NBR_SUPPORTED_TCPLS_OPTIONS);
-  tcpls->streams = new_list(sizeof(tcpls_stream_t), 3);
-  tcpls->connect_infos = new_list(sizeof(connect_info_t), 2);
+  tcpls->tcpls_options = &session->tcpls_options;
+  list_init(tcpls->tcpls_options, sizeof(tcpls_options_t), NBR_SUPPORTED_TCPLS_OPTIONS);
+  tcpls->streams = &session->streams;
+  slab_init(tcpls->streams, sizeof(tcpls_stream_t), 16);
+  tcpls->streams_index = &session->streams_index;
+  id_map_init(tcpls->streams_index, 3);
+  tcpls->streams_ack_due = &session->streams_ack_due;
+  list_init(tcpls->streams_ack_due, sizeof(streamid_t), 3);
+  tcpls->streams_attach_pending = &session->streams_attach_pending;
+  list_init(tcpls->streams_attach_pending, sizeof(streamid_t), 3);
+  tcpls->connect_infos = &session->connect_infos;
+  slab_init(tcpls->connect_infos, sizeof(connect_info_t), 4);
+  tcpls->sockets_index = &session->sockets_index;
+  id_map_init(tcpls->sockets_index, 2);
   tcpls->schedule_receive = &round_robin_con_scheduler;
+  tcpls->schedule_receive_ready = &round_robin_ready_scheduler;
+  tcpls->epoll_fd = -1;
+  tcpls->connect_attempt_delay_ms = TCPLS_CONNECT_ATTEMPT_DELAY_MS;
+  tcpls->path_metrics_interval_ms = TCPLS_PATH_METRICS_INTERVAL_MS;
   tls->tcpls = tcpls;
   return tcpls;
 }
 
+/**
+ * Allocate the receiving buffer of the session, if this is the first time it
+ * receives
+ */
+
+static int session_recvbuf_reserve(tcpls_t *tcpls) {
+  if (tcpls->recvbuf)
+    return 0;
+  if ((tcpls->recvbuf = malloc(tcpls->recvbuflen)) == NULL)
+    return -1;
+  return 0;
+}
+
 /**
  * Add our current registered v4 addresses to the options, which might be sent by
  * the application to the other peer
@@ -321,23 +493,15 @@ int tcpls_add_v6(ptls_t *tls, struct sockaddr_in6 *addr, int is_primary, int
 }
 
 /**
- * Makes TCP connections to registered IPs that are in CLOSED state.
- *
- * Returns -1 upon error
- *         -2 upon timeout experiration without any addresses connected
- *         1 if the timeout fired but some address(es) connected
- *         0 if all addresses connected
+ * Prepare a connection attempt towards each pair of addresses selected by src
+ * and dest, as described for tcpls_connect(); the connections found closed or
+ * failed are queued in tcpls->connector, IPv6 and IPv4 ones alternating and
+ * IPv6 first.
  */
-int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
-    struct timeval *timeout) {
-  tcpls_t *tcpls = tls->tcpls;
-  int maxfds = 0;
-  int nfds = 0;
-  int ret;
-  fd_set wset;
-  FD_ZERO(&wset);
-  connect_info_t coninfo;
-  memset(&coninfo, 0, sizeof(connect_info_t));
+
+static int connector_setup(tcpls_t *tcpls, struct sockaddr *src, struct sockaddr *dest) {
+  struct st_tcpls_connector_t *connector = tcpls->connector;
+  int first = connector->attempts.size;
   if (!src && !dest) {
     // FULL MESH CONNECT
     tcpls_v4_addr_t *current_v4 = tcpls->v4_addr_llist;
@@ -347,16 +511,14 @@ int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
       tcpls_v6_addr_t *ours_current_v6 = tcpls->ours_v6_addr_llist;
       do {
         if (current_v4) {
-          if (handle_connect(tcpls, ours_current_v4, current_v4, NULL, NULL, AF_INET, &nfds, &coninfo) < 0) {
+          if (connector_add(tcpls, connection_prepare(tcpls, ours_current_v4, current_v4, NULL, NULL, AF_INET)) < 0)
             return -1;
-          }
         }
         if (current_v6) {
-          if(handle_connect(tcpls, NULL, NULL, ours_current_v6, current_v6, AF_INET6, &nfds, &coninfo) < 0) {
+          if (connector_add(tcpls, connection_prepare(tcpls, NULL, NULL, ours_current_v6, current_v6, AF_INET6)) < 0)
             return -1;
-          }
         }
-        /** move forward */    
+        /** move forward */
         if (ours_current_v4)
           ours_current_v4 = ours_current_v4->next;
         if (ours_current_v6)
@@ -377,9 +539,8 @@ int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
       if (!ours_v4)
         return -1;
       while (current_v4) {
-        if (handle_connect(tcpls, ours_v4, current_v4, NULL, NULL, AF_INET, &nfds, &coninfo) < 0) {
+        if (connector_add(tcpls, connection_prepare(tcpls, ours_v4, current_v4, NULL, NULL, AF_INET)) < 0)
           return -1;
-        }
         current_v4 = current_v4->next;
       }
     }
@@ -389,9 +550,8 @@ int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
       if (!ours_v6)
         return -1;
       while (current_v6) {
-        if (handle_connect(tcpls, NULL, NULL, ours_v6, current_v6, AF_INET6, &nfds, &coninfo) < 0) {
+        if (connector_add(tcpls, connection_prepare(tcpls, NULL, NULL, ours_v6, current_v6, AF_INET6)) < 0)
           return -1;
-        }
         current_v6 = current_v6->next;
       }
     }
@@ -403,18 +563,16 @@ int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
       tcpls_v4_addr_t *dest_addr = get_addr_from_sockaddr(tcpls->v4_addr_llist, (struct sockaddr_in *) dest);
       if (!our_addr || !dest_addr)
         return -1;
-      if (handle_connect(tcpls, our_addr, dest_addr, NULL, NULL, AF_INET, &nfds, &coninfo) < 0) {
+      if (connector_add(tcpls, connection_prepare(tcpls, our_addr, dest_addr, NULL, NULL, AF_INET)) < 0)
         return -1;
-      }
     }
     else if (src->sa_family == AF_INET6 && dest->sa_family == AF_INET6) {
       tcpls_v6_addr_t *our_addr = get_addr6_from_sockaddr(tcpls->ours_v6_addr_llist, (struct sockaddr_in6 *) src);
       tcpls_v6_addr_t *dest_addr = get_addr6_from_sockaddr(tcpls->v6_addr_llist, (struct sockaddr_in6 *) dest);
       if (!our_addr || !dest_addr)
         return -1;
-      if (handle_connect(tcpls, NULL, NULL, our_addr, dest_addr, AF_INET6, &nfds, &coninfo) < 0) {
+      if (connector_add(tcpls, connection_prepare(tcpls, NULL, NULL, our_addr, dest_addr, AF_INET6)) < 0)
         return -1;
-      }
     }
   }
   else if (!src && dest) {
@@ -423,77 +581,326 @@ int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
       tcpls_v4_addr_t *dest_addr = get_addr_from_sockaddr(tcpls->v4_addr_llist, (struct sockaddr_in *)dest);
       if (!dest_addr)
         return -1;
-      if (handle_connect(tcpls, NULL, dest_addr, NULL, NULL, AF_INET, &nfds, &coninfo) < 0) {
+      if (connector_add(tcpls, connection_prepare(tcpls, NULL, dest_addr, NULL, NULL, AF_INET)) < 0)
         return -1;
-      }
     }
     else {
       tcpls_v6_addr_t *dest_addr = get_addr6_from_sockaddr(tcpls->v6_addr_llist, (struct sockaddr_in6 *) dest);
       if (!dest_addr)
         return -1;
-      if (handle_connect(tcpls, NULL, NULL, NULL, dest_addr, AF_INET6, &nfds, &coninfo) < 0) {
+      if (connector_add(tcpls, connection_prepare(tcpls, NULL, NULL, NULL, dest_addr, AF_INET6)) < 0)
         return -1;
-      }
     }
   }
+  connector_interleave(tcpls, first);
+  return 0;
+}
+
+/**
+ * Makes TCP connections to registered IPs that are in CLOSED state. All the
+ * attempts start at once; see tcpls_connect_start() for a staggered race
+ * which does not block.
+ *
+ * Returns -1 upon error
+ *         -2 upon timeout experiration without any addresses connected
+ *         1 if the timeout fired but some address(es) connected
+ *         0 if all addresses connected
+ */
+int tcpls_connect(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest,
+    struct timeval *timeout) {
+  tcpls_t *tcpls = tls->tcpls;
+  int ret;
+  if (!tcpls->connector && connector_new(tcpls) == NULL)
+    return -1;
+  if (connector_setup(tcpls, src, dest) < 0)
+    return -1;
+  if (!timeout) {
+    /** the attempts go on from tcpls_receive() */
+    tcpls_connect_progress(tcpls, NULL);
+    _set_primary(tcpls);
+    return 0;
+  }
   /* wait until all connected or the timeout fired */
-  int remaining_nfds = nfds;
-  struct timeval t_initial, t_previous;
-  gettimeofday(&t_initial, NULL);
-  memcpy(&t_previous, &t_initial, sizeof(t_previous));
-  tcpls->nbr_tcp_streams = nfds;
+  struct timeval t_end, t_current, remaining;
+  gettimeofday(&t_end, NULL);
+  t_end.tv_sec += timeout->tv_sec;
+  t_end.tv_usec += timeout->tv_usec;
+  t_end.tv_sec += t_end.tv_usec / 1000000;
+  t_end.tv_usec %= 1000000;
   connect_info_t *con;
-  int nbr_errors = 0;
-  while (remaining_nfds && timeout) {
-    int result = 0;
-    FD_ZERO(&wset);
+  while ((ret = tcpls_connect_progress(tcpls, NULL)) == PTLS_ERROR_IN_PROGRESS || ret == 1) {
+    gettimeofday(&t_current, NULL);
+    if (cmp_times(&t_current, &t_end) >= 0)
+      break;
+    remaining = timediff(&t_end, &t_current);
+    struct pollfd pfds[tcpls->connect_infos->size + 1];
+    int nfds = 0;
     for (int i = 0; i < tcpls->connect_infos->size; i++) {
-      con = list_get(tcpls->connect_infos, i);
+      con = slab_get(tcpls->connect_infos, i);
       if (con->state == CONNECTING) {
-        FD_SET(con->socket, &wset);
-        if (con->socket > maxfds)
-          maxfds = con->socket;
+        pfds[nfds].fd = con->socket;
+        pfds[nfds].events = POLLOUT;
+        pfds[nfds++].revents = 0;
       }
     }
-    if ((ret = select(maxfds+1, NULL, &wset, NULL, timeout)) < 0) {
+    if (poll(pfds, nfds, remaining.tv_sec * 1000 + (remaining.tv_usec + 999) / 1000) < 0 &&
+        errno != EINTR)
       return -1;
-    }
-    else if (!ret) {
-      /* the timeout fired! */
-      if (remaining_nfds == nfds) {
-        /* None of the addresses connected */
-        return -2;
+  }
+  gettimeofday(&t_current, NULL);
+  if (cmp_times(&t_current, &t_end) < 0) {
+    *timeout = timediff(&t_end, &t_current);
+  }
+  else {
+    timeout->tv_sec = 0;
+    timeout->tv_usec = 0;
+  }
+  if (ret == -1)
+    return -1;
+  if (ret == PTLS_ERROR_IN_PROGRESS) {
+    /* None of the addresses connected */
+    connector_free(tcpls);
+    return -2;
+  }
+  _set_primary(tcpls);
+  /* the timeout fired but some connected; the others go on from tcpls_receive() */
+  return ret;
+}
+
+/**
+ * Start connecting as RFC 8305 describes, without blocking: one attempt
+ * every connect_attempt_delay_ms, IPv6 and IPv4 addresses alternating with
+ * IPv6 first, and the next attempt right away when one fails. src and dest
+ * select the pairs of addresses as for tcpls_connect(). The first connection
+ * that connects becomes the primary one, upon which tcpls_handshake() may
+ * start; if race is set the other attempts are then cancelled, otherwise they
+ * go on and their connections may be joined later.
+ *
+ * The attempts progress from tcpls_connect_progress(); a CONN_WANTS_WRITE
+ * event is emitted for each socket which connects.
+ *
+ * returns 0, or -1 upon error
+ */
+
+int tcpls_connect_start(ptls_t *tls, struct sockaddr *src, struct sockaddr *dest, int race) {
+  tcpls_t *tcpls = tls->tcpls;
+  if (tls->is_server || tcpls->connector)
+    return -1;
+  if (connector_new(tcpls) == NULL)
+    return -1;
+  tcpls->connector->staggered = 1;
+  tcpls->connector->race = race;
+  if (connector_setup(tcpls, src, dest) < 0) {
+    connector_free(tcpls);
+    return -1;
+  }
+  if (tcpls_connect_progress(tcpls, NULL) == -1)
+    return -1;
+  return 0;
+}
+
+/**
+ * Push the connection attempts forward, without blocking: see which
+ * connecting sockets became writable and start the attempts which are due.
+ * If next_attempt is not NULL and an attempt waits to start, it is set to the
+ * time left until then.
+ *
+ * returns 0 once every attempt completed (or the race is won) and some
+ *           connected,
+ *         1 if some connected while others are still in progress,
+ *         PTLS_ERROR_IN_PROGRESS if none connected yet,
+ *         -1 if every attempt failed
+ */
+
+int tcpls_connect_progress(tcpls_t *tcpls, struct timeval *next_attempt) {
+  struct st_tcpls_connector_t *connector = tcpls->connector;
+  struct st_tcpls_connect_attempt_t *attempt;
+  connect_info_t *con;
+  struct timeval now;
+  struct pollfd *pfds = NULL;
+  int nfds = 0, ret, start_next = 0;
+  if (!connector)
+    return 0;
+  gettimeofday(&now, NULL);
+  /** which of the attempts in flight did complete? pfds[i] follows the i-th
+   * attempt, and poll() skips the negative fds */
+  if (connector->next) {
+    if ((pfds = malloc(sizeof(*pfds) * connector->next)) == NULL)
+      return -1;
+    for (int i = 0; i < connector->next; i++) {
+      attempt = list_get(&connector->attempts, i);
+      con = connection_get(tcpls, attempt->transportid);
+      pfds[i].fd = -1;
+      pfds[i].events = POLLOUT;
+      pfds[i].revents = 0;
+      if (attempt->launched && !attempt->settled && con && con->state == CONNECTING) {
+        pfds[i].fd = con->socket;
+        nfds++;
       }
-      return 1;
     }
-    else {
-      /** Check first for connection result! */
-      for (int i = 0; i < tcpls->connect_infos->size; i++) {
-        con = list_get(tcpls->connect_infos, i);
-        if (con->state == CONNECTING && FD_ISSET(con->socket, &wset)) {
-          if (check_con_has_connected(tcpls, con, &result) < 0) {
-            connection_close(tcpls, con);
-            break;
-          }
-          if (result != 0) {
-            FD_CLR(con->socket, &wset);
-            connection_close(tcpls, con);
-            nbr_errors++;
-            break;
-          }
-          /** we connected! */
-          else {
-            compute_client_rtt(con, timeout, &t_initial, &t_previous);
-          }
-        }
+    if (nfds && (ret = poll(pfds, connector->next, 0)) <= 0) {
+      if (ret < 0 && errno != EINTR) {
+        free(pfds);
+        return -1;
       }
-      remaining_nfds-=ret;
+      for (int i = 0; i < connector->next; i++)
+        pfds[i].revents = 0;
+    }
+  }
+  for (int i = 0; i < connector->next; i++) {
+    attempt = list_get(&connector->attempts, i);
+    if (!attempt->launched || attempt->settled)
+      continue;
+    con = connection_get(tcpls, attempt->transportid);
+    if (!con || con->state != CONNECTING) {
+      /** the connection was closed under us */
+      attempt->settled = 1;
+      start_next = 1;
+      continue;
+    }
+    if (!pfds[i].revents)
+      continue;
+    int result = 0;
+    attempt->settled = 1;
+    if (check_con_has_connected(tcpls, con, &result) < 0 || result != 0) {
+      connection_close(tcpls, con);
+      start_next = 1;
+      continue;
+    }
+    /** we connected! the RTT of a fastopen con comes with its first exchange */
+    if (!con->fastopen)
+      con->connect_time = timediff(&now, &attempt->started);
+    con->state = CONNECTED;
+    connection_epoll_add(tcpls, con);
+    if (connector->staggered && !connector->nbr_connected)
+      connection_make_primary(tcpls, con);
+    connector->nbr_connected++;
+  }
+  free(pfds);
+  /** we have a winner; cancel the others */
+  if (connector->race && connector->nbr_connected) {
+    for (int i = 0; i < connector->next; i++) {
+      attempt = list_get(&connector->attempts, i);
+      con = connection_get(tcpls, attempt->transportid);
+      if (attempt->launched && !attempt->settled && con && con->state == CONNECTING)
+        connection_close(tcpls, con);
+    }
+    connector_free(tcpls);
+    return 0;
+  }
+  /** start what is due */
+  int inflight = 0;
+  for (int i = 0; i < connector->next; i++) {
+    attempt = list_get(&connector->attempts, i);
+    if (attempt->launched && !attempt->settled)
+      inflight++;
+  }
+  while (connector->next < connector->attempts.size && (!connector->staggered ||
+        start_next || !inflight || cmp_times(&now, &connector->next_start) >= 0)) {
+    attempt = list_get(&connector->attempts, connector->next++);
+    con = connection_get(tcpls, attempt->transportid);
+    if (!con || (con->state != CLOSED && con->state != FAILED) ||
+        connection_start(tcpls, con) < 0) {
+      attempt->settled = 1;
+      continue;
     }
+    attempt->launched = 1;
+    attempt->started = now;
+    tcpls->nbr_tcp_streams++;
+    if (tcpls->tls->ctx->connection_event_cb)
+      tcpls->tls->ctx->connection_event_cb(tcpls, CONN_WANTS_WRITE, con->socket,
+          con->this_transportid, tcpls->tls->ctx->cb_data);
+    inflight++;
+    start_next = 0;
+    connector->next_start = now;
+    connector->next_start.tv_usec += (suseconds_t) tcpls->connect_attempt_delay_ms * 1000;
+    connector->next_start.tv_sec += connector->next_start.tv_usec / 1000000;
+    connector->next_start.tv_usec %= 1000000;
+  }
+  if (!inflight && connector->next == connector->attempts.size) {
+    ret = connector->nbr_connected ? 0 : -1;
+    connector_free(tcpls);
+    return ret;
+  }
+  if (next_attempt && connector->next < connector->attempts.size) {
+    if (cmp_times(&connector->next_start, &now) > 0)
+      *next_attempt = timediff(&connector->next_start, &now);
+    else
+      memset(next_attempt, 0, sizeof(*next_attempt));
   }
-  if (nbr_errors == nfds)
+  return connector->nbr_connected ? 1 : PTLS_ERROR_IN_PROGRESS;
+}
+
+static struct st_tcpls_connector_t *connector_new(tcpls_t *tcpls) {
+  struct st_tcpls_connector_t *connector = malloc(sizeof(*connector));
+  if (!connector)
+    return NULL;
+  memset(connector, 0, sizeof(*connector));
+  list_init(&connector->attempts, sizeof(struct st_tcpls_connect_attempt_t), 4);
+  tcpls->connector = connector;
+  return connector;
+}
+
+static void connector_free(tcpls_t *tcpls) {
+  if (!tcpls->connector)
+    return;
+  list_dispose(&tcpls->connector->attempts);
+  free(tcpls->connector);
+  tcpls->connector = NULL;
+}
+
+/**
+ * Queue an attempt for con unless it is connecting, connected, or already
+ * queued
+ */
+
+static int connector_add(tcpls_t *tcpls, connect_info_t *con) {
+  struct st_tcpls_connector_t *connector = tcpls->connector;
+  struct st_tcpls_connect_attempt_t attempt;
+  if (!con)
     return -1;
-  _set_primary(tcpls);
-  return 0;
+  if (con->state != CLOSED && con->state != FAILED)
+    return 0;
+  for (int i = connector->next; i < connector->attempts.size; i++) {
+    struct st_tcpls_connect_attempt_t *queued = list_get(&connector->attempts, i);
+    if (queued->transportid == con->this_transportid)
+      return 0;
+  }
+  memset(&attempt, 0, sizeof(attempt));
+  attempt.transportid = con->this_transportid;
+  return list_add(&connector->attempts, &attempt);
+}
+
+/**
+ * Reorder the attempts queued from position first so that IPv6 and IPv4 ones
+ * alternate, IPv6 first; each family keeps its order
+ */
+
+static void connector_interleave(tcpls_t *tcpls, int first) {
+  list_t *attempts = &tcpls->connector->attempts;
+  int n = attempts->size - first, nv6 = 0, nv4 = 0;
+  if (n < 2)
+    return;
+  struct st_tcpls_connect_attempt_t *queued = list_get(attempts, first);
+  struct st_tcpls_connect_attempt_t *v6 = malloc(n * sizeof(*v6)), *v4 = malloc(n * sizeof(*v4));
+  if (!v6 || !v4)
+    goto Exit;
+  for (int i = 0; i < n; i++) {
+    connect_info_t *con = connection_get(tcpls, queued[i].transportid);
+    if (con && con->dest6)
+      v6[nv6++] = queued[i];
+    else
+      v4[nv4++] = queued[i];
+  }
+  for (int i = 0, i6 = 0, i4 = 0; i < n; i++) {
+    if (i6 < nv6 && (i4 == nv4 || i6 <= i4))
+      queued[i] = v6[i6++];
+    else
+      queued[i] = v4[i4++];
+  }
+Exit:
+  free(v6);
+  free(v4);
 }
 
 /**
@@ -511,7 +918,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
   tcpls_t *tcpls = tls->tcpls;
   ssize_t rret = 1;
   connect_info_t *con = NULL;
-  struct timeval t_initial, t_previous;
+  struct timeval t_initial, t_previous, t_sent = {0};
   if (!tcpls)
     return -1;
   int sock = 0;
@@ -538,7 +945,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
       coninfo.this_transportid = tcpls->next_transport_id++;
       coninfo.buffrag = malloc(sizeof(ptls_buffer_t));
       memset(coninfo.buffrag, 0, sizeof(ptls_buffer_t));
-      ptls_buffer_init(coninfo.buffrag, "", 0);
+      session_buffer_init(tcpls->tls->ctx, coninfo.buffrag);
       if (ptls_buffer_reserve(coninfo.buffrag, 5) != 0)
         return -1;
       if (properties->client.dest->ss_family == AF_INET) {
@@ -575,8 +982,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
           }
         }
       }
-      list_add(tcpls->connect_infos, &coninfo);
-      con = list_get(tcpls->connect_infos, tcpls->connect_infos->size-1);
+      con = slab_add(tcpls->connect_infos, &coninfo);
       assert(con);
     }
     /* returns an error if the connection is already established or connecting*/
@@ -599,7 +1005,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
   }
   else if (properties && properties->socket) {
     sock = properties->socket;
-    con = get_con_info_from_socket(tcpls, sock);
+    con = connection_get_from_socket(tcpls, sock);
     if (!con)
       return -1;
   }
@@ -619,6 +1025,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
   if (!tls->is_server && ((ret = ptls_handshake(tls, &sendbuf, NULL, NULL,
             properties)) == PTLS_ERROR_IN_PROGRESS || ret == PTLS_ERROR_HANDSHAKE_IS_MPJOIN)) {
     rret = 0;
+    gettimeofday(&t_sent, NULL);
     while (rret < sendbuf.off) {
       if (properties && properties->client.zero_rtt) {
         con->state = CONNECTING;
@@ -666,6 +1073,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
         ;
       if (rret == 0)
         goto Exit;
+      connection_fastopen_rtt(con, &t_sent);
       if (properties->client.zero_rtt) {
         /*check whether tcp connected */
         int result;
@@ -680,20 +1088,14 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
         struct timeval timeout = {.tv_sec = 100, .tv_usec = 0};
         compute_client_rtt(con, &timeout, &t_initial, &t_previous);
         con->state = CONNECTED;
+        connection_epoll_add(tcpls, con);
       }
 
       /** Decrypt and apply the TRANSPORT_NEW */
-      size_t input_off = 0;
       ptls_buffer_t decryptbuf;
-      ptls_buffer_init(&decryptbuf, "", 0);
-      size_t consumed;;
-      input_off = 0;
-      size_t input_size = rret;
-      do {
-        consumed = input_size - input_off;
-        rret = ptls_receive(tls, &decryptbuf, NULL, recvbuf + input_off, &consumed);
-        input_off += consumed;
-      } while (rret == 0 && input_off < input_size);
+      session_buffer_init(tcpls->tls->ctx, &decryptbuf);
+      size_t consumed = rret;
+      rret = ptls_receive_batch(tls, &decryptbuf, NULL, recvbuf, &consumed);
 
       ptls_buffer_dispose(&sendbuf);
       ptls_buffer_dispose(&decryptbuf);
@@ -714,6 +1116,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
       ;
     if (rret == 0)
       goto Exit;
+    connection_fastopen_rtt(con, &t_sent);
     if (properties->client.zero_rtt && con->state == CONNECTING) {
       int result;
       if (check_con_has_connected(tcpls, con, &result) < 0) {
@@ -724,6 +1127,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
         goto Exit;
       }
       con->state = CONNECTED;
+      connection_epoll_add(tcpls, con);
     }
     roff = 0;
     do {
@@ -760,7 +1164,7 @@ int tcpls_handshake(ptls_t *tls, ptls_handshake_properties_t *properties) {
 Exit:
   /** TODO Make callbacks for the different possible errors*/
   if (rret <= 0) {
-    connect_info_t *con = get_con_info_from_socket(tcpls, sock);
+    connect_info_t *con = connection_get_from_socket(tcpls, sock);
     connection_close(tcpls, con);
   }
   ptls_buffer_dispose(&sendbuf);
@@ -784,7 +1188,7 @@ int tcpls_accept(tcpls_t *tcpls, int socket, uint8_t *cookie, uint32_t transport
   /** check whether this socket has been already added */
   connect_info_t *con = NULL;
   connect_info_t newconn;
-  con = get_con_info_from_socket(tcpls, socket);
+  con = connection_get_from_socket(tcpls, socket);
   if (con && con->state > FAILED) {
     fprintf(stderr, "We accept a con which is already attached and connected?\n");
     return 0;
@@ -850,7 +1254,7 @@ int tcpls_accept(tcpls_t *tcpls, int socket, uint8_t *cookie, uint32_t transport
       newconn.dest = peer_v4;
       newconn.buffrag = malloc(sizeof(ptls_buffer_t));
       memset(newconn.buffrag, 0, sizeof(ptls_buffer_t));
-      ptls_buffer_init(newconn.buffrag, "", 0);
+      session_buffer_init(tcpls->tls->ctx, newconn.buffrag);
       if (ptls_buffer_reserve(newconn.buffrag, 5) != 0)
         return PTLS_ERROR_NO_MEMORY;
 
@@ -878,7 +1282,7 @@ int tcpls_accept(tcpls_t *tcpls, int socket, uint8_t *cookie, uint32_t transport
       newconn.dest6 = peer_v6;
       newconn.buffrag = malloc(sizeof(ptls_buffer_t));
       memset(newconn.buffrag, 0, sizeof(ptls_buffer_t));
-      ptls_buffer_init(newconn.buffrag, "", 0);
+      session_buffer_init(tcpls->tls->ctx, newconn.buffrag);
       if (ptls_buffer_reserve(newconn.buffrag, 5) != 0)
         return PTLS_ERROR_NO_MEMORY;
     }
@@ -947,11 +1351,12 @@ int tcpls_accept(tcpls_t *tcpls, int socket, uint8_t *cookie, uint32_t transport
     tcpls->initial_socket = socket;
   }
   if (!con) {
-    list_add(tcpls->connect_infos, &newconn);
+    slab_add(tcpls->connect_infos, &newconn);
     ret = newconn.this_transportid;
   }
   else
     ret = con->this_transportid;
+  connection_epoll_add(tcpls, connection_get_from_socket(tcpls, socket));
   tcpls->nbr_tcp_streams++;
   return ret;
 }
@@ -1017,7 +1422,7 @@ streamid_t tcpls_stream_new(ptls_t *tls, struct sockaddr *src, struct sockaddr *
     coninfo.this_transportid = tcpls->next_transport_id++;
     coninfo.buffrag = malloc(sizeof(ptls_buffer_t));
     memset(coninfo.buffrag, 0, sizeof(ptls_buffer_t));
-    ptls_buffer_init(coninfo.buffrag, "", 0);
+    session_buffer_init(tcpls->tls->ctx, coninfo.buffrag);
     if (ptls_buffer_reserve(coninfo.buffrag, 5) != 0)
       return -1;
     if (dest->sa_family == AF_INET) {
@@ -1047,10 +1452,8 @@ streamid_t tcpls_stream_new(ptls_t *tls, struct sockaddr *src, struct sockaddr *
         coninfo.is_primary = 1;
       }
     }
-    /** copy coninfo into the heap allocated list */
-    list_add(tcpls->connect_infos, &coninfo);
-    /** get back this copy */
-    con_stored = list_get(tcpls->connect_infos, tcpls->connect_infos->size-1);
+    /** copy coninfo into the slab; con_stored won't move */
+    con_stored = slab_add(tcpls->connect_infos, &coninfo);
   }
   tcpls_stream_t *stream = stream_helper_new(tcpls, con_stored);
   if (!stream)
@@ -1093,7 +1496,7 @@ int tcpls_streams_attach(ptls_t *tls, streamid_t streamid, int sendnow) {
   }
   tcpls_stream_t *stream_to_attach;
   for (int i = 0; i < tcpls->streams->size; i++) {
-    stream_to_attach = list_get(tcpls->streams, i);
+    stream_to_attach = slab_get(tcpls->streams, i);
     if (stream_to_attach->need_sending_attach_event) {
       connect_info_t *con = connection_get(tcpls, stream_to_attach->transportid);
       tcpls->sending_con = con;
@@ -1103,10 +1506,11 @@ int tcpls_streams_attach(ptls_t *tls, streamid_t streamid, int sendnow) {
       memcpy(input, &stream_to_attach->streamid, 4);
       memcpy(&input[4], &con->this_transportid, 4);
       memcpy(&input[8], &stream_to_attach->offset, 4);
-      stream_send_control_message(tls, stream_to_attach->streamid,
+      stream_send_control_message(tls, streamid,
           sendbuf_to_use, ctx_to_use, input, STREAM_ATTACH, 12);
       stream_to_attach->send_stream_attach_in_sendbuf_pos = sendbuf_to_use->off;
       stream_to_attach->need_sending_attach_event = 0;
+      list_add(tcpls->streams_attach_pending, &stream_to_attach->streamid);
       tcpls->check_stream_attach_sent = 1;
       if (sendnow) {
         ret = do_send(tcpls, stream_to_use, con);
@@ -1114,9 +1518,8 @@ int tcpls_streams_attach(ptls_t *tls, streamid_t streamid, int sendnow) {
         if (!tcpls->failover_recovering)
           check_stream_attach_have_been_sent(tcpls, ret);
         /** did we sent everything? =) */
-        if (!tcpls->failover_recovering && !did_we_sent_everything(tcpls, stream_to_use, ret)) {
-          return -1;
-        }
+        if (!tcpls->failover_recovering)
+          did_we_sent_everything(tcpls, stream_to_use, ret);
         tcpls->check_stream_attach_sent = 0;
       }
     }
@@ -1141,8 +1544,8 @@ static int stream_close_helper(tcpls_t *tcpls, tcpls_stream_t *stream, int type,
     int ret;
     ret = do_send(tcpls, stream, con);
     /* check whether we sent everything */
-    if (!tcpls->failover_recovering && !did_we_sent_everything(tcpls, stream, ret))
-      return -1;
+    if (!tcpls->failover_recovering)
+      did_we_sent_everything(tcpls, stream, ret);
   }
   else {
     // XXX ensure that the message is when housekeeping! 
@@ -1181,6 +1584,8 @@ int tcpls_stream_close(ptls_t *tls, streamid_t streamid, int sendnow) {
  *
  * @returns: TCPLS_OK if everything has been passed to the kernel buffer
  *           TCPLS_HOLD_DATA_TO_SEND if some data still need to be sent
+ *           TCPLS_HOLD_UNACKED_DATA if input was not taken, see
+ *           max_unacked_bytes
  *
  *           or -1 in case of errors:
  *           TODO be more explicit on the potential errors
@@ -1189,6 +1594,17 @@ int tcpls_stream_close(ptls_t *tls, streamid_t streamid, int sendnow) {
 
 
 int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbytes) {
+  ptls_iovec_t vec = ptls_iovec_init(input, nbytes);
+  return tcpls_sendv(tls, streamid, &vec, 1, 0);
+}
+
+/**
+ * Same as tcpls_send, for data held in iovcnt buffers. The buffers are
+ * encrypted straight into the stream's sendbuf; if align is set, each of them
+ * starts a new record.
+ */
+
+int tcpls_sendv(ptls_t *tls, streamid_t streamid, const ptls_iovec_t *iov, size_t iovcnt, int align) {
   tcpls_t *tcpls = tls->tcpls;
   int ret;
   tcpls_stream_t *stream;
@@ -1197,6 +1613,19 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
   if ((!streamid && !tcpls->socket_primary) || !ptls_handshake_is_complete(tls)) {
     return -1;
   }
+  /** Refuse the input rather than taking the data kept for failover past
+   * max_unacked_bytes; it still goes whole if nothing waits for an ack */
+  if (tcpls->enable_failover) {
+    size_t nbytes = 0, unacked = unacked_bytes(tcpls);
+    for (size_t i = 0; i < iovcnt; i++)
+      nbytes += iov[i].len;
+    if (unacked && unacked + nbytes > tcpls->max_unacked_bytes) {
+      if ((stream = stream_get(tcpls, streamid)) != NULL)
+        stream->stats.holds++;
+      tcpls->stats.holds++;
+      return TCPLS_HOLD_UNACKED_DATA;
+    }
+  }
   int is_client_origin = tls->is_server ? 0 : 1;
   /** Check whether we already have a stream open; if not, build a stream
    * with the default context */
@@ -1210,6 +1639,8 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
     connect_info_t *con = get_primary_con_info(tcpls);
     assert(con);
     stream = stream_new(tls, tcpls->next_stream_id++, con, ++tcpls->nbr_of_our_streams_attached, is_client_origin);
+    if (!stream)
+      return -1;
     if (tls->ctx->stream_event_cb) {
       tls->ctx->stream_event_cb(tcpls, STREAM_OPENED, stream->streamid, con->this_transportid,
           tls->ctx->cb_data);
@@ -1230,9 +1661,7 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
     tcpls->check_stream_attach_sent = 1;
     //XXX potential bug if the failure happens while the STREAM_ATTACH has not
     //been acked !
-    list_add(tcpls->streams, stream);
-    free(stream);
-    stream = list_get(tcpls->streams, tcpls->streams->size-1);
+    list_add(tcpls->streams_attach_pending, &stream->streamid);
   }
   else {
     stream = stream_get(tcpls, streamid);
@@ -1252,6 +1681,8 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
   }
   if (!stream)
     return -1;
+  if (tcpls->enable_multipath && tcpls->schedule_send)
+    return send_scheduled(tcpls, stream, iov, iovcnt, align);
   tcpls->sending_stream = stream;
   connect_info_t *con = connection_get(tcpls, stream->transportid);
 
@@ -1262,7 +1693,7 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
   // This is done for compabitility with original PTLS's unit tests
   tcpls->tls->traffic_protection.enc.aead = stream->aead_enc;
   tcpls->sending_con = con;
-  ret = ptls_send(tcpls->tls, stream->streamid, stream->sendbuf, input, nbytes);
+  ret = ptls_sendv(tcpls->tls, stream->streamid, stream->sendbuf, iov, iovcnt, align);
 
   tcpls->tls->traffic_protection.enc.aead = remember_aead;
   switch (ret) {
@@ -1279,13 +1710,15 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
     check_stream_attach_have_been_sent(tcpls, ret);
   }
   /** did we sent everything? =) */
-  if (!tcpls->failover_recovering && !did_we_sent_everything(tcpls, stream, ret))
-    return -1;
+  if (!tcpls->failover_recovering)
+    did_we_sent_everything(tcpls, stream, ret);
 
   tcpls->check_stream_attach_sent = 0;
   /** Do some house keeping task */
   tcpls_housekeeping(tcpls);
-  if (stream->send_start != stream->sendbuf->off) {
+  if (should_hold_data_to_send(tcpls, stream)) {
+    stream->stats.holds++;
+    tcpls->stats.holds++;
     return TCPLS_HOLD_DATA_TO_SEND;
   }
   else {
@@ -1293,6 +1726,137 @@ int tcpls_send(ptls_t *tls, streamid_t streamid, const void *input, size_t nbyte
   }
 }
 
+/**
+ * Spread the iovecs over the connections, one record at a time, following
+ * tcpls->schedule_send. Each record is encrypted with the context of the
+ * stream the scheduler picked and sent right away over its connection, so
+ * that the scheduler sees up-to-date send buffers for the next one.
+ *
+ * stream is used whenever the scheduler has no stream to propose
+ */
+
+static int send_scheduled(tcpls_t *tcpls, tcpls_stream_t *stream, const ptls_iovec_t *iov, size_t iovcnt, int align) {
+  int ret = TCPLS_OK;
+  ptls_aead_context_t *remember_aead = tcpls->tls->traffic_protection.enc.aead;
+  size_t recsize = PTLS_MAX_PLAINTEXT_RECORD_SIZE -
+    get_tcpls_header_size(tcpls, PTLS_CONTENT_TYPE_TCPLS_DATA, NONE);
+  size_t nbytes = 0, vecidx = 0, vecoff = 0;
+  for (size_t i = 0; i < iovcnt; i++)
+    nbytes += iov[i].len;
+  /** the pieces of the iovecs making up the record being sent */
+  ptls_iovec_t *slices = malloc(sizeof(*slices) * (iovcnt ? iovcnt : 1));
+  if (!slices)
+    return PTLS_ERROR_NO_MEMORY;
+  while (nbytes) {
+    size_t len = nbytes < recsize ? nbytes : recsize, nslices = 0;
+    if (align) {
+      while (vecoff == iov[vecidx].len) {
+        vecidx++;
+        vecoff = 0;
+      }
+      if (len > iov[vecidx].len - vecoff)
+        len = iov[vecidx].len - vecoff;
+    }
+    for (size_t filled = 0; filled < len;) {
+      if (vecoff == iov[vecidx].len) {
+        vecidx++;
+        vecoff = 0;
+        continue;
+      }
+      size_t n = iov[vecidx].len - vecoff;
+      if (n > len - filled)
+        n = len - filled;
+      slices[nslices++] = ptls_iovec_init(iov[vecidx].base + vecoff, n);
+      filled += n;
+      vecoff += n;
+    }
+    tcpls_stream_t *sched_stream = tcpls->schedule_send(tcpls, len, NULL);
+    if (!sched_stream)
+      sched_stream = stream;
+    connect_info_t *con = connection_get(tcpls, sched_stream->transportid);
+    tcpls->sending_stream = sched_stream;
+    tcpls->sending_con = con;
+    tcpls->tls->traffic_protection.enc.aead = sched_stream->aead_enc;
+    ret = ptls_sendv(tcpls->tls, sched_stream->streamid, sched_stream->sendbuf, slices, nslices, 0);
+    tcpls->tls->traffic_protection.enc.aead = remember_aead;
+    if (ret)
+      goto Exit;
+    ret = do_send(tcpls, sched_stream, con);
+    if (tcpls->check_stream_attach_sent && !tcpls->failover_recovering) {
+      check_stream_attach_have_been_sent(tcpls, ret);
+    }
+    if (!tcpls->failover_recovering)
+      did_we_sent_everything(tcpls, sched_stream, ret);
+    nbytes -= len;
+  }
+  tcpls->check_stream_attach_sent = 0;
+  tcpls_housekeeping(tcpls);
+  if (should_hold_data_to_send(tcpls, NULL)) {
+    stream->stats.holds++;
+    tcpls->stats.holds++;
+    ret = TCPLS_HOLD_DATA_TO_SEND;
+  }
+  else
+    ret = TCPLS_OK;
+Exit:
+  free(slices);
+  return ret;
+}
+
+/**
+ * Whether stream (any stream if NULL) could not send everything yet or, with
+ * failover, whether the streams keep max_unacked_bytes or more for
+ * retransmission
+ */
+
+static int should_hold_data_to_send(tcpls_t *tcpls, tcpls_stream_t *stream) {
+  if (stream && stream->send_start != stream->sendbuf->off)
+    return 1;
+  for (int i = 0; !stream && i < tcpls->streams->size; i++) {
+    tcpls_stream_t *s = slab_get(tcpls->streams, i);
+    if (s->send_start != s->sendbuf->off)
+      return 1;
+  }
+  return tcpls->enable_failover && unacked_bytes(tcpls) >= tcpls->max_unacked_bytes;
+}
+
+/**
+ * Bytes the streams keep for retransmission until the peer acks them
+ */
+
+static size_t unacked_bytes(tcpls_t *tcpls) {
+  size_t unacked = 0;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    tcpls_stream_t *s = slab_get(tcpls->streams, i);
+    unacked += s->sendbuf->off - s->send_acked;
+  }
+  return unacked;
+}
+
+/**
+ * Set the memory cap of the data kept for failover, see tcpls_send()
+ */
+
+int tcpls_set_max_unacked_bytes(tcpls_t *tcpls, size_t max_unacked_bytes) {
+  if (max_unacked_bytes == 0)
+    return -1;
+  tcpls->max_unacked_bytes = max_unacked_bytes;
+  return 0;
+}
+
+/**
+ * Set the share of records weighted_round_robin_send_scheduler gives to the
+ * connection transportid
+ */
+
+int tcpls_set_send_weight(tcpls_t *tcpls, uint32_t transportid, uint32_t weight) {
+  connect_info_t *con = connection_get(tcpls, transportid);
+  if (!con)
+    return -1;
+  con->send_weight = weight;
+  return 0;
+}
+
 /**
  * Used by a receiver scheduler to process read data.
  *
@@ -1318,25 +1882,31 @@ int tcpls_internal_data_process(tcpls_t *tcpls, connect_info_t *con,  int recvre
   else {
     /* We have stuff to decrypt */
     tcpls->transportid_rcv = con->this_transportid;
-    int count_streams = count_streams_from_transportid(tcpls,  con->this_transportid);
-    /** The first message over the fist connection, server-side, we do not
-     * have streams attach yet, it is coming! */
     int rret = 1;
     size_t input_off = 0;
     size_t input_size = recvret;
     size_t consumed;
-    if (count_streams == 0) {
+    int count_streams = 0;
+    /** Records tell us their stream; decrypt everything in one pass */
+    if (tcpls->stream_hint_confirmed) {
+      rret = decrypt_with_stream_hint(tcpls, con, buf, input_size);
+      input_off = input_size;
+    }
+    else
+      count_streams = count_streams_from_transportid(tcpls,  con->this_transportid);
+    /** The first message over the fist connection, server-side, we do not
+     * have streams attach yet, it is coming! */
+    if (input_off < input_size && count_streams == 0) {
       tcpls->streamid_rcv = 0; /** no stream; we should get a STREAM_ATTACH first! */
       /** we should only be able to decrypt the STREAM_ATTACH, then would need
        * to change the context anyway */
       ptls_buffer_t decryptbuf;
-      ptls_buffer_init(&decryptbuf, "", 0);
+      session_buffer_init(tcpls->tls->ctx, &decryptbuf);
       ptls_aead_context_t *remember_aead = tcpls->tls->traffic_protection.dec.aead;
-      do {
-        consumed = input_size - input_off;
-        rret = ptls_receive(tls, &decryptbuf, tcpls->buffrag, tcpls->recvbuf + input_off, &consumed);
-        input_off += consumed;
-      } while (rret == 0 && input_off < input_size);
+      consumed = input_size - input_off;
+      rret = ptls_receive_batch(tls, &decryptbuf, tcpls->buffrag, tcpls->recvbuf + input_off, &consumed);
+      input_off += consumed;
+      ptls_buffer_dispose(&decryptbuf);
       /** We may have received a stream attach that changed the aead*/
       tcpls->tls->traffic_protection.dec.aead = remember_aead;
     }
@@ -1361,6 +1931,12 @@ int tcpls_internal_data_process(tcpls_t *tcpls, connect_info_t *con,  int recvre
     if (buf->bufkind == AGGREGATION) {
       multipath_merge_buffers(tcpls, buf->decryptbuf);
     }
+    else if (buf->bufkind == REASSEMBLY) {
+      reassembly_advance(tcpls);
+      /** the receive scheduler stops reading the sockets */
+      if (buf->held->size)
+        return TCPLS_HOLD_DATA_TO_CONSUME;
+    }
     return TCPLS_OK;
   }
 }
@@ -1376,50 +1952,155 @@ int tcpls_receive(ptls_t *tls, tcpls_buffer_t *buf, struct timeval *tv) {
   fd_set rset;
   int selectret;
   tcpls_t *tcpls = tls->tcpls;
+  if (session_recvbuf_reserve(tcpls))
+    return -1;
+  if (reassembly_release_held(tcpls))
+    return TCPLS_HOLD_DATA_TO_CONSUME;
+  if (tcpls->epoll_fd >= 0)
+    return receive_epoll(tcpls, buf, tv);
   FD_ZERO(&rset);
   connect_info_t *con;
   int maxfd = 0;
   for (int i = 0; i < tcpls->connect_infos->size; i++) {
-    con = list_get(tcpls->connect_infos, i);
+    con = slab_get(tcpls->connect_infos, i);
     if (con->state >= CONNECTED) {
       FD_SET(con->socket, &rset);
       if (maxfd < con->socket)
         maxfd = con->socket;
     }
   }
-  selectret = select(maxfd+1, &rset, NULL, NULL, tv);
+  /** a failover recovery may wait for a socket to become writable */
+  fd_set wset;
+  int wsock = failover_wants_write(tcpls);
+  FD_ZERO(&wset);
+  if (wsock > 0) {
+    FD_SET(wsock, &wset);
+    if (maxfd < wsock)
+      maxfd = wsock;
+  }
+  selectret = select(maxfd+1, &rset, wsock > 0 ? &wset : NULL, NULL, tv);
   if (selectret <= 0) {
+    /** an idle session still makes its standby connections */
+    if (selectret == 0)
+      tcpls_housekeeping(tcpls);
     return -1;
   }
   /* Call a scheduler from rsched.c */
   if (tcpls->schedule_receive(tcpls, &rset, buf, NULL) < 0)
     return -1;
+  return receive_finish(tcpls);
+}
+
+/**
+ * Process the sockets the application got from epoll_wait() on a shared epoll
+ * instance given to tcpls_enable_epoll(). Sockets which do not belong to this
+ * session are ignored.
+ */
+
+int tcpls_receive_ready(ptls_t *tls, tcpls_buffer_t *buf, const int *ready_socks, int nready) {
+  tcpls_t *tcpls = tls->tcpls;
+  if (session_recvbuf_reserve(tcpls))
+    return -1;
+  if (reassembly_release_held(tcpls))
+    return TCPLS_HOLD_DATA_TO_CONSUME;
+  if (tcpls->schedule_receive_ready(tcpls, ready_socks, nready, buf, NULL) < 0)
+    return -1;
+  return receive_finish(tcpls);
+}
+
+/**
+ * Tasks to perform once the receive scheduler pulled bytes from the ready
+ * connections
+ */
+
+static int receive_finish(tcpls_t *tcpls) {
   /** flush an ack if needed */
   if (send_ack_if_needed(tcpls, NULL))
     return -1;
   /** Do some house keeping task */
   tcpls_housekeeping(tcpls);
-  if (heap_size(tcpls->priority_q))
+  if (tcpls->buffer && tcpls->buffer->bufkind == REASSEMBLY && tcpls->buffer->held->size)
+    return TCPLS_HOLD_DATA_TO_CONSUME;
+  if ((tcpls->reorder_window && tcpls->reorder_window->size) ||
+      (tcpls->reorder_held && tcpls->reorder_held->size))
     return TCPLS_HOLD_OUT_OF_ORDER_DATA_TO_READ;
   else
     return TCPLS_OK;
 }
 
 /**
- * Sends a tcp option which has previously been registered with ptls_set...,
- * or alternative addresses registered with tcpls_add_v4/v6
- *
- * This function should be called after the handshake is complete for both party
- * */
-int tcpls_send_tcpoption(tcpls_t *tcpls, int transportid, tcpls_enum_t type, int sendnow)
-{
-  ptls_t *tls = tcpls->tls;
-  if(tls->traffic_protection.enc.aead == NULL)
-    return -1;
+ * Wait on the session's epoll instance; only the sockets reported ready are
+ * handed to the scheduler
+ */
 
-  /** Get the option */
-  tcpls_options_t *option;
-  int found = 0;
+static int receive_epoll(tcpls_t *tcpls, tcpls_buffer_t *buf, struct timeval *tv) {
+  struct epoll_event events[TCPLS_EPOLL_MAX_EVENTS];
+  int ready_socks[TCPLS_EPOLL_MAX_EVENTS];
+  int timeout = -1, nready;
+  if (tv)
+    timeout = tv->tv_sec*1000 + (tv->tv_usec+999)/1000;
+  while ((nready = epoll_wait(tcpls->epoll_fd, events, TCPLS_EPOLL_MAX_EVENTS,
+          timeout)) < 0 && errno == EINTR)
+    ;
+  if (nready <= 0) {
+    if (nready == 0)
+      tcpls_housekeeping(tcpls);
+    return -1;
+  }
+  /** sockets only reported writable are for the failover recovery, which
+   * receive_finish() pushes forward */
+  int nreadable = 0;
+  for (int i = 0; i < nready; i++) {
+    if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+      ready_socks[nreadable++] = events[i].data.fd;
+  }
+  if (tcpls->schedule_receive_ready(tcpls, ready_socks, nreadable, buf, NULL) < 0)
+    return -1;
+  return receive_finish(tcpls);
+}
+
+/**
+ * Watch the session's sockets with epoll instead of select(). epollfd is either
+ * -1 to get an instance owned by the session, or an instance shared with other
+ * sessions. Sockets are then (un)registered automatically when connections
+ * are established or closed.
+ *
+ * returns 0, or -1 upon error
+ */
+
+int tcpls_enable_epoll(tcpls_t *tcpls, int epollfd) {
+  if (tcpls->epoll_fd >= 0)
+    return -1;
+  if (epollfd < 0) {
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      return -1;
+    tcpls->epoll_owned = 1;
+  }
+  tcpls->epoll_fd = epollfd;
+  connect_info_t *con;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    con = slab_get(tcpls->connect_infos, i);
+    if (con->state >= CONNECTED)
+      connection_epoll_add(tcpls, con);
+  }
+  return 0;
+}
+
+/**
+ * Sends a tcp option which has previously been registered with ptls_set...,
+ * or alternative addresses registered with tcpls_add_v4/v6
+ *
+ * This function should be called after the handshake is complete for both party
+ * */
+int tcpls_send_tcpoption(tcpls_t *tcpls, int transportid, tcpls_enum_t type, int sendnow)
+{
+  ptls_t *tls = tcpls->tls;
+  if(tls->traffic_protection.enc.aead == NULL)
+    return -1;
+
+  /** Get the option */
+  tcpls_options_t *option;
+  int found = 0;
   for (int i = 0; i < tcpls->tcpls_options->size && !found; i++) {
     option = list_get(tcpls->tcpls_options, i);
     if (option->type == type && option->data->base && option->settopeer) {
@@ -1432,7 +2113,7 @@ int tcpls_send_tcpoption(tcpls_t *tcpls, int transportid, tcpls_enum_t type, int
   tcpls_stream_t *stream;
   found = 0;
   for (int i = 0; i < tcpls->streams->size && !found; i++) {
-    stream = list_get(tcpls->streams, i);
+    stream = slab_get(tcpls->streams, i);
     if (stream->transportid == transportid && stream->stream_usable)
       found = 1;
   }
@@ -1468,7 +2149,7 @@ int tcpls_send_tcpoption(tcpls_t *tcpls, int transportid, tcpls_enum_t type, int
   else {
     uint8_t input[option->data->len];
     memcpy(input, option->data->base, option->data->len);
-    buffer_push_encrypted_records(tls, 0, buf,
+    buffer_push_encrypted_records(tls, stream ? stream->streamid : 0, buf,
         PTLS_CONTENT_TYPE_TCPLS_CONTROL, type, input,
         option->data->len, ctx_to_use);
   }
@@ -1477,8 +2158,7 @@ int tcpls_send_tcpoption(tcpls_t *tcpls, int transportid, tcpls_enum_t type, int
     if (!con)
       return -1;
     int ret = do_send(tcpls, stream, con);
-    if (!did_we_sent_everything(tcpls, stream, ret))
-      return -1;
+    did_we_sent_everything(tcpls, stream, ret);
   }
   return 0;
 }
@@ -1536,22 +2216,6 @@ int tcpls_set_bpf_cc(tcpls_t *tcpls, const uint8_t *bpf_prog_bytecode, size_t by
 
 /*===================================Internal========================================*/
 
-/**
- * Compare two uint32_t for ordering
- */
-static int cmp_uint32(void *mpseq1, void *mpseq2) {
-
-  register uint32_t key1_v = *((uint32_t*)mpseq1);
-  register uint32_t key2_v = *((uint32_t*)mpseq2);
-
-  // Perform the comparison
-  if (key1_v < key2_v)
-    return -1;
-  else if (key1_v == key2_v)
-    return 0;
-  else return 1;
-}
-
 /**
  * Try decrypting some data received over some connection. Multiple streams
  * might have been attached to the connection, and we need to find which one
@@ -1566,7 +2230,8 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input,
   size_t consumed;
   int restore_buf = 0;
   ptls_buffer_t *decryptbuf = NULL;
-  list_clean(buf->wtr_streams);
+  if (buf->bufkind == STREAMBASED)
+    list_clean(buf->wtr_streams);
   connect_info_t *con = connection_get(tcpls, tcpls->transportid_rcv);
   /** if we have something in tcpls->buffrag, let's push it to this
    * con->buffrag*/
@@ -1574,7 +2239,7 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input,
     /* XXX We should not have fragmented data over this buffer as well, right?*/
     assert(con->buffrag->off == 0);
     if (con->buffrag->base == NULL)
-      ptls_buffer_init(con->buffrag, "", 0);
+      session_buffer_init(tcpls->tls->ctx, con->buffrag);
     if ((ret = ptls_buffer_reserve(con->buffrag, tcpls->buffrag->off)) != 0)
       return ret;
     memcpy(con->buffrag->base, tcpls->buffrag->base, tcpls->buffrag->off);
@@ -1583,7 +2248,7 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input,
   }
   restore_buf = con->buffrag->off;
   for (int i = 0; i < tcpls->streams->size && rret; i++) {
-    tcpls_stream_t *stream = list_get(tcpls->streams, i);
+    tcpls_stream_t *stream = slab_get(tcpls->streams, i);
     /* this is a stream attached to this connection */
     if (con->this_transportid == stream->transportid) {
       ptls_aead_context_t *remember_aead = tcpls->tls->traffic_protection.dec.aead;
@@ -1592,17 +2257,21 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input,
       /** We might have no stream attached server-side */
       tcpls->tls->traffic_protection.dec.aead = stream->aead_dec;
       tcpls->streamid_rcv = stream->streamid;
-      if (buf->bufkind == AGGREGATION)
-        decryptbuf = buf->decryptbuf;
-      else
+      if (buf->bufkind == STREAMBASED)
         decryptbuf = tcpls_get_stream_buffer(buf, stream->streamid);
+      else if (buf->bufkind == REASSEMBLY)
+        decryptbuf = buf->slotbuf;
+      else
+        decryptbuf = buf->decryptbuf;
       int decryptoff = decryptbuf->off;
-      do {
-        consumed = input_size - *input_off;
-        rret = ptls_receive(tcpls->tls, decryptbuf, con->buffrag, input + *input_off, &consumed);
-        *input_off += consumed;
-      } while (rret == 0 && *input_off < input_size);
+      consumed = input_size - *input_off;
+      rret = ptls_receive_batch(tcpls->tls, decryptbuf, con->buffrag, input + *input_off, &consumed);
+      *input_off += consumed;
       tcpls->tls->traffic_protection.dec.aead = remember_aead;
+      if (rret == PTLS_ALERT_BAD_RECORD_MAC) {
+        con->stats.aead_failures++;
+        tcpls->stats.aead_failures++;
+      }
       /* Add this stream in the want-to-read list for the app */
       if (decryptbuf->off-decryptoff > 0 && buf->bufkind == STREAMBASED)
         list_add(buf->wtr_streams, &stream->streamid);
@@ -1618,17 +2287,100 @@ static int try_decrypt_with_multistreams(tcpls_t *tcpls, const void *input,
       tcpls->buffrag->off = restore_buf;
     /* That MUST be a control message */
     ptls_buffer_t deccontrolbuf;
-    ptls_buffer_init(&deccontrolbuf, "", 0);
-    do {
-      consumed = input_size - *input_off;
-      rret = ptls_receive(tcpls->tls, &deccontrolbuf, tcpls->buffrag, input + *input_off, &consumed);
-      *input_off += consumed;
-    } while (rret == 0 && *input_off < input_size);
+    session_buffer_init(tcpls->tls->ctx, &deccontrolbuf);
+    consumed = input_size - *input_off;
+    rret = ptls_receive_batch(tcpls->tls, &deccontrolbuf, tcpls->buffrag, input + *input_off, &consumed);
+    *input_off += consumed;
+    ptls_buffer_dispose(&deccontrolbuf);
     tcpls->buffrag->off = 0;
   }
   return rret;
 }
 
+/**
+ * Decrypt the data received over con when records carry a stream hint. Each
+ * record is decrypted once with the context of the stream it announces, see
+ * tcpls_stream_hint_demux().
+ */
+
+static int decrypt_with_stream_hint(tcpls_t *tcpls, connect_info_t *con,
+    tcpls_buffer_t *buf, size_t input_size) {
+  int ret = 0;
+  size_t consumed = input_size;
+  if (buf->bufkind == STREAMBASED)
+    list_clean(buf->wtr_streams);
+  /** if we have something in tcpls->buffrag, let's push it to this
+   * con->buffrag*/
+  if (tcpls->buffrag->off != 0) {
+    assert(con->buffrag->off == 0);
+    if (con->buffrag->base == NULL)
+      session_buffer_init(tcpls->tls->ctx, con->buffrag);
+    if ((ret = ptls_buffer_reserve(con->buffrag, tcpls->buffrag->off)) != 0)
+      return ret;
+    memcpy(con->buffrag->base, tcpls->buffrag->base, tcpls->buffrag->off);
+    con->buffrag->off = tcpls->buffrag->off;
+    tcpls->buffrag->off = 0;
+  }
+  /** receives what is not bound to a stream */
+  ptls_buffer_t deccontrolbuf;
+  session_buffer_init(tcpls->tls->ctx, &deccontrolbuf);
+  ret = ptls_receive_batch(tcpls->tls, &deccontrolbuf, con->buffrag, tcpls->recvbuf, &consumed);
+  ptls_buffer_dispose(&deccontrolbuf);
+  return ret;
+}
+
+/**
+ * Called by handle_input() for each record carrying a stream hint. Gives the
+ * aead context of the stream, and the buffer in which its data must be
+ * decrypted if the application registered a tcpls_buffer_t. streamid 0 stands
+ * for the default context.
+ */
+
+int tcpls_stream_hint_demux(tcpls_t *tcpls, streamid_t streamid,
+    ptls_aead_context_t **aead, ptls_buffer_t **decryptbuf) {
+  tcpls->streamid_rcv = streamid;
+  if (streamid == 0)
+    return 0;
+  tcpls_stream_t *stream = stream_get(tcpls, streamid);
+  if (!stream || !stream->aead_dec)
+    return PTLS_ERROR_STREAM_NOT_FOUND;
+  *aead = stream->aead_dec;
+  if (!tcpls->buffer)
+    return 0;
+  if (tcpls->buffer->bufkind == AGGREGATION) {
+    *decryptbuf = tcpls->buffer->decryptbuf;
+  }
+  else if (tcpls->buffer->bufkind == STREAMBASED) {
+    ptls_buffer_t *stream_buf = tcpls_get_stream_buffer(tcpls->buffer, streamid);
+    if (!stream_buf)
+      return 0;
+    *decryptbuf = stream_buf;
+    /* Add this stream in the want-to-read list for the app */
+    for (int i = 0; i < tcpls->buffer->wtr_streams->size; i++) {
+      if (*(streamid_t *) list_get(tcpls->buffer->wtr_streams, i) == streamid)
+        return 0;
+    }
+    list_add(tcpls->buffer->wtr_streams, &streamid);
+  }
+  return 0;
+}
+
+/**
+ * Called by handle_input() before decrypting a record. With a REASSEMBLY
+ * buffer, records are decrypted within the spare slot of its window, and
+ * handle_tcpls_data_record() commits them there; returns NULL otherwise.
+ */
+
+ptls_buffer_t *tcpls_reassembly_decryptbuf(tcpls_t *tcpls) {
+  tcpls_buffer_t *buf = tcpls->buffer;
+  uint8_t *spare;
+  if (!buf || buf->bufkind != REASSEMBLY || !tcpls->tcpls_options_confirmed ||
+      !(spare = tcpls_reorder_window_spare(buf->window)))
+    return NULL;
+  ptls_buffer_init(buf->slotbuf, spare, TCPLS_REORDER_SLOT_SIZE);
+  return buf->slotbuf;
+}
+
 static int do_send(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *con) {
   int ret;
   if (stream) {
@@ -1641,28 +2393,11 @@ static int do_send(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *con)
   }
   if (ret < 0) {
     if ((errno == ECONNRESET || errno == EPIPE || errno == ETIMEDOUT) && tcpls->enable_failover) {
-      if (tcpls->tls->is_server) {
-        if (tcpls->tls->ctx->stream_event_cb) {
-          tcpls_stream_t *stream_failed;
-          for (int i = 0; i < tcpls->streams->size; i++) {
-            stream_failed = list_get(tcpls->streams, i);
-            if (stream->transportid == con->this_transportid && stream_failed->stream_usable) {
-              tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_FAILURE,
-                  stream_failed->streamid, con->this_transportid, tcpls->tls->ctx->cb_data);
-              stream_failed->stream_usable = 0;
-              if (tcpls->tls->ctx->stream_event_cb) {
-                tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_FAILURE,
-                    stream_failed->streamid, stream_failed->transportid, tcpls->tls->ctx->cb_data);
-              }
-            }
-          }
-        }
-        return 0;
-      }
-      else {
-        /* we're a client -- let's try to reconnect */
-        ret = initiate_recovering(tcpls, con);
-      }
+      /* the server waits for the client to failover; the client moves the
+       * streams to another connection */
+      if (initiate_recovering(tcpls, con) < 0)
+        return -1;
+      ret = 0;
     }
     else {
       perror("send failed");
@@ -1672,75 +2407,263 @@ static int do_send(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *con)
   return ret;
 }
 
+/**
+ * Called when con broke. The server only tells the application, and waits for
+ * the FAILOVER messages of the client. The client moves the streams of con to
+ * another connection, which it connects and joins first if needed; this goes
+ * on from tcpls_failover_progress() so that no step blocks.
+ */
+
 static int initiate_recovering(tcpls_t *tcpls, connect_info_t *con) {
-  /** If failover is enabled and we are the client, let's connect again */
   errno = 0;
-  int ret = 1;
   connection_fail(tcpls, con);
-  if (!tcpls->tls->is_server) {
-    connect_info_t *recon;
-    int remaining_con = tcpls->connect_infos->size-1;
-    while (ret && remaining_con) {
-      /* only try the ones that already exist */
-      recon = try_reconnect(tcpls, con, &remaining_con);
-      /* perform a join handshake to reconnect to the server */
-      if (!recon)
-        return -1;
-      if (recon->state == CONNECTED) {
-        /* We need to join the connection */
-        ptls_handshake_properties_t prop = {NULL};
-        prop.client.transportid = recon->this_transportid;
-        prop.client.mpjoin = 1;
-        if (recon->dest) {
-          prop.client.dest = (struct sockaddr_storage *) &recon->dest->addr;
-          prop.client.src = (struct sockaddr_storage *) &recon->src->addr;
-        }
-        else {
-          prop.client.dest = (struct sockaddr_storage *) &recon->dest6->addr;
-          prop.client.src = (struct sockaddr_storage *) &recon->src6->addr;
-        }
-        struct timeval timeout;
-        if (recon->connect_time.tv_sec >= 1 || recon->connect_time.tv_usec*5 >= 1000000) {
-          timeout.tv_sec=2;
-          timeout.tv_usec=0;
-        }
-        else {
-          timeout.tv_sec=0;
-          timeout.tv_usec=recon->connect_time.tv_usec*5;
-        }
-        prop.client.timeout = &timeout;
-        ret = tcpls_handshake(tcpls->tls, &prop);
-        if (ret) {
-          remaining_con--;
-          connection_fail(tcpls, recon);
-          close(recon->socket);
-        }
-      }
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  if (failover && failover->standby) {
+    /** the connection we were making a standby one broke */
+    if (con->this_transportid == failover->recon_transportid) {
+      standby_abort(tcpls);
+      return 0;
     }
-    if (!remaining_con) {
-      return -1;
+    /** a joined standby connection beats the one still being joined */
+    if (standby_count(tcpls) > 0) {
+      standby_abort(tcpls);
+      failover = NULL;
     }
-    /* let's mention on which we failover */
-    con->transportid_to_failover = recon->this_transportid;
+  }
+  if (failover && !failover->standby && failover->step != FAILOVER_REPLAYING) {
+    /** the connection we were recovering onto broke as well */
+    if (con->this_transportid == failover->recon_transportid) {
+      failover->remaining_con--;
+      return failover_next_path(tcpls);
+    }
+    /** streams of con are moved along with the ones of the first failure */
+    return 0;
+  }
+  tcpls_stream_t *stream;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    stream = slab_get(tcpls->streams, i);
+    if (stream->transportid == con->this_transportid) {
+      stream->stream_usable = 0;
+      if (tcpls->tls->ctx->stream_event_cb)
+        tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_FAILURE,
+            stream->streamid, stream->transportid, tcpls->tls->ctx->cb_data);
+    }
+  }
+  if (tcpls->tls->is_server)
+    return 0;
+  if (failover) {
+    /** the standby connection being joined is where the streams go */
+    if (failover->standby) {
+      failover->standby = 0;
+      failover->failed_transportid = con->this_transportid;
+      failover->remaining_con = tcpls->connect_infos->size;
+    }
+    return 0;
+  }
+  if ((failover = failover_new(tcpls)) == NULL)
+    return -1;
+  failover->failed_transportid = con->this_transportid;
+  failover->remaining_con = tcpls->connect_infos->size;
+  return failover_next_path(tcpls);
+}
 
-    tcpls_stream_t *stream_to_use = NULL, *stream_failed = NULL;
-    // find a usable stream attached to recon
-    int found = 0;
-    for (int i = 0; i < tcpls->streams->size && !found; i++) {
-      stream_to_use = list_get(tcpls->streams, i);
-      if (stream_to_use->transportid == recon->this_transportid)
-        found = 1;
-    }
-    /* if no stream found, we use tcpls->sendbuf to send failover, with the
-     * default aead */
-    if (!found) {
-      tcpls->sendbuf->off = 0;
-      tcpls->send_start = 0;
+/**
+ * Pick the connection to recover onto and start its first step, without
+ * waiting for it. Prefers a connection already established with a different
+ * src and dest than the failed one, then any established one -- joined ones,
+ * as the standby connections, first -- then a closed one towards another
+ * destination, and eventually the failed one again.
+ *
+ * returns 0, or -1 if no connection is left to try
+ */
+
+static int failover_next_path(tcpls_t *tcpls) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  connect_info_t *con_failed = connection_get(tcpls, failover->failed_transportid);
+  connect_info_t *con, *recon = NULL;
+  /** a joined connection, such as a standby one, takes the streams at once;
+   * among them, the one with the lowest RTT */
+  for (int state = JOINED; state >= CONNECTED && !recon; state--) {
+    for (int i = 0; i < tcpls->connect_infos->size; i++) {
+      con = slab_get(tcpls->connect_infos, i);
+      if (con->state >= state && ((con->dest && con->dest != con_failed->dest &&
+              con->src != con_failed->src) || (con->dest6 && con->dest6 !=
+              con_failed->dest6 && con->src6 != con_failed->src6)) &&
+          path_is_better(con, recon))
+        recon = con;
+    }
+  }
+  for (int state = JOINED; state >= CONNECTED && !recon; state--) {
+    for (int i = 0; i < tcpls->connect_infos->size; i++) {
+      con = slab_get(tcpls->connect_infos, i);
+      if (con->state >= state && path_is_better(con, recon))
+        recon = con;
+    }
+  }
+  if (recon) {
+    failover->recon_transportid = recon->this_transportid;
+    if (recon->state == JOINED)
+      return failover_replay_start(tcpls, recon);
+    return failover_join(tcpls, recon);
+  }
+  /** we need to connect; a path failed or timed out is not tried twice */
+  while (failover->remaining_con > 0) {
+    for (int i = 0; i < tcpls->connect_infos->size && !recon; i++) {
+      con = slab_get(tcpls->connect_infos, i);
+      if (con != con_failed && con->state == CLOSED &&
+          ((con->dest && con->dest != con_failed->dest) ||
+           (con->dest6 && con->dest6 != con_failed->dest6)))
+        recon = con;
+    }
+    if (!recon && con_failed->state == FAILED &&
+        failover->recon_transportid != con_failed->this_transportid) {
+      /** Simply retry con_failed */
+      recon = con_failed;
+      close(recon->socket);
+      recon->socket = 0;
     }
+    if (!recon)
+      break;
+    /** one path at a time: past its deadline, failover_progress() comes back
+     * here for the next one */
+    if (failover_connect(tcpls, recon) == 0)
+      return 0;
+    recon->state = FAILED;
+    failover->remaining_con--;
+    recon = NULL;
+  }
+  failover_free(tcpls);
+  return -1;
+}
+
+/**
+ * Start connecting recon without waiting for it; failover_progress() sees it
+ * connected once its socket is writable
+ */
+
+static int failover_connect(tcpls_t *tcpls, connect_info_t *recon) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  failover->recon_transportid = recon->this_transportid;
+  if ((recon->state != CLOSED && recon->state != FAILED) || connection_start(tcpls, recon) < 0)
+    return -1;
+  failover->step = FAILOVER_CONNECTING;
+  gettimeofday(&failover->started, NULL);
+  failover->deadline = failover->started;
+  failover->deadline.tv_sec += 2;
+  connection_want_write(tcpls, recon);
+  return 0;
+}
+
+/**
+ * Start a MPJOIN handshake over recon; TRANSPORT_NEW from the server
+ * completes it, see failover_joined()
+ */
+
+static int failover_join(tcpls_t *tcpls, connect_info_t *recon) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  ptls_handshake_properties_t prop = {NULL};
+  prop.client.transportid = recon->this_transportid;
+  prop.client.mpjoin = 1;
+  if (recon->dest) {
+    prop.client.dest = (struct sockaddr_storage *) &recon->dest->addr;
+    prop.client.src = (struct sockaddr_storage *) &recon->src->addr;
+  }
+  else {
+    prop.client.dest = (struct sockaddr_storage *) &recon->dest6->addr;
+    prop.client.src = (struct sockaddr_storage *) &recon->src6->addr;
+  }
+  failover->step = FAILOVER_JOINING;
+  failover->joinbuf.off = 0;
+  failover->joinbuf_sent = 0;
+  tcpls->sending_con = recon;
+  int ret = ptls_handshake(tcpls->tls, &failover->joinbuf, NULL, NULL, &prop);
+  if (ret != PTLS_ERROR_IN_PROGRESS && ret != PTLS_ERROR_HANDSHAKE_IS_MPJOIN)
+    return failover_path_failed(tcpls, recon);
+  /** give the server five times the connection's RTT to answer, 2 sec at
+   * most; a fastopen connection has no RTT before its first exchange */
+  gettimeofday(&failover->deadline, NULL);
+  failover->started = failover->deadline;
+  if (recon->connect_time.tv_sec >= 1 || recon->connect_time.tv_usec*5 >= 1000000 ||
+      (!recon->connect_time.tv_sec && !recon->connect_time.tv_usec)) {
+    failover->deadline.tv_sec += 2;
+  }
+  else {
+    failover->deadline.tv_usec += recon->connect_time.tv_usec*5;
+    failover->deadline.tv_sec += failover->deadline.tv_usec / 1000000;
+    failover->deadline.tv_usec %= 1000000;
+  }
+  return 0;
+}
+
+/**
+ * Called for each TRANSPORT_NEW; if con is the connection we are joining, the
+ * recovery can go on with the FAILOVER messages
+ */
+
+static void failover_joined(tcpls_t *tcpls, connect_info_t *con) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  if (!failover || failover->step != FAILOVER_JOINING ||
+      failover->recon_transportid != con->this_transportid ||
+      failover->joinbuf_sent != failover->joinbuf.off)
+    return;
+  con->state = JOINED;
+  if (con->fastopen && !con->connect_time.tv_sec && !con->connect_time.tv_usec) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    con->connect_time = timediff(&now, &failover->started);
+  }
+  // remove the cookie we have sent
+  tcpls->cookies->size -= 1;
+}
+
+/** recon did not connect or join in time: try the next connection */
+
+static int failover_path_failed(tcpls_t *tcpls, connect_info_t *recon) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  if (failover->standby) {
+    standby_abort(tcpls);
+    return 0;
+  }
+  connection_close(tcpls, recon);
+  recon->state = FAILED;
+  failover->remaining_con--;
+  return failover_next_path(tcpls);
+}
+
+/**
+ * Queue a FAILOVER message over recon for every stream attached to the failed
+ * connection; the unacked data and FAILOVER_END then follow from
+ * failover_replay()
+ */
+
+static int failover_replay_start(tcpls_t *tcpls, connect_info_t *recon) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  tcpls_stream_t *stream_to_use = NULL, *stream_failed = NULL;
+  failover->step = FAILOVER_REPLAYING;
+  // find a usable stream attached to recon
+  int found = 0;
+  for (int i = 0; i < tcpls->streams->size && !found; i++) {
+    stream_to_use = slab_get(tcpls->streams, i);
+    if (stream_to_use->transportid == recon->this_transportid)
+      found = 1;
+  }
+  /* if no stream found, we use tcpls->sendbuf to send failover, with the
+   * default aead */
+  if (!found) {
+    tcpls->sendbuf->off = 0;
+    tcpls->send_start = 0;
+  }
+  failover->ctl_streamid = found ? stream_to_use->streamid : 0;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    connect_info_t *con = slab_get(tcpls->connect_infos, i);
+    if (con->state != FAILED || con == recon)
+      continue;
+    /* let's mention on which we failover */
+    con->transportid_to_failover = recon->this_transportid;
     /* Now we need to send a failover message  for all streams attached
      * to the failed con*/
-    for (int i = 0; i < tcpls->streams->size; i++) {
-      stream_failed = list_get(tcpls->streams, i);
+    for (int j = 0; j < tcpls->streams->size; j++) {
+      stream_failed = slab_get(tcpls->streams, j);
       if (stream_failed->transportid == con->this_transportid) {
         char input[12];
         memcpy(input, &con->peer_transportid, 4);
@@ -1750,162 +2673,379 @@ static int initiate_recovering(tcpls_t *tcpls, connect_info_t *con) {
         if (seq == 1)
           seq--;
         memcpy(input+8, &seq, 4);
-        if (found)
+        if (found) {
+          tcpls->sending_stream = stream_to_use;
           stream_send_control_message(tcpls->tls, stream_to_use->streamid,
               stream_to_use->sendbuf, stream_to_use->aead_enc, input, FAILOVER, 12);
+        }
         else {
           tcpls->sending_stream = NULL;
           stream_send_control_message(tcpls->tls, 0, tcpls->sendbuf,
               tcpls->tls->traffic_protection.enc.aead, input, FAILOVER, 12);
         }
-        stream_failed->stream_usable = 0;
-        /* we would resend the full sendbuf when housekeeping */
-        stream_failed->send_start = 0;
-        /* callback event */
-        if (tcpls->tls->ctx->stream_event_cb) {
-          tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_FAILURE,
-              stream_failed->streamid, stream_failed->transportid,
-              tcpls->tls->ctx->cb_data);
-        }
+        /* we would resend everything unacked when replaying */
+        stream_failed->send_start = stream_failed->send_acked;
+        PTLS_PROBE(TCPLS_CONN_RECOVER, tcpls->tls, stream_failed->streamid, con->this_transportid,
+            recon->this_transportid);
       }
     }
-    tcpls->failover_recovering = 1;
-    //send the failover messages
-    ret = do_send(tcpls, NULL, recon);
-    if (ret <= 0) {
-      //XXX
-      fprintf(stderr, "Unimplemented yet\n");
-    }
   }
-  else {
-    /** just send STREAM_NETWORK_FAILURE */
-    if (tcpls->tls->ctx->stream_event_cb) {
-      tcpls_stream_t *stream;
-      for (int i = 0; i < tcpls->streams->size; i++) {
-        stream = list_get(tcpls->streams, i);
-        if (stream->transportid == con->this_transportid) {
-          tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_FAILURE,
-              stream->streamid, stream->transportid, tcpls->tls->ctx->cb_data);
-        }
+  tcpls->failover_recovering = 1;
+  return 0;
+}
+
+/**
+ * Write what con's socket takes right now from sendbuf, starting at
+ * *send_start.
+ *
+ * returns 1 once sendbuf is fully written, 0 if the socket is full -- con
+ * then wants to write -- or -1 upon error
+ */
+
+static int flush_nonblocking(tcpls_t *tcpls, connect_info_t *con, ptls_buffer_t
+    *sendbuf, int *send_start) {
+  while (*send_start < sendbuf->off) {
+    ssize_t ret = send(con->socket, sendbuf->base + *send_start,
+        sendbuf->off - *send_start, MSG_DONTWAIT);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      /** a fastopen socket without a cookie sent a bare SYN */
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS) {
+        connection_want_write(tcpls, con);
+        return 0;
       }
+      return -1;
     }
+    *send_start += ret;
   }
-  return 0;
+  return 1;
 }
 
 /**
- * Send everything from con that has been unacked to tocon.
+ * Send everything unacked of the streams of the failed connections over the
+ * connection they failed over to, then a FAILOVER_END for each stream.
  *
- * FAILOVER messages should have been sent over tocon for all
- * streams that were previously attached in con.
+ * returns 1 once every FAILOVER_END is queued, 0 if a socket is full, or -1
+ * upon error
  */
 
-static int send_unacked_data(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t *tocon) {
-  int ret;
-  ret = do_send(tcpls, stream, tocon);
-  /* just try to send everything if we didn't*/
-  if (!did_we_sent_everything(tcpls, stream, ret))
+static int failover_replay(tcpls_t *tcpls) {
+  int done = 1, ret;
+  connect_info_t *con, *con_to_failover;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    con = slab_get(tcpls->connect_infos, i);
+    /* we have a con that failed. If we're a client, we already buffered every
+     * FAILOVER messages in con_to_failover's sendbuf */
+    if (con->state != FAILED)
+      continue;
+    con_to_failover = connection_get(tcpls, con->transportid_to_failover);
+    if (!con_to_failover || con_to_failover == con || con_to_failover->state < CONNECTED) {
+      done = 0;
+      continue;
+    }
+    /** find all streams attached to this con */
+    tcpls_stream_t *stream_failed;
+    for (int j = 0; j < tcpls->streams->size; j++) {
+      stream_failed = slab_get(tcpls->streams, j);
+      if (stream_failed->orcon_transportid != con->this_transportid ||
+          stream_failed->failover_end_sent || stream_failed->stream_usable)
+        continue;
+      /* first, we send the unacked data */
+      tcpls->sending_con = con_to_failover;
+      tcpls->sending_stream = stream_failed;
+      int replay_start = stream_failed->send_start;
+      ret = flush_nonblocking(tcpls, con_to_failover, stream_failed->sendbuf,
+          &stream_failed->send_start);
+      stream_failed->stats.retransmitted_bytes += stream_failed->send_start - replay_start;
+      con_to_failover->stats.retransmitted_bytes += stream_failed->send_start - replay_start;
+      tcpls->stats.retransmitted_bytes += stream_failed->send_start - replay_start;
+      if (ret < 0)
+        return -1;
+      if (!ret) {
+        done = 0;
+        continue;
+      }
+      /* we have flushed the buffer, let's send FAILOVER_END */
+      char input[8];
+      memcpy(input, &con_to_failover->peer_transportid, 4);
+      memcpy(input+4, &stream_failed->streamid, 4);
+      stream_send_control_message(tcpls->tls, stream_failed->streamid,
+          stream_failed->sendbuf, stream_failed->aead_enc, input, FAILOVER_END, 8);
+      stream_failed->failover_end_sent = 1;
+      stream_failed->stream_usable = 1;
+      PTLS_PROBE(TCPLS_FAILOVER_END, tcpls->tls, stream_failed->streamid, con_to_failover->this_transportid, 0);
+      /*trigger a stream event STREAM_NETWORK_RECOVERED*/
+      if (tcpls->tls->ctx->stream_event_cb) {
+        tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_RECOVERED,
+            stream_failed->streamid, con_to_failover->this_transportid,
+            tcpls->tls->ctx->cb_data);
+      }
+      /** what the socket does not take goes with the next send on the stream */
+      if (flush_nonblocking(tcpls, con_to_failover, stream_failed->sendbuf,
+            &stream_failed->send_start) < 0)
+        return -1;
+    }
+    /** Do we me miss fully sending a FAILOVER_END? */
+    int do_we_miss_a_failover_end = 0;
+    tcpls_stream_t *stream;
+    for (int j = 0; j < tcpls->streams->size; j++) {
+      stream = slab_get(tcpls->streams, j);
+      if (stream->orcon_transportid == con->this_transportid && !stream->failover_end_sent)
+        do_we_miss_a_failover_end++;
+    }
+    if (!do_we_miss_a_failover_end) {
+      /*reinit failover_end_sent*/
+      for (int j = 0; j < tcpls->streams->size; j++) {
+        stream = slab_get(tcpls->streams, j);
+        if (stream->orcon_transportid == con->this_transportid && stream->failover_end_sent)
+          stream->failover_end_sent = 0;
+      }
+      if (tcpls->tls->ctx->connection_event_cb)
+        tcpls->tls->ctx->connection_event_cb(tcpls, CONN_CLOSED, con->socket, con->this_transportid,
+            tcpls->tls->ctx->cb_data);
+      con->socket = 0;
+      con->state = CLOSED;
+    }
+    else {
+      done = 0;
+    }
+  }
+  return done;
+}
+
+/**
+ * The socket a recovery waits on to become writable, or -1
+ */
+
+static int failover_wants_write(tcpls_t *tcpls) {
+  if (!tcpls->failover || tcpls->failover->wants_write <= 0)
     return -1;
-  /* tells us how much of the initial data we have sent */
-  return ret;
+  return tcpls->failover->wants_write;
+}
+
+static struct st_tcpls_failover_t *failover_new(tcpls_t *tcpls) {
+  struct st_tcpls_failover_t *failover = malloc(sizeof(*failover));
+  if (!failover)
+    return NULL;
+  memset(failover, 0, sizeof(*failover));
+  /** no connection tried yet; 0 is a valid transportid */
+  failover->recon_transportid = UINT32_MAX;
+  ptls_buffer_init(&failover->joinbuf, "", 0);
+  tcpls->failover = failover;
+  return failover;
+}
+
+static void failover_free(tcpls_t *tcpls) {
+  if (!tcpls->failover)
+    return;
+  ptls_buffer_dispose(&tcpls->failover->joinbuf);
+  free(tcpls->failover);
+  tcpls->failover = NULL;
 }
 
 /**
- * Try to reconnect to the server using either an existing con (i.e., if we
- * already have another con connected, returns this con).
- *
- * First try a different address than the one in con_closed. If not other
- * address exist or the connection fails, try to connect again with con_closed.
+ * Count the connections joined without any stream attached, ready to take the
+ * streams of a failed connection
+ */
+
+static int standby_count(tcpls_t *tcpls) {
+  connect_info_t *con;
+  int count = 0;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    con = slab_get(tcpls->connect_infos, i);
+    if (con->state == JOINED && !con->nbr_streams && !con->is_primary)
+      count++;
+  }
+  return count;
+}
+
+/**
+ * Start making one more standby connection if the application asked for more
+ * than we have: join a connected one or connect a closed one. Only one is made
+ * at a time, from tcpls_housekeeping(), and never during a recovery.
+ */
+
+static void standby_replenish(tcpls_t *tcpls) {
+  struct timeval now;
+  connect_info_t *con, *spare = NULL;
+  if (tcpls->failover || tcpls->failover_recovering || tcpls->connector || !tcpls->cookies->size ||
+      standby_count(tcpls) >= tcpls->nbr_standby)
+    return;
+  gettimeofday(&now, NULL);
+  if (cmp_times(&now, &tcpls->standby_retry) < 0)
+    return;
+  tcpls_tcp_state_t states[] = {CONNECTED, CLOSED};
+  for (int j = 0; j < 2 && !spare; j++) {
+    for (int i = 0; i < tcpls->connect_infos->size && !spare; i++) {
+      con = slab_get(tcpls->connect_infos, i);
+      if (con->state == states[j] && !con->nbr_streams && !con->is_primary)
+        spare = con;
+    }
+  }
+  if (!spare)
+    return;
+  struct st_tcpls_failover_t *failover = failover_new(tcpls);
+  if (!failover)
+    return;
+  failover->standby = 1;
+  failover->recon_transportid = spare->this_transportid;
+  if (spare->state == CONNECTED)
+    failover_join(tcpls, spare);
+  else if (failover_connect(tcpls, spare) < 0)
+    standby_abort(tcpls);
+}
+
+/**
+ * Give up on the standby connection being made; the next attempt waits a
+ * second
+ */
+
+static void standby_abort(tcpls_t *tcpls) {
+  connect_info_t *recon = connection_get(tcpls, tcpls->failover->recon_transportid);
+  if (recon && recon->socket > 0)
+    connection_close(tcpls, recon);
+  else if (recon)
+    recon->state = CLOSED;
+  failover_free(tcpls);
+  gettimeofday(&tcpls->standby_retry, NULL);
+  tcpls->standby_retry.tv_sec += 1;
+}
+
+/**
+ * Keep nbr_standby connections joined without any stream, so that a failed
+ * connection's streams move to one of them right away instead of waiting for
+ * a connect and a MPJOIN handshake. They are made in the background, by
+ * tcpls_receive(), from the connections the client knows of and which carry
+ * no stream; each one uses a cookie.
  *
- * returns NULL if nothing worked
- * returns the connect_info_t * that connected or which is already connected
+ * Client only; returns -1 otherwise
  */
 
-static connect_info_t* try_reconnect(tcpls_t *tcpls, connect_info_t *con_closed, int *remaining_con) {
+int tcpls_set_standby(tcpls_t *tcpls, int nbr_standby) {
+  if (tcpls->tls->is_server || nbr_standby < 0)
+    return -1;
+  tcpls->nbr_standby = nbr_standby;
+  return 0;
+}
 
-  if (tcpls->connect_infos->size > 1) {
-    /*Check first whether we have another CONNECTED con with a different src and
-     * dst*/
-    connect_info_t *con;
-    for (int i = 0; i < tcpls->connect_infos->size; i++) {
-      con = list_get(tcpls->connect_infos, i);
-      if (con->state >= CONNECTED) {
-        if (con->dest) {
-          if (con->dest != con_closed->dest && con->src != con_closed->src)
-            return con;
-        }
-        else if (con->dest6) {
-          if (con->dest6 != con_closed->dest6 && con->src6 != con_closed->src6)
-            return con;
-        }
+/**
+ * Let a listening socket accept data in the SYN of TCP Fast Open clients, such
+ * as the ClientHello of a session or of a MPJOIN; qlen bounds the number of
+ * pending fastopen requests
+ */
+
+int tcpls_listen_fastopen(int socket, int qlen) {
+  if (setsockopt(socket, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0)
+    return -1;
+  return 0;
+}
+
+int tcpls_failover_progress(tcpls_t *tcpls) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  int ret, waited = 0;
+  if (failover) {
+    waited = failover->wants_write;
+    failover->wants_write = 0;
+  }
+  ret = failover_progress(tcpls);
+  failover = tcpls->failover;
+  /** stop watching a socket which has nothing left to write */
+  if (waited > 0 && (!failover || failover->wants_write != waited))
+    connection_epoll_watch(tcpls, connection_get_from_socket(tcpls, waited), 0);
+  if (failover && !tcpls->failover_recovering && failover->step == FAILOVER_REPLAYING)
+    failover_free(tcpls);
+  return ret;
+}
+
+/**
+ * One pass over the steps of the recovery in progress, if any, and over the
+ * replay of the failed connections' streams
+ */
+
+static int failover_progress(tcpls_t *tcpls) {
+  struct st_tcpls_failover_t *failover = tcpls->failover;
+  connect_info_t *recon;
+  int ret;
+  struct timeval now;
+  if (failover && failover->step != FAILOVER_REPLAYING) {
+    recon = connection_get(tcpls, failover->recon_transportid);
+    gettimeofday(&now, NULL);
+    int expired = cmp_times(&now, &failover->deadline) > 0;
+    if (failover->step == FAILOVER_CONNECTING) {
+      struct pollfd pfd = {.fd = recon->socket, .events = POLLOUT};
+      if ((ret = poll(&pfd, 1, 0)) < 0)
+        return -1;
+      if (!ret && !expired) {
+        failover->wants_write = recon->socket;
+        return TCPLS_HOLD_DATA_TO_SEND;
+      }
+      int result = 0;
+      if (!ret || check_con_has_connected(tcpls, recon, &result) < 0 || result != 0) {
+        if (failover_path_failed(tcpls, recon) < 0)
+          return -1;
+        return failover_progress(tcpls);
       }
+      if (!recon->fastopen)
+        recon->connect_time = timediff(&now, &failover->started);
+      recon->state = CONNECTED;
+      connection_epoll_add(tcpls, recon);
+      uint32_t recon_transportid = recon->this_transportid;
+      if (failover_join(tcpls, recon) < 0)
+        return -1;
+      /** a standby connection which could not join is dropped, and a
+       * recovery which could not join over recon moved to another path */
+      if (!tcpls->failover || tcpls->failover->recon_transportid != recon_transportid)
+        return failover_progress(tcpls);
+      expired = 0;
     }
-    /** Pick any other CONNECTED con */
-    for (int i = 0; i < tcpls->connect_infos->size; i++) {
-      con = list_get(tcpls->connect_infos, i);
-      if (con->state >= CONNECTED)
-        return con;
-    }
-    /* We don't have a connected con, do we have a con not connected to a different
-     * address than con_closed->dest[6]?*/
-    int found = 0;
-    for (int i = 0; i < tcpls->connect_infos->size && !found; i++) {
-      con = list_get(tcpls->connect_infos, i);
-      if (con != con_closed && con->state == CLOSED) {
-        /* ensure the destination isn't the same address */
-        // XXX shouldn't we just make either src or dest differnt?
-        if (con->dest && (con->dest != con_closed->dest)) {
-          found = 1;
-        }
-        else if (con->dest6 && (con->dest6 != con_closed->dest6)) {
-          found = 1;
-        }
-        /* Try to connect to this con*/
-        if (found) {
-          int ret;
-          // XXX Maybe just try initial connection rtt+some C
-          // XXX we could race connections instead and use the one that
-          // connected the fastest
-          struct timeval timeout = {.tv_sec=2, .tv_usec=0};
-          struct sockaddr *src=NULL, *dest=NULL;
-          if (con->src)
-            src = (struct sockaddr *) &con->src->addr;
-          else if (con->src6)
-            src = (struct sockaddr *) &con->src6->addr;
-          if (con->dest)
-            dest = (struct sockaddr *) &con->dest->addr;
-          else if (con->dest6)
-            dest = (struct sockaddr *) &con->dest6->addr;
-          ret = tcpls_connect(tcpls->tls, src, dest, &timeout);
-          if (!ret)
-            return con;
-          else {
-            /*connection_fail(tcpls, con);*/
-            con->state = FAILED;
-            *remaining_con = *remaining_con-1;
-          }
+    if (failover->step == FAILOVER_JOINING) {
+      if (recon->state == JOINED && failover->standby) {
+        failover_free(tcpls);
+        failover = NULL;
+      }
+      else if (recon->state == JOINED) {
+        failover_replay_start(tcpls, recon);
+      }
+      else if (expired) {
+        if (failover_path_failed(tcpls, recon) < 0)
+          return -1;
+        return failover_progress(tcpls);
+      }
+      else {
+        ret = flush_nonblocking(tcpls, recon, &failover->joinbuf, &failover->joinbuf_sent);
+        if (ret < 0) {
+          if (failover_path_failed(tcpls, recon) < 0)
+            return -1;
+          return failover_progress(tcpls);
         }
-        found = 0;
+        return ret ? TCPLS_HOLD_DATA_TO_READ : TCPLS_HOLD_DATA_TO_SEND;
       }
     }
+    else if (failover->step != FAILOVER_REPLAYING) {
+      /** failover_join() moved to another connection */
+      return failover_progress(tcpls);
+    }
   }
-  /* Simply retry con_closed;*/ 
-  int ret;
-  struct timeval timeout = {.tv_sec=2, .tv_usec=0};
-  struct sockaddr *src=NULL, *dest=NULL;
-  if (con_closed->src)
-    src = (struct sockaddr *) &con_closed->src->addr;
-  else if (con_closed->src6)
-    src = (struct sockaddr *) &con_closed->src6->addr;
-  if (con_closed->dest)
-    dest = (struct sockaddr *) &con_closed->dest->addr;
-  else if (con_closed->dest6)
-    dest = (struct sockaddr *) &con_closed->dest6->addr;
-  ret = tcpls_connect(tcpls->tls, src, dest, &timeout);
-  if (!ret)
-    return con_closed;
-  else
-    return NULL;
+  if (!tcpls->enable_failover || !tcpls->failover_recovering)
+    return TCPLS_OK;
+  /** our FAILOVER messages go first */
+  if (failover) {
+    recon = connection_get(tcpls, failover->recon_transportid);
+    tcpls_stream_t *ctl_stream = failover->ctl_streamid ? stream_get(tcpls, failover->ctl_streamid) : NULL;
+    tcpls->sending_con = recon;
+    tcpls->sending_stream = ctl_stream;
+    if (ctl_stream)
+      ret = flush_nonblocking(tcpls, recon, ctl_stream->sendbuf, &ctl_stream->send_start);
+    else
+      ret = flush_nonblocking(tcpls, recon, tcpls->sendbuf, &tcpls->send_start);
+    if (ret <= 0)
+      return ret < 0 ? -1 : TCPLS_HOLD_DATA_TO_SEND;
+  }
+  if ((ret = failover_replay(tcpls)) <= 0)
+    return ret < 0 ? -1 : TCPLS_HOLD_DATA_TO_SEND;
+  tcpls->failover_recovering = 0;
+  return TCPLS_OK;
 }
 
 /**
@@ -1914,81 +3054,87 @@ static connect_info_t* try_reconnect(tcpls_t *tcpls, connect_info_t *con_closed,
  */
 
 static int multipath_merge_buffers(tcpls_t *tcpls, ptls_buffer_t *decryptbuf) {
-  // We try to pull bytes from the reordering buffer only if there is something
-  // within our priorty queue, and we have > 0 nbytes to get to the application
-
+  // We try to pull bytes from the reordering window only if it holds records
   uint32_t initial_pos = decryptbuf->off;
-  int ret;
-  if (heap_size(tcpls->priority_q) > 0) {
-    uint32_t *mpseq;
-    uint64_t *buf_position_data;
-    ret = heap_min(tcpls->priority_q, (void **) &mpseq, (void **)&buf_position_data);
-    while (ret && *mpseq == tcpls->next_expected_mpseq) {
-      *buf_position_data = *buf_position_data - tcpls->gap_offset;
-      size_t *length = (size_t *) malloc(sizeof(size_t));
-      *length = *(size_t *) (tcpls->rec_reordering->base+*buf_position_data);
-      ptls_buffer_pushv(decryptbuf, tcpls->rec_reordering->base+*buf_position_data+sizeof(size_t), *length);
-      heap_delmin(tcpls->priority_q, (void**)&mpseq, (void**)&buf_position_data);
+  int ret = 0;
+  if (!tcpls->reorder_window)
+    return 0;
+  for (;;) {
+    while (tcpls->reorder_window->size &&
+        (ret = tcpls_reorder_window_pop(tcpls->reorder_window, tcpls->next_expected_mpseq, decryptbuf)) == 1) {
+      PTLS_PROBE(TCPLS_REORDER_DEQUEUE, tcpls->tls, tcpls->next_expected_mpseq, tcpls->reorder_window->size);
       tcpls->next_expected_mpseq++;
-      heap_insert(tcpls->gap_rec_reordering, (void *) buf_position_data, (void *) length);
-      free(mpseq);
-      /*free(buf_position_data);*/
-      ret = heap_min(tcpls->priority_q, (void **) &mpseq, (void **) &buf_position_data);
-
-    }
-  }
-  /** we have nothing left in the heap and no fragments, we can clean rec_reordering! */
-  if (heap_size(tcpls->priority_q) == 0 && tcpls->rec_reordering->off) {
-    ptls_buffer_dispose(tcpls->rec_reordering);
-    /** reinit the gap heap */
-    heap_foreach(tcpls->gap_rec_reordering, &free_heap_key_value);
-    heap_destroy(tcpls->gap_rec_reordering);
-    heap_create(tcpls->gap_rec_reordering, 0, cmp_uint32);
-    tcpls->gap_size = 0;
-  }
-  else {
-    /** Check whether we can memmove rec_reordering buffer */
-    uint64_t *buf_position_data;
-    size_t *length;
-    ret = heap_min(tcpls->gap_rec_reordering, (void **) &buf_position_data, (void **) &length);
-    while (ret && *buf_position_data == tcpls->gap_size) {
-      tcpls->gap_size += *length;
-      tcpls->gap_size += sizeof(size_t);
-      heap_delmin(tcpls->gap_rec_reordering, (void **) &buf_position_data, (void**) &length);
-      free(length);
-      free(buf_position_data);
-      ret = heap_min(tcpls->gap_rec_reordering, (void **) &buf_position_data, (void **) &length);
-    }
-    if (tcpls->gap_size >= tcpls->max_gap_size) {
-      shift_buffer(tcpls->rec_reordering, tcpls->gap_size);
-      tcpls->gap_offset += tcpls->gap_size;
-      tcpls->gap_size = 0;
     }
+    if ((ret != 0 && ret != 1) || !tcpls->reorder_held || !tcpls->reorder_held->size)
+      break;
+    /** the window has room again for the records held aside */
+    int nbr_held = tcpls->reorder_held->size;
+    if (tcpls_held_records_release(tcpls->reorder_held, tcpls->reorder_window,
+          tcpls->next_expected_mpseq) == nbr_held)
+      break;
   }
+  reorder_stats_delivered(tcpls);
+  if (ret != 0 && ret != 1)
+    return -1;
   return decryptbuf->off-initial_pos;
-Exit:
-  return -1;
 }
 
 
+/**
+ * Move next_expected_mpseq past the records the reassembly window holds; the
+ * application can read up to there
+ */
+
+static void reassembly_advance(tcpls_t *tcpls) {
+  tcpls_buffer_t *buf = tcpls->buffer;
+  tcpls_reorder_window_t *window = buf->window;
+  ptls_iovec_t vec;
+  while (tcpls->next_expected_mpseq - buf->read_mpseq < window->nbr_slots &&
+      tcpls_reorder_window_peek(window, tcpls->next_expected_mpseq, &vec)) {
+    PTLS_PROBE(TCPLS_REORDER_DEQUEUE, tcpls->tls, tcpls->next_expected_mpseq, window->size);
+    tcpls->next_expected_mpseq++;
+  }
+  reorder_stats_delivered(tcpls);
+}
+
+/**
+ * Move the records held by a full reassembly buffer to its window once the
+ * application consumed enough of it
+ *
+ * returns the number of records still held
+ */
+
+static int reassembly_release_held(tcpls_t *tcpls) {
+  tcpls_buffer_t *buf = tcpls->buffer;
+  if (!buf || buf->bufkind != REASSEMBLY || !buf->held->size)
+    return 0;
+  int nbr_held = tcpls_reassembly_release(buf);
+  reassembly_advance(tcpls);
+  return nbr_held;
+}
 
 /**
  * Verify whether the position of the stream attach event event has been
  * consumed by a blocking send system call; as soon as it has been, the stream
- * is usable
+ * is usable. Only the streams of tcpls->streams_attach_pending are looked at
  */
 
 //XXX FIXME
 static void check_stream_attach_have_been_sent(tcpls_t *tcpls, int consumed) {
   tcpls_stream_t *stream;
-  for (int i = 0; i < tcpls->streams->size; i++) {
-    stream = list_get(tcpls->streams, i);
-    if (!stream->stream_usable && stream->send_stream_attach_in_sendbuf_pos <=
-        consumed + stream->send_start) {
+  for (int i = 0; i < tcpls->streams_attach_pending->size; i++) {
+    streamid_t *streamid = list_get(tcpls->streams_attach_pending, i);
+    stream = stream_get(tcpls, *streamid);
+    if (stream && !stream->stream_usable && stream->send_stream_attach_in_sendbuf_pos >
+        consumed + stream->send_start)
+      continue;
+    if (stream && !stream->stream_usable) {
       stream->stream_usable = 1;
       stream->send_stream_attach_in_sendbuf_pos = 0; // reset it
       /** fire callback ! TODO */
     }
+    list_remove(tcpls->streams_attach_pending, streamid);
+    i--;
   }
 }
 
@@ -2016,97 +3162,106 @@ static tcpls_v6_addr_t *get_addr6_from_sockaddr(tcpls_v6_addr_t *llist, struct s
   return NULL;
 }
 
-static int handle_connect(tcpls_t *tcpls, tcpls_v4_addr_t *src, tcpls_v4_addr_t
-    *dest, tcpls_v6_addr_t *src6, tcpls_v6_addr_t *dest6, unsigned short afinet,
-    int *nfds, connect_info_t *coninfo) {
-  int ret = get_con_info_from_addrs(tcpls, src, dest, src6, dest6, &coninfo);
-  if (ret) {
+/**
+ * Find the connection between the given addresses, or add a closed one
+ */
 
-    coninfo->socket = 0;
-    coninfo->state = CLOSED;
-    coninfo->this_transportid = tcpls->next_transport_id++;
-    coninfo->buffrag = malloc(sizeof(ptls_buffer_t));
-    memset(coninfo->buffrag, 0, sizeof(ptls_buffer_t));
-
-    if (afinet == AF_INET) {
-      coninfo->src = src;
-      coninfo->dest = dest;
-      coninfo->src6 = NULL;
-      coninfo->dest6 = NULL;
-      if ((src && src->is_primary) && dest->is_primary)
-        coninfo->is_primary = 1;
-      else if (!src && dest->is_primary)
-        coninfo->is_primary = 1;
-    }
-    else {
-      coninfo->src6 = src6;
-      coninfo->dest6 = dest6;
-      coninfo->src = NULL;
-      coninfo->dest = NULL;
-      if ((src6 && src6->is_primary) && dest6->is_primary)
-        coninfo->is_primary = 1;
-      else if (!src6 && dest6->is_primary)
-        coninfo->is_primary = 1;
-    }
+static connect_info_t *connection_prepare(tcpls_t *tcpls, tcpls_v4_addr_t *src,
+    tcpls_v4_addr_t *dest, tcpls_v6_addr_t *src6, tcpls_v6_addr_t *dest6,
+    unsigned short afinet) {
+  connect_info_t *con, coninfo;
+  if (get_con_info_from_addrs(tcpls, src, dest, src6, dest6, &con) == 0)
+    return con;
+  memset(&coninfo, 0, sizeof(coninfo));
+  coninfo.state = CLOSED;
+  coninfo.this_transportid = tcpls->next_transport_id++;
+  coninfo.buffrag = malloc(sizeof(ptls_buffer_t));
+  if (!coninfo.buffrag)
+    return NULL;
+  memset(coninfo.buffrag, 0, sizeof(ptls_buffer_t));
+  if (afinet == AF_INET) {
+    coninfo.src = src;
+    coninfo.dest = dest;
+    if ((src && src->is_primary) && dest->is_primary)
+      coninfo.is_primary = 1;
+    else if (!src && dest->is_primary)
+      coninfo.is_primary = 1;
   }
+  else {
+    coninfo.src6 = src6;
+    coninfo.dest6 = dest6;
+    if ((src6 && src6->is_primary) && dest6->is_primary)
+      coninfo.is_primary = 1;
+    else if (!src6 && dest6->is_primary)
+      coninfo.is_primary = 1;
+  }
+  return slab_add(tcpls->connect_infos, &coninfo);
+}
 
-  if (coninfo->state == CLOSED || coninfo->state == FAILED) {
-    /** we can connect */
-    if (!coninfo->socket) {
-      if ((coninfo->socket = socket(afinet, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
-        return -1;
-      }
-    }
-    int on = 1;
-    if (setsockopt(coninfo->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) {
-      perror("setsockopt(SO_REUSEADDR) failed");
+/**
+ * Start a non-blocking connect() of a closed or failed connection; it is
+ * CONNECTING afterwards, and connected once its socket is writable.
+ */
+
+static int connection_start(tcpls_t *tcpls, connect_info_t *con) {
+  int afinet = con->dest ? AF_INET : AF_INET6;
+  if (!con->socket) {
+    if ((con->socket = socket(afinet, SOCK_STREAM|SOCK_NONBLOCK, 0)) < 0) {
+      con->socket = 0;
       return -1;
     }
-    /** try to connect */
-    if (src || src6) {
-      if (src) {
-        if (bind(coninfo->socket, (struct sockaddr*) &src->addr, sizeof(src->addr)) != 0) {
-          perror("bind failed");
-          return -1;
-        }
-      }
-      else {
-        if (bind(coninfo->socket, (struct sockaddr *) &src6->addr, sizeof(src6->addr)) != 0) {
-          perror("bind failed");
-          return -1;
-        }
-      }
-    }
-    if (afinet == AF_INET) {
-      if (connect(coninfo->socket, (struct sockaddr*) &dest->addr,
-            sizeof(dest->addr)) < 0 && errno != EINPROGRESS) {
-        connection_close(tcpls, coninfo);
-        return -1;
+  }
+  int on = 1;
+  if (setsockopt(con->socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0) {
+    perror("setsockopt(SO_REUSEADDR) failed");
+    goto Fail;
+  }
+  con->fastopen = 0;
+#ifdef TCP_FASTOPEN_CONNECT
+  /** connect() returns at once and the SYN leaves with our first write */
+  if (tcpls->enable_fastopen) {
+    if (setsockopt(con->socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) == 0)
+      con->fastopen = 1;
+    else
+      perror("setsockopt(TCP_FASTOPEN_CONNECT) failed");
+  }
+#endif
+  /** try to connect */
+  if (con->src || con->src6) {
+    if (con->src) {
+      if (bind(con->socket, (struct sockaddr*) &con->src->addr, sizeof(con->src->addr)) != 0) {
+        perror("bind failed");
+        goto Fail;
       }
     }
     else {
-      if (connect(coninfo->socket, (struct sockaddr*) &dest6->addr,
-            sizeof(dest6->addr)) < 0 && errno != EINPROGRESS) {
-        coninfo->state =  CLOSED;
-        close(coninfo->socket);
-        return -1;
+      if (bind(con->socket, (struct sockaddr *) &con->src6->addr, sizeof(con->src6->addr)) != 0) {
+        perror("bind failed");
+        goto Fail;
       }
     }
-    coninfo->state = CONNECTING;
-    /* put back the socket in blocking mode */
-    int flags = fcntl(coninfo->socket, F_GETFL);
-    flags &= ~O_NONBLOCK;
-    fcntl(coninfo->socket, F_SETFL, flags);
-
-    *nfds = *nfds + 1;
   }
-  else if (coninfo->state == CONNECTING) {
-    *nfds = *nfds + 1;
-  }
-  if (ret) {
-    list_add(tcpls->connect_infos, coninfo);
+  if (afinet == AF_INET) {
+    if (connect(con->socket, (struct sockaddr*) &con->dest->addr,
+          sizeof(con->dest->addr)) < 0 && errno != EINPROGRESS)
+      goto Fail;
   }
+  else {
+    if (connect(con->socket, (struct sockaddr*) &con->dest6->addr,
+          sizeof(con->dest6->addr)) < 0 && errno != EINPROGRESS)
+      goto Fail;
+  }
+  con->state = CONNECTING;
+  /* put back the socket in blocking mode */
+  int flags = fcntl(con->socket, F_GETFL);
+  flags &= ~O_NONBLOCK;
+  fcntl(con->socket, F_SETFL, flags);
   return 0;
+Fail:
+  con->state = CLOSED;
+  close(con->socket);
+  con->socket = 0;
+  return -1;
 }
 
 /**
@@ -2119,14 +3274,14 @@ static tcpls_stream_t *stream_helper_new(tcpls_t *tcpls, connect_info_t *con) {
   int is_client_origin = tcpls->tls->is_server ? 0 : 1;
   stream = stream_new(tcpls->tls, tcpls->next_stream_id++, con,
       ++tcpls->nbr_of_our_streams_attached, is_client_origin);
+  if (!stream)
+    return NULL;
   /**
    * remember to send a stream attach event with this stream the first time we
    * use it
    * */
   stream->need_sending_attach_event = 1;
-  list_add(tcpls->streams, stream);
-  free(stream);
-  return list_get(tcpls->streams, tcpls->streams->size-1);
+  return stream;
 }
 
 
@@ -2319,9 +3474,10 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
         uint32_t our_transportid = *(uint32_t*) &input[4];
         connect_info_t *con;
         for (int i = 0; i < ptls->tcpls->connect_infos->size; i++) {
-          con = list_get(ptls->tcpls->connect_infos, i);
+          con = slab_get(ptls->tcpls->connect_infos, i);
           if (con->this_transportid == our_transportid) {
             con->peer_transportid = peer_transportid;
+            failover_joined(ptls->tcpls, con);
             return 0;
           }
         }
@@ -2378,7 +3534,7 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
         connect_info_t *con;
         int found = 0;
         for (int i = 0; i < ptls->tcpls->connect_infos->size && !found; i++) {
-          con = list_get(ptls->tcpls->connect_infos, i);
+          con = slab_get(ptls->tcpls->connect_infos, i);
           if (con->peer_transportid == peer_transportid && con->state == JOINED) {
             found = 1;
           }
@@ -2390,6 +3546,8 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
         ptls->tcpls->nbr_of_peer_streams_attached++;
         int is_client_origin = ptls->is_server ? 1 : 0;
         tcpls_stream_t *stream = stream_new(ptls, streamid, con, offset, is_client_origin);
+        if (!stream)
+          return PTLS_ERROR_NO_MEMORY;
         stream->stream_usable = 1;
 
         stream->need_sending_attach_event = 0;
@@ -2399,10 +3557,6 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
           ptls->ctx->stream_event_cb(ptls->tcpls, STREAM_OPENED, stream->streamid,
               con->this_transportid, ptls->ctx->cb_data);
         }
-        if (!stream) {
-          return PTLS_ERROR_STREAM_NOT_FOUND;
-        }
-        list_add(ptls->tcpls->streams, stream);
       }
       break;
     case DATA_ACK:
@@ -2415,6 +3569,7 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
         if (!stream)
           return PTLS_ERROR_STREAM_NOT_FOUND;
         con = connection_get(ptls->tcpls, stream->transportid);
+        PTLS_PROBE(TCPLS_DATA_ACK_RECEIVE, ptls, streamid, ptls->tcpls->transportid_rcv, seqnum);
         if (con->state == JOINED) {
           free_bytes_in_sending_buffer(ptls->tcpls, stream, seqnum);
         }
@@ -2452,7 +3607,7 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
           int found = 0;
           tcpls_stream_t *stream_to_use;
           for (int i = 0; i < ptls->tcpls->streams->size && !found; i++) {
-            stream_to_use = list_get(ptls->tcpls->streams, i);
+            stream_to_use = slab_get(ptls->tcpls->streams, i);
             /** Find a stream attached to this con */
             if (stream_to_use->transportid == con->this_transportid) {
               found = 1;
@@ -2481,16 +3636,30 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
             stream_send_control_message(ptls, 0, ptls->tcpls->sendbuf,
                 ptls->traffic_protection.enc.aead, input, FAILOVER, 12);
           }
-          /* send the failover message right away */
-          if (do_send(ptls->tcpls, NULL, con) <= 0) {
-            //XXX
-            fprintf(stderr, "Unimplemented\n");
-          }
-          /*to send the full sendbuf when housekeeping*/
-          stream_failed->send_start = 0;
+          /* send the failover message right away; what the socket does not
+           * take goes from tcpls_failover_progress() */
+          struct st_tcpls_failover_t *failover = ptls->tcpls->failover;
+          if (!failover && (failover = failover_new(ptls->tcpls)) == NULL)
+            return PTLS_ERROR_NO_MEMORY;
+          failover->step = FAILOVER_REPLAYING;
+          failover->failed_transportid = con_failed->this_transportid;
+          failover->recon_transportid = con->this_transportid;
+          failover->ctl_streamid = found ? stream_to_use->streamid : 0;
+          int ret;
+          if (found)
+            ret = flush_nonblocking(ptls->tcpls, con, stream_to_use->sendbuf, &stream_to_use->send_start);
+          else
+            ret = flush_nonblocking(ptls->tcpls, con, ptls->tcpls->sendbuf, &ptls->tcpls->send_start);
+          if (ret < 0)
+            return -1;
+          /*to send everything unacked when housekeeping*/
+          stream_failed->send_start = stream_failed->send_acked;
         }
         /*move stream_failed to  con */
+        PTLS_PROBE(TCPLS_CONN_RECOVER, ptls, streamid, con_failed->this_transportid, con->this_transportid);
+        stream_con_unlink(ptls->tcpls, stream_failed);
         stream_failed->transportid = con->this_transportid;
+        stream_con_link(ptls->tcpls, stream_failed);
         /*update the decryption seq value -- the next expected record for this
          * stream should be decrypted with that seq; and potentially, we already
          * see it! That should be handed properly when handling the decrypted
@@ -2513,6 +3682,7 @@ int handle_tcpls_control(ptls_t *ptls, tcpls_enum_t type,
           return PTLS_ERROR_STREAM_NOT_FOUND;
         stream->orcon_transportid = this_transportid;
         stream->failover_end_received = 1;
+        PTLS_PROBE(TCPLS_FAILOVER_END, ptls, streamid, this_transportid, 1);
         break;
       }
     case BPF_CC:
@@ -2559,39 +3729,72 @@ int handle_tcpls_data_record(ptls_t *tls, struct st_ptls_record_t *rec)
     }
   }
   int ret = 0;
+  PTLS_PROBE(TCPLS_RECORD_DECRYPT, tls, stream->streamid, con->this_transportid,
+      stream->aead_dec->seq-1, rec->length);
   con->nbr_records_received++;
   con->nbr_bytes_received += rec->length;
   con->tot_data_bytes_received += rec->length;
+  con->stats.records_received++;
+  stream->stats.records_received++;
+  stream->stats.bytes_received += rec->length;
+  tcpls->stats.records_received++;
+  tcpls->stats.bytes_received += rec->length;
   stream->last_seq_received = stream->aead_dec->seq-1;
-  stream->nbr_records_since_last_ack++;
-  stream->nbr_bytes_since_last_ack += rec->length;
-  if (tcpls->enable_multipath) {
+  stream_count_received(tcpls, stream, rec->length);
+  if (tcpls->enable_multipath && (int32_t) (mpseq - con->last_mpseq_received) > 0)
+    con->last_mpseq_received = mpseq;
+  if (tcpls->buffer && tcpls->buffer->bufkind == REASSEMBLY) {
+    tcpls_buffer_t *buf = tcpls->buffer;
+    // the record has been decrypted within the spare slot of the window:
+    // it stays where it is, and duplicates are dropped. When the application
+    // lags behind, the window is full and the record is held aside until it
+    // consumed enough
+    if (!tcpls->enable_multipath)
+      mpseq = tcpls->next_expected_mpseq + buf->held->size;
+    ret = 1;
+    if ((int32_t) (mpseq - tcpls->next_expected_mpseq) >= 0) {
+      if (tcpls_reorder_window_commit(buf->window, buf->read_mpseq, mpseq,
+            rec->fragment, rec->length) == OK) {
+        if (mpseq != tcpls->next_expected_mpseq) {
+          PTLS_PROBE(TCPLS_REORDER_ENQUEUE, tls, mpseq, buf->window->size);
+          reorder_stats_held(tcpls, mpseq, buf->window->size);
+        }
+        reassembly_advance(tcpls);
+      }
+      else if (tcpls_reassembly_hold(buf, mpseq, rec->fragment, rec->length) != OK)
+        return PTLS_ERROR_NO_MEMORY;
+    }
+  }
+  else if (tcpls->enable_multipath) {
     if (tcpls->next_expected_mpseq == mpseq) {
       // then we push this fragment in the received buffer
       tcpls->next_expected_mpseq++;
       ret = 0;
     }
     else {
-      // push the record to the reordering buffer, and add it to the priority
-      // queue
-      if (tcpls->rec_reordering->base == NULL) {
-        ptls_buffer_init(tcpls->rec_reordering, "", 0);
-      }
-      uint32_t *mpseq_ptr = (uint32_t*) malloc(sizeof(uint32_t));
-      *mpseq_ptr = mpseq;
-      ptls_buffer_pushv(tcpls->rec_reordering, &rec->length,
-          sizeof(rec->length));
-      ptls_buffer_pushv(tcpls->rec_reordering, rec->fragment, rec->length);
-      /** contains length + payload, point to the length*/
-      uint64_t *buf_position_data = (uint64_t*) malloc(sizeof(uint32_t));
-      *buf_position_data = tcpls->rec_reordering->off-rec->length-sizeof(rec->length) + tcpls->gap_offset;
-      heap_insert(tcpls->priority_q, (void *)mpseq_ptr, (void*)buf_position_data);
+      // keep the record in the reordering window until the missing ones
+      // arrive; a record older than next_expected_mpseq is a duplicate. The
+      // record is decrypted already, so one too far ahead for the window is
+      // held aside rather than dropped
       ret = 1;
+      if ((int32_t) (mpseq - tcpls->next_expected_mpseq) > 0) {
+        if (!tcpls->reorder_window &&
+            !(tcpls->reorder_window = tcpls_reorder_window_new(tcpls->reorder_window_size)))
+          return PTLS_ERROR_NO_MEMORY;
+        if (tcpls_reorder_window_push(tcpls->reorder_window, tcpls->next_expected_mpseq,
+              mpseq, rec->fragment, rec->length) == OK) {
+          PTLS_PROBE(TCPLS_REORDER_ENQUEUE, tls, mpseq, tcpls->reorder_window->size);
+          reorder_stats_held(tcpls, mpseq, tcpls->reorder_window->size);
+        }
+        else if ((!tcpls->reorder_held && !(tcpls->reorder_held =
+                new_list(sizeof(struct st_tcpls_held_record), 4))) ||
+            tcpls_held_records_add(tcpls->reorder_held, mpseq, rec->fragment, rec->length) != OK)
+          return PTLS_ERROR_NO_MEMORY;
+      }
     }
   }
   if (stream->stream_usable)
     send_ack_if_needed(tcpls, stream);
-Exit:
   return ret;
 }
 
@@ -2697,8 +3900,7 @@ int handle_tcpls_control_record(ptls_t *tls, struct st_ptls_record_t *rec)
       con->nbr_records_received++;
       con->nbr_bytes_received += rec->length;
       stream->last_seq_received = stream->aead_dec->seq-1;
-      stream->nbr_records_since_last_ack++;
-      stream->nbr_bytes_since_last_ack++;
+      stream_count_received(tls->tcpls, stream, 1);
       return ret;
     }
   }
@@ -2706,8 +3908,7 @@ int handle_tcpls_control_record(ptls_t *tls, struct st_ptls_record_t *rec)
     con->nbr_records_received++;
     con->nbr_bytes_received += rec->length;
     stream->last_seq_received = stream->aead_dec->seq-1;
-    stream->nbr_records_since_last_ack++;
-    stream->nbr_bytes_since_last_ack++;
+    stream_count_received(tls->tcpls, stream, 1);
   }
   /** We assume that only Variable size options won't hold into 1 record */
   return handle_tcpls_control(tls, type, rec->fragment, rec->length);
@@ -2733,14 +3934,11 @@ static int setlocal_bpf_cc(ptls_t *ptls, const uint8_t *prog, size_t proglen) {
 /*=====================================utilities======================================*/
 
 /**
- * Check whether everythin has been sent, and if we have not, send it if we
- * need to flush it.
- *
- * return 1 if it went well
- * return 0 upon any issue
+ * Account for the bytes_sent of a send, keeping what the socket did not take
+ * for later; this never waits on the socket and cannot fail.
  */
 
-static int did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int bytes_sent) {
+static void did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int bytes_sent) {
   int *send_start;
   ptls_buffer_t *sendbuf;
   if (stream) {
@@ -2751,7 +3949,8 @@ static int did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int by
     send_start = &tcpls->send_start;
     sendbuf = tcpls->sendbuf;
   }
-  connect_info_t *con = tcpls->sending_con;
+  if (bytes_sent < 0)
+    bytes_sent = 0;
 
   if (sendbuf->off == *send_start + bytes_sent) {
     if (!tcpls->enable_failover) {
@@ -2762,45 +3961,10 @@ static int did_we_sent_everything(tcpls_t *tcpls, tcpls_stream_t *stream, int by
       *send_start = sendbuf->off;
   }
   else if (bytes_sent+*send_start < sendbuf->off) {
-    int sending = *send_start + bytes_sent;
-    /* flush it */
-    if (tcpls->failover_recovering) {
-      // We need to flush if from our sending buffer
-      int ret = 0;
-      struct timeval timeout = {.tv_sec=2, .tv_usec=0};
-      fd_set writefds;
-      FD_ZERO(&writefds);
-      FD_SET(con->socket, &writefds);
-      while (sending != sendbuf->off &&
-          (ret = select(con->socket+1, NULL, &writefds, NULL, &timeout)) > 0) {
-        ret = send(con->socket, sendbuf->base+sending,
-            sendbuf->off-sending, 0);
-        if (ret > 0) {
-          sending += ret;
-        }
-        else {
-          fprintf(stderr, "sending %lu failed\n", sendbuf->off-sending);
-          perror("Error while flushing (send)");
-          return 0;
-        }
-      }
-      /* any select error?*/
-      if (ret <= 0) {
-        // we need to do something here :-)
-        fprintf(stderr, "did_we_sent_everything(): flushing the message failed\n");
-        return 0;
-      }
-      else {
-        /* We erase the sent message from the sending buffer */
-        sendbuf->off = *send_start;
-      }
-    }
-    else {
-      /* will be sent at the next send */
-      *send_start = sending;
-    }
+    /* will be sent at the next send; while recovering from a failure,
+     * tcpls_failover_progress() flushes it once the socket is writable */
+    *send_start += bytes_sent;
   }
-  return 1;
 }
 
 /**
@@ -2871,116 +4035,30 @@ static void tcpls_housekeeping(tcpls_t *tcpls) {
   /* check whether we have a stream to remove */
   if (tcpls->streams_marked_for_close) {
     tcpls_stream_t *stream;
-    list_t *streams_to_remove = new_list(sizeof(streamid_t), tcpls->streams->size);
-    for (int i = 0; i < tcpls->streams->size; i++) {
-      stream = list_get(tcpls->streams, i);
-      if (stream->marked_for_close)
-        list_add(streams_to_remove, &stream->streamid);
-    }
-    for (int i = 0; i < streams_to_remove->size; i++) {
-      stream = stream_get(tcpls, *(streamid_t *) list_get(streams_to_remove, i));
-      stream_free(stream);
-      assert(!list_remove(tcpls->streams, stream));
-    }
-    list_free(streams_to_remove);
+    /** backward, since removing moves the last stream to the freed position */
+    for (int i = tcpls->streams->size-1; i >= 0; i--) {
+      stream = slab_get(tcpls->streams, i);
+      if (stream->marked_for_close) {
+        PTLS_PROBE(TCPLS_STREAM_CLOSE, tcpls->tls, stream->streamid, stream->transportid);
+        stream_free(stream);
+        stream_remove(tcpls, stream);
+      }
+    }
     tcpls->streams_marked_for_close = 0;
   }
 
+  if (tcpls->path_metrics_interval_ms)
+    path_metrics_sample(tcpls);
+  /* connection attempts which went on after tcpls_connect() returned */
+  if (tcpls->connector)
+    tcpls_connect_progress(tcpls, NULL);
   /* If we had lost a connection and failover enabled */
-  if (tcpls->enable_failover && tcpls->failover_recovering) {
-    /** We find all lost connection, send their buffer into the new con and then
-     * we need each stream that have moved to send a FAILOVER_END */
-    connect_info_t *con, *con_to_failover;
-    for (int i = 0; i < tcpls->connect_infos->size; i++) {
-      con = list_get(tcpls->connect_infos, i);
-      /* we have a con that failed. If we're a client, we already buffered every
-       * FAILOVER messages in con_to_failover's sendbuf */
-      if (con->state == FAILED) {
-        con_to_failover = connection_get(tcpls, con->transportid_to_failover);
-        /** find all streams attached to this con */
-        tcpls_stream_t *stream_failed;
-        for (int i = 0; i < tcpls->streams->size; i++) {
-          stream_failed = list_get(tcpls->streams, i);
-          if (stream_failed->orcon_transportid == con->this_transportid &&
-              !stream_failed->failover_end_sent &&
-              !stream_failed->stream_usable) {
-            /* first, we send the unacked data */
-            int ret;
-            /*fprintf(stderr, "sent seq %u; our send_queue contains %d records, and our next enc seq is %lu\n",*/
-                /*stream_failed->last_seq_poped+1, stream_failed->send_queue->size, stream_failed->aead_enc->seq);*/
-            tcpls->sending_con = con_to_failover;
-            tcpls->sending_stream = stream_failed;
-            ret = send_unacked_data(tcpls, stream_failed, con_to_failover);
-            if (ret < 0) {
-              //analyze what to do
-              fprintf(stderr, "Unimplemented so far; send_unacked_data failed\n");
-              return;
-            }
-            /* if we have flushed the buffer, let's send FAILOVER_END */
-            if (stream_failed->send_start == stream_failed->sendbuf->off) {
-              char input[8];
-              memcpy(input, &con_to_failover->peer_transportid, 4);
-              memcpy(input+4, &stream_failed->streamid, 4);
-              stream_send_control_message(tcpls->tls, stream_failed->streamid,
-                  stream_failed->sendbuf, stream_failed->aead_enc, input, FAILOVER_END, 8);
-              stream_failed->failover_end_sent = 1;
-              stream_failed->stream_usable = 1;
-              /*trigger a stream event STREAM_NETWORK_RECOVERED*/
-              if (tcpls->tls->ctx->stream_event_cb) {
-                tcpls->tls->ctx->stream_event_cb(tcpls, STREAM_NETWORK_RECOVERED,
-                    stream_failed->streamid, con_to_failover->this_transportid,
-                    tcpls->tls->ctx->cb_data);
-              }
-              /**
-               * send the FAILOVER_END message with the now recovered
-               * stream_failed stream
-               **/
-              ret = do_send(tcpls, stream_failed, con_to_failover);
-              if (ret < 0) {
-                //XXX analyze what to do;
-                fprintf(stderr, "Unimplemented so far; sending the failover_end message failed\n");
-                return;
-              }
-              if (!did_we_sent_everything(tcpls, stream_failed, ret)) {
-                fprintf(stderr, "Failed to flush unacked data\n");
-                return;
-              }
-              stream_failed->stream_usable = 1;
-
-            }
-            else {
-              /** XXX CALLBACK con WANTS TO WRITE*/
-              fprintf(stderr,"Unimplemented callback: socket %d has data to write!\n", con_to_failover->socket);
-              /**returns*/
-            }
-          }
-        }
-        /** Do we me miss fully sending a FAILOVER_END? */
-        int do_we_miss_a_failover_end = 0;
-        tcpls_stream_t *stream;
-        for (int i = 0; i < tcpls->streams->size; i++) {
-          stream = list_get(tcpls->streams, i);
-          if (stream->orcon_transportid == con->this_transportid && !stream->failover_end_sent)
-            do_we_miss_a_failover_end++;
-        }
-        if (!do_we_miss_a_failover_end) {
-          /*reinit failover_end_sent*/
-          for (int i = 0; i < tcpls->streams->size; i++) {
-            stream = list_get(tcpls->streams, i);
-            if (stream->orcon_transportid == con->this_transportid && stream->failover_end_sent)
-              stream->failover_end_sent = 0;
-          }
-          if (tcpls->tls->ctx->connection_event_cb)
-            tcpls->tls->ctx->connection_event_cb(tcpls, CONN_CLOSED, con->socket, con->this_transportid,
-                tcpls->tls->ctx->cb_data);
-          con->socket = 0;
-          con->state = CLOSED;
-          tcpls->failover_recovering = 0;
-        }
-      }
-    }
-  }
+  if (tcpls->failover || (tcpls->enable_failover && tcpls->failover_recovering))
+    tcpls_failover_progress(tcpls);
+  else if (tcpls->nbr_standby && tcpls->enable_failover && ptls_handshake_is_complete(tcpls->tls))
+    standby_replenish(tcpls);
 }
+
 static void shift_buffer(ptls_buffer_t *buf, size_t delta) {
   if (delta != 0) {
     assert(delta <= buf->off);
@@ -3035,11 +4113,15 @@ static int send_ack_if_needed__do(tcpls_t *tcpls, tcpls_stream_t *stream) {
   memcpy(&input[4], &stream->last_seq_received, 4);
   tcpls->sending_stream = stream;
   stream_send_control_message(tcpls->tls, stream->streamid, stream->sendbuf, stream->aead_enc, input, DATA_ACK, 8);
+  PTLS_PROBE(TCPLS_DATA_ACK_SEND, tcpls->tls, stream->streamid, con->this_transportid, stream->last_seq_received);
+  stream->stats.acks_sent++;
+  con->stats.acks_sent++;
+  tcpls->stats.acks_sent++;
   int ret;
   ret = do_send(tcpls, stream, con);
   /** did we sent everything? =) */
-  if (!tcpls->failover_recovering && !did_we_sent_everything(tcpls, stream, ret))
-    return -1;
+  if (!tcpls->failover_recovering)
+    did_we_sent_everything(tcpls, stream, ret);
   stream->nbr_records_since_last_ack = 0;
   stream->nbr_bytes_since_last_ack = 0;
   return 0;
@@ -3050,14 +4132,21 @@ static int send_ack_if_needed(tcpls_t *tcpls, tcpls_stream_t *stream) {
     return 0;
   connect_info_t *con;
   if (!stream) {
-    for (int i = 0; i < tcpls->streams->size; i++) {
-      stream = list_get(tcpls->streams, i);
-      con = connection_get(tcpls, stream->transportid);
-      if (con->state == JOINED && !tcpls->failover_recovering &&
-          stream->stream_usable && is_ack_needed(tcpls, stream)) {
+    /** only the streams which received enough since their last ack */
+    for (int i = 0; i < tcpls->streams_ack_due->size; i++) {
+      streamid_t *streamid = list_get(tcpls->streams_ack_due, i);
+      stream = stream_get(tcpls, *streamid);
+      if (stream && is_ack_needed(tcpls, stream)) {
+        con = connection_get(tcpls, stream->transportid);
+        if (con->state != JOINED || tcpls->failover_recovering || !stream->stream_usable)
+          continue;
         if (send_ack_if_needed__do(tcpls, stream))
           return -1;
       }
+      if (stream)
+        stream->ack_due = 0;
+      list_remove(tcpls->streams_ack_due, streamid);
+      i--;
     }
   }
   else {
@@ -3089,8 +4178,23 @@ static void free_bytes_in_sending_buffer(tcpls_t *tcpls, tcpls_stream_t *stream,
     stream->last_seq_poped = stream_seq;
     totlength += reclen;
   }
-  shift_buffer(stream->sendbuf, totlength);
-  stream->send_start -= totlength;
+  stream->send_acked += totlength;
+  release_acked_bytes(stream);
+}
+
+/**
+ * Drop the acked bytes from the front of the stream's sendbuf, only once they
+ * are at least as many as the bytes left, or when nothing is left. Releasing
+ * acked records is O(1) for most acks, and each byte is moved at most once on
+ * average rather than the whole window being moved on every ack.
+ */
+
+static void release_acked_bytes(tcpls_stream_t *stream) {
+  if (stream->send_acked == 0 || stream->send_acked < stream->sendbuf->off - stream->send_acked)
+    return;
+  shift_buffer(stream->sendbuf, stream->send_acked);
+  stream->send_start -= stream->send_acked;
+  stream->send_acked = 0;
 }
 
 static void compute_client_rtt(connect_info_t *con, struct timeval *timeout,
@@ -3114,6 +4218,198 @@ static void compute_client_rtt(connect_info_t *con, struct timeval *timeout,
   con->state = CONNECTED;
 }
 
+/**
+ * A fastopen connection "connects" before its SYN leaves: its RTT is the time
+ * between our first write, sent at t_sent, and the first answer
+ */
+
+static void connection_fastopen_rtt(connect_info_t *con, struct timeval *t_sent) {
+  if (!con || !con->fastopen || con->connect_time.tv_sec || con->connect_time.tv_usec)
+    return;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  con->connect_time = timediff(&now, t_sent);
+}
+
+/**
+ * Sample con's TCP_INFO into con->metrics; the receive rate is averaged since
+ * the previous sample
+ */
+
+static int connection_sample_metrics(connect_info_t *con, struct timeval *now) {
+  tcpls_path_metrics_t *metrics = &con->metrics;
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  /** an older kernel fills a shorter structure */
+  memset(&info, 0, sizeof(info));
+  if (con->socket <= 0 || getsockopt(con->socket, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+    return -1;
+  if (metrics->sampled.tv_sec || metrics->sampled.tv_usec) {
+    struct timeval elapsed = timediff(now, &metrics->sampled);
+    uint64_t elapsed_us = elapsed.tv_sec*(uint64_t)1000000+elapsed.tv_usec;
+    if (elapsed_us && info.tcpi_bytes_received >= metrics->bytes_received)
+      metrics->rcv_rate = (info.tcpi_bytes_received - metrics->bytes_received) * 1000000 / elapsed_us;
+  }
+  metrics->srtt_us = info.tcpi_rtt;
+  metrics->rttvar_us = info.tcpi_rttvar;
+  metrics->min_rtt_us = info.tcpi_min_rtt;
+  metrics->rcv_rtt_us = info.tcpi_rcv_rtt;
+  metrics->snd_cwnd = info.tcpi_snd_cwnd;
+  metrics->snd_mss = info.tcpi_snd_mss;
+  metrics->unacked = info.tcpi_unacked;
+  metrics->total_retrans = info.tcpi_total_retrans;
+  metrics->delivery_rate = info.tcpi_delivery_rate;
+  metrics->bytes_received = info.tcpi_bytes_received;
+  metrics->sampled = *now;
+  return 0;
+}
+
+/**
+ * Sample the path metrics of every established connection, once every
+ * path_metrics_interval_ms
+ */
+
+static void path_metrics_sample(tcpls_t *tcpls) {
+  struct timeval now;
+  connect_info_t *con;
+  gettimeofday(&now, NULL);
+  if (cmp_times(&now, &tcpls->path_metrics_next) < 0)
+    return;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    con = slab_get(tcpls->connect_infos, i);
+    if (con->state >= CONNECTED)
+      connection_sample_metrics(con, &now);
+  }
+  tcpls->path_metrics_next = now;
+  tcpls->path_metrics_next.tv_usec += (suseconds_t) tcpls->path_metrics_interval_ms * 1000;
+  tcpls->path_metrics_next.tv_sec += tcpls->path_metrics_next.tv_usec / 1000000;
+  tcpls->path_metrics_next.tv_usec %= 1000000;
+}
+
+int tcpls_get_path_metrics(tcpls_t *tcpls, uint32_t transportid, tcpls_path_metrics_t *metrics) {
+  connect_info_t *con = connection_get(tcpls, transportid);
+  struct timeval now;
+  if (!con || con->state < CONNECTED)
+    return -1;
+  gettimeofday(&now, NULL);
+  if (connection_sample_metrics(con, &now) < 0)
+    return -1;
+  *metrics = con->metrics;
+  return 0;
+}
+
+/**
+ * RTT of con in µs: the smoothed one of its last path metrics sample, or else
+ * the one measured when it connected; 0 if unknown
+ */
+
+uint64_t connection_rtt_us(connect_info_t *con) {
+  if (con->metrics.srtt_us)
+    return con->metrics.srtt_us;
+  return con->connect_time.tv_sec*(uint64_t)1000000+con->connect_time.tv_usec;
+}
+
+/** Whether con has a lower RTT than best; an unknown RTT comes last */
+
+static int path_is_better(connect_info_t *con, connect_info_t *best) {
+  if (!best)
+    return 1;
+  uint64_t rtt = connection_rtt_us(con), best_rtt = connection_rtt_us(best);
+  return rtt && (!best_rtt || rtt < best_rtt);
+}
+
+/**
+ * Count a DATA record of len bytes encrypted for tcpls->sending_stream over
+ * tcpls->sending_con
+ */
+
+void tcpls_stats_record_sent(tcpls_t *tcpls, size_t len) {
+  tcpls->stats.records_sent++;
+  tcpls->stats.bytes_sent += len;
+  if (tcpls->sending_con) {
+    tcpls->sending_con->stats.records_sent++;
+    tcpls->sending_con->stats.bytes_sent += len;
+  }
+  if (tcpls->sending_stream) {
+    tcpls->sending_stream->stats.records_sent++;
+    tcpls->sending_stream->stats.bytes_sent += len;
+  }
+}
+
+static void stream_sendbuf_occupancy(tcpls_t *tcpls, tcpls_stream_t *stream, uint64_t *unsent, uint64_t *unacked) {
+  *unsent = stream->sendbuf->off - stream->send_start;
+  *unacked = tcpls->enable_failover ? stream->send_start - stream->send_acked : 0;
+}
+
+/**
+ * The record mpseq waits in the reordering window, which holds depth records:
+ * the delivery is blocked since the first record of the gap arrived
+ */
+
+static void reorder_stats_held(tcpls_t *tcpls, uint32_t mpseq, uint32_t depth) {
+  if (depth > tcpls->stats.reorder_high_water)
+    tcpls->stats.reorder_high_water = depth;
+  if (!tcpls->reorder_gap_open) {
+    tcpls->reorder_gap_open = 1;
+    gettimeofday(&tcpls->reorder_gap_start, NULL);
+    tcpls->reorder_gap_end = mpseq;
+  }
+  else if ((int32_t) (mpseq - tcpls->reorder_gap_end) > 0)
+    tcpls->reorder_gap_end = mpseq;
+}
+
+/** next_expected_mpseq moved; account the gap once it is past all of it */
+
+static void reorder_stats_delivered(tcpls_t *tcpls) {
+  if (!tcpls->reorder_gap_open || (int32_t) (tcpls->next_expected_mpseq - tcpls->reorder_gap_end) <= 0)
+    return;
+  struct timeval now, delay;
+  gettimeofday(&now, NULL);
+  delay = timediff(&now, &tcpls->reorder_gap_start);
+  uint64_t delay_us = delay.tv_sec*(uint64_t)1000000+delay.tv_usec;
+  int bucket = 0;
+  while (delay_us && bucket < TCPLS_STATS_REORDER_DELAY_BUCKETS-1) {
+    delay_us >>= 1;
+    bucket++;
+  }
+  tcpls->stats.reorder_delay_us[bucket]++;
+  tcpls->reorder_gap_open = 0;
+}
+
+void tcpls_get_stats(tcpls_t *tcpls, tcpls_stats_t *stats) {
+  uint64_t unsent, unacked;
+  *stats = tcpls->stats;
+  stats->sendbuf_unsent = tcpls->sendbuf->off - tcpls->send_start;
+  stats->sendbuf_unacked = 0;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    stream_sendbuf_occupancy(tcpls, slab_get(tcpls->streams, i), &unsent, &unacked);
+    stats->sendbuf_unsent += unsent;
+    stats->sendbuf_unacked += unacked;
+  }
+}
+
+int tcpls_get_conn_stats(tcpls_t *tcpls, uint32_t transportid, tcpls_conn_stats_t *stats) {
+  connect_info_t *con = connection_get(tcpls, transportid);
+  if (!con)
+    return -1;
+  *stats = con->stats;
+  stats->transportid = con->this_transportid;
+  stats->bytes_received = con->tot_data_bytes_received;
+  stats->control_bytes_received = con->tot_control_bytes_received;
+  return 0;
+}
+
+int tcpls_get_stream_stats(tcpls_t *tcpls, streamid_t streamid, tcpls_stream_stats_t *stats) {
+  tcpls_stream_t *stream = stream_get(tcpls, streamid);
+  if (!stream)
+    return -1;
+  *stats = stream->stats;
+  stats->streamid = stream->streamid;
+  stats->transportid = stream->transportid;
+  stream_sendbuf_occupancy(tcpls, stream, &stats->sendbuf_unsent, &stats->sendbuf_unacked);
+  return 0;
+}
+
 static int check_con_has_connected(tcpls_t *tcpls, connect_info_t *con, int *result) {
   socklen_t reslen = sizeof(*result);
   if (getsockopt(con->socket, SOL_SOCKET, SO_ERROR, result, &reslen) < 0) {
@@ -3175,73 +4471,175 @@ static void stream_derive_new_aead_iv(ptls_t *tls, uint8_t *iv, int iv_size, uin
   }
 }
 
+/**
+ * AEAD context of the traffic secret, with its key expanded once and shared by
+ * all the streams
+ */
+
+struct st_tcpls_stream_key_t {
+  uint8_t secret[PTLS_MAX_DIGEST_SIZE];
+  uint8_t iv[PTLS_MAX_IV_SIZE];
+  ptls_aead_context_t *aead;
+  /** nbr of stream contexts using it, plus one while it is the current one */
+  unsigned refcnt;
+};
+
+/**
+ * Lightweight AEAD context of a stream: the IV of the stream differs from the
+ * one of the shared context by iv_tweak, which is xored into the shared
+ * context around each use
+ */
+
+struct st_tcpls_stream_aead_t {
+  ptls_aead_context_t super;
+  struct st_tcpls_stream_key_t *key;
+  uint8_t iv_tweak[PTLS_MAX_IV_SIZE];
+};
+
+static void stream_key_release(struct st_tcpls_stream_key_t *key) {
+  if (key && --key->refcnt == 0) {
+    ptls_aead_free(key->aead);
+    ptls_clear_memory(key, sizeof(*key));
+    free(key);
+  }
+}
+
+/**
+ * Get the shared context of secret; only derived again when the traffic
+ * secret changed
+ */
+
+static struct st_tcpls_stream_key_t *stream_key_get(ptls_t *tls,
+    struct st_tcpls_stream_key_t **current, const uint8_t *secret, int is_enc) {
+  ptls_cipher_suite_t *cs = tls->cipher_suite;
+  uint8_t key[PTLS_MAX_SECRET_SIZE];
+  struct st_tcpls_stream_key_t *stream_key;
+  if (*current && memcmp((*current)->secret, secret, cs->hash->digest_size) == 0)
+    return *current;
+  if ((stream_key = malloc(sizeof(*stream_key))) == NULL)
+    return NULL;
+  memset(stream_key, 0, sizeof(*stream_key));
+  memcpy(stream_key->secret, secret, cs->hash->digest_size);
+  if (ptls_hkdf_expand_label(cs->hash, key, cs->aead->key_size,
+        ptls_iovec_init(secret, cs->hash->digest_size), "key",
+        ptls_iovec_init(NULL, 0), tls->ctx->hkdf_label_prefix__obsolete) != 0 ||
+      ptls_hkdf_expand_label(cs->hash, stream_key->iv, cs->aead->iv_size,
+        ptls_iovec_init(secret, cs->hash->digest_size), "iv",
+        ptls_iovec_init(NULL, 0), tls->ctx->hkdf_label_prefix__obsolete) != 0 ||
+      (stream_key->aead = ptls_aead_new_direct(cs->aead, is_enc, key, stream_key->iv)) == NULL) {
+    ptls_clear_memory(key, sizeof(key));
+    free(stream_key);
+    return NULL;
+  }
+  ptls_clear_memory(key, sizeof(key));
+  stream_key->refcnt = 1;
+  stream_key_release(*current);
+  *current = stream_key;
+  return stream_key;
+}
+
+static void stream_aead_dispose_crypto(ptls_aead_context_t *_ctx) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  stream_key_release(ctx->key);
+}
+
+static void stream_aead_xor_iv(ptls_aead_context_t *_ctx, const void *bytes, size_t len) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  for (size_t i = 0; i < len; i++)
+    ctx->iv_tweak[i] ^= ((const uint8_t *)bytes)[i];
+}
+
+static void stream_aead_encrypt_init(ptls_aead_context_t *_ctx, uint64_t seq, const void *aad, size_t aadlen) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  ptls_aead_context_t *aead = ctx->key->aead;
+  /** the tweak is removed by stream_aead_encrypt_final */
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+  aead->do_encrypt_init(aead, seq, aad, aadlen);
+}
+
+static size_t stream_aead_encrypt_update(ptls_aead_context_t *_ctx, void *output, const void *input, size_t inlen) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  return ctx->key->aead->do_encrypt_update(ctx->key->aead, output, input, inlen);
+}
+
+static size_t stream_aead_encrypt_final(ptls_aead_context_t *_ctx, void *output) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  ptls_aead_context_t *aead = ctx->key->aead;
+  size_t off = aead->do_encrypt_final(aead, output);
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+  return off;
+}
+
+static void stream_aead_encrypt(ptls_aead_context_t *_ctx, void *output, const void *input, size_t inlen, uint64_t seq,
+    const void *aad, size_t aadlen, ptls_aead_supplementary_encryption_t *supp) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  ptls_aead_context_t *aead = ctx->key->aead;
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+  aead->do_encrypt(aead, output, input, inlen, seq, aad, aadlen, supp);
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+}
+
+static size_t stream_aead_decrypt(ptls_aead_context_t *_ctx, void *output, const void *input, size_t inlen, uint64_t seq,
+    const void *aad, size_t aadlen) {
+  struct st_tcpls_stream_aead_t *ctx = (struct st_tcpls_stream_aead_t *)_ctx;
+  ptls_aead_context_t *aead = ctx->key->aead;
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+  size_t off = aead->do_decrypt(aead, output, input, inlen, seq, aad, aadlen);
+  ptls_aead_xor_iv(aead, ctx->iv_tweak, aead->algo->iv_size);
+  return off;
+}
+
+/**
+ * Context of a stream whose IV is derived from the one of key with offset
+ */
+
+static ptls_aead_context_t *stream_aead_new(ptls_t *tls, struct st_tcpls_stream_key_t *key,
+    uint32_t offset, int is_client_origin) {
+  struct st_tcpls_stream_aead_t *ctx;
+  size_t iv_size = key->aead->algo->iv_size;
+  if ((ctx = malloc(sizeof(*ctx))) == NULL)
+    return NULL;
+  *ctx = (struct st_tcpls_stream_aead_t){{key->aead->algo, 0, stream_aead_dispose_crypto,
+    stream_aead_xor_iv, stream_aead_encrypt_init, stream_aead_encrypt_update,
+    stream_aead_encrypt_final, stream_aead_encrypt, stream_aead_decrypt}, key};
+  memcpy(ctx->iv_tweak, key->iv, iv_size);
+  stream_derive_new_aead_iv(tls, ctx->iv_tweak, iv_size, offset, is_client_origin);
+  for (size_t i = 0; i < iv_size; i++)
+    ctx->iv_tweak[i] ^= key->iv[i];
+  key->refcnt++;
+  return &ctx->super;
+}
+
 /**
  * Derive new aead context for the new stream; i.e., currently use a tweak on
  * the IV but the same key
  *
+ * The key of each traffic secret is expanded once per session; the contexts
+ * of the streams share it and only hold their IV tweak, see stream_aead_new().
+ *
  * Using a different salt to derive another secret and then derive new keys/IVs
  * is another possible solution
  *
  * Note: less keys => better security
  *
  */
-static int new_stream_derive_aead_context(ptls_t *tls, tcpls_stream_t *stream, int is_client_origin) {
 
-  struct st_ptls_traffic_protection_t *ctx_enc = &tls->traffic_protection.enc;
-  struct st_ptls_traffic_protection_t *ctx_dec = &tls->traffic_protection.dec;
-  uint8_t key[PTLS_MAX_SECRET_SIZE];
-  uint8_t iv[PTLS_MAX_IV_SIZE];
-  int ret;
+static int new_stream_derive_aead_context(ptls_t *tls, tcpls_stream_t *stream, int is_client_origin) {
+  tcpls_t *tcpls = tls->tcpls;
+  struct st_tcpls_stream_key_t *key_enc, *key_dec;
 
   PTLS_DEBUGF(stderr, "New AEAD context\n");
 
-  if ((ret = ptls_hkdf_expand_label(tls->cipher_suite->hash, key,
-          tls->cipher_suite->aead->key_size, ptls_iovec_init(ctx_enc->secret,
-            tls->cipher_suite->hash->digest_size), "key", ptls_iovec_init(NULL, 0),
-          tls->ctx->hkdf_label_prefix__obsolete)) != 0)
-      return -1;
-  if ((ret = ptls_hkdf_expand_label(tls->cipher_suite->hash, iv,
-          tls->cipher_suite->aead->iv_size, ptls_iovec_init(ctx_enc->secret,
-            tls->cipher_suite->hash->digest_size), "iv", ptls_iovec_init(NULL, 0),
-          tls->ctx->hkdf_label_prefix__obsolete)) != 0)
-      return -1;
-  /** Derive enc iv */
-  stream_derive_new_aead_iv(tls, iv, tls->cipher_suite->aead->iv_size, stream->offset, is_client_origin);
-
-  stream->aead_enc = ptls_aead_new_direct(tls->cipher_suite->aead,
-      1, key, iv);
-  if (!stream->aead_enc)
+  if ((key_enc = stream_key_get(tls, &tcpls->stream_key_enc, tls->traffic_protection.enc.secret, 1)) == NULL ||
+      (key_dec = stream_key_get(tls, &tcpls->stream_key_dec, tls->traffic_protection.dec.secret, 0)) == NULL)
+    return -1;
+  if ((stream->aead_enc = stream_aead_new(tls, key_enc, stream->offset, is_client_origin)) == NULL)
     return PTLS_ERROR_NO_MEMORY;
-  stream->aead_enc->seq = 0;
-
-  if ((ret = ptls_hkdf_expand_label(tls->cipher_suite->hash, key,
-          tls->cipher_suite->aead->key_size, ptls_iovec_init(ctx_dec->secret,
-            tls->cipher_suite->hash->digest_size), "key", ptls_iovec_init(NULL, 0),
-          tls->ctx->hkdf_label_prefix__obsolete)) != 0)
-      return -1;
-  if ((ret = ptls_hkdf_expand_label(tls->cipher_suite->hash, iv,
-          tls->cipher_suite->aead->iv_size, ptls_iovec_init(ctx_dec->secret,
-            tls->cipher_suite->hash->digest_size), "iv", ptls_iovec_init(NULL, 0),
-          tls->ctx->hkdf_label_prefix__obsolete)) != 0)
-      return -1;
-  /** Derive dec iv */
-  stream_derive_new_aead_iv(tls, iv, tls->cipher_suite->aead->iv_size, stream->offset, is_client_origin);
-  stream->aead_dec = ptls_aead_new_direct(tls->cipher_suite->aead,
-    0, key, iv);
-  if (!stream->aead_dec)
+  if ((stream->aead_dec = stream_aead_new(tls, key_dec, stream->offset, is_client_origin)) == NULL) {
+    ptls_aead_free(stream->aead_enc);
+    stream->aead_enc = NULL;
     return PTLS_ERROR_NO_MEMORY;
-  stream->aead_dec->seq = 0;
-
-  PTLS_DEBUGF(stderr, "Key: ");
-  for (int i = 0; i < sizeof(key); i++) {
-    PTLS_DEBUGF(stderr, "%02x ", key[i]);
-  }
-
-  PTLS_DEBUGF(stderr, "\nIV: ");
-  for (int i = 0; i < sizeof(iv); i++) {
-    PTLS_DEBUGF(stderr, "%02x ", iv[i]);
   }
-  PTLS_DEBUGF(stderr, "\n");
   return 0;
 }
 
@@ -3252,20 +4650,27 @@ static int new_stream_derive_aead_context(ptls_t *tls, tcpls_stream_t *stream, i
  * 
  * is_ours tells whether this stream has been initiated by us (is_our = 1), or
  * initiated by the peer (STREAM_ATTACH event, is_ours = 0)
+ *
+ * The stream is stored within tcpls->streams and indexed right away; returns
+ * NULL if an error occured
  */
 
 static tcpls_stream_t *stream_new(ptls_t *tls, streamid_t streamid,
     connect_info_t *con, uint32_t offset, int is_client_origin) {
   tcpls_t *tcpls = tls->tcpls;
-  tcpls_stream_t *stream = malloc(sizeof(*stream));
-  memset(stream, 0, sizeof(tcpls_stream_t));
-  stream->streamid = streamid;
-
-  stream->transportid = con->this_transportid;
-  stream->stream_usable = 0;
-  stream->orcon_transportid = con->this_transportid;
+  tcpls_stream_t init;
+  memset(&init, 0, sizeof(tcpls_stream_t));
+  init.streamid = streamid;
+
+  init.transportid = con->this_transportid;
+  init.stream_usable = 0;
+  init.orcon_transportid = con->this_transportid;
+  tcpls_stream_t *stream = stream_insert(tcpls, &init);
+  if (!stream)
+    return NULL;
+  PTLS_PROBE(TCPLS_STREAM_ATTACH, tls, streamid, con->this_transportid);
   stream->sendbuf = malloc(sizeof(ptls_buffer_t));
-  ptls_buffer_init(stream->sendbuf, "", 0);
+  session_buffer_init(tcpls->tls->ctx, stream->sendbuf);
   stream->offset = offset;
   if (tcpls->buffer && tcpls->buffer->bufkind == STREAMBASED) {
     tcpls_stream_buffer_add(tcpls->buffer, streamid);
@@ -3290,35 +4695,97 @@ static tcpls_stream_t *stream_new(ptls_t *tls, streamid_t streamid,
 }
 
 static int count_streams_from_transportid(tcpls_t *tcpls, int transportid) {
-  tcpls_stream_t *stream;
-  int count = 0;
-  for (int i = 0; i < tcpls->streams->size; i++) {
-    stream = list_get(tcpls->streams, i);
-    if (transportid == stream->transportid)
-      count++;
-  }
-  return count;
+  connect_info_t *con = connection_get(tcpls, transportid);
+  return con ? con->nbr_streams : 0;
+}
+
+tcpls_stream_t *stream_get(tcpls_t *tcpls, streamid_t streamid) {
+  if (!tcpls->streams)
+    return NULL;
+  return slab_at(tcpls->streams, id_map_get(tcpls->streams_index, streamid));
 }
 
 /**
- * TODO: improve by adding an offset to stream id and get streams in O(1)
+ * Copy stream within tcpls->streams, index it and attach it to the connection
+ * of its transportid.
+ *
+ * returns the stream within the slab, whose address won't change until
+ * stream_remove(); or NULL if an error occured
  */
 
-tcpls_stream_t *stream_get(tcpls_t *tcpls, streamid_t streamid) {
-  if (!tcpls->streams)
+static tcpls_stream_t *stream_insert(tcpls_t *tcpls, tcpls_stream_t *stream) {
+  tcpls_stream_t *stored = slab_add(tcpls->streams, stream);
+  if (!stored)
+    return NULL;
+  if (id_map_set(tcpls->streams_index, stored->streamid, slab_handle(tcpls->streams, stored))) {
+    slab_remove(tcpls->streams, stored);
     return NULL;
-  tcpls_stream_t *stream;
-  for (int i = 0; i < tcpls->streams->size; i++) {
-    stream = list_get(tcpls->streams, i);
-    if (stream->streamid == streamid)
-      return stream;
   }
-  return NULL;
+  stream_con_link(tcpls, stored);
+  return stored;
+}
+
+static void stream_remove(tcpls_t *tcpls, tcpls_stream_t *stream) {
+  stream_con_unlink(tcpls, stream);
+  id_map_remove(tcpls->streams_index, stream->streamid);
+  int ret = slab_remove(tcpls->streams, stream);
+  assert(!ret);
+  (void)ret;
+}
+
+/**
+ * Put stream at the head of the list of streams attached to its transportid
+ */
+
+static void stream_con_link(tcpls_t *tcpls, tcpls_stream_t *stream) {
+  connect_info_t *con = connection_get(tcpls, stream->transportid);
+  if (!con)
+    return;
+  stream->next_con_stream = con->first_stream;
+  con->first_stream = stream->streamid;
+  con->nbr_streams++;
+}
+
+static void stream_con_unlink(tcpls_t *tcpls, tcpls_stream_t *stream) {
+  connect_info_t *con = connection_get(tcpls, stream->transportid);
+  if (!con)
+    return;
+  streamid_t *next = &con->first_stream;
+  while (*next && *next != stream->streamid) {
+    tcpls_stream_t *cur = stream_get(tcpls, *next);
+    if (!cur)
+      return;
+    next = &cur->next_con_stream;
+  }
+  if (!*next)
+    return;
+  *next = stream->next_con_stream;
+  stream->next_con_stream = 0;
+  con->nbr_streams--;
+}
+
+/**
+ * Account nbytes received over stream and remember it in
+ * tcpls->streams_ack_due once an ack becomes needed
+ */
+
+static void stream_count_received(tcpls_t *tcpls, tcpls_stream_t *stream, uint32_t nbytes) {
+  stream->nbr_records_since_last_ack++;
+  stream->nbr_bytes_since_last_ack += nbytes;
+  if (!stream->ack_due && is_ack_needed(tcpls, stream)) {
+    stream->ack_due = 1;
+    list_add(tcpls->streams_ack_due, &stream->streamid);
+  }
 }
 
+/**
+ * Connections are never removed from the slab, hence the handle of a
+ * connection is its transportid
+ */
+
 connect_info_t* connection_get(tcpls_t *tcpls, uint32_t transportid) {
   if (transportid < tcpls->connect_infos->size)
-    return list_get(tcpls->connect_infos, transportid);
+    return slab_at(tcpls->connect_infos, transportid);
   return NULL;
 }
 
@@ -3329,8 +4796,10 @@ static void stream_free(tcpls_stream_t *stream) {
   // XXX make a tcpls_record_free function in container.c
   if (stream->send_queue)
     tcpls_record_fifo_free(stream->send_queue);
-  /*ptls_aead_free(stream->aead_enc);*/
-  /*ptls_aead_free(stream->aead_dec);*/
+  if (stream->aead_enc)
+    ptls_aead_free(stream->aead_enc);
+  if (stream->aead_dec)
+    ptls_aead_free(stream->aead_dec);
 }
 
 /**
@@ -3339,9 +4808,9 @@ static void stream_free(tcpls_stream_t *stream) {
 
 /*static connect_info_t *get_best_con(tcpls_t *tcpls) {*/
   /*connect_info_t *con;*/
-  /*connect_info_t *con_fastest = list_get(tcpls->connect_infos, 0);*/
+  /*connect_info_t *con_fastest = slab_get(tcpls->connect_infos, 0);*/
   /*for (int i = 1; i < tcpls->connect_infos->size; i++) {*/
-    /*con = list_get(tcpls->connect_infos, i);*/
+    /*con = slab_get(tcpls->connect_infos, i);*/
     /*if (con->state == CONNECTED && (cmp_times(&con_fastest->connect_time,*/
             /*&con->connect_time) < 0 || con_fastest->state != CONNECTED))*/
       /*con_fastest = con;*/
@@ -3349,13 +4818,26 @@ static void stream_free(tcpls_stream_t *stream) {
   /*return con_fastest;*/
 /*}*/
 
-static connect_info_t *get_con_info_from_socket(tcpls_t *tcpls, int socket) {
+/**
+ * Sockets are reused by the kernel once closed; the cached transportid is
+ * checked against the connection and refreshed if it does not match anymore
+ */
+
+connect_info_t *connection_get_from_socket(tcpls_t *tcpls, int socket) {
   connect_info_t *con;
-  for (int i = 0; i < tcpls->connect_infos->size; i++) {
-    con = list_get(tcpls->connect_infos, i);
+  int transportid = id_map_get(tcpls->sockets_index, (uint32_t) socket);
+  if (transportid >= 0 && transportid < tcpls->connect_infos->size) {
+    con = slab_get(tcpls->connect_infos, transportid);
     if (con->socket == socket)
       return con;
   }
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    con = slab_get(tcpls->connect_infos, i);
+    if (con->socket == socket) {
+      id_map_set(tcpls->sockets_index, (uint32_t) socket, i);
+      return con;
+    }
+  }
   return NULL;
 }
 
@@ -3368,9 +4850,9 @@ static int get_con_info_from_addrs(tcpls_t *tcpls, tcpls_v4_addr_t *src,
 {
   connect_info_t *con;
   for (int i = 0; i < tcpls->connect_infos->size; i++) {
-    con = list_get(tcpls->connect_infos, i);
+    con = slab_get(tcpls->connect_infos, i);
     if (dest && con->dest) {
-      if (src && !memcmp(src, con->src, sizeof(*src)) && !memcmp(dest,
+      if (src && con->src && !memcmp(src, con->src, sizeof(*src)) && !memcmp(dest,
             con->dest, sizeof(*dest))) {
         *coninfo = con;
         return 0;
@@ -3381,7 +4863,7 @@ static int get_con_info_from_addrs(tcpls_t *tcpls, tcpls_v4_addr_t *src,
       }
     }
     else if (dest6 && con->dest6) {
-      if (src6 && !memcmp(src6, con->src6, sizeof(*src6)) && !memcmp(dest6,
+      if (src6 && con->src6 && !memcmp(src6, con->src6, sizeof(*src6)) && !memcmp(dest6,
             con->dest6, sizeof(*dest6))) {
         *coninfo = con;
         return 0;
@@ -3398,7 +4880,7 @@ static int get_con_info_from_addrs(tcpls_t *tcpls, tcpls_v4_addr_t *src,
 static connect_info_t * get_primary_con_info(tcpls_t *tcpls) {
   connect_info_t *con;
   for (int i = 0; i < tcpls->connect_infos->size; i++) {
-    con = list_get(tcpls->connect_infos, i);
+    con = slab_get(tcpls->connect_infos, i);
     if (con->is_primary)
       return con;
   }
@@ -3428,12 +4910,13 @@ static int cmp_times(struct timeval *t1, struct timeval *t2) {
 static void _set_primary(tcpls_t *tcpls) {
   int has_primary = 0;
   connect_info_t *con, *primary_con;
-  primary_con = list_get(tcpls->connect_infos, 0);
+  primary_con = slab_get(tcpls->connect_infos, 0);
   assert(primary_con);
   for (int i = 0; i < tcpls->connect_infos->size; i++) {
-    con = list_get(tcpls->connect_infos, i);
+    con = slab_get(tcpls->connect_infos, i);
     if (con->is_primary) {
       has_primary = 1;
+      primary_con = con;
       break;
     }
     if (cmp_times(&primary_con->connect_time, &con->connect_time) > 0)
@@ -3456,6 +4939,39 @@ static void _set_primary(tcpls_t *tcpls) {
     primary_con->dest6->is_primary = 1;
 }
 
+/**
+ * Make con the primary connection, in place of the one the addresses made
+ * primary
+ */
+
+static void connection_make_primary(tcpls_t *tcpls, connect_info_t *con) {
+  connect_info_t *other;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    other = slab_get(tcpls->connect_infos, i);
+    if (other == con || !other->is_primary)
+      continue;
+    other->is_primary = 0;
+    if (other->src)
+      other->src->is_primary = 0;
+    if (other->src6)
+      other->src6->is_primary = 0;
+    if (other->dest)
+      other->dest->is_primary = 0;
+    if (other->dest6)
+      other->dest6->is_primary = 0;
+  }
+  con->is_primary = 1;
+  if (con->src)
+    con->src->is_primary = 1;
+  if (con->src6)
+    con->src6->is_primary = 1;
+  if (con->dest)
+    con->dest->is_primary = 1;
+  if (con->dest6)
+    con->dest6->is_primary = 1;
+  tcpls->socket_primary = con->socket;
+}
+
 int is_varlen(tcpls_enum_t type) {
   switch(type) {
     case CONTROL_VARLEN_BEGIN:
@@ -3477,16 +4993,60 @@ void ptls_tcpls_options_free(tcpls_t *tcpls) {
     }
     free(option->data);
   }
-  list_free(tcpls->tcpls_options);
-  tcpls->tcpls_options = NULL;
+  list_dispose(tcpls->tcpls_options);
+}
+
+static void connection_epoll_add(tcpls_t *tcpls, connect_info_t *con) {
+  if (tcpls->epoll_fd < 0 || !con)
+    return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = con->socket;
+  if (epoll_ctl(tcpls->epoll_fd, EPOLL_CTL_ADD, con->socket, &ev) < 0 && errno != EEXIST)
+    perror("epoll_ctl(EPOLL_CTL_ADD) failed");
+}
+
+/**
+ * Also watch con's socket for writability in the epoll instance we own, or
+ * stop doing so. A shared instance is left alone: its sockets are handed to
+ * tcpls_receive_ready() as readable.
+ */
+
+static void connection_epoll_watch(tcpls_t *tcpls, connect_info_t *con, int want_write) {
+  if (!tcpls->epoll_owned || !con || con->socket <= 0)
+    return;
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = want_write ? EPOLLIN|EPOLLOUT : EPOLLIN;
+  ev.data.fd = con->socket;
+  if (epoll_ctl(tcpls->epoll_fd, EPOLL_CTL_MOD, con->socket, &ev) < 0 && errno == ENOENT)
+    epoll_ctl(tcpls->epoll_fd, EPOLL_CTL_ADD, con->socket, &ev);
 }
 
-static void free_heap_key_value(void *key, void *val) {
-  free(key);
-  free(val);
+/**
+ * con has bytes waiting for its socket to become writable
+ */
+
+static void connection_want_write(tcpls_t *tcpls, connect_info_t *con) {
+  if (tcpls->failover)
+    tcpls->failover->wants_write = con->socket;
+  connection_epoll_watch(tcpls, con, 1);
+  if (tcpls->tls->ctx->connection_event_cb)
+    tcpls->tls->ctx->connection_event_cb(tcpls, CONN_WANTS_WRITE, con->socket, con->this_transportid,
+        tcpls->tls->ctx->cb_data);
+}
+
+static void connection_epoll_del(tcpls_t *tcpls, connect_info_t *con) {
+  if (tcpls->epoll_fd < 0)
+    return;
+  /** the socket may already have been closed, which unregistered it */
+  epoll_ctl(tcpls->epoll_fd, EPOLL_CTL_DEL, con->socket, NULL);
 }
 
 static void connection_fail(tcpls_t *tcpls, connect_info_t *con) {
+  PTLS_PROBE(TCPLS_CONN_FAIL, tcpls->tls, con->this_transportid);
+  connection_epoll_del(tcpls, con);
   con->state = FAILED;
   if (tcpls->tls->ctx->connection_event_cb)
     tcpls->tls->ctx->connection_event_cb(tcpls, CONN_FAILED, con->socket, con->this_transportid,
@@ -3497,6 +5057,7 @@ static void connection_fail(tcpls_t *tcpls, connect_info_t *con) {
 }
 
 static void connection_close(tcpls_t *tcpls, connect_info_t *con) {
+  connection_epoll_del(tcpls, con);
   con->state = CLOSED;
   close(con->socket);
   if (tcpls->tls->ctx->connection_event_cb)
@@ -3511,24 +5072,29 @@ static void connection_close(tcpls_t *tcpls, connect_info_t *con) {
 void tcpls_free(tcpls_t *tcpls) {
   if (!tcpls)
     return;
+  if (tcpls->epoll_owned)
+    close(tcpls->epoll_fd);
+  failover_free(tcpls);
+  connector_free(tcpls);
   ptls_buffer_dispose(tcpls->sendbuf);
-  ptls_buffer_dispose(tcpls->rec_reordering);
-  free(tcpls->sendbuf);
+  ptls_buffer_dispose(tcpls->buffrag);
   free(tcpls->recvbuf);
-  free(tcpls->rec_reordering);
-  heap_foreach(tcpls->priority_q, &free_heap_key_value);
-  heap_destroy(tcpls->priority_q);
-  heap_foreach(tcpls->gap_rec_reordering, &free_heap_key_value);
-  heap_destroy(tcpls->gap_rec_reordering);
-  free(tcpls->priority_q);
+  tcpls_reorder_window_free(tcpls->reorder_window);
+  tcpls_held_records_free(tcpls->reorder_held);
   tcpls_stream_t *stream;
   for (int i = 0; i < tcpls->streams->size; i++) {
-    stream = list_get(tcpls->streams, i);
+    stream = slab_get(tcpls->streams, i);
     stream_free(stream);
   }
-  list_free(tcpls->streams);
-  list_free(tcpls->connect_infos);
-  list_free(tcpls->cookies);
+  slab_dispose(tcpls->streams);
+  id_map_dispose(tcpls->streams_index);
+  list_dispose(tcpls->streams_ack_due);
+  list_dispose(tcpls->streams_attach_pending);
+  stream_key_release(tcpls->stream_key_enc);
+  stream_key_release(tcpls->stream_key_dec);
+  slab_dispose(tcpls->connect_infos);
+  id_map_dispose(tcpls->sockets_index);
+  list_dispose(tcpls->cookies);
   ptls_tcpls_options_free(tcpls);
 #define FREE_ADDR_LLIST(current, next) do {              \
   if (!next) {                                           \
@@ -3564,5 +5130,6 @@ if (tcpls->ours_v6_addr_llist) {
 }
 #undef FREE_ADDR_LLIST
 ptls_free(tcpls->tls);
+/** tcpls is the first member of its st_tcpls_session_t */
 free(tcpls);
 }
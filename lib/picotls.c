@@ -198,11 +198,67 @@ uint64_t ntoh64(const uint8_t *src)
 }
 #endif
 
+/**
+ * Blocks freed by the pooled buffers of this thread, by capacity
+ */
+static PTLS_THREADLOCAL struct {
+    size_t count[PTLS_BUFFER_POOL_NBR_CLASSES];
+    uint8_t *blocks[PTLS_BUFFER_POOL_NBR_CLASSES][PTLS_BUFFER_POOL_MAX_BLOCKS];
+} thread_buffer_pool;
+
+/**
+ * returns the class of the blocks of exactly capacity bytes, or -1 if the pool does not keep them
+ */
+static int thread_pool_class(size_t capacity)
+{
+    for (int class = 0; class < PTLS_BUFFER_POOL_NBR_CLASSES; ++class) {
+        if (capacity == (size_t)1 << (PTLS_BUFFER_POOL_MIN_CLASS + class))
+            return class;
+    }
+    return -1;
+}
+
+static uint8_t *thread_pool_alloc(size_t capacity)
+{
+    int class = thread_pool_class(capacity);
+    if (class >= 0 && thread_buffer_pool.count[class] != 0)
+        return thread_buffer_pool.blocks[class][--thread_buffer_pool.count[class]];
+    return malloc(capacity);
+}
+
+static void thread_pool_release(uint8_t *p, size_t capacity)
+{
+    int class = thread_pool_class(capacity);
+    if (class >= 0 && thread_buffer_pool.count[class] < PTLS_BUFFER_POOL_MAX_BLOCKS) {
+        thread_buffer_pool.blocks[class][thread_buffer_pool.count[class]++] = p;
+    } else {
+        free(p);
+    }
+}
+
+void ptls_buffer_init_pooled(ptls_buffer_t *buf)
+{
+    ptls_buffer_init(buf, "", 0);
+    buf->is_allocated = PTLS_BUFFER_POOLED;
+}
+
+void ptls_buffer_pool_trim(void)
+{
+    for (int class = 0; class < PTLS_BUFFER_POOL_NBR_CLASSES; ++class) {
+        while (thread_buffer_pool.count[class] != 0)
+            free(thread_buffer_pool.blocks[class][--thread_buffer_pool.count[class]]);
+    }
+}
+
 void ptls_buffer__release_memory(ptls_buffer_t *buf)
 {
     ptls_clear_memory(buf->base, buf->off);
-    if (buf->is_allocated)
+    if (buf->is_allocated == PTLS_BUFFER_POOLED) {
+        if (buf->capacity != 0)
+            thread_pool_release(buf->base, buf->capacity);
+    } else if (buf->is_allocated) {
         free(buf->base);
+    }
 }
 
 int ptls_buffer_reserve(ptls_buffer_t *buf, size_t delta)
@@ -212,19 +268,20 @@ int ptls_buffer_reserve(ptls_buffer_t *buf, size_t delta)
 
     if (PTLS_MEMORY_DEBUG || buf->capacity < buf->off + delta) {
         uint8_t *newp;
+        int pooled = buf->is_allocated == PTLS_BUFFER_POOLED;
         size_t new_capacity = buf->capacity;
         if (new_capacity < 1024)
             new_capacity = 1024;
         while (new_capacity < buf->off + delta) {
             new_capacity *= 2;
         }
-        if ((newp = malloc(new_capacity)) == NULL)
+        if ((newp = pooled ? thread_pool_alloc(new_capacity) : malloc(new_capacity)) == NULL)
             return PTLS_ERROR_NO_MEMORY;
         memcpy(newp, buf->base, buf->off);
         ptls_buffer__release_memory(buf);
         buf->base = newp;
         buf->capacity = new_capacity;
-        buf->is_allocated = 1;
+        buf->is_allocated = pooled ? PTLS_BUFFER_POOLED : 1;
     }
 
     return 0;
@@ -299,14 +356,17 @@ Exit:
 #if PTLS_FUZZ_HANDSHAKE
 
 static size_t aead_encrypt(ptls_aead_context_t *ctx, void *output, const void
-    *input, size_t inlen, const void *tcpls_header, size_t header_size, uint8_t content_type)
+    *input, size_t inlen, const void *tcpls_header, size_t header_size, uint8_t content_type,
+    const uint8_t *stream_hint)
 {
-    memcpy(output, input, inlen);
-    memcpy(output + inlen, &content_type, 1);
+    if (output != input)
+        memmove(output, input, inlen);
+    memcpy((uint8_t *)output + inlen, &content_type, 1);
     return inlen + 1 + 16;
 }
 
-static int aead_decrypt(ptls_aead_context_t *ctx, void *output, size_t *outlen, const void *input, size_t inlen)
+static int aead_decrypt(ptls_aead_context_t *ctx, void *output, size_t *outlen, const void *input, size_t inlen,
+    const uint8_t *stream_hint)
 {
     if (inlen < 16) {
         return PTLS_ALERT_BAD_RECORD_MAC;
@@ -327,32 +387,54 @@ static void build_aad(uint8_t aad[5], size_t reclen)
     aad[4] = (uint8_t)reclen;
 }
 
+/**
+ * The stream hint, if any, sits between the record header and the ciphertext;
+ * it is accounted in the record length and authenticated as part of the AAD
+ */
+static size_t build_aad_with_stream_hint(uint8_t aad[5 + TCPLS_STREAM_HINT_SIZE], size_t reclen, const uint8_t *stream_hint)
+{
+    if (stream_hint == NULL) {
+        build_aad(aad, reclen);
+        return 5;
+    }
+    build_aad(aad, reclen + TCPLS_STREAM_HINT_SIZE);
+    memcpy(aad + 5, stream_hint, TCPLS_STREAM_HINT_SIZE);
+    return 5 + TCPLS_STREAM_HINT_SIZE;
+}
+
+/**
+ * The inner plaintext (payload, TCPLS header, content type) is laid out
+ * contiguously in output then encrypted in place with a single call to the
+ * one-shot interface, which every AEAD backend implements (including fusion,
+ * that has no incremental mode).
+ */
 static size_t aead_encrypt(ptls_aead_context_t *aead, void
-    *output, const void *input, size_t inlen, const void *tcpls_header, size_t header_size, uint8_t content_type)
+    *output, const void *input, size_t inlen, const void *tcpls_header, size_t header_size, uint8_t content_type,
+    const uint8_t *stream_hint)
 {
-    size_t off = 0;
-    int aad_length = 5;
+    uint8_t *inner = output;
+    size_t inner_len = inlen;
+    uint8_t aad[5 + TCPLS_STREAM_HINT_SIZE];
+    size_t aad_length = build_aad_with_stream_hint(aad, inlen + 1 + aead->algo->tag_size + header_size, stream_hint);
 
-    uint8_t aad[aad_length];
-    build_aad(aad, inlen + 1 + aead->algo->tag_size + header_size);
-    ptls_aead_encrypt_init(aead, aead->seq++, aad, sizeof(aad));
-    off += ptls_aead_encrypt_update(aead, ((uint8_t *)output) + off, input, inlen);
+    if (inner != input)
+        memmove(inner, input, inlen);
     if (header_size > 0) {
-      off += ptls_aead_encrypt_update(aead, ((uint8_t *)output) + off, tcpls_header, header_size);
+      memcpy(inner + inner_len, tcpls_header, header_size);
+      inner_len += header_size;
     }
-    off += ptls_aead_encrypt_update(aead, ((uint8_t *)output) + off, &content_type, 1);
-    off += ptls_aead_encrypt_final(aead, ((uint8_t *)output) + off);
+    inner[inner_len++] = content_type;
 
-    return off;
+    return ptls_aead_encrypt(aead, inner, inner, inner_len, aead->seq++, aad, aad_length);
 }
 
 static int aead_decrypt(ptls_aead_context_t *ctx,
-    void *output, size_t *outlen, const void *input, size_t inlen)
+    void *output, size_t *outlen, const void *input, size_t inlen, const uint8_t *stream_hint)
 {
-    uint8_t aad[5];
+    uint8_t aad[5 + TCPLS_STREAM_HINT_SIZE];
+    size_t aad_length = build_aad_with_stream_hint(aad, inlen, stream_hint);
 
-    build_aad(aad, inlen);
-    if ((*outlen = ptls_aead_decrypt(ctx, output, input, inlen, ctx->seq, aad, sizeof(aad))) == SIZE_MAX)
+    if ((*outlen = ptls_aead_decrypt(ctx, output, input, inlen, ctx->seq, aad, aad_length)) == SIZE_MAX)
         return PTLS_ALERT_BAD_RECORD_MAC;
     ++ctx->seq;
     return 0;
@@ -360,13 +442,47 @@ static int aead_decrypt(ptls_aead_context_t *ctx,
 
 #endif /* #if PTLS_FUZZ_HANDSHAKE */
 
-//XXX FIXME function signature
-int buffer_push_encrypted_records(ptls_t *tls, streamid_t streamid, ptls_buffer_t *buf, uint8_t type, tcpls_enum_t tcpls_message,
-    const uint8_t *src, size_t len, ptls_aead_context_t *ctx)
+/**
+ * Records protected by the application traffic keys carry a stream hint once
+ * both peers agreed on it during the handshake
+ */
+static int has_stream_hint(ptls_t *tls, struct st_ptls_traffic_protection_t *tp)
+{
+    return tls->tcpls != NULL && tls->tcpls->stream_hint_confirmed && tp->epoch == 3;
+}
+
+/**
+ * Encrypts the concatenation of the iovecs into records. The payload of each
+ * record is gathered from the iovecs right where it gets encrypted in buf, and
+ * buf is grown once for all the records. If align is set, a record never
+ * spans two iovecs: each iovec starts a new record.
+ */
+int buffer_push_encrypted_records_vec(ptls_t *tls, streamid_t streamid, ptls_buffer_t *buf, uint8_t type, tcpls_enum_t tcpls_message,
+    const ptls_iovec_t *iov, size_t iovcnt, int align, ptls_aead_context_t *ctx)
 {
     int ret = 0;
     int tcpls_header_size = get_tcpls_header_size(tls->tcpls, type, tcpls_message);
     uint8_t tcpls_header[tcpls_header_size];
+    uint8_t stream_hint[TCPLS_STREAM_HINT_SIZE];
+    size_t hint_size = 0;
+    if (has_stream_hint(tls, &tls->traffic_protection.enc)) {
+        stream_hint[0] = (uint8_t)(streamid >> 24);
+        stream_hint[1] = (uint8_t)(streamid >> 16);
+        stream_hint[2] = (uint8_t)(streamid >> 8);
+        stream_hint[3] = (uint8_t)streamid;
+        hint_size = TCPLS_STREAM_HINT_SIZE;
+    }
+    size_t max_chunk_size = PTLS_MAX_PLAINTEXT_RECORD_SIZE - tcpls_header_size;
+    size_t len = 0, nrecords = 0, vecidx = 0, vecoff = 0;
+    for (size_t i = 0; i != iovcnt; ++i) {
+        len += iov[i].len;
+        if (align)
+            nrecords += (iov[i].len + max_chunk_size - 1) / max_chunk_size;
+    }
+    if (!align)
+        nrecords = (len + max_chunk_size - 1) / max_chunk_size;
+    if ((ret = ptls_buffer_reserve(buf, len + nrecords * (5 + hint_size + ctx->algo->tag_size + tcpls_header_size + 1))) != 0)
+        goto Exit;
     while (len != 0) {
         /** XXX refactor to a function to format the tcpls header */
         size_t chunk_size = len;
@@ -381,13 +497,45 @@ int buffer_push_encrypted_records(ptls_t *tls, streamid_t streamid, ptls_buffer_
         else if (tcpls_header_size > 0)
           memcpy(tcpls_header, &tcpls_message, tcpls_header_size);
 
-        if (chunk_size > PTLS_MAX_PLAINTEXT_RECORD_SIZE-tcpls_header_size)
-            chunk_size = PTLS_MAX_PLAINTEXT_RECORD_SIZE-tcpls_header_size;
+        if (chunk_size > max_chunk_size)
+            chunk_size = max_chunk_size;
+        if (align) {
+            while (vecoff == iov[vecidx].len) {
+                ++vecidx;
+                vecoff = 0;
+            }
+            if (chunk_size > iov[vecidx].len - vecoff)
+                chunk_size = iov[vecidx].len - vecoff;
+        }
         buffer_push_record(buf, PTLS_CONTENT_TYPE_APPDATA, {
-            if ((ret = ptls_buffer_reserve(buf, chunk_size + ctx->algo->tag_size + tcpls_header_size + 1)) != 0)
+            if ((ret = ptls_buffer_reserve(buf, hint_size + chunk_size + ctx->algo->tag_size + tcpls_header_size + 1)) != 0)
                 goto Exit;
-            buf->off += aead_encrypt(ctx, buf->base + buf->off, src, chunk_size,
-                tcpls_header, tcpls_header_size, type);
+            if (hint_size) {
+                memcpy(buf->base + buf->off, stream_hint, hint_size);
+                buf->off += hint_size;
+            }
+            uint8_t *payload = buf->base + buf->off;
+            for (size_t filled = 0; filled != chunk_size;) {
+                if (vecoff == iov[vecidx].len) {
+                    ++vecidx;
+                    vecoff = 0;
+                    continue;
+                }
+                size_t n = iov[vecidx].len - vecoff;
+                if (n > chunk_size - filled)
+                    n = chunk_size - filled;
+                memcpy(payload + filled, iov[vecidx].base + vecoff, n);
+                filled += n;
+                vecoff += n;
+            }
+            buf->off += aead_encrypt(ctx, payload, payload, chunk_size,
+                tcpls_header, tcpls_header_size, type, hint_size ? stream_hint : NULL);
+            if (type == PTLS_CONTENT_TYPE_TCPLS_DATA) {
+                PTLS_PROBE(TCPLS_RECORD_ENCRYPT, tls, streamid,
+                           tls->tcpls->sending_con ? tls->tcpls->sending_con->this_transportid : UINT32_MAX, ctx->seq - 1,
+                           chunk_size);
+                tcpls_stats_record_sent(tls->tcpls, chunk_size);
+            }
 
             /**
              * tcpls message sent during the handshake are not sent over a
@@ -399,12 +547,11 @@ int buffer_push_encrypted_records(ptls_t *tls, streamid_t streamid, ptls_buffer_
                 !is_handshake_tcpls_message(tcpls_message)) {
               // push seq and record size
               queue_ret_t ret = tcpls_record_queue_push(tls->tcpls->sending_stream->send_queue,
-                  (uint32_t) ctx->seq-1, chunk_size+ctx->algo->tag_size+tcpls_header_size+1+5);
+                  (uint32_t) ctx->seq-1, hint_size+chunk_size+ctx->algo->tag_size+tcpls_header_size+1+5);
               if (ret == MEMORY_FULL)
                 return PTLS_ERROR_NO_MEMORY;
             }
         });
-        src += chunk_size;
         len -= chunk_size;
     }
 
@@ -412,6 +559,14 @@ Exit:
     return ret;
 }
 
+//XXX FIXME function signature
+int buffer_push_encrypted_records(ptls_t *tls, streamid_t streamid, ptls_buffer_t *buf, uint8_t type, tcpls_enum_t tcpls_message,
+    const uint8_t *src, size_t len, ptls_aead_context_t *ctx)
+{
+    ptls_iovec_t vec = ptls_iovec_init(src, len);
+    return buffer_push_encrypted_records_vec(tls, streamid, buf, type, tcpls_message, &vec, 1, 0, ctx);
+}
+
 int buffer_encrypt_record(ptls_t *tls, ptls_buffer_t *buf, size_t rec_start,
     ptls_aead_context_t *aead)
 {
@@ -419,14 +574,22 @@ int buffer_encrypt_record(ptls_t *tls, ptls_buffer_t *buf, size_t rec_start,
     uint8_t *tmpbuf, type = buf->base[rec_start];
     int ret;
     int offset = 5;
+    /* records not bound to a stream use the hint of the default context */
+    static const uint8_t default_stream_hint[TCPLS_STREAM_HINT_SIZE] = {0};
+    size_t hint_size = has_stream_hint(tls, &tls->traffic_protection.enc) ? TCPLS_STREAM_HINT_SIZE : 0;
     /* fast path: do in-place encryption if only one record needs to be emitted */
     if (bodylen <= PTLS_MAX_PLAINTEXT_RECORD_SIZE) {
-        size_t overhead = 1 + aead->algo->tag_size;
+        size_t overhead = hint_size + 1 + aead->algo->tag_size;
         if ((ret = ptls_buffer_reserve(buf, overhead)) != 0)
             return ret;
-        size_t encrypted_len = aead_encrypt(aead,
-            buf->base + rec_start + offset,
-            buf->base + rec_start + offset, bodylen, "", 0, type);
+        if (hint_size) {
+            memmove(buf->base + rec_start + offset + hint_size, buf->base + rec_start + offset, bodylen);
+            memcpy(buf->base + rec_start + offset, default_stream_hint, hint_size);
+        }
+        size_t encrypted_len = hint_size + aead_encrypt(aead,
+            buf->base + rec_start + offset + hint_size,
+            buf->base + rec_start + offset + hint_size, bodylen, "", 0, type,
+            hint_size ? default_stream_hint : NULL);
         assert(encrypted_len == bodylen + overhead);
         buf->off += overhead;
         buf->base[rec_start] = PTLS_CONTENT_TYPE_APPDATA;
@@ -1783,6 +1946,8 @@ static int send_client_hello(ptls_t *tls, ptls_message_emitter_t *emitter, ptls_
               // Not cool for fingerprintability, not sending the list of
               // supported TCP options in clear =/ 
               buffer_push_extension(sendbuf, PTLS_EXTENSION_TYPE_ENCRYPTED_TCP_OPTIONS, {});
+              if (tls->ctx->tcpls_stream_hint)
+                buffer_push_extension(sendbuf, PTLS_EXTENSION_TYPE_TCPLS_STREAM_HINT, {});
             }
 
             if (properties != NULL && properties->client.negotiated_protocols.count != 0) {
@@ -2229,6 +2394,13 @@ static int client_handle_encrypted_extensions(ptls_t *tls, ptls_iovec_t message,
             }
             break;
         //TCPLS
+        case PTLS_EXTENSION_TYPE_TCPLS_STREAM_HINT:
+            if (!(tls->ctx->tcpls_stream_hint && tls->tcpls)) {
+              ret = PTLS_ALERT_ILLEGAL_PARAMETER;
+              goto Exit;
+            }
+            tls->tcpls->stream_hint_confirmed = 1;
+            break;
         case PTLS_EXTENSION_TYPE_ENCRYPTED_TCP_OPTIONS_USERTIMEOUT:
             if (end-src != sizeof(uint16_t)) {
               ret = PTLS_ALERT_ILLEGAL_PARAMETER;
@@ -3062,6 +3234,11 @@ static int decode_client_hello(ptls_t *tls, struct st_ptls_client_hello_t *ch,
               tls->tcpls->tcpls_options_confirmed = 1;
             }
             break;
+        case PTLS_EXTENSION_TYPE_TCPLS_STREAM_HINT:
+            if (tls->ctx->support_tcpls_options && tls->ctx->tcpls_stream_hint && tls->tcpls) {
+              tls->tcpls->stream_hint_confirmed = 1;
+            }
+            break;
         case PTLS_EXTENSION_TYPE_SERVER_NAME:
             if ((ret = client_hello_decode_server_name(&ch->server_name, &src, end)) != 0)
                 goto Exit;
@@ -3878,6 +4055,8 @@ static int server_handle_hello(ptls_t *tls, ptls_message_emitter_t *emitter, ptl
             /** Push encrypted TCP options if we have some */
             // TCPLS
             if (tls->ctx->support_tcpls_options && tls->tcpls) {
+              if (tls->tcpls->stream_hint_confirmed)
+                buffer_push_extension(sendbuf, PTLS_EXTENSION_TYPE_TCPLS_STREAM_HINT, {});
               /** Push connid */
               buffer_push_extension(sendbuf, PTLS_EXTENSION_TYPE_ENCRYPTED_CONNID, {
                   ptls_buffer_push_block(sendbuf, 2, {
@@ -4126,7 +4305,10 @@ static int parse_record(ptls_t *tls, ptls_buffer_t *conbuf, struct st_ptls_recor
     *rec = (struct st_ptls_record_t){0};
 
     if (buffrag->base == NULL) {
+        int pooled = buffrag->is_allocated == PTLS_BUFFER_POOLED;
         ptls_buffer_init(buffrag, "", 0);
+        if (pooled)
+            buffrag->is_allocated = PTLS_BUFFER_POOLED;
         if ((ret = ptls_buffer_reserve(buffrag, offset)) != 0)
             return ret;
     }
@@ -4614,13 +4796,31 @@ static int handle_input(ptls_t *tls, ptls_message_emitter_t *emitter,
     }
     if (tls->traffic_protection.dec.aead != NULL && rec.type != PTLS_CONTENT_TYPE_ALERT) {
         size_t decrypted_length;
+        ptls_aead_context_t *aead = tls->traffic_protection.dec.aead;
+        const uint8_t *stream_hint = NULL;
         /** For middlebox compatibility */
         if (rec.type != PTLS_CONTENT_TYPE_APPDATA)
             return PTLS_ALERT_HANDSHAKE_FAILURE;
+        /** The stream hint tells us which context to use; no need to guess */
+        if (has_stream_hint(tls, &tls->traffic_protection.dec)) {
+            if (rec.length < TCPLS_STREAM_HINT_SIZE)
+                return PTLS_ALERT_DECODE_ERROR;
+            stream_hint = rec.fragment;
+            if ((ret = tcpls_stream_hint_demux(tls->tcpls, ntoh32(stream_hint), &aead, &decryptbuf)) != 0)
+                return ret;
+            rec.fragment += TCPLS_STREAM_HINT_SIZE;
+            rec.length -= TCPLS_STREAM_HINT_SIZE;
+        }
+        /** decrypt straight into the reassembly window, if any */
+        if (tls->tcpls) {
+            ptls_buffer_t *slotbuf = tcpls_reassembly_decryptbuf(tls->tcpls);
+            if (slotbuf != NULL)
+                decryptbuf = slotbuf;
+        }
         if ((ret = ptls_buffer_reserve(decryptbuf, offset + rec.length)) != 0)
             return ret;
-        if ((ret = aead_decrypt(tls->traffic_protection.dec.aead, decryptbuf->base +
-                decryptbuf->off, &decrypted_length, rec.fragment, rec.length))
+        if ((ret = aead_decrypt(aead, decryptbuf->base +
+                decryptbuf->off, &decrypted_length, rec.fragment, rec.length, stream_hint))
             != 0) {
             if (tls->is_server && tls->server.early_data_skipped_bytes != UINT32_MAX)
                 goto ServerSkipEarlyData;
@@ -4794,8 +4994,8 @@ int ptls_handshake(ptls_t *tls, ptls_buffer_t *_sendbuf, const void *input,
     return ret;
 }
 
-int ptls_receive(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t
-    *buffrag, const void *_input, size_t *inlen)
+static int receive_records(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t *buffrag, const void *_input, size_t *inlen,
+                           int stop_on_appdata)
 {
     const uint8_t *input = (const uint8_t *)_input, *const end = input + *inlen;
     size_t decryptbuf_orig_size = decryptbuf->off;
@@ -4803,8 +5003,8 @@ int ptls_receive(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t
 
     assert(tls->state >= PTLS_STATE_SERVER_EXPECT_END_OF_EARLY_DATA);
 
-    /* loop until we decrypt some application data (or an error) */
-    while (ret == 0 && input != end && decryptbuf_orig_size == decryptbuf->off) {
+    /* loop until we decrypt some application data if asked to, or all the input (or an error) */
+    while (ret == 0 && input != end && !(stop_on_appdata && decryptbuf_orig_size != decryptbuf->off)) {
         size_t consumed = end - input;
         ret = handle_input(tls, NULL, decryptbuf, buffrag, input, &consumed, NULL);
         if (ret != PTLS_ALERT_BAD_RECORD_MAC)
@@ -4832,6 +5032,17 @@ int ptls_receive(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t
     return ret;
 }
 
+int ptls_receive(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t
+    *buffrag, const void *_input, size_t *inlen)
+{
+    return receive_records(tls, decryptbuf, buffrag, _input, inlen, 1);
+}
+
+int ptls_receive_batch(ptls_t *tls, ptls_buffer_t *decryptbuf, ptls_buffer_t *buffrag, const void *_input, size_t *inlen)
+{
+    return receive_records(tls, decryptbuf, buffrag, _input, inlen, 0);
+}
+
 int update_send_key(ptls_t *tls, ptls_buffer_t *_sendbuf, int request_update)
 {
     struct st_ptls_record_message_emitter_t emitter;
@@ -4853,6 +5064,12 @@ Exit:
 }
 
 int ptls_send(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, const void *input, size_t inlen)
+{
+    ptls_iovec_t vec = ptls_iovec_init(input, inlen);
+    return ptls_sendv(tls, streamid, sendbuf, &vec, 1, 0);
+}
+
+int ptls_sendv(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, const ptls_iovec_t *iov, size_t iovcnt, int align)
 {
     assert(tls->traffic_protection.enc.aead != NULL);
 
@@ -4875,12 +5092,12 @@ int ptls_send(ptls_t *tls, streamid_t streamid, ptls_buffer_t *sendbuf, const vo
         tls->key_update_send_request = 0;
     }
     if (tls->tcpls && tls->tcpls->tcpls_options_confirmed) {
-      return buffer_push_encrypted_records(tls, streamid, sendbuf, PTLS_CONTENT_TYPE_TCPLS_DATA, NONE,
-          input, inlen, tls->traffic_protection.enc.aead);
+      return buffer_push_encrypted_records_vec(tls, streamid, sendbuf, PTLS_CONTENT_TYPE_TCPLS_DATA, NONE,
+          iov, iovcnt, align, tls->traffic_protection.enc.aead);
     }
     else {
-      return buffer_push_encrypted_records(tls, streamid, sendbuf, PTLS_CONTENT_TYPE_APPDATA, NONE,
-          input, inlen, tls->traffic_protection.enc.aead);
+      return buffer_push_encrypted_records_vec(tls, streamid, sendbuf, PTLS_CONTENT_TYPE_APPDATA, NONE,
+          iov, iovcnt, align, tls->traffic_protection.enc.aead);
     }
 }
 
@@ -4896,6 +5113,8 @@ int ptls_update_key(ptls_t *tls, int request_update)
 
 size_t ptls_get_record_overhead(ptls_t *tls)
 {
+    if (has_stream_hint(tls, &tls->traffic_protection.enc))
+        return 6 + TCPLS_STREAM_HINT_SIZE + tls->traffic_protection.enc.aead->algo->tag_size;
     return 6 + tls->traffic_protection.enc.aead->algo->tag_size;
 }
 
@@ -5,10 +5,13 @@
  * receiver can set to process bytes from the different connections
  */
 
+#include <errno.h>
 #include "rsched.h"
 
 /**
- * Simply call recv once on every available socket.
+ * Simply call recv once on every available socket. Every scheduler stops
+ * reading as soon as a reassembly buffer is full, and returns
+ * TCPLS_HOLD_DATA_TO_CONSUME.
  *
  * data is whatever data structure the application may want to remember and use
  * 
@@ -27,11 +30,265 @@ int round_robin_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t
     if (FD_ISSET(con->socket, rset) && con->state >= CONNECTED) {
       ret = recv(con->socket, tcpls->recvbuf, tcpls->recvbuflen, 0);
       ret = tcpls_internal_data_process(tcpls, con, ret, buf);
-      if (ret < 0)
+      if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
         return ret;
-      else if (rret == TCPLS_OK && rret > TCPLS_OK)
+      else if (rret == TCPLS_OK && ret > TCPLS_OK)
         rret = ret;
     }
   }
   return rret;
 }
+
+/**
+ * Same as round_robin_con_scheduler, but only visits the sockets that epoll
+ * reported ready.
+ *
+ * returns TCPLS_OK, TCPLS_HOLD_DATA_TO_READ or
+ * TCPLS_HOLD_OUT_OF_ORDER_DATA_TO_READ.
+ * or -1 upon error
+ */
+
+int round_robin_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *buf, void *data) {
+  connect_info_t *con;
+  int rret = 0;
+  for (int i = 0; i < nready; i++) {
+    int ret;
+    con = connection_get_from_socket(tcpls, ready_socks[i]);
+    /** may belong to another session sharing the epoll instance */
+    if (!con || con->state < CONNECTED)
+      continue;
+    ret = recv(con->socket, tcpls->recvbuf, tcpls->recvbuflen, 0);
+    ret = tcpls_internal_data_process(tcpls, con, ret, buf);
+    if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+      return ret;
+    else if (rret == TCPLS_OK && ret > TCPLS_OK)
+      rret = ret;
+  }
+  return rret;
+}
+
+/**
+ * recv() at most len bytes from con without blocking, and process them.
+ *
+ * *nbytes is set to the number of bytes read; 0 if there was nothing left to
+ * read, or if the connection went down
+ */
+
+static int recv_and_process(tcpls_t *tcpls, connect_info_t *con, size_t len,
+    tcpls_buffer_t *buf, size_t *nbytes) {
+  int ret = recv(con->socket, tcpls->recvbuf, len, MSG_DONTWAIT);
+  *nbytes = ret > 0 ? ret : 0;
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return TCPLS_OK;
+  return tcpls_internal_data_process(tcpls, con, ret, buf);
+}
+
+/**
+ * Read and process what con holds, until the socket has nothing left or budget
+ * bytes have been read. A short read tells us the socket is drained; we do not
+ * wait for EAGAIN to stop.
+ *
+ * returns TCPLS_OK, TCPLS_HOLD_DATA_TO_READ if the budget ran out first, or -1
+ * upon error
+ */
+
+static int drain_con(tcpls_t *tcpls, uint32_t transportid, size_t budget,
+    tcpls_buffer_t *buf, size_t *drained) {
+  connect_info_t *con = connection_get(tcpls, transportid);
+  size_t len, nbytes;
+  int ret;
+  *drained = 0;
+  do {
+    len = budget - *drained;
+    if (len > tcpls->recvbuflen)
+      len = tcpls->recvbuflen;
+    ret = recv_and_process(tcpls, con, len, buf, &nbytes);
+    *drained += nbytes;
+    if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+      return ret;
+    /** con may have moved if a connection got added */
+    con = connection_get(tcpls, transportid);
+  } while (nbytes == len && *drained < budget && con->state >= CONNECTED);
+  if (nbytes == len && con->state >= CONNECTED)
+    return TCPLS_HOLD_DATA_TO_READ;
+  return TCPLS_OK;
+}
+
+/** transportids of the readable connections */
+
+static int readable_from_rset(tcpls_t *tcpls, fd_set *rset, uint32_t *transportids) {
+  int n = 0;
+  for (int i = 0; i < tcpls->connect_infos->size; i++) {
+    connect_info_t *con = connection_get(tcpls, i);
+    if (FD_ISSET(con->socket, rset) && con->state >= CONNECTED)
+      transportids[n++] = i;
+  }
+  return n;
+}
+
+static int readable_from_ready(tcpls_t *tcpls, const int *ready_socks, int nready,
+    uint32_t *transportids) {
+  int n = 0;
+  for (int i = 0; i < nready; i++) {
+    connect_info_t *con = connection_get_from_socket(tcpls, ready_socks[i]);
+    if (con && con->state >= CONNECTED)
+      transportids[n++] = con->this_transportid;
+  }
+  return n;
+}
+
+static int drain(tcpls_t *tcpls, const uint32_t *transportids, int n, tcpls_buffer_t *buf) {
+  int rret = TCPLS_OK;
+  size_t drained;
+  for (int i = 0; i < n; i++) {
+    int ret = drain_con(tcpls, transportids[i], TCPLS_RSCHED_DRAIN_BUDGET, buf, &drained);
+    if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+      return ret;
+    else if (rret == TCPLS_OK && ret > TCPLS_OK)
+      rret = ret;
+  }
+  return rret;
+}
+
+/**
+ * Read every available socket until it has nothing left, or until
+ * TCPLS_RSCHED_DRAIN_BUDGET bytes have been read from it. A fast path is no
+ * longer serviced at the pace of select() calls.
+ *
+ * returns TCPLS_OK, TCPLS_HOLD_DATA_TO_READ or -1 upon error
+ */
+
+int drain_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *buf, void *data) {
+  /** a VLA may not be empty */
+  if (!tcpls->connect_infos->size)
+    return TCPLS_OK;
+  uint32_t transportids[tcpls->connect_infos->size];
+  int n = readable_from_rset(tcpls, rset, transportids);
+  return drain(tcpls, transportids, n, buf);
+}
+
+int drain_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *buf, void *data) {
+  if (nready <= 0)
+    return TCPLS_OK;
+  uint32_t transportids[nready];
+  int n = readable_from_ready(tcpls, ready_socks, nready, transportids);
+  return drain(tcpls, transportids, n, buf);
+}
+
+static int deficit_round_robin(tcpls_t *tcpls, const uint32_t *transportids, int n,
+    tcpls_buffer_t *buf) {
+  int rret = TCPLS_OK;
+  size_t drained;
+  for (int i = 0; i < n; i++) {
+    connect_info_t *con = connection_get(tcpls, transportids[i]);
+    uint64_t quantum = TCPLS_RSCHED_QUANTUM + con->rcv_throughput;
+    if (quantum > TCPLS_RSCHED_DRAIN_BUDGET)
+      quantum = TCPLS_RSCHED_DRAIN_BUDGET;
+    con->rcv_deficit += quantum;
+    if (con->rcv_deficit > TCPLS_RSCHED_DRAIN_BUDGET)
+      con->rcv_deficit = TCPLS_RSCHED_DRAIN_BUDGET;
+    int ret = drain_con(tcpls, transportids[i], con->rcv_deficit, buf, &drained);
+    if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+      return ret;
+    con = connection_get(tcpls, transportids[i]);
+    con->rcv_throughput = (3*con->rcv_throughput + drained) / 4;
+    /** as in DRR, an empty queue does not keep its deficit */
+    if (ret == TCPLS_HOLD_DATA_TO_READ)
+      con->rcv_deficit -= drained;
+    else
+      con->rcv_deficit = 0;
+    if (rret == TCPLS_OK && ret > TCPLS_OK)
+      rret = ret;
+  }
+  return rret;
+}
+
+/**
+ * Deficit round-robin over the available sockets. Each connection is given a
+ * quantum of TCPLS_RSCHED_QUANTUM bytes plus its measured throughput, i.e.,
+ * the average number of bytes it delivered per round; a faster path gets to
+ * deliver more per round, without starving the slow ones.
+ *
+ * returns TCPLS_OK, TCPLS_HOLD_DATA_TO_READ or -1 upon error
+ */
+
+int deficit_round_robin_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *buf,
+    void *data) {
+  if (!tcpls->connect_infos->size)
+    return TCPLS_OK;
+  uint32_t transportids[tcpls->connect_infos->size];
+  int n = readable_from_rset(tcpls, rset, transportids);
+  return deficit_round_robin(tcpls, transportids, n, buf);
+}
+
+int deficit_round_robin_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *buf, void *data) {
+  if (nready <= 0)
+    return TCPLS_OK;
+  uint32_t transportids[nready];
+  int n = readable_from_ready(tcpls, ready_socks, nready, transportids);
+  return deficit_round_robin(tcpls, transportids, n, buf);
+}
+
+static int next_expected_mpseq_first(tcpls_t *tcpls, const uint32_t *transportids, int n,
+    tcpls_buffer_t *buf) {
+  int rret = TCPLS_OK, lagging = -1, ahead = 0;
+  size_t drained;
+  /** a connection delivered records beyond next_expected_mpseq: the missing
+   * ones are within the connection the furthest behind */
+  for (int i = 0; i < n; i++) {
+    connect_info_t *con = connection_get(tcpls, transportids[i]);
+    if (con->tot_data_bytes_received &&
+        (int32_t) (con->last_mpseq_received - tcpls->next_expected_mpseq) >= 0)
+      ahead = 1;
+    if (lagging < 0 || (int32_t) (con->last_mpseq_received -
+          connection_get(tcpls, transportids[lagging])->last_mpseq_received) < 0)
+      lagging = i;
+  }
+  if (!ahead)
+    return drain(tcpls, transportids, n, buf);
+  int ret = drain_con(tcpls, transportids[lagging], TCPLS_RSCHED_DRAIN_BUDGET, buf, &drained);
+  if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+    return ret;
+  rret = ret;
+  for (int i = 0; i < n; i++) {
+    if (i == lagging)
+      continue;
+    ret = drain_con(tcpls, transportids[i], TCPLS_RSCHED_QUANTUM, buf, &drained);
+    if (ret < 0 || ret == TCPLS_HOLD_DATA_TO_CONSUME)
+      return ret;
+    else if (rret == TCPLS_OK && ret > TCPLS_OK)
+      rret = ret;
+  }
+  return rret;
+}
+
+/**
+ * Multipath: when records are held because of a gap in the mpseq, drain first
+ * the available connection which is the furthest behind, since it carries
+ * next_expected_mpseq; the other ones get only TCPLS_RSCHED_QUANTUM bytes
+ * read, not to fill the reordering window any further. Without any gap, every
+ * socket is drained.
+ *
+ * returns TCPLS_OK, TCPLS_HOLD_DATA_TO_READ or -1 upon error
+ */
+
+int next_expected_mpseq_con_scheduler(tcpls_t *tcpls, fd_set *rset, tcpls_buffer_t *buf,
+    void *data) {
+  if (!tcpls->connect_infos->size)
+    return TCPLS_OK;
+  uint32_t transportids[tcpls->connect_infos->size];
+  int n = readable_from_rset(tcpls, rset, transportids);
+  return next_expected_mpseq_first(tcpls, transportids, n, buf);
+}
+
+int next_expected_mpseq_ready_scheduler(tcpls_t *tcpls, const int *ready_socks, int nready,
+    tcpls_buffer_t *buf, void *data) {
+  if (nready <= 0)
+    return TCPLS_OK;
+  uint32_t transportids[nready];
+  int n = readable_from_ready(tcpls, ready_socks, nready, transportids);
+  return next_expected_mpseq_first(tcpls, transportids, n, buf);
+}
@@ -0,0 +1,134 @@
+/**
+ * \file ssched.c
+ *
+ * \brief Hold implementations for multi connection schedulers which the
+ * sender can set to spread the records of a tcpls_send() call over the
+ * different connections
+ *
+ * A scheduler returns the stream the next record must be encrypted with; the
+ * record is sent over the connection this stream is attached to. Records are
+ * put back in order by the receiver thanks to their mpseq.
+ */
+
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include "ssched.h"
+
+/**
+ * Whether the next record may be sent with stream; sets its connection
+ */
+
+static int is_sendable(tcpls_t *tcpls, tcpls_stream_t *stream, connect_info_t **con) {
+  if (!stream->stream_usable || stream->marked_for_close || !stream->aead_initialized)
+    return 0;
+  *con = connection_get(tcpls, stream->transportid);
+  return *con && (*con)->state >= CONNECTED;
+}
+
+/**
+ * Bytes waiting to leave through con: the ones the stream did not manage to
+ * send yet, and the ones still unsent within the socket's buffer
+ */
+
+static size_t pending_bytes(tcpls_stream_t *stream, connect_info_t *con) {
+  size_t pending = stream->sendbuf->off - stream->send_start;
+#ifdef SIOCOUTQ
+  int unsent;
+  if (ioctl(con->socket, SIOCOUTQ, &unsent) == 0 && unsent > 0)
+    pending += unsent;
+#endif
+  return pending;
+}
+
+/**
+ * Fill the connection with the lowest RTT first, as long as it does not hold
+ * more than TCPLS_SSCHED_MAX_BACKLOG pending bytes; then the next one. The RTT
+ * is the live one of the path metrics once sampled.
+ *
+ * If no connection has room, use the least occupied one.
+ */
+
+tcpls_stream_t *lowest_rtt_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data) {
+  tcpls_stream_t *best = NULL, *least_occupied = NULL;
+  uint64_t best_rtt = UINT64_MAX;
+  size_t least_pending = SIZE_MAX;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    tcpls_stream_t *stream = slab_get(tcpls->streams, i);
+    connect_info_t *con;
+    if (!is_sendable(tcpls, stream, &con))
+      continue;
+    size_t pending = pending_bytes(stream, con);
+    if (pending < least_pending) {
+      least_pending = pending;
+      least_occupied = stream;
+    }
+    if (pending + reclen > TCPLS_SSCHED_MAX_BACKLOG)
+      continue;
+    uint64_t rtt = connection_rtt_us(con);
+    if (rtt < best_rtt) {
+      best_rtt = rtt;
+      best = stream;
+    }
+  }
+  return best ? best : least_occupied;
+}
+
+/**
+ * Smooth weighted round-robin over the connections: each one gets a share of
+ * the records proportional to its send_weight, and the records of a share are
+ * interleaved with the ones of the others.
+ */
+
+tcpls_stream_t *weighted_round_robin_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data) {
+  tcpls_stream_t *best = NULL;
+  connect_info_t *best_con = NULL;
+  int32_t total = 0;
+  tcpls->send_round++;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    tcpls_stream_t *stream = slab_get(tcpls->streams, i);
+    connect_info_t *con;
+    if (!is_sendable(tcpls, stream, &con))
+      continue;
+    /** a connection may carry several streams; credit it once */
+    if (con->send_round == tcpls->send_round)
+      continue;
+    con->send_round = tcpls->send_round;
+    int32_t weight = con->send_weight ? con->send_weight : 1;
+    con->send_credit += weight;
+    total += weight;
+    if (!best || con->send_credit > best_con->send_credit) {
+      best = stream;
+      best_con = con;
+    }
+  }
+  if (best)
+    best_con->send_credit -= total;
+  return best;
+}
+
+/**
+ * Send over the connection holding the fewest pending bytes; ties go to the
+ * lowest RTT
+ */
+
+tcpls_stream_t *buffer_occupancy_send_scheduler(tcpls_t *tcpls, size_t reclen, void *data) {
+  tcpls_stream_t *best = NULL;
+  size_t best_pending = SIZE_MAX;
+  uint64_t best_rtt = UINT64_MAX;
+  for (int i = 0; i < tcpls->streams->size; i++) {
+    tcpls_stream_t *stream = slab_get(tcpls->streams, i);
+    connect_info_t *con;
+    if (!is_sendable(tcpls, stream, &con))
+      continue;
+    size_t pending = pending_bytes(stream, con);
+    uint64_t rtt = connection_rtt_us(con);
+    if (pending < best_pending || (pending == best_pending && rtt < best_rtt)) {
+      best = stream;
+      best_pending = pending;
+      best_rtt = rtt;
+    }
+  }
+  return best;
+}
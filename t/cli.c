@@ -85,6 +85,8 @@ struct tcpls_options {
   unsigned int timeout;
   unsigned int is_second;
   unsigned int failover_enabled;
+  unsigned int epoll_enabled;
+  unsigned int fastopen_enabled;
   list_t *our_addrs;
   list_t *our_addrs6;
   list_t *peer_addrs;
@@ -790,7 +792,7 @@ static int handle_client_transfer_test(tcpls_t *tcpls, int test, struct cli_data
       /*int socket = 0;*/
       connect_info_t *con = NULL;
       for (int i = 0; i < tcpls->connect_infos->size; i++) {
-        con = list_get(tcpls->connect_infos, i);
+        con = slab_get(tcpls->connect_infos, i);
         if (con->dest) {
           break;
         }
@@ -837,7 +839,7 @@ static int handle_client_transfer_test(tcpls_t *tcpls, int test, struct cli_data
       int socket = 0;
       connect_info_t *con = NULL;
       for (int i = 0; i < tcpls->connect_infos->size; i++) {
-        con = list_get(tcpls->connect_infos, i);
+        con = slab_get(tcpls->connect_infos, i);
         if (con->state < JOINED) {
           socket = con->socket;
           prop.socket = socket;
@@ -1218,7 +1220,7 @@ Exit:
 static int run_server(struct sockaddr_storage *sa_ours, struct sockaddr_storage
     *sa_peers, int nbr_ours, int nbr_peers, ptls_context_t *ctx, const char *input_file,
     ptls_handshake_properties_t *hsprop, int request_key_update, integration_test_t test,
-    unsigned int failover_enabled)
+    unsigned int failover_enabled, unsigned int epoll_enabled)
 {
   int conn_fd, on = 1;
   int inputfd = 0;
@@ -1255,7 +1257,7 @@ static int run_server(struct sockaddr_storage *sa_ours, struct sockaddr_storage
       perror("setsockopt(SO_REUSEADDR) failed");
       return 1;
     }
-    if (setsockopt(listenfd[i], SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0) {
+    if (tcpls_listen_fastopen(listenfd[i], qlen) != 0) {
       perror("setsockopt(TCP_FASTOPEN) failed");
     }
     if (sa_ours[i].ss_family == AF_INET)
@@ -1337,6 +1339,8 @@ static int run_server(struct sockaddr_storage *sa_ours, struct sockaddr_storage
             fprintf(stderr, "Accepting a new connection\n");
             tcpls_t *new_tcpls = tcpls_new(ctx,  1);
             new_tcpls->enable_failover = failover_enabled;
+            if (epoll_enabled && tcpls_enable_epoll(new_tcpls, -1) < 0)
+              perror("tcpls_enable_epoll");
             struct conn_to_tcpls conntcpls;
             memset(&conntcpls, 0, sizeof(conntcpls));
             conntcpls.conn_fd = new_conn;
@@ -1421,7 +1425,8 @@ Exit:
 static int run_client(struct sockaddr_storage *sa_our, struct sockaddr_storage
     *sa_peer, int nbr_our, int nbr_peer,  ptls_context_t *ctx, const char *server_name, const char
     *input_file, ptls_handshake_properties_t *hsprop, int request_key_update,
-    int keep_sender_open, integration_test_t test, unsigned int failover_enabled, const char *goodputfile)
+    int keep_sender_open, integration_test_t test, unsigned int failover_enabled,
+    unsigned int epoll_enabled, unsigned int fastopen_enabled, const char *goodputfile)
 {
   int fd;
 
@@ -1441,6 +1446,9 @@ static int run_client(struct sockaddr_storage *sa_our, struct sockaddr_storage
   tcpls_add_ips(tcpls, sa_our, sa_peer, nbr_our, nbr_peer);
   ctx->output_decrypted_tcpls_data = 0;
   tcpls->enable_failover = failover_enabled;
+  tcpls->enable_fastopen = fastopen_enabled;
+  if (epoll_enabled && tcpls_enable_epoll(tcpls, -1) < 0)
+    perror("tcpls_enable_epoll");
   signal(SIGPIPE, sig_handler);
 
   if (ctx->support_tcpls_options) {
@@ -1477,6 +1485,7 @@ static void usage(const char *cmd)
       "                       both endpoints with this option for some time, then kill\n"
       "                       the client. Server will report the ingress bandwidth.\n"
       "  -f                   Enable failover mode.\n"
+      "  -F                   Connect with TCP Fast Open (client-only).\n"
       "  -C certificate-file  certificate chain used for client authentication\n"
       "  -c certificate-file  certificate chain used for server authentication\n"
       "  -i file              a file to read from and send to the peer (default: stdin)\n"
@@ -1496,6 +1505,9 @@ static void usage(const char *cmd)
       "                       all)\n"
       "  -h                   print this help\n"
       "  -t                   Use tcpls\n"
+      "  -H                   Prefix tcpls records with their stream id (with -t)\n"
+      "  -w                   Wait for tcpls records with epoll rather than select\n"
+      "  -M                   Recycle the tcpls buffers through a per-thread pool\n"
       "  -T intergration_test Precise which integration test is to be run\n"
       "  -p v4_address        Peer's v4 IP address\n"
       "  -P v6_address        Peer's v6 IP address\n"
@@ -1549,7 +1561,7 @@ int main(int argc, char **argv)
   tcpls_options.peer_addrs6 = new_list(39*sizeof(char), 2);
   int family = 0;
 
-  while ((ch = getopt(argc, argv, "46abBC:c:i:Ik:nN:es:SE:K:l:y:vhtd:p:P:z:Z:T:fg:")) != -1) {
+  while ((ch = getopt(argc, argv, "46abBC:c:i:Ik:nN:es:SE:K:l:y:vhtHMd:p:P:z:Z:T:fFwg:")) != -1) {
     switch (ch) {
       case '4':
         family = AF_INET;
@@ -1702,6 +1714,12 @@ int main(int argc, char **argv)
       case 't':
                 ctx.support_tcpls_options = 1;
                 break;
+      case 'H':
+                ctx.tcpls_stream_hint = 1;
+                break;
+      case 'M':
+                ctx.use_buffer_pool = 1;
+                break;
 
 
       case 'd':
@@ -1771,6 +1789,12 @@ int main(int argc, char **argv)
       case 'f':
                 tcpls_options.failover_enabled = 1;
                 break;
+      case 'w':
+                tcpls_options.epoll_enabled = 1;
+                break;
+      case 'F':
+                tcpls_options.fastopen_enabled = 1;
+                break;
       case 'g':
                 goodputfile = optarg;
                 break;
@@ -1881,9 +1905,11 @@ int main(int argc, char **argv)
 
   if (is_server) {
     return run_server(sa_ours, sa_peer, nbr_our_addrs, nbr_peer_addrs, &ctx,
-        input_file, &hsprop, request_key_update, test, tcpls_options.failover_enabled);
+        input_file, &hsprop, request_key_update, test, tcpls_options.failover_enabled,
+        tcpls_options.epoll_enabled);
   } else {
     return run_client(sa_ours, sa_peer, nbr_our_addrs, nbr_peer_addrs, &ctx,
-        host, input_file, &hsprop, request_key_update, keep_sender_open, test, tcpls_options.failover_enabled, goodputfile);
+        host, input_file, &hsprop, request_key_update, keep_sender_open, test, tcpls_options.failover_enabled,
+        tcpls_options.epoll_enabled, tcpls_options.fastopen_enabled, goodputfile);
   }
 }
@@ -27,6 +27,7 @@
 #include "picotls/minicrypto.h"
 #include "../deps/picotest/picotest.h"
 #include "../lib/fusion.c"
+#include "test.h"
 
 static const char *tostr(const void *_p, size_t len)
 {
@@ -319,6 +320,99 @@ static void test_generated_aes256_iv96(void)
 {
     test_generated(1, 1);
 }
+/**
+ * Runs a TCPLS session whose record layer is protected by fusion: handshake,
+ * stream attach, then application data sent over the stream.
+ */
+static void tcpls_session(void)
+{
+    ptls_cipher_suite_t aes128gcmsha256 = {PTLS_CIPHER_SUITE_AES_128_GCM_SHA256, &ptls_fusion_aes128gcm, &ptls_minicrypto_sha256};
+    ptls_cipher_suite_t *cipher_suites[] = {&aes128gcmsha256, NULL};
+    ptls_iovec_t cert = ptls_iovec_init(SECP256R1_CERTIFICATE, sizeof(SECP256R1_CERTIFICATE) - 1);
+    ptls_minicrypto_secp256r1sha256_sign_certificate_t sign_certificate;
+    ptls_minicrypto_init_secp256r1sha256_sign_certificate(&sign_certificate,
+                                                          ptls_iovec_init(SECP256R1_PRIVATE_KEY, SECP256R1_PRIVATE_KEY_SIZE));
+    ptls_context_t ctx = {ptls_minicrypto_random_bytes, &ptls_get_time, ptls_minicrypto_key_exchanges, cipher_suites, {&cert, 1},
+                          NULL, NULL, NULL, &sign_certificate.super};
+    ctx.support_tcpls_options = 1;
+    ctx.tcpls_stream_hint = 1;
+
+    tcpls_t *client = tcpls_new(&ctx, 0), *server = tcpls_new(&ctx, 1);
+    ptls_buffer_t cbuf, sbuf, decbuf;
+    size_t consumed;
+    int ret;
+
+    ptls_buffer_init(&cbuf, "", 0);
+    ptls_buffer_init(&sbuf, "", 0);
+    ptls_buffer_init(&decbuf, "", 0);
+
+    /* handshake */
+    ret = ptls_handshake(client->tls, &cbuf, NULL, NULL, NULL);
+    ok(ret == PTLS_ERROR_IN_PROGRESS);
+    consumed = cbuf.off;
+    ret = ptls_handshake(server->tls, &sbuf, cbuf.base, &consumed, NULL);
+    ok(ret == 0);
+    ok(consumed == cbuf.off);
+    cbuf.off = 0;
+    consumed = sbuf.off;
+    ret = ptls_handshake(client->tls, &cbuf, sbuf.base, &consumed, NULL);
+    ok(ret == 0);
+    ok(consumed == sbuf.off);
+    sbuf.off = 0;
+    consumed = cbuf.off;
+    ret = ptls_handshake(server->tls, &sbuf, cbuf.base, &consumed, NULL);
+    ok(ret == 0);
+    ok(ptls_handshake_is_complete(client->tls));
+    ok(ptls_handshake_is_complete(server->tls));
+    ok(ptls_get_cipher(client->tls)->aead == &ptls_fusion_aes128gcm);
+    ok(client->tcpls_options_confirmed && server->tcpls_options_confirmed);
+
+    /* attach a stream */
+    connect_info_t con;
+    memset(&con, 0, sizeof(con));
+    con.state = JOINED;
+    slab_add(server->connect_infos, &con);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ok(tcpls_add_v4(client->tls, &addr, 1, 0, 0) == 0);
+    streamid_t streamid = tcpls_stream_new(client->tls, NULL, (struct sockaddr *)&addr);
+    ok(streamid != 0);
+    ok(tcpls_streams_attach(client->tls, 0, 0) == 0);
+    consumed = client->sendbuf->off;
+    ret = ptls_receive(server->tls, &decbuf, NULL, client->sendbuf->base, &consumed);
+    ok(ret == 0);
+    ok(server->streams->size == 1);
+
+    /* send more than one record of data over the stream */
+    tcpls_stream_t *stream = slab_get(client->streams, 0);
+    ptls_aead_context_t *default_aead = client->tls->traffic_protection.enc.aead;
+    static uint8_t data[3 * 16384 + 123];
+    for (size_t i = 0; i != sizeof(data); ++i)
+        data[i] = (uint8_t)i;
+    cbuf.off = 0;
+    client->tls->traffic_protection.enc.aead = stream->aead_enc;
+    ret = ptls_send(client->tls, streamid, &cbuf, data, sizeof(data));
+    client->tls->traffic_protection.enc.aead = default_aead;
+    ok(ret == 0);
+    const uint8_t *src = cbuf.base, *end = cbuf.base + cbuf.off;
+    while (ret == 0 && src != end) {
+        consumed = end - src;
+        ret = ptls_receive(server->tls, &decbuf, NULL, src, &consumed);
+        src += consumed;
+    }
+    ok(ret == 0);
+    ok(decbuf.off == sizeof(data));
+    ok(memcmp(decbuf.base, data, sizeof(data)) == 0);
+
+    ptls_buffer_dispose(&cbuf);
+    ptls_buffer_dispose(&sbuf);
+    ptls_buffer_dispose(&decbuf);
+    tcpls_free(client);
+    tcpls_free(server);
+}
+
 int main(int argc, char **argv)
 {
     if (!ptls_fusion_is_supported_by_cpu()) {
@@ -336,6 +430,7 @@ int main(int argc, char **argv)
     subtest("generated-256", test_generated_aes256);
     subtest("generated-128-iv96", test_generated_aes128_iv96);
     subtest("generated-256-iv96", test_generated_aes256_iv96);
+    subtest("tcpls-session", tcpls_session);
 
     return done_testing();
 }
@@ -0,0 +1,502 @@
+/**
+ * \file handshakebench.c
+ *
+ * \brief Measures connection setup: handshakes are run in memory, from
+ * ptls_handshake() to ptls_handshake() and without any socket, for each
+ * combination of handshake type, key exchange, signer and certificate
+ * compression.
+ *
+ * The handshake types are full handshakes, PSK-DHE resumptions, 0-RTT
+ * resumptions, TCPLS handshakes (that also exchange the CONNID and the
+ * COOKIEs), and MPJOIN handshakes joining an established TCPLS session.
+ * Reports the handshake rate of both peers and of the server alone, and the
+ * median and 99th percentile of the handshake latency, in the CSV style of
+ * ptlsbench.
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include "picotls.h"
+#include "picotls/minicrypto.h"
+#include "picotls/openssl.h"
+#if PICOTLS_USE_BROTLI
+#include "picotls/certificate_compression.h"
+#endif
+#include "picotcpls.h"
+#include "containers.h"
+#include "test.h"
+
+#ifdef PTLS_DEBUG
+#define BENCH_MODE "debug"
+#else
+#define BENCH_MODE "release"
+#endif
+
+enum bench_type { BENCH_FULL, BENCH_PSK_DHE, BENCH_0RTT, BENCH_TCPLS, BENCH_MPJOIN };
+
+static const char *type_names[] = {"full", "psk-dhe", "0rtt", "tcpls", "mpjoin"};
+
+typedef struct st_bench_kx_entry_t {
+    const char *provider;
+    const char *name;
+    ptls_key_exchange_algorithm_t *algo;
+} bench_kx_entry_t;
+
+static bench_kx_entry_t kx_list[] = {{"minicrypto", "x25519", &ptls_minicrypto_x25519},
+                                     {"uecc", "secp256r1", &ptls_minicrypto_secp256r1},
+#if PTLS_OPENSSL_HAVE_X25519
+                                     {"openssl", "x25519", &ptls_openssl_x25519},
+#endif
+                                     {"openssl", "secp256r1", &ptls_openssl_secp256r1},
+#if PTLS_OPENSSL_HAVE_SECP384R1
+                                     {"openssl", "secp384r1", &ptls_openssl_secp384r1},
+#endif
+};
+
+static size_t nb_kx_list = sizeof(kx_list) / sizeof(bench_kx_entry_t);
+
+typedef struct st_bench_signer_t {
+    const char *name;
+    ptls_iovec_t certificate;
+    ptls_sign_certificate_t *sign_certificate;
+} bench_signer_t;
+
+/* the early data sent in 0-RTT */
+static const char req[] = "GET / HTTP/1.1\r\n\r\n";
+
+static ptls_iovec_t saved_ticket = {NULL};
+
+/* Time in nanoseconds */
+static uint64_t bench_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_uint64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* tickets are not encrypted, as in the tests */
+static int on_copy_ticket(ptls_encrypt_ticket_t *self, ptls_t *tls, int is_encrypt, ptls_buffer_t *dst, ptls_iovec_t src)
+{
+    int ret;
+
+    if ((ret = ptls_buffer_reserve(dst, src.len)) != 0)
+        return ret;
+    memcpy(dst->base + dst->off, src.base, src.len);
+    dst->off += src.len;
+    return 0;
+}
+
+static int on_save_ticket(ptls_save_ticket_t *self, ptls_t *tls, ptls_iovec_t src)
+{
+    free(saved_ticket.base);
+    saved_ticket.base = malloc(src.len);
+    memcpy(saved_ticket.base, src.base, src.len);
+    saved_ticket.len = src.len;
+    return 0;
+}
+
+/**
+ * Server-side, checks the CONNID and the COOKIE of a MPJOIN against the
+ * established session given as cb_data, as tcpls_accept() does
+ */
+static int on_mpjoin(tcpls_t *tcpls, int socket, uint8_t *connid, uint8_t *cookie, uint32_t transportid, void *cb_data)
+{
+    tcpls_t *joined = cb_data;
+    if (memcmp(joined->connid, connid, CONNID_LEN) != 0 ||
+        memcmp(list_get(joined->cookies, joined->cookies->size - 1), cookie, COOKIE_LEN) != 0)
+        return -1;
+    return 0;
+}
+
+/**
+ * Runs one handshake between client and server, in memory. The client sends
+ * early data if max_early_data_size is set in client_prop, and processes the
+ * session ticket the server sends at the end. The time spent by the server
+ * is added to server_time.
+ */
+static int bench_handshake_one(ptls_t *client, ptls_t *server, ptls_handshake_properties_t *client_prop, uint64_t *server_time)
+{
+    ptls_buffer_t cbuf, sbuf, decbuf;
+    size_t consumed;
+    uint64_t t_start;
+    int cret, sret = PTLS_ERROR_IN_PROGRESS, ret = 0;
+
+    ptls_buffer_init(&cbuf, "", 0);
+    ptls_buffer_init(&sbuf, "", 0);
+    ptls_buffer_init(&decbuf, "", 0);
+    if ((cret = ptls_handshake(client, &cbuf, NULL, NULL, client_prop)) != PTLS_ERROR_IN_PROGRESS) {
+        ret = cret;
+        goto Exit;
+    }
+    if (client_prop->client.max_early_data_size != NULL) {
+        if (*client_prop->client.max_early_data_size == 0) {
+            ret = -1;
+            goto Exit;
+        }
+        if ((ret = ptls_send(client, 0, &cbuf, req, sizeof(req) - 1)) != 0)
+            goto Exit;
+    }
+    while (cret != 0 || !ptls_handshake_is_complete(server)) {
+        if (cbuf.off == 0) {
+            ret = -1;
+            goto Exit;
+        }
+        /* once it has sent its flight, the server reads early data and the client Finished with ptls_receive() */
+        t_start = bench_time();
+        for (size_t off = 0; off != cbuf.off; off += consumed) {
+            consumed = cbuf.off - off;
+            if (sret == PTLS_ERROR_IN_PROGRESS) {
+                sret = ptls_handshake(server, &sbuf, cbuf.base + off, &consumed, NULL);
+                if (sret != 0 && sret != PTLS_ERROR_IN_PROGRESS)
+                    ret = sret;
+            } else {
+                ret = ptls_receive(server, &decbuf, NULL, cbuf.base + off, &consumed);
+            }
+            if (ret != 0)
+                goto Exit;
+        }
+        *server_time += bench_time() - t_start;
+        cbuf.off = 0;
+        decbuf.off = 0;
+        if (cret == 0)
+            continue;
+        consumed = sbuf.off;
+        if ((cret = ptls_handshake(client, &cbuf, sbuf.base, &consumed, client_prop)) != 0 && cret != PTLS_ERROR_IN_PROGRESS) {
+            ret = cret;
+            goto Exit;
+        }
+        /* the session ticket */
+        if (cret == 0 && consumed != sbuf.off) {
+            size_t rest = sbuf.off - consumed;
+            if ((ret = ptls_receive(client, &decbuf, NULL, sbuf.base + consumed, &rest)) != 0)
+                goto Exit;
+        }
+        sbuf.off = 0;
+    }
+
+Exit:
+    ptls_buffer_dispose(&cbuf);
+    ptls_buffer_dispose(&sbuf);
+    ptls_buffer_dispose(&decbuf);
+    return ret;
+}
+
+/**
+ * Runs count handshakes of the given type. latencies receives the time each
+ * of them took, elapsed the time all of them took, including the creation
+ * and the destruction of the sessions
+ */
+static int bench_run(enum bench_type type, ptls_context_t *client_ctx, ptls_context_t *server_ctx, size_t count,
+                     uint64_t *latencies, uint64_t *elapsed, uint64_t *server_time)
+{
+    ptls_handshake_properties_t client_prop;
+    size_t max_early_data_size;
+    tcpls_t *client = NULL, *server = NULL;
+    uint64_t t_start, t_all = bench_time();
+    int ret = 0;
+
+    *server_time = 0;
+    if (type == BENCH_MPJOIN) {
+        /* the session to join; each MPJOIN is processed by a new server session, as for a new connection */
+        connect_info_t con;
+        uint64_t setup_time;
+        memset(&con, 0, sizeof(con));
+        client = tcpls_new(client_ctx, 0);
+        server = tcpls_new(server_ctx, 1);
+        slab_add(client->connect_infos, &con);
+        slab_add(server->connect_infos, &con);
+        memset(&client_prop, 0, sizeof(client_prop));
+        if ((ret = bench_handshake_one(client->tls, server->tls, &client_prop, &setup_time)) != 0)
+            goto Exit;
+        server_ctx->cb_data = server;
+        t_all = bench_time();
+        for (size_t i = 0; i < count; i++) {
+            ptls_handshake_properties_t join_prop;
+            ptls_buffer_t cbuf, sbuf;
+            size_t consumed;
+            memset(&join_prop, 0, sizeof(join_prop));
+            join_prop.client.mpjoin = 1;
+            join_prop.received_mpjoin_to_process = &on_mpjoin;
+            ptls_buffer_init(&cbuf, "", 0);
+            ptls_buffer_init(&sbuf, "", 0);
+            t_start = bench_time();
+            ret = ptls_handshake(client->tls, &cbuf, NULL, NULL, &join_prop);
+            /* the key share of a MPJOIN is never used */
+            if (client->tls->client.key_share_ctx != NULL)
+                client->tls->client.key_share_ctx->on_exchange(&client->tls->client.key_share_ctx, 1, NULL, ptls_iovec_init(NULL, 0));
+            if (ret == PTLS_ERROR_HANDSHAKE_IS_MPJOIN) {
+                uint64_t t_server = bench_time();
+                tcpls_t *joining = tcpls_new(server_ctx, 1);
+                consumed = cbuf.off;
+                ret = ptls_handshake(joining->tls, &sbuf, cbuf.base, &consumed, &join_prop);
+                tcpls_free(joining);
+                *server_time += bench_time() - t_server;
+            }
+            latencies[i] = bench_time() - t_start;
+            ptls_buffer_dispose(&cbuf);
+            ptls_buffer_dispose(&sbuf);
+            if (ret != PTLS_ERROR_HANDSHAKE_IS_MPJOIN) {
+                if (ret == 0)
+                    ret = -1;
+                goto Exit;
+            }
+        }
+        ret = 0;
+        goto Exit;
+    }
+
+    if (type == BENCH_PSK_DHE || type == BENCH_0RTT) {
+        /* get a ticket */
+        ptls_t *c = ptls_client_new(client_ctx), *s = ptls_server_new(server_ctx);
+        uint64_t setup_time;
+        memset(&client_prop, 0, sizeof(client_prop));
+        ret = bench_handshake_one(c, s, &client_prop, &setup_time);
+        ptls_free(c);
+        ptls_free(s);
+        if (ret != 0)
+            goto Exit;
+        if (saved_ticket.base == NULL) {
+            ret = -1;
+            goto Exit;
+        }
+        t_all = bench_time();
+    }
+    for (size_t i = 0; i < count; i++) {
+        ptls_t *c, *s;
+        connect_info_t con;
+        t_start = bench_time();
+        memset(&client_prop, 0, sizeof(client_prop));
+        if (type == BENCH_TCPLS) {
+            memset(&con, 0, sizeof(con));
+            client = tcpls_new(client_ctx, 0);
+            server = tcpls_new(server_ctx, 1);
+            slab_add(client->connect_infos, &con);
+            slab_add(server->connect_infos, &con);
+            c = client->tls;
+            s = server->tls;
+        } else {
+            c = ptls_client_new(client_ctx);
+            s = ptls_server_new(server_ctx);
+            if (type != BENCH_FULL)
+                client_prop.client.session_ticket = saved_ticket;
+            if (type == BENCH_0RTT) {
+                max_early_data_size = 0;
+                client_prop.client.max_early_data_size = &max_early_data_size;
+            }
+        }
+        ret = bench_handshake_one(c, s, &client_prop, server_time);
+        latencies[i] = bench_time() - t_start;
+        if (ret == 0 && type != BENCH_FULL && type != BENCH_TCPLS && !ptls_is_psk_handshake(s))
+            ret = -1;
+        if (ret == 0 && type == BENCH_TCPLS && !(client->tcpls_options_confirmed && server->tcpls_options_confirmed))
+            ret = -1;
+        if (type == BENCH_TCPLS) {
+            tcpls_free(client);
+            tcpls_free(server);
+            client = server = NULL;
+        } else {
+            ptls_free(c);
+            ptls_free(s);
+        }
+        if (ret != 0)
+            goto Exit;
+    }
+
+Exit:
+    *elapsed = bench_time() - t_all;
+    if (client != NULL)
+        tcpls_free(client);
+    if (server != NULL)
+        tcpls_free(server);
+    server_ctx->cb_data = NULL;
+    return ret;
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Runs every combination of the options below, unless some are set.\n"
+           "\n"
+           "Options:\n"
+           "  -t type         full, psk-dhe, 0rtt, tcpls or mpjoin\n"
+           "  -p provider     key exchange provider: minicrypto, uecc or openssl\n"
+           "  -k algorithm    key exchange: x25519, secp256r1 or secp384r1\n"
+           "  -s signer       rsa2048 or ecdsa-p256\n"
+           "  -z 0|1          certificate compression off or on\n"
+           "  -n handshakes   number of handshakes per combination (default: 200)\n"
+           "  -h              print this help\n"
+           "\n",
+           cmd);
+}
+
+int main(int argc, char **argv)
+{
+    const char *type_filter = NULL, *provider_filter = NULL, *kx_filter = NULL, *signer_filter = NULL;
+    int compress_filter = -1, ch, ret = 0;
+    size_t count = 200;
+
+    while ((ch = getopt(argc, argv, "t:p:k:s:z:n:h")) != -1) {
+        switch (ch) {
+        case 't':
+            type_filter = optarg;
+            break;
+        case 'p':
+            provider_filter = optarg;
+            break;
+        case 'k':
+            kx_filter = optarg;
+            break;
+        case 's':
+            signer_filter = optarg;
+            break;
+        case 'z':
+            compress_filter = atoi(optarg);
+            break;
+        case 'n':
+            count = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (count == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* signers */
+    bench_signer_t signers[2];
+    ptls_openssl_sign_certificate_t rsa_sign_certificate;
+    ptls_minicrypto_secp256r1sha256_sign_certificate_t ecdsa_sign_certificate;
+    {
+        BIO *bio = BIO_new_mem_buf(RSA_PRIVATE_KEY, (int)strlen(RSA_PRIVATE_KEY));
+        EVP_PKEY *pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+        bio = BIO_new_mem_buf(RSA_CERTIFICATE, (int)strlen(RSA_CERTIFICATE));
+        X509 *cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+        BIO_free(bio);
+        assert(pkey != NULL && cert != NULL);
+        ptls_openssl_init_sign_certificate(&rsa_sign_certificate, pkey);
+        EVP_PKEY_free(pkey);
+        signers[0].name = "rsa2048";
+        signers[0].certificate.base = NULL;
+        signers[0].certificate.len = i2d_X509(cert, &signers[0].certificate.base);
+        signers[0].sign_certificate = &rsa_sign_certificate.super;
+        X509_free(cert);
+    }
+    ptls_minicrypto_init_secp256r1sha256_sign_certificate(&ecdsa_sign_certificate,
+                                                          ptls_iovec_init(SECP256R1_PRIVATE_KEY, SECP256R1_PRIVATE_KEY_SIZE));
+    signers[1].name = "ecdsa-p256";
+    signers[1].certificate = ptls_iovec_init(SECP256R1_CERTIFICATE, sizeof(SECP256R1_CERTIFICATE) - 1);
+    signers[1].sign_certificate = &ecdsa_sign_certificate.super;
+
+    char OS[128] = "", HW[128] = "";
+    struct utsname uts;
+    if (uname(&uts) == 0) {
+        if (strlen(uts.sysname) + 1 < sizeof(OS))
+            strcpy(OS, uts.sysname);
+        if (strlen(uts.machine) + 1 < sizeof(HW))
+            strcpy(HW, uts.machine);
+    }
+
+    ptls_cipher_suite_t *cipher_suites[] = {&ptls_openssl_aes128gcmsha256, NULL};
+    ptls_encrypt_ticket_t encrypt_ticket = {on_copy_ticket};
+    ptls_save_ticket_t save_ticket = {on_save_ticket};
+    uint64_t *latencies = malloc(count * sizeof(*latencies));
+    assert(latencies != NULL);
+
+    printf("OS, HW, bits, mode, type, provider, key exchange, signer, compression, handshakes, handshakes per s, "
+           "server handshakes per s, p50 us, p99 us,\n");
+    for (int type = BENCH_FULL; ret == 0 && type <= BENCH_MPJOIN; type++) {
+        if (type_filter != NULL && strcmp(type_filter, type_names[type]) != 0)
+            continue;
+        for (size_t k = 0; ret == 0 && k < nb_kx_list; k++) {
+            if ((provider_filter != NULL && strcmp(provider_filter, kx_list[k].provider) != 0) ||
+                (kx_filter != NULL && strcmp(kx_filter, kx_list[k].name) != 0))
+                continue;
+            /* resumptions and joins do not send the certificate; they are run once */
+            int uses_certificate = type == BENCH_FULL || type == BENCH_TCPLS;
+            for (size_t s = 0; ret == 0 && s < (uses_certificate ? PTLS_ELEMENTSOF(signers) : 1); s++) {
+                if (uses_certificate && signer_filter != NULL && strcmp(signer_filter, signers[s].name) != 0)
+                    continue;
+                for (int compress = 0; ret == 0 && compress <= uses_certificate; compress++) {
+                    if (uses_certificate && compress_filter != -1 && compress != compress_filter)
+                        continue;
+                    ptls_key_exchange_algorithm_t *key_exchanges[] = {kx_list[k].algo, NULL};
+                    ptls_context_t client_ctx = {ptls_openssl_random_bytes, &ptls_get_time, key_exchanges, cipher_suites};
+                    ptls_context_t server_ctx = client_ctx;
+                    /* the client does not verify the certificate, only the cost of the server depends on the signer */
+                    server_ctx.certificates.list = &signers[s].certificate;
+                    server_ctx.certificates.count = 1;
+                    server_ctx.sign_certificate = signers[s].sign_certificate;
+                    if (compress) {
+#if PICOTLS_USE_BROTLI
+                        static ptls_emit_compressed_certificate_t ecc;
+                        ptls_dispose_compressed_certificate(&ecc);
+                        if (ptls_init_compressed_certificate(&ecc, &signers[s].certificate, 1, ptls_iovec_init(NULL, 0)) != 0) {
+                            fprintf(stderr, "failed to compress the certificate\n");
+                            exit(1);
+                        }
+                        server_ctx.emit_certificate = &ecc.super;
+                        client_ctx.decompress_certificate = &ptls_decompress_certificate;
+#else
+                        continue;
+#endif
+                    }
+                    switch (type) {
+                    case BENCH_0RTT:
+                        server_ctx.max_early_data_size = 8192;
+                    /* fallthrough */
+                    case BENCH_PSK_DHE:
+                        server_ctx.ticket_lifetime = 86400;
+                        server_ctx.encrypt_ticket = &encrypt_ticket;
+                        client_ctx.save_ticket = &save_ticket;
+                        client_ctx.require_dhe_on_psk = 1;
+                        break;
+                    case BENCH_TCPLS:
+                    case BENCH_MPJOIN:
+                        client_ctx.support_tcpls_options = 1;
+                        server_ctx.support_tcpls_options = 1;
+                        break;
+                    }
+
+                    uint64_t elapsed, server_time;
+                    if ((ret = bench_run(type, &client_ctx, &server_ctx, count, latencies, &elapsed, &server_time)) != 0) {
+                        fprintf(stderr, "%s handshake failed:%d\n", type_names[type], ret);
+                        break;
+                    }
+                    qsort(latencies, count, sizeof(*latencies), bench_uint64_cmp);
+                    printf("%s, %s, %d, %s, %s, %s, %s, %s, %s, %zu, %.1f, %.1f, %.1f, %.1f,\n", OS, HW, (int)(8 * sizeof(size_t)),
+                           BENCH_MODE, type_names[type], kx_list[k].provider, kx_list[k].name,
+                           uses_certificate ? signers[s].name : "-", uses_certificate ? (compress ? "1" : "0") : "-", count,
+                           elapsed ? (double)count * 1000000000 / elapsed : 0,
+                           server_time ? (double)count * 1000000000 / server_time : 0, (double)latencies[count / 2] / 1000,
+                           (double)latencies[count * 99 / 100] / 1000);
+                    fflush(stdout);
+                    free(saved_ticket.base);
+                    saved_ticket = ptls_iovec_init(NULL, 0);
+                }
+            }
+        }
+    }
+
+    free(latencies);
+    free(signers[0].certificate.base);
+    ptls_openssl_dispose_sign_certificate(&rsa_sign_certificate);
+    return ret == 0 ? 0 : 1;
+}
@@ -23,22 +23,23 @@
 #include "wincompat.h"
 #endif
 #include <assert.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 #include <string.h>
 #include <stdio.h>
 #include "picotypes.h"
 #include "picotls.h"
 #include "picotcpls.h"
 #include "containers.h"
-#include "heap.h"
 #include "picotls/ffx.h"
 #include "picotls/minicrypto.h"
 #include "picotls/pembase64.h"
 #include "../deps/picotest/picotest.h"
 #include "../lib/containers.c"
-#include "../lib/heap.c"
 #include "../lib/picotls.c"
 #include "../lib/picotcpls.c"
 #include "../lib/rsched.c"
+#include "../lib/ssched.c"
 #include "test.h"
 
 static void test_is_ipaddr(void)
@@ -1263,7 +1264,7 @@ static void test_sends_varlen_bpf_prog(void)
   connect_info_t con;
   memset(&con, 0, sizeof(con));
   con.state = JOINED;
-  list_add(tcpls_client->connect_infos, &con);
+  slab_add(tcpls_client->connect_infos, &con);
   ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
   ok(ret == PTLS_ERROR_IN_PROGRESS);
   ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
@@ -1306,7 +1307,7 @@ static void test_sends_varlen_bpf_prog(void)
   tcpls_client->transportid_rcv = con.this_transportid;
   tcpls_client->streamid_rcv = streamid;
   ptls_aead_context_t *rememberctx = client->traffic_protection.dec.aead;
-  client->traffic_protection.dec.aead = ((tcpls_stream_t *) list_get(tcpls_client->streams, 0))->aead_dec;
+  client->traffic_protection.dec.aead = ((tcpls_stream_t *) slab_get(tcpls_client->streams, 0))->aead_dec;
   ret = ptls_receive(client, &decbuf, NULL, stream->sendbuf->base, &consumed);
   ok(ret == 0);
   client->traffic_protection.dec.aead = rememberctx;
@@ -1355,8 +1356,8 @@ static void test_tcpls_mpjoin(void)
   
   connect_info_t con;
   memset(&con, 0, sizeof(con));
-  list_add(tcpls_client->connect_infos, &con);
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls_client->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
   
   ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
   
@@ -1433,8 +1434,8 @@ static void test_sends_tcpls_record(void)
   memset(&con, 0, sizeof(con));
   con.state = JOINED;
   /*con.this_transportid = 42;*/
-  /*list_add(tcpls_client->connect_infos, &con);*/
-  list_add(tcpls_server->connect_infos, &con);
+  /*slab_add(tcpls_client->connect_infos, &con);*/
+  slab_add(tcpls_server->connect_infos, &con);
 
   ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
   
@@ -1514,6 +1515,356 @@ static void test_sends_tcpls_record(void)
   ctx_peer->support_tcpls_options = 0;
 }
 
+static void test_tcpls_stream_hint(void)
+{
+  ptls_t *client, *server;
+  ctx->support_tcpls_options = 1;
+  ctx_peer->support_tcpls_options = 1;
+  ctx->tcpls_stream_hint = 1;
+  ctx_peer->tcpls_stream_hint = 1;
+
+  ptls_buffer_t cbuf, sbuf, decbuf, databuf;
+  size_t coffs[5] = {0}, soffs[5];
+  ctx_peer->on_extension = NULL;
+  ctx->on_extension = NULL;
+  int ret;
+  size_t consumed;
+  tcpls_t *tcpls_client = tcpls_new(ctx, 0);
+  tcpls_t *tcpls_server = tcpls_new(ctx_peer, 1);
+  ptls_buffer_init(&cbuf, "", 0);
+  ptls_buffer_init(&sbuf, "", 0);
+  ptls_buffer_init(&decbuf, "", 0);
+  ptls_buffer_init(&databuf, "", 0);
+
+  client = tcpls_client->tls;
+  server = tcpls_server->tls;
+
+  connect_info_t con;
+  memset(&con, 0, sizeof(con));
+  con.state = JOINED;
+  slab_add(tcpls_server->connect_infos, &con);
+
+  ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
+  ok(ret == PTLS_ERROR_IN_PROGRESS);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ok(tcpls_server->stream_hint_confirmed == 1);
+  ret = feed_messages(client, &cbuf, coffs, sbuf.base, soffs, NULL);
+  ok(ret == 0);
+  ok(ptls_handshake_is_complete(client));
+  ok(tcpls_client->stream_hint_confirmed == 1);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ok(ptls_handshake_is_complete(server));
+
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  inet_pton(AF_INET, "192.168.1.1", &addr.sin_addr);
+  addr.sin_family = AF_INET;
+  ok(tcpls_add_v4(client, &addr, 1, 0, 0) == 0);
+  streamid_t streamid = tcpls_stream_new(client, NULL, (struct sockaddr*) &addr);
+  ok(tcpls_streams_attach(client, 0, 0) == 0);
+  /* the stream attach is sent with the default context */
+  ok(ntoh32(tcpls_client->sendbuf->base + 5) == 0);
+  consumed = tcpls_client->sendbuf->off;
+  ret = ptls_receive(server, &decbuf, NULL, tcpls_client->sendbuf->base, &consumed);
+  ok(ret == 0);
+  ok(stream_get(tcpls_server, streamid) != NULL);
+
+  /* the stream context shares the session's key, and encrypts as a context of
+   * its own would */
+  tcpls_stream_t *stream = stream_get(tcpls_client, streamid);
+  ok(((struct st_tcpls_stream_aead_t *) stream->aead_enc)->key == tcpls_client->stream_key_enc);
+  {
+    ptls_cipher_suite_t *cs = client->cipher_suite;
+    uint8_t key[PTLS_MAX_SECRET_SIZE], iv[PTLS_MAX_IV_SIZE], expected[64], actual[64];
+    ok(ptls_hkdf_expand_label(cs->hash, key, cs->aead->key_size, ptls_iovec_init(client->traffic_protection.enc.secret,
+            cs->hash->digest_size), "key", ptls_iovec_init(NULL, 0), NULL) == 0);
+    ok(ptls_hkdf_expand_label(cs->hash, iv, cs->aead->iv_size, ptls_iovec_init(client->traffic_protection.enc.secret,
+            cs->hash->digest_size), "iv", ptls_iovec_init(NULL, 0), NULL) == 0);
+    stream_derive_new_aead_iv(client, iv, cs->aead->iv_size, stream->offset, 1);
+    ptls_aead_context_t *aead = ptls_aead_new_direct(cs->aead, 1, key, iv);
+    size_t len = ptls_aead_encrypt(aead, expected, "hello", 5, 7, "aad", 3);
+    ok(ptls_aead_encrypt(stream->aead_enc, actual, "hello", 5, 7, "aad", 3) == len);
+    ok(memcmp(expected, actual, len) == 0);
+    ptls_aead_free(aead);
+  }
+
+  /* data over the stream is decrypted without touching the server's dec context */
+  ptls_aead_context_t *rememberctx = client->traffic_protection.enc.aead;
+  client->traffic_protection.enc.aead = stream->aead_enc;
+  ok(ptls_send(client, streamid, &databuf, "hello", 5) == 0);
+  client->traffic_protection.enc.aead = rememberctx;
+  ok(ntoh32(databuf.base + 5) == streamid);
+  consumed = databuf.off;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base, &consumed);
+  ok(ret == 0);
+  ok(consumed == databuf.off);
+  ok(tcpls_server->streamid_rcv == streamid);
+  ok(decbuf.off == 5 && memcmp(decbuf.base, "hello", 5) == 0);
+
+  /* the hint is authenticated */
+  databuf.off = 0;
+  client->traffic_protection.enc.aead = stream->aead_enc;
+  ok(ptls_send(client, streamid, &databuf, "world", 5) == 0);
+  client->traffic_protection.enc.aead = rememberctx;
+  databuf.base[8] ^= 1;
+  consumed = databuf.off;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base, &consumed);
+  ok(ret != 0);
+
+  ptls_buffer_dispose(&cbuf);
+  ptls_buffer_dispose(&sbuf);
+  ptls_buffer_dispose(&decbuf);
+  ptls_buffer_dispose(&databuf);
+  tcpls_free(tcpls_client);
+  tcpls_free(tcpls_server);
+
+  ctx->tcpls_stream_hint = 0;
+  ctx_peer->tcpls_stream_hint = 0;
+  ctx->support_tcpls_options = 0;
+  ctx_peer->support_tcpls_options = 0;
+}
+
+static void test_tcpls_reassembly(void)
+{
+  ptls_t *client, *server;
+  ctx->support_tcpls_options = 1;
+  ctx_peer->support_tcpls_options = 1;
+  ctx->tcpls_stream_hint = 1;
+  ctx_peer->tcpls_stream_hint = 1;
+
+  ptls_buffer_t cbuf, sbuf, decbuf, databuf;
+  size_t coffs[5] = {0}, soffs[5];
+  ctx_peer->on_extension = NULL;
+  ctx->on_extension = NULL;
+  int ret;
+  size_t consumed;
+  tcpls_t *tcpls_client = tcpls_new(ctx, 0);
+  tcpls_t *tcpls_server = tcpls_new(ctx_peer, 1);
+  ptls_buffer_init(&cbuf, "", 0);
+  ptls_buffer_init(&sbuf, "", 0);
+  ptls_buffer_init(&decbuf, "", 0);
+  ptls_buffer_init(&databuf, "", 0);
+
+  client = tcpls_client->tls;
+  server = tcpls_server->tls;
+
+  connect_info_t con;
+  memset(&con, 0, sizeof(con));
+  con.state = JOINED;
+  slab_add(tcpls_server->connect_infos, &con);
+
+  ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
+  ok(ret == PTLS_ERROR_IN_PROGRESS);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ret = feed_messages(client, &cbuf, coffs, sbuf.base, soffs, NULL);
+  ok(ret == 0);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ok(ptls_handshake_is_complete(server));
+
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  inet_pton(AF_INET, "192.168.1.1", &addr.sin_addr);
+  addr.sin_family = AF_INET;
+  ok(tcpls_add_v4(client, &addr, 1, 0, 0) == 0);
+  streamid_t streamid = tcpls_stream_new(client, NULL, (struct sockaddr*) &addr);
+  ok(tcpls_streams_attach(client, 0, 0) == 0);
+  consumed = tcpls_client->sendbuf->off;
+  ret = ptls_receive(server, &decbuf, NULL, tcpls_client->sendbuf->base, &consumed);
+  ok(ret == 0);
+
+  tcpls_buffer_t *buf = tcpls_reassembly_buffer_new(tcpls_server, 4);
+  ok(buf != NULL);
+  tcpls_client->enable_multipath = 1;
+  tcpls_server->enable_multipath = 1;
+
+  /* the second record arrives first, e.g., over another connection */
+  tcpls_stream_t *stream = stream_get(tcpls_client, streamid);
+  ptls_aead_context_t *rememberctx = client->traffic_protection.enc.aead;
+  client->traffic_protection.enc.aead = stream->aead_enc;
+  tcpls_client->send_mpseq = 1;
+  ok(ptls_send(client, streamid, &databuf, "world", 5) == 0);
+  tcpls_client->send_mpseq = 0;
+  ok(ptls_send(client, streamid, &databuf, "hello", 5) == 0);
+  client->traffic_protection.enc.aead = rememberctx;
+
+  ptls_iovec_t vecs[4];
+  size_t first = databuf.off / 2;
+  consumed = first;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base, &consumed);
+  ok(ret == 0);
+  ok(tcpls_server->next_expected_mpseq == 0);
+  ok(tcpls_buffer_peek(tcpls_server, vecs, 4) == 0);
+  consumed = databuf.off - first;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base + first, &consumed);
+  ok(ret == 0);
+  ok(tcpls_server->next_expected_mpseq == 2);
+  /* the records were decrypted in place */
+  ok(decbuf.off == 0);
+  tcpls_stats_t stats;
+  tcpls_stream_stats_t stream_stats;
+  tcpls_get_stats(tcpls_client, &stats);
+  ok(stats.records_sent == 2 && stats.bytes_sent == 10);
+  tcpls_get_stats(tcpls_server, &stats);
+  ok(stats.records_received == 2 && stats.bytes_received == 10);
+  ok(stats.reorder_high_water == 1);
+  uint64_t nbr_delays = 0;
+  for (int i = 0; i < TCPLS_STATS_REORDER_DELAY_BUCKETS; i++)
+    nbr_delays += stats.reorder_delay_us[i];
+  ok(nbr_delays == 1);
+  ok(tcpls_get_stream_stats(tcpls_server, streamid, &stream_stats) == 0);
+  ok(stream_stats.streamid == streamid && stream_stats.records_received == 2);
+  ok(tcpls_get_stream_stats(tcpls_server, streamid+1, &stream_stats) == -1);
+  ok(tcpls_buffer_peek(tcpls_server, vecs, 4) == 2);
+  ok(vecs[0].len == 5 && memcmp(vecs[0].base, "hello", 5) == 0);
+  ok(vecs[1].len == 5 && memcmp(vecs[1].base, "world", 5) == 0);
+  tcpls_buffer_consume(tcpls_server, 7);
+  ok(tcpls_buffer_peek(tcpls_server, vecs, 4) == 1);
+  ok(vecs[0].len == 3 && memcmp(vecs[0].base, "rld", 3) == 0);
+  tcpls_buffer_consume(tcpls_server, 3);
+  ok(tcpls_buffer_peek(tcpls_server, vecs, 4) == 0);
+  ok(buf->read_mpseq == 2 && buf->window->size == 0);
+
+  /* the application lags behind: what the window has no room for is held,
+   * and no socket is read until it consumed enough */
+  databuf.off = 0;
+  client->traffic_protection.enc.aead = stream->aead_enc;
+  tcpls_client->send_mpseq = 2;
+  for (int i = 0; i < 6; i++) {
+    char msg[2] = {'a'+i, '\n'};
+    ok(ptls_send(client, streamid, &databuf, msg, 2) == 0);
+  }
+  client->traffic_protection.enc.aead = rememberctx;
+  consumed = databuf.off;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base, &consumed);
+  ok(ret == 0);
+  ok(consumed == databuf.off);
+  ok(tcpls_server->next_expected_mpseq == 6);
+  ok(buf->held->size == 2);
+  ok(tcpls_receive(server, buf, NULL) == TCPLS_HOLD_DATA_TO_CONSUME);
+  tcpls_buffer_consume(tcpls_server, 2);
+  ok(reassembly_release_held(tcpls_server) == 1);
+  ok(tcpls_server->next_expected_mpseq == 7);
+  tcpls_buffer_consume(tcpls_server, 6);
+  ok(reassembly_release_held(tcpls_server) == 0);
+  ok(tcpls_server->next_expected_mpseq == 8);
+  ok(tcpls_buffer_peek(tcpls_server, vecs, 4) == 2);
+  ok(vecs[0].len == 2 && memcmp(vecs[0].base, "e\n", 2) == 0);
+  ok(vecs[1].len == 2 && memcmp(vecs[1].base, "f\n", 2) == 0);
+
+  ptls_buffer_dispose(&cbuf);
+  ptls_buffer_dispose(&sbuf);
+  ptls_buffer_dispose(&decbuf);
+  ptls_buffer_dispose(&databuf);
+  tcpls_buffer_free(tcpls_server, buf);
+  tcpls_free(tcpls_client);
+  tcpls_free(tcpls_server);
+
+  ctx->tcpls_stream_hint = 0;
+  ctx_peer->tcpls_stream_hint = 0;
+  ctx->support_tcpls_options = 0;
+  ctx_peer->support_tcpls_options = 0;
+}
+
+static void test_tcpls_reorder(void)
+{
+  ptls_t *client, *server;
+  ctx->support_tcpls_options = 1;
+  ctx_peer->support_tcpls_options = 1;
+  ctx->tcpls_stream_hint = 1;
+  ctx_peer->tcpls_stream_hint = 1;
+
+  ptls_buffer_t cbuf, sbuf, decbuf, databuf;
+  size_t coffs[5] = {0}, soffs[5];
+  ctx_peer->on_extension = NULL;
+  ctx->on_extension = NULL;
+  int ret;
+  size_t consumed;
+  tcpls_t *tcpls_client = tcpls_new(ctx, 0);
+  tcpls_t *tcpls_server = tcpls_new(ctx_peer, 1);
+  ptls_buffer_init(&cbuf, "", 0);
+  ptls_buffer_init(&sbuf, "", 0);
+  ptls_buffer_init(&decbuf, "", 0);
+  ptls_buffer_init(&databuf, "", 0);
+
+  client = tcpls_client->tls;
+  server = tcpls_server->tls;
+
+  connect_info_t con;
+  memset(&con, 0, sizeof(con));
+  con.state = JOINED;
+  slab_add(tcpls_server->connect_infos, &con);
+
+  ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
+  ok(ret == PTLS_ERROR_IN_PROGRESS);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ret = feed_messages(client, &cbuf, coffs, sbuf.base, soffs, NULL);
+  ok(ret == 0);
+  ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+  ok(ret == 0);
+  ok(ptls_handshake_is_complete(server));
+
+  struct sockaddr_in addr;
+  bzero(&addr, sizeof(addr));
+  inet_pton(AF_INET, "192.168.1.1", &addr.sin_addr);
+  addr.sin_family = AF_INET;
+  ok(tcpls_add_v4(client, &addr, 1, 0, 0) == 0);
+  streamid_t streamid = tcpls_stream_new(client, NULL, (struct sockaddr*) &addr);
+  ok(tcpls_streams_attach(client, 0, 0) == 0);
+  consumed = tcpls_client->sendbuf->off;
+  ret = ptls_receive(server, &decbuf, NULL, tcpls_client->sendbuf->base, &consumed);
+  ok(ret == 0);
+
+  tcpls_client->enable_multipath = 1;
+  tcpls_server->enable_multipath = 1;
+  tcpls_server->reorder_window_size = 4;
+
+  /* records 1 to 7 arrive before record 0: the window takes the first 3 and
+   * the others are held aside */
+  tcpls_stream_t *stream = stream_get(tcpls_client, streamid);
+  ptls_aead_context_t *rememberctx = client->traffic_protection.enc.aead;
+  client->traffic_protection.enc.aead = stream->aead_enc;
+  for (int i = 1; i <= 8; i++) {
+    char msg[2] = {'a'+i%8, '\n'};
+    tcpls_client->send_mpseq = i%8;
+    ok(ptls_send(client, streamid, &databuf, msg, 2) == 0);
+  }
+  client->traffic_protection.enc.aead = rememberctx;
+  size_t last = databuf.off / 8 * 7;
+  consumed = last;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base, &consumed);
+  ok(ret == 0);
+  ok(consumed == last);
+  ok(decbuf.off == 0);
+  ok(tcpls_server->reorder_window->size == 3);
+  ok(tcpls_server->reorder_held->size == 4);
+  /* record 0 releases them all, in order */
+  consumed = databuf.off - last;
+  ret = ptls_receive(server, &decbuf, NULL, databuf.base + last, &consumed);
+  ok(ret == 0);
+  ok(decbuf.off == 2);
+  ok(multipath_merge_buffers(tcpls_server, &decbuf) == 14);
+  ok(decbuf.off == 16 && memcmp(decbuf.base, "a\nb\nc\nd\ne\nf\ng\nh\n", 16) == 0);
+  ok(tcpls_server->next_expected_mpseq == 8);
+  ok(tcpls_server->reorder_window->size == 0 && tcpls_server->reorder_held->size == 0);
+
+  ptls_buffer_dispose(&cbuf);
+  ptls_buffer_dispose(&sbuf);
+  ptls_buffer_dispose(&decbuf);
+  ptls_buffer_dispose(&databuf);
+  tcpls_free(tcpls_client);
+  tcpls_free(tcpls_server);
+
+  ctx->tcpls_stream_hint = 0;
+  ctx_peer->tcpls_stream_hint = 0;
+  ctx->support_tcpls_options = 0;
+  ctx_peer->support_tcpls_options = 0;
+}
+
 static void test_server_sends_tcpls_encrypted_extensions(void)
 {
   ptls_t *client, *server;
@@ -1552,8 +1903,8 @@ static void test_server_sends_tcpls_encrypted_extensions(void)
  
   connect_info_t con;
   memset(&con, 0, sizeof(con));
-  list_add(tcpls_client->connect_infos, &con);
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls_client->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
 
   ret = tcpls_set_user_timeout(tcpls_server, 0, 5, 0, 1, 1);
   ok(ret == -1);
@@ -1617,7 +1968,7 @@ static void test_tcpls_usertimeout(void)
   tcpls_t *tcpls_server = tcpls_new(ctx_peer, 1);
   connect_info_t con;
   memset(&con, 0, sizeof(con));
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
   /** 1 second */
   int ret = tcpls_set_user_timeout(tcpls_server, 0, 1, 0, 1, 1);
   ok(ret == -1);
@@ -1679,8 +2030,8 @@ static void test_tcpls_option_api(void)
   *ptls_get_data_ptr(server) = &server_secrets;
   connect_info_t con;
   memset(&con, 0, sizeof(con));
-  list_add(tcpls_client->connect_infos, &con);
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls_client->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
   /* full handshake */
   ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
   ok(ret == PTLS_ERROR_IN_PROGRESS);
@@ -1993,6 +2344,128 @@ static void test_handshake_api(void)
     ctx_peer->max_early_data_size = 0;
 }
 
+static void test_receive_batch(void)
+{
+    ptls_t *client, *server;
+    ptls_buffer_t cbuf, sbuf, decbuf;
+    size_t coffs[5] = {0}, soffs[5], consumed, reclen;
+    static uint8_t data[2 * PTLS_MAX_PLAINTEXT_RECORD_SIZE + 100];
+    int ret;
+
+    ptls_buffer_init(&cbuf, "", 0);
+    ptls_buffer_init(&sbuf, "", 0);
+    ptls_buffer_init(&decbuf, "", 0);
+    client = ptls_new(ctx, 0);
+    server = ptls_new(ctx_peer, 1);
+
+    ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
+    ok(ret == PTLS_ERROR_IN_PROGRESS);
+    ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+    ok(ret == 0);
+    ret = feed_messages(client, &cbuf, coffs, sbuf.base, soffs, NULL);
+    ok(ret == 0);
+    ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+    ok(ret == 0);
+    ok(ptls_handshake_is_complete(server));
+    cbuf.off = 0;
+
+    for (size_t i = 0; i != sizeof(data); ++i)
+        data[i] = (uint8_t)i;
+    ret = ptls_send(client, 0, &cbuf, data, sizeof(data));
+    ok(ret == 0);
+    reclen = 5 + ((cbuf.base[3] << 8) | cbuf.base[4]);
+
+    /* every complete record is decrypted in one call, the partial one is kept */
+    consumed = cbuf.off - 50;
+    ret = ptls_receive_batch(server, &decbuf, NULL, cbuf.base, &consumed);
+    ok(ret == 0);
+    ok(consumed == cbuf.off - 50);
+    ok(decbuf.off == 2 * PTLS_MAX_PLAINTEXT_RECORD_SIZE);
+    consumed = 50;
+    ret = ptls_receive_batch(server, &decbuf, NULL, cbuf.base + cbuf.off - 50, &consumed);
+    ok(ret == 0);
+    ok(consumed == 50);
+    ok(decbuf.off == sizeof(data));
+    ok(memcmp(decbuf.base, data, sizeof(data)) == 0);
+
+    /* stops before the record which fails to decrypt */
+    cbuf.off = 0;
+    decbuf.off = 0;
+    ret = ptls_send(client, 0, &cbuf, data, sizeof(data));
+    ok(ret == 0);
+    cbuf.base[2 * reclen - 1] ^= 1;
+    consumed = cbuf.off;
+    ret = ptls_receive_batch(server, &decbuf, NULL, cbuf.base, &consumed);
+    ok(ret == PTLS_ALERT_BAD_RECORD_MAC);
+    ok(consumed == reclen);
+    ok(decbuf.off == PTLS_MAX_PLAINTEXT_RECORD_SIZE);
+
+    ptls_free(client);
+    ptls_free(server);
+    ptls_buffer_dispose(&cbuf);
+    ptls_buffer_dispose(&sbuf);
+    ptls_buffer_dispose(&decbuf);
+}
+
+static void test_sendv(void)
+{
+    ptls_t *client, *server;
+    ptls_buffer_t cbuf, sbuf, decbuf;
+    size_t coffs[5] = {0}, soffs[5], consumed, nrecords;
+    static uint8_t body[2 * PTLS_MAX_PLAINTEXT_RECORD_SIZE + 100];
+    static const char header[] = "HTTP/1.1 200 OK\r\n\r\n", trailer[] = "0\r\n\r\n";
+    ptls_iovec_t iov[] = {{(uint8_t *)header, sizeof(header) - 1}, {NULL, 0}, {body, sizeof(body)},
+                          {(uint8_t *)trailer, sizeof(trailer) - 1}};
+    int ret;
+
+    ptls_buffer_init(&cbuf, "", 0);
+    ptls_buffer_init(&sbuf, "", 0);
+    ptls_buffer_init(&decbuf, "", 0);
+    client = ptls_new(ctx, 0);
+    server = ptls_new(ctx_peer, 1);
+
+    ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
+    ok(ret == PTLS_ERROR_IN_PROGRESS);
+    ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+    ok(ret == 0);
+    ret = feed_messages(client, &cbuf, coffs, sbuf.base, soffs, NULL);
+    ok(ret == 0);
+    ret = feed_messages(server, &sbuf, soffs, cbuf.base, coffs, NULL);
+    ok(ret == 0);
+    ok(ptls_handshake_is_complete(server));
+
+    for (size_t i = 0; i != sizeof(body); ++i)
+        body[i] = (uint8_t)i;
+
+    for (int align = 0; align <= 1; ++align) {
+        cbuf.off = 0;
+        decbuf.off = 0;
+        ret = ptls_sendv(client, 0, &cbuf, iov, PTLS_ELEMENTSOF(iov), align);
+        ok(ret == 0);
+        /* records are filled across buffers, unless aligned to them */
+        for (nrecords = 0, consumed = 0; consumed < cbuf.off; ++nrecords) {
+            size_t reclen = 5 + ((cbuf.base[consumed + 3] << 8) | cbuf.base[consumed + 4]);
+            size_t off = decbuf.off;
+            ret = ptls_receive(server, &decbuf, NULL, cbuf.base + consumed, &reclen);
+            ok(ret == 0);
+            if (align && nrecords == 0)
+                ok(decbuf.off - off == sizeof(header) - 1);
+            consumed += reclen;
+        }
+        ok(nrecords == (align ? 5 : 3));
+        ok(decbuf.off == sizeof(header) - 1 + sizeof(body) + sizeof(trailer) - 1);
+        ok(memcmp(decbuf.base, header, sizeof(header) - 1) == 0);
+        ok(memcmp(decbuf.base + sizeof(header) - 1, body, sizeof(body)) == 0);
+        ok(memcmp(decbuf.base + sizeof(header) - 1 + sizeof(body), trailer, sizeof(trailer) - 1) == 0);
+    }
+
+    ptls_free(client);
+    ptls_free(server);
+    ptls_buffer_dispose(&cbuf);
+    ptls_buffer_dispose(&sbuf);
+    ptls_buffer_dispose(&decbuf);
+}
+
 static void test_all_handshakes(void)
 {
     ptls_sign_certificate_t server_sc = {sign_certificate};
@@ -2020,6 +2493,9 @@ static void test_all_handshakes(void)
 
     subtest("key-update", test_key_update);
 
+    subtest("receive-batch", test_receive_batch);
+    subtest("sendv", test_sendv);
+
     subtest("handshake-api", test_handshake_api);
 
     ctx_peer->sign_certificate = sc_orig;
@@ -2122,6 +2598,9 @@ static void test_tcpls(void)
     subtest("set_usertimeout", test_tcpls_usertimeout);
     subtest("server_sends_tcpls_encrypted_extensions", test_server_sends_tcpls_encrypted_extensions);
     subtest("sends_tcpls_record", test_sends_tcpls_record);
+    subtest("stream_hint", test_tcpls_stream_hint);
+    subtest("reassembly", test_tcpls_reassembly);
+    subtest("reorder", test_tcpls_reorder);
     subtest("sends_varlen_bpf_prog", test_sends_varlen_bpf_prog);
     subtest("mpjoin", test_tcpls_mpjoin);
     ctx_peer->sign_certificate = sc_orig;
@@ -2190,8 +2669,8 @@ static void test_tcpls_addresses(void)
   
   connect_info_t con;
   memset(&con, 0, sizeof(con));
-  list_add(tcpls->connect_infos, &con);
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
 
   ret = ptls_handle_message(client, &cbuf, coffs, 0, NULL, 0, NULL);
   ok(ret == PTLS_ERROR_IN_PROGRESS);
@@ -2239,7 +2718,7 @@ static void test_tcpls_stream_api(void)
   connect_info_t con;
   memset(&con, 0, sizeof(con));
   con.state = JOINED;
-  list_add(tcpls_server->connect_infos, &con);
+  slab_add(tcpls_server->connect_infos, &con);
   inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
   inet_pton(AF_INET, "192.168.1.1", &addr2.sin_addr);
   ok(tcpls_add_v4(tcpls_server->tls, &addr, 1, 1, 1) == 0);
@@ -2313,10 +2792,765 @@ static void test_tcpls_stream_api(void)
   tcpls_free(tcpls_server);
 }
 
+static void test_tcpls_send_schedulers(void)
+{
+  tcpls_t *tcpls = tcpls_new(ctx, 0);
+  int socks[2][2];
+  ptls_buffer_t sendbufs[2];
+  for (int i = 0; i < 2; i++) {
+    ok(socketpair(AF_UNIX, SOCK_STREAM, 0, socks[i]) == 0);
+    connect_info_t con;
+    memset(&con, 0, sizeof(con));
+    con.state = CONNECTED;
+    con.socket = socks[i][0];
+    con.this_transportid = i;
+    /* the second connection is the fastest */
+    con.connect_time.tv_usec = i ? 10000 : 50000;
+    slab_add(tcpls->connect_infos, &con);
+    tcpls_stream_t stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.streamid = i+1;
+    stream.transportid = i;
+    stream.stream_usable = 1;
+    stream.aead_initialized = 1;
+    ptls_buffer_init(&sendbufs[i], "", 0);
+    stream.sendbuf = &sendbufs[i];
+    stream_insert(tcpls, &stream);
+  }
+  tcpls_stream_t *stream1 = slab_get(tcpls->streams, 0);
+  tcpls_stream_t *stream2 = slab_get(tcpls->streams, 1);
+
+  ok(lowest_rtt_send_scheduler(tcpls, 1000, NULL) == stream2);
+  ok(buffer_occupancy_send_scheduler(tcpls, 1000, NULL) == stream2);
+  /* the fastest one is full */
+  ok(ptls_buffer_reserve(&sendbufs[1], TCPLS_SSCHED_MAX_BACKLOG) == 0);
+  sendbufs[1].off = TCPLS_SSCHED_MAX_BACKLOG;
+  ok(lowest_rtt_send_scheduler(tcpls, 1000, NULL) == stream1);
+  ok(buffer_occupancy_send_scheduler(tcpls, 1000, NULL) == stream1);
+  sendbufs[1].off = 0;
+  /* a sampled RTT takes over the one measured upon connect */
+  connection_get(tcpls, 0)->metrics.srtt_us = 5000;
+  ok(lowest_rtt_send_scheduler(tcpls, 1000, NULL) == stream1);
+  connection_get(tcpls, 0)->metrics.srtt_us = 0;
+
+  ok(tcpls_set_send_weight(tcpls, 0, 2) == 0);
+  ok(tcpls_set_send_weight(tcpls, 2, 1) == -1);
+  int nbr_sent[2] = {0};
+  for (int i = 0; i < 6; i++) {
+    tcpls_stream_t *stream = weighted_round_robin_send_scheduler(tcpls, 1000, NULL);
+    nbr_sent[stream == stream2]++;
+  }
+  ok(nbr_sent[0] == 4 && nbr_sent[1] == 2);
+
+  /* unusable streams are never picked */
+  stream2->stream_usable = 0;
+  ok(lowest_rtt_send_scheduler(tcpls, 1000, NULL) == stream1);
+  ok(weighted_round_robin_send_scheduler(tcpls, 1000, NULL) == stream1);
+  stream1->stream_usable = 0;
+  ok(buffer_occupancy_send_scheduler(tcpls, 1000, NULL) == NULL);
+
+  for (int i = 0; i < 2; i++) {
+    close(socks[i][0]);
+    close(socks[i][1]);
+  }
+  tcpls_free(tcpls);
+}
+
+static void test_tcpls_connect_race(void)
+{
+  tcpls_t *tcpls = tcpls_new(ctx, 0);
+  struct sockaddr_in listen_addr, addr1, addr2;
+  socklen_t len = sizeof(listen_addr);
+  int lsock = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&listen_addr, 0, sizeof(listen_addr));
+  listen_addr.sin_family = AF_INET;
+  listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  ok(bind(lsock, (struct sockaddr *) &listen_addr, sizeof(listen_addr)) == 0);
+  ok(listen(lsock, 4) == 0);
+  ok(getsockname(lsock, (struct sockaddr *) &listen_addr, &len) == 0);
+  addr1 = listen_addr;
+  addr1.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr2 = addr1;
+  addr2.sin_addr.s_addr = htonl(INADDR_LOOPBACK+1);
+  ok(tcpls_add_v4(tcpls->tls, &addr1, 0, 0, 0) == 0);
+  ok(tcpls_add_v4(tcpls->tls, &addr2, 1, 0, 0) == 0);
+
+  /* the second attempt is not due before the first one connects */
+  tcpls->connect_attempt_delay_ms = 60000;
+  ok(tcpls_connect_start(tcpls->tls, NULL, NULL, 1) == 0);
+  ok(tcpls->connect_infos->size == 2);
+  int ret, i = 0;
+  while ((ret = tcpls_connect_progress(tcpls, NULL)) == PTLS_ERROR_IN_PROGRESS && i++ < 1000)
+    usleep(1000);
+  ok(ret == 0);
+  ok(tcpls->connector == NULL);
+  connect_info_t *con1 = slab_get(tcpls->connect_infos, 0), *con2 = slab_get(tcpls->connect_infos, 1);
+  /* the first one won and became primary, the other was never started */
+  ok(con1->state == CONNECTED);
+  ok(con1->is_primary && !con2->is_primary);
+  ok(tcpls->socket_primary == con1->socket);
+  ok(con2->state == CLOSED && con2->socket == 0);
+
+  /* tcpls_connect() only starts the closed one */
+  struct timeval timeout = {.tv_sec = 5};
+  ok(tcpls_connect(tcpls->tls, NULL, NULL, &timeout) == 0);
+  ok(con2->state == CONNECTED);
+  ok(con1->is_primary);
+
+  tcpls_path_metrics_t metrics;
+  ok(tcpls_get_path_metrics(tcpls, con1->this_transportid, &metrics) == 0);
+  ok(metrics.srtt_us != 0 && metrics.snd_mss != 0);
+  ok(con1->metrics.sampled.tv_sec != 0);
+
+  /* a source we do not own cannot be bound; its socket is not leaked */
+  struct sockaddr_in src = addr1;
+  src.sin_port = 0;
+  src.sin_addr.s_addr = htonl(0xc0000201);
+  ok(tcpls_add_v4(tcpls->tls, &src, 0, 0, 1) == 0);
+  connect_info_t *con3 = connection_prepare(tcpls, tcpls->ours_v4_addr_llist,
+      tcpls->v4_addr_llist, NULL, NULL, AF_INET);
+  ok(con3 != NULL && con3->state == CLOSED);
+  int fd = dup(lsock);
+  close(fd);
+  ok(connection_start(tcpls, con3) == -1);
+  ok(con3->state == CLOSED && con3->socket == 0);
+  ok(dup(lsock) == fd);
+  close(fd);
+
+  close(con1->socket);
+  close(con2->socket);
+  close(lsock);
+  tcpls_free(tcpls);
+}
+
+#define LOOPBACK_MAX_SOCKS 8
+
+/**
+ * A client and a server session connected over the loopback, where the server
+ * listens on 127.0.0.1 and 127.0.0.2. A handshake blocks on its socket, so the
+ * server runs the first one in a thread; MPJOIN handshakes are run once the
+ * client has written its ClientHello.
+ */
+typedef struct st_loopback_t {
+  int lsock;
+  struct sockaddr_in addrs[2];
+  tcpls_t *client;
+  tcpls_t *server;
+  /** the server sessions which carried a MPJOIN handshake */
+  tcpls_t *joins[LOOPBACK_MAX_SOCKS];
+  int nbr_joins;
+  /** sockets accepted by the server */
+  int socks[LOOPBACK_MAX_SOCKS];
+  int nbr_socks;
+} loopback_t;
+
+typedef struct st_loopback_handshake_t {
+  loopback_t *lb;
+  int enable_failover;
+  int ret;
+} loopback_handshake_t;
+
+static int loopback_on_mpjoin(tcpls_t *tcpls, int socket, uint8_t *connid, uint8_t *cookie,
+    uint32_t transportid, void *cb_data)
+{
+  loopback_t *lb = cb_data;
+  if (memcmp(lb->server->connid, connid, CONNID_LEN))
+    return -1;
+  return tcpls_accept(lb->server, socket, cookie, transportid) < 0 ? -1 : 0;
+}
+
+/**
+ * Accept a connection and give it a server session of its own
+ */
+static tcpls_t *loopback_accept(loopback_t *lb)
+{
+  fd_set rset;
+  struct timeval timeout = {.tv_sec = 5};
+  FD_ZERO(&rset);
+  FD_SET(lb->lsock, &rset);
+  if (lb->nbr_socks == LOOPBACK_MAX_SOCKS || select(lb->lsock+1, &rset, NULL, NULL, &timeout) != 1)
+    return NULL;
+  int sock = accept(lb->lsock, NULL, NULL);
+  if (sock < 0)
+    return NULL;
+  lb->socks[lb->nbr_socks++] = sock;
+  tcpls_t *tcpls = tcpls_new(ctx_peer, 1);
+  for (int i = 0; i < 2; i++)
+    tcpls_add_v4(tcpls->tls, &lb->addrs[i], 0, 0, 1);
+  if (tcpls_accept(tcpls, sock, NULL, 0) < 0) {
+    tcpls_free(tcpls);
+    return NULL;
+  }
+  return tcpls;
+}
+
+/**
+ * Accept the first connection and run the server side of its handshake; a
+ * fastopen client may only send its SYN along with the ClientHello
+ */
+static void *loopback_server_handshake(void *arg)
+{
+  loopback_handshake_t *hs = arg;
+  ptls_handshake_properties_t prop;
+  hs->ret = -1;
+  if ((hs->lb->server = loopback_accept(hs->lb)) == NULL) {
+    /* resets what waits in the backlog, so that the client gives up too */
+    close(hs->lb->lsock);
+    hs->lb->lsock = -1;
+    return NULL;
+  }
+  hs->lb->server->enable_failover = hs->enable_failover;
+  memset(&prop, 0, sizeof(prop));
+  prop.received_mpjoin_to_process = loopback_on_mpjoin;
+  prop.socket = hs->lb->socks[0];
+  hs->ret = tcpls_handshake(hs->lb->server->tls, &prop);
+  return NULL;
+}
+
+/**
+ * Connect the client to 127.0.0.1 and run the handshake; the client also
+ * knows of 127.0.0.2. With enable_fastopen, the server listens for TCP Fast
+ * Open and the client connects with it.
+ */
+static int loopback_new(loopback_t *lb, int enable_failover, int enable_fastopen)
+{
+  socklen_t len = sizeof(lb->addrs[0]);
+  memset(lb, 0, sizeof(*lb));
+  ctx->support_tcpls_options = 1;
+  ctx->cb_data = lb;
+  lb->lsock = socket(AF_INET, SOCK_STREAM, 0);
+  lb->addrs[0].sin_family = AF_INET;
+  lb->addrs[0].sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(lb->lsock, (struct sockaddr *) &lb->addrs[0], sizeof(lb->addrs[0])) != 0 ||
+      listen(lb->lsock, LOOPBACK_MAX_SOCKS) != 0 ||
+      getsockname(lb->lsock, (struct sockaddr *) &lb->addrs[0], &len) != 0 ||
+      (enable_fastopen && tcpls_listen_fastopen(lb->lsock, LOOPBACK_MAX_SOCKS) != 0))
+    return -1;
+  lb->addrs[0].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  lb->addrs[1] = lb->addrs[0];
+  lb->addrs[1].sin_addr.s_addr = htonl(INADDR_LOOPBACK+1);
+
+  lb->client = tcpls_new(ctx, 0);
+  lb->client->enable_failover = enable_failover;
+  lb->client->enable_fastopen = enable_fastopen;
+  for (int i = 0; i < 2; i++)
+    tcpls_add_v4(lb->client->tls, &lb->addrs[i], i == 0, 0, 0);
+  struct timeval timeout = {.tv_sec = 5};
+  if (tcpls_connect(lb->client->tls, NULL, (struct sockaddr *) &lb->addrs[0], &timeout) != 0)
+    return -1;
+  loopback_handshake_t hs = {lb, enable_failover};
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, loopback_server_handshake, &hs) != 0)
+    return -1;
+  ptls_handshake_properties_t prop;
+  memset(&prop, 0, sizeof(prop));
+  int ret = tcpls_handshake(lb->client->tls, &prop);
+  pthread_join(thread, NULL);
+  /* tests wait for small records to be queued on the server */
+  int nodelay = 1;
+  setsockopt(lb->client->socket_primary, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  return ret || hs.ret ? -1 : 0;
+}
+
+/**
+ * Give the client a connection towards 127.0.0.2, not connected yet; a
+ * connection from src, if any, is another one than the one without
+ */
+static connect_info_t *loopback_add_path(loopback_t *lb, struct sockaddr_in *src)
+{
+  tcpls_v4_addr_t *ours = NULL;
+  if (src) {
+    /* not a failover test of the context */
+    int failover = ctx->failover;
+    tcpls_add_v4(lb->client->tls, src, 0, 0, 1);
+    ctx->failover = failover;
+    if ((ours = get_addr_from_sockaddr(lb->client->ours_v4_addr_llist, src)) == NULL)
+      return NULL;
+  }
+  tcpls_v4_addr_t *dest = get_addr_from_sockaddr(lb->client->v4_addr_llist, &lb->addrs[1]);
+  return dest ? connection_prepare(lb->client, ours, dest, NULL, NULL, AF_INET) : NULL;
+}
+
+/**
+ * Run the server side of the MPJOIN handshake the client has sent over a new
+ * connection
+ */
+static int loopback_join(loopback_t *lb)
+{
+  tcpls_t *join = loopback_accept(lb);
+  if (!join)
+    return -1;
+  lb->joins[lb->nbr_joins++] = join;
+  ptls_handshake_properties_t prop;
+  memset(&prop, 0, sizeof(prop));
+  prop.received_mpjoin_to_process = loopback_on_mpjoin;
+  prop.socket = lb->socks[lb->nbr_socks-1];
+  return tcpls_handshake(join->tls, &prop) == PTLS_ERROR_HANDSHAKE_IS_MPJOIN ? 0 : -1;
+}
+
+
+/**
+ * Receive with tcpls until buf holds len bytes, or for a second at most
+ */
+static int loopback_receive(tcpls_t *tcpls, tcpls_buffer_t *buf, size_t len)
+{
+  for (int i = 0; i < 100 && buf->decryptbuf->off < len; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(tcpls->tls, buf, &tv);
+  }
+  return buf->decryptbuf->off == len ? 0 : -1;
+}
+
+/**
+ * Wait for at least len bytes to be queued on sock, and for the queue to stop
+ * growing
+ */
+static int loopback_wait_queued(int sock, int len)
+{
+  int queued = 0, previous = -1;
+  for (int i = 0; i < 100 && (queued < len || queued != previous); i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    previous = queued;
+    select(0, NULL, NULL, NULL, &tv);
+    if (ioctl(sock, FIONREAD, &queued) != 0)
+      return -1;
+  }
+  return queued >= len && queued == previous ? 0 : -1;
+}
+
+static void loopback_free(loopback_t *lb)
+{
+  for (int i = 0; lb->client && i < lb->client->connect_infos->size; i++) {
+    connect_info_t *con = slab_get(lb->client->connect_infos, i);
+    if (con->socket > 0)
+      close(con->socket);
+  }
+  for (int i = 0; i < lb->nbr_socks; i++)
+    close(lb->socks[i]);
+  for (int i = 0; i < lb->nbr_joins; i++)
+    tcpls_free(lb->joins[i]);
+  tcpls_free(lb->client);
+  tcpls_free(lb->server);
+  close(lb->lsock);
+  ctx->support_tcpls_options = 0;
+  ctx->cb_data = NULL;
+}
+
+static void test_tcpls_epoll(void)
+{
+  loopback_t lb;
+  ok(loopback_new(&lb, 0, 0) == 0);
+  tcpls_buffer_t *sbuf = tcpls_aggr_buffer_new(lb.server);
+  tcpls_buffer_t *cbuf = tcpls_aggr_buffer_new(lb.client);
+
+  /* an instance owned by the server session */
+  ok(tcpls_enable_epoll(lb.server, -1) == 0);
+  ok(lb.server->epoll_fd >= 0 && lb.server->epoll_owned);
+  ok(tcpls_enable_epoll(lb.server, -1) == -1);
+  ok(tcpls_send(lb.client->tls, 0, "hello", 5) == TCPLS_OK);
+  ok(loopback_receive(lb.server, sbuf, 5) == 0);
+  ok(memcmp(sbuf->decryptbuf->base, "hello", 5) == 0);
+  /* nothing left: times out */
+  struct timeval tv = {.tv_usec = 10000};
+  ok(tcpls_receive(lb.server->tls, sbuf, &tv) == -1);
+
+  /* an instance shared by the application, which feeds the ready sockets */
+  int epollfd = epoll_create1(EPOLL_CLOEXEC);
+  ok(tcpls_enable_epoll(lb.client, epollfd) == 0);
+  ok(lb.client->epoll_fd == epollfd && !lb.client->epoll_owned);
+  tcpls_stream_t *stream = slab_get(lb.server->streams, 0);
+  ok(tcpls_send(lb.server->tls, stream->streamid, "world", 5) == TCPLS_OK);
+  struct epoll_event events[4];
+  int nready = epoll_wait(epollfd, events, 4, 1000);
+  ok(nready == 1);
+  ok(events[0].data.fd == lb.client->socket_primary);
+  /* sockets of other sessions are ignored */
+  int socks[2] = {lb.lsock, events[0].data.fd};
+  ok(tcpls_receive_ready(lb.client->tls, cbuf, socks, 2) == TCPLS_OK);
+  ok(cbuf->decryptbuf->off == 5 && memcmp(cbuf->decryptbuf->base, "world", 5) == 0);
+
+  tcpls_buffer_free(lb.server, sbuf);
+  tcpls_buffer_free(lb.client, cbuf);
+  loopback_free(&lb);
+  close(epollfd);
+}
+
+static void test_tcpls_rsched(void)
+{
+  loopback_t lb;
+  ok(loopback_new(&lb, 0, 0) == 0);
+  tcpls_buffer_t *sbuf = tcpls_aggr_buffer_new(lb.server);
+  static uint8_t msg[6*PTLS_MAX_PLAINTEXT_RECORD_SIZE];
+  memset(msg, 'a', sizeof(msg));
+  connect_info_t *con = connection_get(lb.server, 0);
+  fd_set rset;
+  FD_ZERO(&rset);
+  FD_SET(con->socket, &rset);
+
+  /* the whole socket is read within one call, a recvbuflen at a time */
+  lb.server->recvbuflen = 4096;
+  ok(session_recvbuf_reserve(lb.server) == 0);
+  ok(tcpls_send(lb.client->tls, 0, msg, sizeof(msg)) == TCPLS_OK);
+  streamid_t streamid = ((tcpls_stream_t *) slab_get(lb.client->streams, 0))->streamid;
+  ok(loopback_wait_queued(con->socket, sizeof(msg)) == 0);
+  ok(drain_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_OK);
+  ok(sbuf->decryptbuf->off == sizeof(msg));
+  sbuf->decryptbuf->off = 0;
+  free(lb.server->recvbuf);
+  lb.server->recvbuf = NULL;
+  lb.server->recvbuflen = TCPLS_RECVBUF_SIZE;
+  ok(session_recvbuf_reserve(lb.server) == 0);
+
+  /* the first round only gets a quantum, the next one also the throughput
+   * measured in the first */
+  ok(tcpls_send(lb.client->tls, streamid, msg, sizeof(msg)) == TCPLS_OK);
+  ok(loopback_wait_queued(con->socket, sizeof(msg)) == 0);
+  ok(deficit_round_robin_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_HOLD_DATA_TO_READ);
+  con = connection_get(lb.server, 0);
+  ok(con->rcv_deficit == 0 && con->rcv_throughput == TCPLS_RSCHED_QUANTUM/4);
+  ok(sbuf->decryptbuf->off < sizeof(msg));
+  ok(deficit_round_robin_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_OK);
+  con = connection_get(lb.server, 0);
+  ok(con->rcv_deficit == 0);
+  ok(sbuf->decryptbuf->off == sizeof(msg));
+  sbuf->decryptbuf->off = 0;
+
+  /* a second connection lags behind next_expected_mpseq: it is drained first,
+   * and the one ahead only gets a quantum */
+  int pair[2];
+  ok(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+  connect_info_t lagging;
+  memset(&lagging, 0, sizeof(lagging));
+  lagging.socket = pair[0];
+  lagging.state = JOINED;
+  lagging.this_transportid = lb.server->next_transport_id++;
+  lagging.last_mpseq_received = UINT32_MAX;
+  ok(slab_add(lb.server->connect_infos, &lagging) != NULL);
+  FD_SET(pair[0], &rset);
+  lb.server->next_expected_mpseq = 0;
+  ok(tcpls_send(lb.client->tls, streamid, msg, sizeof(msg)) == TCPLS_OK);
+  con = connection_get(lb.server, 0);
+  ok(loopback_wait_queued(con->socket, sizeof(msg)) == 0);
+  ok(next_expected_mpseq_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_HOLD_DATA_TO_READ);
+  ok(sbuf->decryptbuf->off < sizeof(msg));
+  /* no gap: every socket is drained */
+  lb.server->next_expected_mpseq = 1;
+  ok(next_expected_mpseq_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_OK);
+  ok(sbuf->decryptbuf->off == sizeof(msg));
+  slab_remove(lb.server->connect_infos, connection_get(lb.server, 1));
+  close(pair[0]);
+  close(pair[1]);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+
+  /* a full reassembly window stops every scheduler */
+  ok(loopback_new(&lb, 0, 0) == 0);
+  sbuf = tcpls_reassembly_buffer_new(lb.server, 4);
+  ok(tcpls_send(lb.client->tls, 0, "abc", 3) == TCPLS_OK);
+  streamid = ((tcpls_stream_t *) slab_get(lb.client->streams, 0))->streamid;
+  for (int i = 1; i < 6; i++)
+    ok(tcpls_send(lb.client->tls, streamid, "abc", 3) == TCPLS_OK);
+  con = connection_get(lb.server, 0);
+  FD_ZERO(&rset);
+  FD_SET(con->socket, &rset);
+  ok(loopback_wait_queued(con->socket, 6*3) == 0);
+  ok(session_recvbuf_reserve(lb.server) == 0);
+  ok(round_robin_con_scheduler(lb.server, &rset, sbuf, NULL) == TCPLS_HOLD_DATA_TO_CONSUME);
+  ok(sbuf->held->size == 2);
+  ok(tcpls_receive(lb.server->tls, sbuf, NULL) == TCPLS_HOLD_DATA_TO_CONSUME);
+  tcpls_buffer_consume(lb.server, 6*3);
+  struct timeval tv = {.tv_usec = 10000};
+  ok(tcpls_receive(lb.server->tls, sbuf, &tv) == -1);
+  ptls_iovec_t vecs[4];
+  ok(tcpls_buffer_peek(lb.server, vecs, 4) == 2);
+  ok(sbuf->held->size == 0);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+}
+
+/**
+ * tcpls_sendv() in multipath mode, where each record is cut from the iovecs
+ * before the send scheduler picks its stream
+ */
+static void test_tcpls_sendv(void)
+{
+  loopback_t lb;
+  static uint8_t body[20000], expected[7+sizeof(body)+8];
+  ok(loopback_new(&lb, 0, 0) == 0);
+  lb.client->enable_multipath = 1;
+  lb.server->enable_multipath = 1;
+  lb.client->schedule_send = lowest_rtt_send_scheduler;
+  tcpls_buffer_t *sbuf = tcpls_reassembly_buffer_new(lb.server, 16);
+  memset(body, 'b', sizeof(body));
+  ptls_iovec_t iov[4] = {{(uint8_t *) "header\n", 7}, {NULL, 0}, {body, sizeof(body)},
+    {(uint8_t *) "trailer\n", 8}};
+  memcpy(expected, iov[0].base, 7);
+  memcpy(expected+7, body, sizeof(body));
+  memcpy(expected+7+sizeof(body), iov[3].base, 8);
+  size_t recsize = PTLS_MAX_PLAINTEXT_RECORD_SIZE -
+    get_tcpls_header_size(lb.client, PTLS_CONTENT_TYPE_TCPLS_DATA, NONE);
+  /* aligned, no record spans two iovecs and the empty one makes none;
+   * otherwise, the records are as full as can be */
+  size_t aligned[] = {7, recsize, sizeof(body)-recsize, 8}, packed[] = {recsize, sizeof(expected)-recsize};
+  streamid_t streamid = 0;
+  for (int align = 1; align >= 0; align--) {
+    size_t *lens = align ? aligned : packed, nbr_records = align ? 4 : 2, nbr_vecs = 0;
+    ok(tcpls_sendv(lb.client->tls, streamid, iov, 4, align) == TCPLS_OK);
+    streamid = ((tcpls_stream_t *) slab_get(lb.client->streams, 0))->streamid;
+    ptls_iovec_t vecs[8];
+    for (int i = 0; i < 100 && (nbr_vecs = tcpls_buffer_peek(lb.server, vecs, 8)) < nbr_records; i++) {
+      struct timeval tv = {.tv_usec = 10000};
+      tcpls_receive(lb.server->tls, sbuf, &tv);
+    }
+    ok(nbr_vecs == nbr_records);
+    int same = nbr_vecs == nbr_records;
+    for (size_t i = 0, off = 0; same && i < nbr_records; off += lens[i++])
+      same = vecs[i].len == lens[i] && memcmp(vecs[i].base, expected+off, lens[i]) == 0;
+    ok(same);
+    tcpls_buffer_consume(lb.server, sizeof(expected));
+  }
+  ok(lb.client->stats.records_sent == 6);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+}
+
+static void test_tcpls_unacked_cap(void)
+{
+  loopback_t lb;
+  uint8_t msg[256] = {0};
+  ok(loopback_new(&lb, 1, 0) == 0);
+  ok(tcpls_set_max_unacked_bytes(lb.client, sizeof(msg)) == 0);
+  /* nothing waits for an ack: the input goes whole, even past the cap */
+  ok(tcpls_send(lb.client->tls, 0, msg, sizeof(msg)) == TCPLS_HOLD_DATA_TO_SEND);
+  tcpls_stream_t *stream = slab_get(lb.client->streams, 0);
+  size_t off = stream->sendbuf->off;
+  /* refused, and not encrypted */
+  ok(tcpls_send(lb.client->tls, stream->streamid, msg, 1) == TCPLS_HOLD_UNACKED_DATA);
+  ok(stream->sendbuf->off == off);
+  tcpls_stream_stats_t stats;
+  ok(tcpls_get_stream_stats(lb.client, stream->streamid, &stats) == 0);
+  ok(stats.holds == 2);
+  /* room again once acked */
+  stream->send_acked = stream->sendbuf->off;
+  ok(tcpls_send(lb.client->tls, stream->streamid, msg, 1) == TCPLS_OK);
+  loopback_free(&lb);
+}
+
+/**
+ * Open the client's first stream and have the server ack its first records,
+ * so that a failover replays none of what the server got
+ */
+static tcpls_stream_t *loopback_acked_stream(loopback_t *lb, tcpls_buffer_t *sbuf, tcpls_buffer_t *cbuf)
+{
+  uint8_t msg[256] = {0};
+  if (tcpls_send(lb->client->tls, 0, msg, sizeof(msg)) < 0)
+    return NULL;
+  tcpls_stream_t *stream = slab_get(lb->client->streams, 0);
+  /* the last record acked is not released */
+  for (int i = 0; i < 2; i++) {
+    if (tcpls_send(lb->client->tls, stream->streamid, msg, sizeof(msg)) < 0)
+      return NULL;
+  }
+  if (loopback_receive(lb->server, sbuf, 3*sizeof(msg)) != 0 ||
+      send_ack_if_needed__do(lb->server, slab_get(lb->server->streams, 0)) != 0)
+    return NULL;
+  for (int i = 0; i < 100 && !stream->last_seq_poped; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(lb->client->tls, cbuf, &tv);
+  }
+  return stream->last_seq_poped == 1 ? stream : NULL;
+}
+
+static int failover_wants_write_events;
+
+static int on_failover_event(tcpls_t *tcpls, tcpls_event_t event, int socket, int transportid, void *cb_data)
+{
+  if (event == CONN_WANTS_WRITE)
+    failover_wants_write_events++;
+  return 0;
+}
+
+/**
+ * Fail the client's first connection; run the recovery with
+ * tcpls_failover_progress() until the connection it moves to waits for the
+ * server's TRANSPORT_NEW
+ */
+static connect_info_t *failover_start(loopback_t *lb)
+{
+  connect_info_t *con = connection_get(lb->client, 0);
+  failover_wants_write_events = 0;
+  if (initiate_recovering(lb->client, con) != 0 || !lb->client->failover)
+    return NULL;
+  struct st_tcpls_failover_t *failover = lb->client->failover;
+  connect_info_t *recon = connection_get(lb->client, failover->recon_transportid);
+  if (failover->step != FAILOVER_CONNECTING || failover_wants_write(lb->client) != recon->socket ||
+      failover_wants_write_events != 1)
+    return NULL;
+  for (int i = 0; i < 100 && failover->step == FAILOVER_CONNECTING; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    select(0, NULL, NULL, NULL, &tv);
+    tcpls_failover_progress(lb->client);
+  }
+  return failover->step == FAILOVER_JOINING ? recon : NULL;
+}
+
+static void test_tcpls_failover(void)
+{
+  loopback_t lb;
+  uint8_t msg[256] = {0};
+  ctx->connection_event_cb = on_failover_event;
+  ok(loopback_new(&lb, 1, 0) == 0);
+  /* the server acks what it got before the first connection fails */
+  tcpls_buffer_t *sbuf = tcpls_aggr_buffer_new(lb.server);
+  tcpls_buffer_t *cbuf = tcpls_aggr_buffer_new(lb.client);
+  tcpls_stream_t *stream = loopback_acked_stream(&lb, sbuf, cbuf);
+  ok(stream != NULL);
+  /* the streams move to 127.0.0.2, once joined */
+  connect_info_t *path = loopback_add_path(&lb, NULL);
+  ok(path != NULL);
+  connect_info_t *recon = failover_start(&lb);
+  ok(recon != NULL && recon == path);
+  ok(tcpls_failover_progress(lb.client) == TCPLS_HOLD_DATA_TO_READ);
+  ok(loopback_join(&lb) == 0);
+  /* the server answers our FAILOVER messages with its own, which move the
+   * streams on our side */
+  for (int i = 0; i < 100 && stream->transportid != recon->this_transportid; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(lb.client->tls, cbuf, &tv);
+    tcpls_receive(lb.server->tls, sbuf, &tv);
+  }
+  ok(!lb.client->failover && !lb.client->failover_recovering);
+  ok(recon->state == JOINED);
+  ok(stream->transportid == recon->this_transportid);
+  tcpls_buffer_free(lb.client, cbuf);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+
+  /* with no other path, the failed connection is tried again, though its
+   * transportid is 0 */
+  ok(loopback_new(&lb, 1, 0) == 0);
+  ok(tcpls_send(lb.client->tls, 0, msg, sizeof(msg)) >= 0);
+  recon = failover_start(&lb);
+  ok(recon == connection_get(lb.client, 0));
+  ok(recon && recon->this_transportid == 0);
+  /* the server never answers: past the deadline, no path is left */
+  lb.client->failover->deadline.tv_sec = 0;
+  ok(tcpls_failover_progress(lb.client) == -1);
+  ok(!lb.client->failover);
+  ok(recon && recon->state == FAILED);
+  loopback_free(&lb);
+  ctx->connection_event_cb = NULL;
+}
+
+/**
+ * Let the client's housekeeping join spare as a standby connection; the
+ * server writes its TRANSPORT_NEW from tcpls_receive()
+ */
+static int standby_join(loopback_t *lb, tcpls_buffer_t *cbuf, tcpls_buffer_t *sbuf, connect_info_t *spare)
+{
+  struct st_tcpls_failover_t *failover = NULL;
+  for (int i = 0; i < 100 && (!failover || failover->step != FAILOVER_JOINING); i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(lb->client->tls, cbuf, &tv);
+    failover = lb->client->failover;
+  }
+  if (!failover || !failover->standby || failover->recon_transportid != spare->this_transportid ||
+      loopback_join(lb) != 0)
+    return -1;
+  for (int i = 0; i < 100 && lb->client->failover; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(lb->server->tls, sbuf, &tv);
+    tcpls_receive(lb->client->tls, cbuf, &tv);
+  }
+  return spare->state == JOINED && !lb->client->failover ? 0 : -1;
+}
+
+static void test_tcpls_standby(void)
+{
+  loopback_t lb;
+  ok(loopback_new(&lb, 1, 0) == 0);
+  tcpls_buffer_t *sbuf = tcpls_aggr_buffer_new(lb.server);
+  tcpls_buffer_t *cbuf = tcpls_aggr_buffer_new(lb.client);
+  tcpls_stream_t *stream = loopback_acked_stream(&lb, sbuf, cbuf);
+  ok(stream != NULL);
+  /* two spare paths, which the slab may move; the server tells connections
+   * apart by their addresses */
+  struct sockaddr_in src = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK+2)};
+  connect_info_t *spare = loopback_add_path(&lb, NULL);
+  ok(spare != NULL);
+  uint32_t ids[2] = {spare ? spare->this_transportid : 0};
+  ok((spare = loopback_add_path(&lb, &src)) != NULL);
+  ids[1] = spare ? spare->this_transportid : 0;
+  ok(ids[0] != ids[1]);
+  ok(tcpls_set_standby(lb.client, 1) == 0);
+  ok(standby_join(&lb, cbuf, sbuf, connection_get(lb.client, ids[0])) == 0);
+  ok(standby_count(lb.client) == 1);
+  ok(connection_get(lb.client, ids[1])->state == CLOSED);
+  /* the streams of the failed connection go to the standby one right away */
+  ok(initiate_recovering(lb.client, connection_get(lb.client, stream->transportid)) == 0);
+  ok(lb.client->failover && lb.client->failover->step == FAILOVER_REPLAYING);
+  ok(lb.client->failover->recon_transportid == ids[0]);
+  for (int i = 0; i < 100 && stream->transportid != ids[0]; i++) {
+    struct timeval tv = {.tv_usec = 10000};
+    tcpls_receive(lb.client->tls, cbuf, &tv);
+    tcpls_receive(lb.server->tls, sbuf, &tv);
+  }
+  ok(stream->transportid == ids[0]);
+  ok(standby_count(lb.client) == 0);
+  /* and the other spare path replaces it */
+  ok(standby_join(&lb, cbuf, sbuf, connection_get(lb.client, ids[1])) == 0);
+  ok(standby_count(lb.client) == 1);
+  tcpls_buffer_free(lb.client, cbuf);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+}
+
+/**
+ * The handshake and a MPJOIN over TCP Fast Open; whether the ClientHellos ride
+ * in the SYNs depends on the host's settings and cached cookies, and both
+ * must work
+ */
+static void test_tcpls_fastopen(void)
+{
+#ifndef TCP_FASTOPEN_CONNECT
+  note("TCP_FASTOPEN_CONNECT is unavailable");
+#else
+  loopback_t lb;
+  ok(loopback_new(&lb, 1, 1) == 0);
+  connect_info_t *con = connection_get(lb.client, 0);
+  ok(con->fastopen);
+  /* its RTT comes with the first exchange, the handshake */
+  ok(con->connect_time.tv_sec || con->connect_time.tv_usec);
+  tcpls_buffer_t *sbuf = tcpls_aggr_buffer_new(lb.server);
+  tcpls_buffer_t *cbuf = tcpls_aggr_buffer_new(lb.client);
+  ok(loopback_acked_stream(&lb, sbuf, cbuf) != NULL);
+  connect_info_t *spare = loopback_add_path(&lb, NULL);
+  ok(spare != NULL);
+  uint32_t transportid = spare ? spare->this_transportid : 0;
+  ok(tcpls_set_standby(lb.client, 1) == 0);
+  ok(standby_join(&lb, cbuf, sbuf, spare) == 0);
+  spare = connection_get(lb.client, transportid);
+  ok(spare->state == JOINED && spare->fastopen);
+  ok(spare->connect_time.tv_sec || spare->connect_time.tv_usec);
+  tcpls_buffer_free(lb.client, cbuf);
+  tcpls_buffer_free(lb.server, sbuf);
+  loopback_free(&lb);
+#endif
+}
+
 static void test_tcpls_api(void)
 {
   subtest("addresses_api", test_tcpls_addresses);
   subtest("stream_api", test_tcpls_stream_api);
+  subtest("send_schedulers", test_tcpls_send_schedulers);
+  subtest("connect_race", test_tcpls_connect_race);
+  subtest("epoll", test_tcpls_epoll);
+  subtest("rsched", test_tcpls_rsched);
+  subtest("sendv", test_tcpls_sendv);
+  subtest("unacked_cap", test_tcpls_unacked_cap);
+  subtest("failover", test_tcpls_failover);
+  subtest("standby", test_tcpls_standby);
+  subtest("fastopen", test_tcpls_fastopen);
 }
 
 static void test_list_t(void)
@@ -2347,6 +3581,134 @@ static void test_list_t(void)
   list_free(list64);
 }
 
+static void test_buffer_pool(void)
+{
+  ptls_buffer_t buf;
+  ptls_buffer_pool_trim();
+  ptls_buffer_init_pooled(&buf);
+  ok(ptls_buffer_reserve(&buf, PTLS_MAX_ENCRYPTED_RECORD_SIZE) == 0);
+  ok(buf.is_allocated == PTLS_BUFFER_POOLED);
+  ok(buf.capacity == 32768);
+  uint8_t *block = buf.base;
+  buf.off = 10;
+  ptls_buffer_dispose(&buf);
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 1);
+  ok(buf.base == NULL && buf.is_allocated == PTLS_BUFFER_POOLED);
+  /* a record fragment buffer set up again after a dispose stays pooled */
+  struct st_ptls_record_t rec;
+  uint8_t header[3] = {PTLS_CONTENT_TYPE_APPDATA, 3, 3};
+  size_t len = sizeof(header);
+  ok(parse_record(NULL, &buf, &rec, header, &len) == PTLS_ERROR_IN_PROGRESS);
+  ok(buf.is_allocated == PTLS_BUFFER_POOLED && buf.off == sizeof(header));
+  ptls_buffer_dispose(&buf);
+  /* the next buffer of that size gets the same block back */
+  ptls_buffer_init_pooled(&buf);
+  ok(ptls_buffer_reserve(&buf, PTLS_MAX_ENCRYPTED_RECORD_SIZE) == 0);
+  ok(buf.base == block);
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 0);
+  /* growing gives the smaller block back to the pool */
+  buf.off = PTLS_MAX_ENCRYPTED_RECORD_SIZE;
+  ok(ptls_buffer_reserve(&buf, 32768) == 0);
+  ok(buf.capacity == 65536);
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 1);
+  ptls_buffer_dispose(&buf);
+  ptls_buffer_pool_trim();
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 0);
+  ok(thread_buffer_pool.count[thread_pool_class(65536)] == 0);
+}
+
+static void test_slab_t(void)
+{
+  slab_t *slab = new_slab(sizeof(uint64_t), 4);
+  assert(slab);
+  uint64_t *items[10];
+  for (uint64_t i = 0; i < 10; i++)
+    items[i] = slab_add(slab, &i);
+  ok(slab->size == 10);
+  ok(slab->nbr_chunks == 3);
+  ok(*(uint64_t *) slab_get(slab, 9) == 9);
+  ok(slab_at(slab, slab_handle(slab, items[5])) == items[5]);
+  /* the last item takes the position of the removed one; nothing else moves */
+  ok(slab_remove(slab, items[2]) == 0);
+  ok(slab_remove(slab, items[2]) == -1);
+  ok(slab->size == 9);
+  ok(slab_get(slab, 2) == items[9]);
+  ok(slab_at(slab, 2) == NULL);
+  ok(*items[5] == 5);
+  /* the freed slot is reused */
+  uint64_t item = 42;
+  ok(slab_add(slab, &item) == items[2]);
+  ok(*items[2] == 42);
+  ok(slab_get(slab, 9) == items[2]);
+  ok(slab_add(slab, NULL) != NULL);
+  ok(*(uint64_t *) slab_get(slab, 10) == 0);
+  ok(slab->nbr_chunks == 3);
+  slab_free(slab);
+  /* an embedded slab allocates nothing until its first item */
+  slab_t embedded;
+  slab_init(&embedded, sizeof(uint64_t), 4);
+  ok(embedded.live == NULL && embedded.nbr_chunks == 0);
+  ok(slab_get(&embedded, 0) == NULL);
+  ok(slab_at(&embedded, 0) == NULL);
+  ok(*(uint64_t *) slab_add(&embedded, &item) == 42);
+  ok(embedded.size == 1 && embedded.nbr_chunks == 1);
+  slab_dispose(&embedded);
+  ok(embedded.live == NULL && embedded.size == 0);
+}
+
+static void test_id_map_t(void)
+{
+  id_map_t *map = new_id_map(2);
+  assert(map);
+  ok(id_map_get(map, 1) == -1);
+  /* two dense ranges, as client and server stream ids */
+  int all_set = 1;
+  for (uint32_t i = 0; i < 300; i++) {
+    if (id_map_set(map, i+1, i) || id_map_set(map, 2147483649u+i, 1000+i))
+      all_set = 0;
+  }
+  ok(all_set);
+  ok(map->size == 600);
+  ok(id_map_get(map, 150) == 149);
+  ok(id_map_get(map, 2147483649u+299) == 1299);
+  ok(id_map_get(map, 301) == -1);
+  ok(id_map_set(map, 150, 7) == 0);
+  ok(map->size == 600);
+  ok(id_map_get(map, 150) == 7);
+  int all_removed = 1;
+  for (uint32_t i = 0; i < 300; i += 2) {
+    if (id_map_remove(map, i+1))
+      all_removed = 0;
+  }
+  ok(all_removed);
+  ok(id_map_remove(map, 1) == -1);
+  int all_found = 1;
+  for (uint32_t i = 1; i < 300; i += 2) {
+    if (i+1 != 150 && id_map_get(map, i+1) != (int) i)
+      all_found = 0;
+    if (id_map_get(map, i) != -1)
+      all_found = 0;
+    if (id_map_get(map, 2147483649u+i) != (int) (1000+i))
+      all_found = 0;
+  }
+  ok(all_found);
+  ok(map->size == 450);
+  id_map_clean(map);
+  ok(map->size == 0);
+  ok(id_map_get(map, 2147483649u) == -1);
+  id_map_free(map);
+  /* an embedded map allocates its buckets upon the first id */
+  id_map_t embedded;
+  id_map_init(&embedded, 3);
+  ok(embedded.values == NULL);
+  ok(id_map_get(&embedded, 1) == -1);
+  ok(id_map_remove(&embedded, 1) == -1);
+  ok(id_map_set(&embedded, 1, 0) == 0);
+  ok(id_map_get(&embedded, 1) == 0);
+  id_map_dispose(&embedded);
+  ok(embedded.values == NULL && embedded.size == 0);
+}
+
 static void test_record_fifo_t(void)
 {
   tcpls_record_fifo_t *r_fifo = tcpls_record_queue_new(3);
@@ -2366,9 +3728,64 @@ static void test_record_fifo_t(void)
   ok(tcpls_record_queue_push(r_fifo, 4, 1) == OK);
   ok(tcpls_record_queue_del(r_fifo, 1) == OK);
   ok(r_fifo->front_idx == r_fifo->back_idx);
+  /* a full queue grows and keeps its records in order */
+  for (uint32_t seq = 5; seq < 9; seq++)
+    ok(tcpls_record_queue_push(r_fifo, seq, seq) == OK);
+  ok(r_fifo->max_record_num == 6 && r_fifo->size == 4);
+  uint32_t seq = 0, reclen = 0;
+  for (uint32_t i = 5; i < 9; i++) {
+    ok(tcpls_record_queue_pop(r_fifo, &seq, &reclen) == OK);
+    ok(seq == i && reclen == i);
+  }
   tcpls_record_fifo_free(r_fifo);
 }
 
+static void test_reorder_window_t(void)
+{
+  tcpls_reorder_window_t *window = tcpls_reorder_window_new(4);
+  ptls_buffer_t buf;
+  ptls_buffer_init(&buf, "", 0);
+  ok(window->nbr_slots == 4);
+  /* slots get their buffer once they hold a record */
+  ok(window->slots[0] == NULL && window->slots[2] == NULL);
+  ok(tcpls_reorder_window_push(window, 10, 12, (const uint8_t *) "c", 1) == OK);
+  ok(tcpls_reorder_window_push(window, 10, 11, (const uint8_t *) "b", 1) == OK);
+  ok(tcpls_reorder_window_push(window, 10, 11, (const uint8_t *) "x", 1) == OK);
+  ok(tcpls_reorder_window_push(window, 10, 14, (const uint8_t *) "e", 1) == MEMORY_FULL);
+  ok(window->slots[0] != NULL && window->slots[2] == NULL);
+  ok(window->size == 2);
+  ok(tcpls_reorder_window_pop(window, 10, &buf) == 0);
+  ok(tcpls_reorder_window_pop(window, 11, &buf) == 1);
+  ok(tcpls_reorder_window_pop(window, 12, &buf) == 1);
+  ok(tcpls_reorder_window_pop(window, 12, &buf) == 0);
+  ok(window->size == 0);
+  ok(buf.off == 2 && memcmp(buf.base, "bc", 2) == 0);
+  /* slots are reused once the window moved forward */
+  ok(tcpls_reorder_window_push(window, 13, 16, (const uint8_t *) "g", 1) == OK);
+  ok(tcpls_reorder_window_pop(window, 16, &buf) == 1);
+  ok(buf.off == 3 && buf.base[2] == 'g');
+  /* a record decrypted within the spare slot is committed without a copy */
+  ok(window->spare == NULL);
+  uint8_t *spare = tcpls_reorder_window_spare(window);
+  ok(spare != NULL && tcpls_reorder_window_spare(window) == spare);
+  memcpy(spare+5, "hello", 5);
+  ok(tcpls_reorder_window_commit(window, 17, 21, spare+5, 5) == MEMORY_FULL);
+  ok(tcpls_reorder_window_commit(window, 17, 18, spare+5, 5) == OK);
+  ok(window->spare != spare);
+  ptls_iovec_t vec;
+  ok(tcpls_reorder_window_peek(window, 17, &vec) == 0);
+  ok(tcpls_reorder_window_peek(window, 18, &vec) == 1);
+  ok(vec.base == spare+5 && vec.len == 5);
+  ok(tcpls_reorder_window_consume(window, 18, 2) == 2);
+  ok(tcpls_reorder_window_peek(window, 18, &vec) == 1);
+  ok(vec.len == 3 && memcmp(vec.base, "llo", 3) == 0);
+  ok(tcpls_reorder_window_consume(window, 18, 10) == 3);
+  ok(tcpls_reorder_window_peek(window, 18, &vec) == 0);
+  ok(window->size == 0);
+  ptls_buffer_dispose(&buf);
+  tcpls_reorder_window_free(window);
+}
+
 static void test_tcpls_buffer_t(void)
 {
   tcpls_t *tcpls = tcpls_new(ctx, 0);
@@ -2398,6 +3815,29 @@ static void test_tcpls_buffer_t(void)
   ok(buf->stream_buffers->size == 1);
   decbuf2 = tcpls_get_stream_buffer(buf, stream2);
   ok(!decbuf2);
+  /* ids added out of order are all found */
+  ok(tcpls_stream_buffer_add(buf, 2147483649u) == 0);
+  ok(tcpls_stream_buffer_add(buf, 42) == 0);
+  ok(tcpls_stream_buffer_add(buf, 7) == 0);
+  ok(tcpls_get_stream_buffer(buf, 2147483649u) != NULL);
+  ok(tcpls_get_stream_buffer(buf, 42) != NULL);
+  ok(tcpls_get_stream_buffer(buf, 7) != NULL);
+  ok(tcpls_get_stream_buffer(buf, stream1) == decbuf);
+  /* the memory of a removed buffer goes to the thread's pool, which hands it
+   * to the next one */
+  ptls_buffer_pool_trim();
+  decbuf2 = tcpls_get_stream_buffer(buf, 42);
+  ok(decbuf2->is_allocated == PTLS_BUFFER_POOLED);
+  ok(ptls_buffer_reserve(decbuf2, PTLS_MAX_ENCRYPTED_RECORD_SIZE) == 0);
+  uint8_t *block = decbuf2->base;
+  ok(tcpls_stream_buffer_remove(buf, 42) == 0);
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 1);
+  ok(tcpls_stream_buffer_add(buf, 43) == 0);
+  decbuf2 = tcpls_get_stream_buffer(buf, 43);
+  ok(decbuf2->off == 0);
+  ok(ptls_buffer_reserve(decbuf2, PTLS_MAX_ENCRYPTED_RECORD_SIZE) == 0);
+  ok(decbuf2->base == block);
+  ok(thread_buffer_pool.count[thread_pool_class(32768)] == 0);
   tcpls_buffer_free(tcpls, buf);
   tcpls_free(tcpls);
 }
@@ -2405,7 +3845,11 @@ static void test_tcpls_buffer_t(void)
 static void test_containers(void)
 {
   subtest("list_t", test_list_t);
+  subtest("buffer_pool", test_buffer_pool);
+  subtest("slab_t", test_slab_t);
+  subtest("id_map_t", test_id_map_t);
   subtest("record_fifo_t", test_record_fifo_t);
+  subtest("reorder_window_t", test_reorder_window_t);
   subtest("tcpls_buffer_t", test_tcpls_buffer_t);
 }
 
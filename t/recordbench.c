@@ -0,0 +1,183 @@
+/**
+ * \file recordbench.c
+ *
+ * \brief Measures the receive side of the record layer: decrypting a chunk of
+ * records, as returned by one large recv(), either with one ptls_receive()
+ * call per record or with a single ptls_receive_batch() call.
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "picotls.h"
+#include "picotls/minicrypto.h"
+#include "picotls/openssl.h"
+#include "test.h"
+
+/* Time in microseconds */
+static uint64_t bench_time(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int bench_handshake(ptls_t *client, ptls_t *server)
+{
+    ptls_buffer_t cbuf, sbuf;
+    size_t consumed;
+    int cret, sret = PTLS_ERROR_IN_PROGRESS;
+
+    ptls_buffer_init(&cbuf, "", 0);
+    ptls_buffer_init(&sbuf, "", 0);
+    cret = ptls_handshake(client, &cbuf, NULL, NULL, NULL);
+    while (cret == PTLS_ERROR_IN_PROGRESS || sret == PTLS_ERROR_IN_PROGRESS) {
+        consumed = cbuf.off;
+        sret = ptls_handshake(server, &sbuf, cbuf.base, &consumed, NULL);
+        cbuf.off = 0;
+        if (sret != 0 && sret != PTLS_ERROR_IN_PROGRESS)
+            break;
+        if (sbuf.off == 0)
+            break;
+        consumed = sbuf.off;
+        cret = ptls_handshake(client, &cbuf, sbuf.base, &consumed, NULL);
+        sbuf.off = 0;
+        if (cret != 0 && cret != PTLS_ERROR_IN_PROGRESS)
+            break;
+        if (cret == 0 && cbuf.off != 0) {
+            consumed = cbuf.off;
+            sret = ptls_handshake(server, &sbuf, cbuf.base, &consumed, NULL);
+            cbuf.off = 0;
+        }
+    }
+    ptls_buffer_dispose(&cbuf);
+    ptls_buffer_dispose(&sbuf);
+    if (cret != 0 || sret != 0 || !ptls_handshake_is_complete(client) || !ptls_handshake_is_complete(server))
+        return -1;
+    return 0;
+}
+
+/**
+ * Decrypts the chunk iterations times, rewinding the sequence number of the
+ * receiver to seq before each run
+ */
+static int bench_run_one(ptls_t *server, uint64_t seq, ptls_buffer_t *chunk, size_t plaintext_len, int batch, size_t iterations,
+                         uint64_t *elapsed, size_t *calls)
+{
+    ptls_aead_context_t *aead = server->traffic_protection.dec.aead;
+    uint64_t t_start;
+    ptls_buffer_t decbuf;
+    int ret = 0;
+
+    ptls_buffer_init(&decbuf, "", 0);
+    if ((ret = ptls_buffer_reserve(&decbuf, chunk->off)) != 0)
+        goto Exit;
+    *calls = 0;
+    t_start = bench_time();
+    for (size_t i = 0; ret == 0 && i < iterations; i++) {
+        const uint8_t *src = chunk->base, *end = chunk->base + chunk->off;
+        aead->seq = seq;
+        decbuf.off = 0;
+        while (ret == 0 && src != end) {
+            size_t consumed = end - src;
+            if (batch)
+                ret = ptls_receive_batch(server, &decbuf, NULL, src, &consumed);
+            else
+                ret = ptls_receive(server, &decbuf, NULL, src, &consumed);
+            src += consumed;
+            ++*calls;
+        }
+        if (ret == 0 && decbuf.off != plaintext_len)
+            ret = -1;
+    }
+    *elapsed = bench_time() - t_start;
+
+Exit:
+    ptls_buffer_dispose(&decbuf);
+    return ret;
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  -c chunk_size   bytes of application data per chunk (default: 262144)\n"
+           "  -n iterations   number of times each chunk is decrypted (default: 200)\n"
+           "  -h              print this help\n"
+           "\n",
+           cmd);
+}
+
+int main(int argc, char **argv)
+{
+    size_t chunk_size = 256 * 1024, iterations = 200;
+    int ch, ret;
+
+    while ((ch = getopt(argc, argv, "c:n:h")) != -1) {
+        switch (ch) {
+        case 'c':
+            chunk_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    if (chunk_size == 0 || iterations == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    ptls_cipher_suite_t *cipher_suites[] = {&ptls_openssl_aes128gcmsha256, NULL};
+    ptls_iovec_t cert = ptls_iovec_init(SECP256R1_CERTIFICATE, sizeof(SECP256R1_CERTIFICATE) - 1);
+    ptls_minicrypto_secp256r1sha256_sign_certificate_t sign_certificate;
+    ptls_minicrypto_init_secp256r1sha256_sign_certificate(&sign_certificate,
+                                                          ptls_iovec_init(SECP256R1_PRIVATE_KEY, SECP256R1_PRIVATE_KEY_SIZE));
+    ptls_context_t ctx = {ptls_minicrypto_random_bytes, &ptls_get_time, ptls_minicrypto_key_exchanges, cipher_suites, {&cert, 1},
+                          NULL, NULL, NULL, &sign_certificate.super};
+    ptls_t *client = ptls_client_new(&ctx), *server = ptls_server_new(&ctx);
+
+    if (bench_handshake(client, server) != 0) {
+        fprintf(stderr, "handshake failed\n");
+        exit(1);
+    }
+
+    /* one chunk, as a single large recv() would return it */
+    uint8_t *data = malloc(chunk_size);
+    ptls_buffer_t chunk;
+    ptls_buffer_init(&chunk, "", 0);
+    for (size_t i = 0; i != chunk_size; ++i)
+        data[i] = (uint8_t)i;
+    if ((ret = ptls_send(client, 0, &chunk, data, chunk_size)) != 0) {
+        fprintf(stderr, "ptls_send failed:%d\n", ret);
+        exit(1);
+    }
+
+    uint64_t seq = server->traffic_protection.dec.aead->seq;
+    printf("mode, chunk, records, iterations, calls per chunk, us per chunk, mbps,\n");
+    for (int batch = 0; batch <= 1; batch++) {
+        uint64_t elapsed;
+        size_t calls;
+        if ((ret = bench_run_one(server, seq, &chunk, chunk_size, batch, iterations, &elapsed, &calls)) != 0) {
+            fprintf(stderr, "decryption failed:%d\n", ret);
+            exit(1);
+        }
+        printf("%s, %zu, %zu, %zu, %.1f, %.1f, %.1f,\n", batch ? "batch" : "per-record", chunk_size,
+               (chunk_size + PTLS_MAX_PLAINTEXT_RECORD_SIZE - 1) / PTLS_MAX_PLAINTEXT_RECORD_SIZE, iterations,
+               (double)calls / iterations, (double)elapsed / iterations,
+               elapsed ? (double)chunk_size * iterations * 8 / elapsed : 0);
+    }
+
+    ptls_buffer_dispose(&chunk);
+    free(data);
+    ptls_free(client);
+    ptls_free(server);
+    return 0;
+}
@@ -0,0 +1,566 @@
+/**
+ * \file tcplsbench.c
+ *
+ * \brief Measures the TCPLS data path end to end: a client and a server
+ * session run in the same process, over loopback, and the client sends
+ * timestamped messages with tcpls_send() that the server reads with
+ * tcpls_receive(). Framing, stream demultiplexing, acks and reordering are
+ * all part of what is measured.
+ *
+ * Reports the goodput, the CPU time spent per byte by both peers, and the
+ * median and 99th percentile of the message latency, in the CSV style of
+ * ptlsbench.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "picotls.h"
+#include "picotls/fusion.h"
+#include "picotls/minicrypto.h"
+#include "picotls/openssl.h"
+#include "picotcpls.h"
+#include "containers.h"
+#include "test.h"
+
+#ifdef PTLS_DEBUG
+#define BENCH_MODE "debug"
+#else
+#define BENCH_MODE "release"
+#endif
+
+/* the client connects to 127.0.0.1 ... 127.0.0.BENCH_MAX_CONNS */
+#define BENCH_MAX_CONNS 8
+/* the bench fails if the server does not receive anything for that long */
+#define BENCH_STALL_TIMEOUT_US 10000000
+
+typedef struct st_bench_config_t {
+    const char *provider;
+    const char *algo_name;
+    int nstreams;
+    int nconns;
+    int multipath;
+    int failover;
+    size_t msg_size;
+    size_t nmsgs;
+    uint16_t port;
+} bench_config_t;
+
+typedef struct st_bench_server_t {
+    bench_config_t *config;
+    ptls_context_t *ctx;
+    int listenfd;
+    tcpls_t *tcpls;
+    /** latency of each message, in nanoseconds */
+    uint64_t *latencies;
+    size_t nreceived;
+    /** time at which the last message was received */
+    uint64_t end;
+    /** streams attached so far, which the client waits for */
+    volatile int nstreams;
+    volatile int done;
+    int ret;
+} bench_server_t;
+
+typedef struct st_bench_aead_entry_t {
+    const char *provider;
+    const char *algo_name;
+    uint16_t cipher_suite_id;
+    ptls_aead_algorithm_t *aead;
+    ptls_hash_algorithm_t *hash;
+} bench_aead_entry_t;
+
+static bench_aead_entry_t aead_list[] = {
+    {"minicrypto", "aes128gcm", PTLS_CIPHER_SUITE_AES_128_GCM_SHA256, &ptls_minicrypto_aes128gcm, &ptls_minicrypto_sha256},
+    {"minicrypto", "aes256gcm", PTLS_CIPHER_SUITE_AES_256_GCM_SHA384, &ptls_minicrypto_aes256gcm, &ptls_minicrypto_sha384},
+    {"minicrypto", "chacha20poly1305", PTLS_CIPHER_SUITE_CHACHA20_POLY1305_SHA256, &ptls_minicrypto_chacha20poly1305,
+     &ptls_minicrypto_sha256},
+    {"fusion", "aes128gcm", PTLS_CIPHER_SUITE_AES_128_GCM_SHA256, &ptls_fusion_aes128gcm, &ptls_minicrypto_sha256},
+    {"fusion", "aes256gcm", PTLS_CIPHER_SUITE_AES_256_GCM_SHA384, &ptls_fusion_aes256gcm, &ptls_minicrypto_sha384},
+#if PTLS_OPENSSL_HAVE_CHACHA20_POLY1305
+    {"openssl", "chacha20poly1305", PTLS_CIPHER_SUITE_CHACHA20_POLY1305_SHA256, &ptls_openssl_chacha20poly1305,
+     &ptls_minicrypto_sha256},
+#endif
+    {"openssl", "aes128gcm", PTLS_CIPHER_SUITE_AES_128_GCM_SHA256, &ptls_openssl_aes128gcm, &ptls_minicrypto_sha256},
+    {"openssl", "aes256gcm", PTLS_CIPHER_SUITE_AES_256_GCM_SHA384, &ptls_openssl_aes256gcm, &ptls_minicrypto_sha384}};
+
+static size_t nb_aead_list = sizeof(aead_list) / sizeof(bench_aead_entry_t);
+
+/* Time in nanoseconds, of the given clock */
+static uint64_t bench_time(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static void bench_addr(struct sockaddr_in *addr, int i, uint16_t port)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK + i);
+    addr->sin_port = port;
+}
+
+/**
+ * Whether a tcpls_receive() return lets the transfer go on: a hold status, or
+ * -1, which it also returns on timeouts -- a stall is caught by
+ * BENCH_STALL_TIMEOUT_US. Anything else is a TLS alert or a picotls error,
+ * such as a record which failed to decrypt.
+ */
+static int bench_receive_ok(int ret)
+{
+    switch (ret) {
+    case -1:
+    case TCPLS_OK:
+    case TCPLS_HOLD_DATA_TO_READ:
+    case TCPLS_HOLD_OUT_OF_ORDER_DATA_TO_READ:
+    case TCPLS_HOLD_DATA_TO_SEND:
+    case TCPLS_HOLD_DATA_TO_CONSUME:
+    case TCPLS_HOLD_UNACKED_DATA:
+        return 1;
+    default:
+        fprintf(stderr, "tcpls_receive failed:%d\n", ret);
+        return 0;
+    }
+}
+
+static int bench_uint64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int bench_handle_mpjoin(tcpls_t *tcpls, int socket, uint8_t *connid, uint8_t *cookie, uint32_t transportid, void *cb_data)
+{
+    bench_server_t *server = cb_data;
+    if (!server->tcpls || memcmp(server->tcpls->connid, connid, CONNID_LEN))
+        return -1;
+    return tcpls_accept(server->tcpls, socket, cookie, transportid) < 0 ? -1 : 0;
+}
+
+static tcpls_t *bench_session_new(ptls_context_t *ctx, bench_config_t *config, int is_server)
+{
+    tcpls_t *tcpls = tcpls_new(ctx, is_server);
+    struct sockaddr_in addr;
+    tcpls->enable_failover = config->failover;
+    tcpls->enable_multipath = config->multipath;
+    for (int i = 0; i < config->nconns; i++) {
+        bench_addr(&addr, i + 1, config->port);
+        tcpls_add_v4(tcpls->tls, &addr, i == 0, 0, is_server);
+    }
+    return tcpls;
+}
+
+/**
+ * Consumes the messages entirely received in buf, and records their latency
+ */
+static void bench_server_consume(bench_server_t *server, ptls_buffer_t *buf)
+{
+    size_t msg_size = server->config->msg_size, off = 0;
+    uint64_t now = bench_time(CLOCK_MONOTONIC), sent_at;
+
+    for (; buf->off - off >= msg_size && server->nreceived < server->config->nmsgs; off += msg_size) {
+        memcpy(&sent_at, buf->base + off, sizeof(sent_at));
+        server->latencies[server->nreceived++] = now - sent_at;
+        server->end = now;
+    }
+    memmove(buf->base, buf->base + off, buf->off - off);
+    buf->off -= off;
+}
+
+/**
+ * Accepts the connections of the client, joins them into one session, and
+ * reads all the messages
+ */
+static void *bench_server_run(void *arg)
+{
+    bench_server_t *server = arg;
+    bench_config_t *config = server->config;
+    tcpls_t *sessions[BENCH_MAX_CONNS] = {NULL};
+    int socks[BENCH_MAX_CONNS], joined[BENCH_MAX_CONNS] = {0}, naccepted = 0, njoined = 0, ret;
+    tcpls_buffer_t *buf = NULL;
+
+    server->ret = -1;
+    for (int i = 0; i < config->nconns; i++) {
+        if ((socks[i] = accept(server->listenfd, NULL, NULL)) < 0) {
+            perror("accept");
+            goto Exit;
+        }
+        naccepted++;
+        sessions[i] = bench_session_new(server->ctx, config, 1);
+        if (tcpls_accept(sessions[i], socks[i], NULL, 0) < 0) {
+            fprintf(stderr, "tcpls_accept failed\n");
+            goto Exit;
+        }
+    }
+    /* the client handshakes its connections one after the other, the primary first */
+    while (njoined < config->nconns) {
+        fd_set rset;
+        int maxfd = 0;
+        struct timeval tv = {BENCH_STALL_TIMEOUT_US / 1000000, 0};
+        FD_ZERO(&rset);
+        for (int i = 0; i < config->nconns; i++) {
+            if (!joined[i]) {
+                FD_SET(socks[i], &rset);
+                if (maxfd < socks[i])
+                    maxfd = socks[i];
+            }
+        }
+        if (select(maxfd + 1, &rset, NULL, NULL, &tv) <= 0) {
+            fprintf(stderr, "timeout while waiting for the handshakes\n");
+            goto Exit;
+        }
+        for (int i = 0; i < config->nconns; i++) {
+            if (joined[i] || !FD_ISSET(socks[i], &rset))
+                continue;
+            ptls_handshake_properties_t prop;
+            memset(&prop, 0, sizeof(prop));
+            prop.received_mpjoin_to_process = &bench_handle_mpjoin;
+            prop.socket = socks[i];
+            ret = tcpls_handshake(sessions[i]->tls, &prop);
+            if (ret == 0 && !server->tcpls) {
+                server->tcpls = sessions[i];
+                sessions[i] = NULL;
+            } else if (ret != PTLS_ERROR_HANDSHAKE_IS_MPJOIN) {
+                fprintf(stderr, "tcpls_handshake failed:%d\n", ret);
+                goto Exit;
+            }
+            joined[i] = 1;
+            njoined++;
+        }
+    }
+
+    if (config->multipath)
+        buf = tcpls_aggr_buffer_new(server->tcpls);
+    else
+        buf = tcpls_stream_buffers_new(server->tcpls, config->nstreams);
+    uint64_t last_progress = bench_time(CLOCK_MONOTONIC);
+    while (server->nreceived < config->nmsgs) {
+        struct timeval tv = {0, 100000};
+        size_t nreceived = server->nreceived;
+        while ((ret = tcpls_receive(server->tcpls->tls, buf, &tv)) == TCPLS_HOLD_DATA_TO_READ)
+            ;
+        if (!bench_receive_ok(ret))
+            goto Exit;
+        server->nstreams = server->tcpls->streams->size;
+        if (buf->bufkind == AGGREGATION) {
+            bench_server_consume(server, buf->decryptbuf);
+        } else {
+            for (int i = 0; i < server->tcpls->streams->size; i++) {
+                tcpls_stream_t *stream = slab_get(server->tcpls->streams, i);
+                ptls_buffer_t *decryptbuf = tcpls_get_stream_buffer(buf, stream->streamid);
+                if (decryptbuf)
+                    bench_server_consume(server, decryptbuf);
+            }
+        }
+        if (server->nreceived != nreceived) {
+            last_progress = bench_time(CLOCK_MONOTONIC);
+        } else if (bench_time(CLOCK_MONOTONIC) - last_progress > (uint64_t)BENCH_STALL_TIMEOUT_US * 1000) {
+            fprintf(stderr, "transfer stalled after %zu messages\n", server->nreceived);
+            goto Exit;
+        }
+    }
+    server->ret = 0;
+
+Exit:
+    /* unblocks the client if we give up */
+    if (server->ret != 0) {
+        for (int i = 0; i < naccepted; i++)
+            shutdown(socks[i], SHUT_RDWR);
+    }
+    server->done = 1;
+    if (buf)
+        tcpls_buffer_free(server->tcpls, buf);
+    for (int i = 0; i < config->nconns; i++) {
+        if (sessions[i])
+            tcpls_free(sessions[i]);
+    }
+    return NULL;
+}
+
+/**
+ * Connects to the server, joins every connection, and spreads the streams
+ * evenly over them
+ */
+static int bench_client_connect(tcpls_t *tcpls, bench_config_t *config, streamid_t *streams, bench_server_t *server)
+{
+    struct timeval timeout = {5, 0};
+    ptls_handshake_properties_t prop;
+    int ret;
+
+    if ((ret = tcpls_connect(tcpls->tls, NULL, NULL, &timeout)) != 0) {
+        fprintf(stderr, "tcpls_connect failed:%d\n", ret);
+        return ret;
+    }
+    memset(&prop, 0, sizeof(prop));
+    if ((ret = tcpls_handshake(tcpls->tls, &prop)) != 0) {
+        fprintf(stderr, "tcpls_handshake failed:%d\n", ret);
+        return ret;
+    }
+    connect_info_t *cons[BENCH_MAX_CONNS];
+    int ncons = 0;
+    for (int i = 0; i < tcpls->connect_infos->size; i++) {
+        connect_info_t *con = slab_get(tcpls->connect_infos, i);
+        if (con->state < CONNECTED)
+            continue;
+        if (con->state < JOINED) {
+            memset(&prop, 0, sizeof(prop));
+            prop.socket = con->socket;
+            prop.client.transportid = con->this_transportid;
+            prop.client.mpjoin = 1;
+            prop.client.timeout = &timeout;
+            if ((ret = tcpls_handshake(tcpls->tls, &prop)) != 0) {
+                fprintf(stderr, "mpjoin handshake failed:%d\n", ret);
+                return ret;
+            }
+        }
+        cons[ncons++] = con;
+    }
+    if (ncons != config->nconns) {
+        fprintf(stderr, "only %d connections out of %d are established\n", ncons, config->nconns);
+        return -1;
+    }
+    /* the STREAM_ATTACH messages share the record sequence of the session whatever their connection, and the server
+     * reads its connections in any order: the streams of a connection are attached once the server has the previous ones */
+    for (int i = 0; i < config->nstreams; i++) {
+        connect_info_t *con = cons[i * ncons / config->nstreams];
+        streams[i] = tcpls_stream_new(tcpls->tls, NULL, (struct sockaddr *)&con->dest->addr);
+        if (i + 1 < config->nstreams && cons[(i + 1) * ncons / config->nstreams] == con)
+            continue;
+        if ((ret = tcpls_streams_attach(tcpls->tls, 0, 1)) < 0) {
+            fprintf(stderr, "tcpls_streams_attach failed:%d\n", ret);
+            return ret;
+        }
+        uint64_t start = bench_time(CLOCK_MONOTONIC);
+        while (server->nstreams < i + 1) {
+            if (server->done || bench_time(CLOCK_MONOTONIC) - start > (uint64_t)BENCH_STALL_TIMEOUT_US * 1000) {
+                fprintf(stderr, "the server did not attach stream %d\n", i);
+                return -1;
+            }
+            struct timeval tv = {0, 1000};
+            select(0, NULL, NULL, NULL, &tv);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends the messages round-robin over the streams. Each message starts with
+ * the time at which it is handed to tcpls_send()
+ */
+static int bench_client_send(tcpls_t *tcpls, bench_config_t *config, streamid_t *streams, tcpls_buffer_t *recvbuf,
+                             volatile int *server_done)
+{
+    uint8_t *msg = malloc(config->msg_size);
+    int ret = 0;
+
+    assert(msg != NULL);
+    for (size_t i = 0; i != config->msg_size; ++i)
+        msg[i] = (uint8_t)i;
+    for (size_t i = 0; ret == 0 && i < config->nmsgs; i++) {
+        uint64_t now = bench_time(CLOCK_MONOTONIC);
+        memcpy(msg, &now, sizeof(now));
+        do {
+            ret = tcpls_send(tcpls->tls, streams[i % config->nstreams], msg, config->msg_size);
+            if (ret == TCPLS_HOLD_DATA_TO_SEND || ret == TCPLS_HOLD_UNACKED_DATA) {
+                /* wait for acks until the next message fits; a refused one is sent again */
+                int refused = ret == TCPLS_HOLD_UNACKED_DATA;
+                tcpls_stats_t stats;
+                int received;
+                do {
+                    struct timeval tv = {0, 1000};
+                    received = bench_receive_ok(tcpls_receive(tcpls->tls, recvbuf, &tv));
+                    recvbuf->decryptbuf->off = 0;
+                    tcpls_get_stats(tcpls, &stats);
+                } while (received && stats.sendbuf_unacked != 0 &&
+                         stats.sendbuf_unacked + config->msg_size > tcpls->max_unacked_bytes && !*server_done);
+                ret = !received || *server_done ? -1 : refused ? TCPLS_HOLD_UNACKED_DATA : 0;
+            }
+        } while (ret == TCPLS_HOLD_UNACKED_DATA);
+        if (ret != 0)
+            fprintf(stderr, "tcpls_send failed:%d\n", ret);
+    }
+    free(msg);
+    return ret;
+}
+
+static void usage(const char *cmd)
+{
+    printf("Usage: %s [options]\n"
+           "\n"
+           "Options:\n"
+           "  -p provider     AEAD provider: openssl, minicrypto or fusion (default: openssl)\n"
+           "  -a algorithm    aes128gcm, aes256gcm or chacha20poly1305 (default: aes128gcm)\n"
+           "  -s streams      number of streams (default: 1)\n"
+           "  -c connections  number of connections, up to %d (default: 1)\n"
+           "  -m              enable multipath\n"
+           "  -f              enable failover (implies -m)\n"
+           "  -l size         bytes per message, at least 8 (default: 16384)\n"
+           "  -n messages     number of messages to send (default: 20000)\n"
+           "  -h              print this help\n"
+           "\n",
+           cmd, BENCH_MAX_CONNS);
+}
+
+int main(int argc, char **argv)
+{
+    bench_config_t config = {"openssl", "aes128gcm", 1, 1, 0, 0, 16384, 20000};
+    bench_aead_entry_t *entry = NULL;
+    int ch, ret;
+
+    while ((ch = getopt(argc, argv, "p:a:s:c:mfl:n:h")) != -1) {
+        switch (ch) {
+        case 'p':
+            config.provider = optarg;
+            break;
+        case 'a':
+            config.algo_name = optarg;
+            break;
+        case 's':
+            config.nstreams = atoi(optarg);
+            break;
+        case 'c':
+            config.nconns = atoi(optarg);
+            break;
+        case 'm':
+            config.multipath = 1;
+            break;
+        case 'f':
+            config.failover = 1;
+            config.multipath = 1;
+            break;
+        case 'l':
+            config.msg_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            config.nmsgs = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            exit(ch == 'h' ? 0 : 1);
+        }
+    }
+    for (size_t i = 0; i < nb_aead_list; i++) {
+        if (strcmp(aead_list[i].provider, config.provider) == 0 && strcmp(aead_list[i].algo_name, config.algo_name) == 0)
+            entry = &aead_list[i];
+    }
+    if (entry == NULL || config.nstreams < 1 || config.nconns < 1 || config.nconns > BENCH_MAX_CONNS ||
+        config.msg_size < sizeof(uint64_t) || config.nmsgs == 0) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    ptls_cipher_suite_t cipher_suite = {entry->cipher_suite_id, entry->aead, entry->hash};
+    ptls_cipher_suite_t *cipher_suites[] = {&cipher_suite, NULL};
+    ptls_iovec_t cert = ptls_iovec_init(SECP256R1_CERTIFICATE, sizeof(SECP256R1_CERTIFICATE) - 1);
+    ptls_minicrypto_secp256r1sha256_sign_certificate_t sign_certificate;
+    ptls_minicrypto_init_secp256r1sha256_sign_certificate(&sign_certificate,
+                                                          ptls_iovec_init(SECP256R1_PRIVATE_KEY, SECP256R1_PRIVATE_KEY_SIZE));
+    ptls_context_t client_ctx = {ptls_minicrypto_random_bytes, &ptls_get_time, ptls_minicrypto_key_exchanges, cipher_suites,
+                                 {&cert, 1}, NULL, NULL, NULL, &sign_certificate.super};
+    client_ctx.support_tcpls_options = 1;
+    /* records tell their stream, rather than being trial-decrypted with each stream of their connection */
+    client_ctx.tcpls_stream_hint = 1;
+    ptls_context_t server_ctx = client_ctx;
+    bench_server_t server = {&config, &server_ctx};
+    server_ctx.cb_data = &server;
+
+    /* the server listens on all the loopback addresses */
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int on = 1;
+    bench_addr(&addr, 0, 0);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if ((server.listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(server.listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) != 0 ||
+        bind(server.listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server.listenfd, BENCH_MAX_CONNS) != 0 ||
+        getsockname(server.listenfd, (struct sockaddr *)&addr, &addrlen) != 0) {
+        perror("failed to listen");
+        exit(1);
+    }
+    config.port = addr.sin_port;
+    server.latencies = malloc(config.nmsgs * sizeof(*server.latencies));
+    assert(server.latencies != NULL);
+
+    pthread_t server_thread;
+    if (pthread_create(&server_thread, NULL, bench_server_run, &server) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    streamid_t streams[config.nstreams];
+    tcpls_t *client = bench_session_new(&client_ctx, &config, 0);
+    tcpls_buffer_t *recvbuf = tcpls_aggr_buffer_new(client);
+    if ((ret = bench_client_connect(client, &config, streams, &server)) != 0) {
+        fprintf(stderr, "failed to set up the client session\n");
+        exit(1);
+    }
+
+    uint64_t start = bench_time(CLOCK_MONOTONIC), cpu_start = bench_time(CLOCK_PROCESS_CPUTIME_ID), cycles_start = bench_cycles();
+    ret = bench_client_send(client, &config, streams, recvbuf, &server.done);
+    /* keep reading acks until the server has everything */
+    while (ret == 0 && !server.done) {
+        struct timeval tv = {0, 1000};
+        if (!bench_receive_ok(tcpls_receive(client->tls, recvbuf, &tv)))
+            ret = -1;
+        recvbuf->decryptbuf->off = 0;
+    }
+    pthread_join(server_thread, NULL);
+    uint64_t cpu = bench_time(CLOCK_PROCESS_CPUTIME_ID) - cpu_start, cycles = bench_cycles() - cycles_start;
+    if (ret != 0 || server.ret != 0) {
+        fprintf(stderr, "benchmark failed\n");
+        exit(1);
+    }
+
+    uint64_t elapsed = server.end - start, bytes = (uint64_t)config.msg_size * config.nmsgs;
+    uint64_t wall = bench_time(CLOCK_MONOTONIC) - start;
+    qsort(server.latencies, config.nmsgs, sizeof(*server.latencies), bench_uint64_cmp);
+    uint64_t p50 = server.latencies[config.nmsgs / 2], p99 = server.latencies[config.nmsgs * 99 / 100];
+
+    char OS[128] = "", HW[128] = "";
+    struct utsname uts;
+    if (uname(&uts) == 0) {
+        if (strlen(uts.sysname) + 1 < sizeof(OS))
+            strcpy(OS, uts.sysname);
+        if (strlen(uts.machine) + 1 < sizeof(HW))
+            strcpy(HW, uts.machine);
+    }
+    /* cpu time counts both peers; the TSC ticks at a constant rate, which the wall clock gives us */
+    printf("OS, HW, bits, mode, provider, algorithm, streams, connections, multipath, failover, message size, messages, mbps, "
+           "cpu ns per byte, cycles per byte, p50 us, p99 us,\n");
+    printf("%s, %s, %d, %s, %s, %s, %d, %d, %d, %d, %zu, %zu, %.1f, %.2f, %.2f, %.1f, %.1f,\n", OS, HW, (int)(8 * sizeof(size_t)),
+           BENCH_MODE, config.provider, config.algo_name, config.nstreams, config.nconns, config.multipath, config.failover,
+           config.msg_size, config.nmsgs, elapsed ? (double)bytes * 8 * 1000 / elapsed : 0, (double)cpu / bytes,
+           wall ? (double)cpu * cycles / wall / bytes : 0, (double)p50 / 1000, (double)p99 / 1000);
+
+    tcpls_buffer_free(client, recvbuf);
+    tcpls_free(client);
+    tcpls_free(server.tcpls);
+    close(server.listenfd);
+    free(server.latencies);
+    return 0;
+}